@@ -47,6 +47,7 @@ const char *username = NULL;
 const char *passwd = NULL;
 const char *bucket = NULL;
 const char *filename = "-";
+const char *stream_threshold = NULL;
 
 static void set_auth_data(char cmd, const void *arg, void *cookie) {
     (void)cmd;
@@ -123,6 +124,14 @@ static struct {
         .handler = set_char_ptr,
         .cookie = &filename
     },
+    ['s'] = {
+        .name = "stream",
+        .description = "\t-s size\tWrite values of this size (or bigger) to the output as they arrive",
+        .argument = true,
+        .letter = 's',
+        .handler = set_char_ptr,
+        .cookie = &stream_threshold
+    },
 };
 
 /**
@@ -164,12 +173,14 @@ static void handle_options(int argc, char **argv) {
 FILE *output;
 
 static void get_callback(libcouchbase_t instance,
+                         const void *cookie,
                          libcouchbase_error_t error,
                          const void *key, size_t nkey,
                          const void *bytes, size_t nbytes,
                          uint32_t flags, uint64_t cas)
 {
     (void)instance;
+    (void)cookie;
     (void)bytes;
     if (error == LIBCOUCHBASE_SUCCESS) {
         fprintf(output, "Found <");
@@ -183,6 +194,26 @@ static void get_callback(libcouchbase_t instance,
     }
 }
 
+static void get_stream_callback(libcouchbase_t instance,
+                                const void *cookie,
+                                const void *key, size_t nkey,
+                                const void *bytes, size_t nbytes,
+                                size_t offset, size_t total,
+                                uint32_t flags, uint64_t cas)
+{
+    (void)instance;
+    (void)cookie;
+    if (offset == 0) {
+        fprintf(output, "Found <");
+        fwrite(key, nkey, 1, output);
+        fprintf(output, "> size: %zu flags %04x cas: %"PRIu64"\n",
+                total, flags, cas);
+    }
+    fwrite(bytes, nbytes, 1, output);
+    if (offset + nbytes == total) {
+        fprintf(output, "\n");
+    }
+}
 
 int main(int argc, char **argv)
 {
@@ -221,11 +252,16 @@ int main(int argc, char **argv)
     }
 
     libcouchbase_callback_t callbacks = {
-        .get = get_callback
+        .get = get_callback,
+        .get_stream = get_stream_callback
     };
     libcouchbase_set_callbacks(instance, &callbacks);
+    if (stream_threshold != NULL) {
+        libcouchbase_set_stream_threshold(instance,
+                                          strtoul(stream_threshold, NULL, 10));
+    }
 
-    if (libcouchbase_mget(instance, jj,
+    if (libcouchbase_mget(instance, NULL, jj,
                           (const void * const *)keys,
                           nkey, NULL) != LIBCOUCHBASE_SUCCESS) {
         fprintf(stderr, "Failed to send requests\n");
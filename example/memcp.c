@@ -167,11 +167,13 @@ static void handle_options(int argc, char **argv) {
 FILE *output;
 
 static void storage_callback(libcouchbase_t instance,
+                             const void *cookie,
                              libcouchbase_error_t error,
                              const void *key, size_t nkey,
                              uint64_t cas)
 {
     (void)instance;
+    (void)cookie;
     fprintf(output, "%sstore <",
             error == LIBCOUCHBASE_SUCCESS ? "" : "Failed to ");
     fwrite(key, nkey, 1, output);
@@ -222,11 +224,16 @@ int main(int argc, char **argv)
                                MAP_NORESERVE | MAP_PRIVATE, fileno(fp), 0);
             if (bytes != NULL) {
                 libcouchbase_error_t err;
-                err = libcouchbase_store(instance,
-                                         LIBCOUCHBASE_SET,
-                                         key, nkey,
-                                         bytes, (size_t)st.st_size,
-                                         0, 0, 0);
+                libcouchbase_iov_t iov = {
+                    .iov_base = bytes,
+                    .iov_len = (size_t)st.st_size
+                };
+                /* The mapping stays valid until we're done executing */
+                err = libcouchbase_store_iov(instance, NULL,
+                                             LIBCOUCHBASE_SET,
+                                             key, nkey,
+                                             &iov, 1,
+                                             0, 0, 0, NULL, NULL);
                 libcouchbase_execute(instance);
                 munmap(bytes, (size_t)st.st_size);
                 fclose(fp);
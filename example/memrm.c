@@ -157,10 +157,12 @@ static void handle_options(int argc, char **argv) {
 }
 
 static void remove_callback(libcouchbase_t instance,
+                            const void *cookie,
                             libcouchbase_error_t error,
                             const void *key, size_t nkey)
 {
     (void)instance;
+    (void)cookie;
     fprintf(stdout, "Remove <");
     fwrite(key, nkey, 1, stdout);
     fprintf(stdout, "> %s\n", error == LIBCOUCHBASE_SUCCESS ? "OK" : "Failed");
@@ -188,12 +190,22 @@ int main(int argc, char **argv)
     };
     libcouchbase_set_callbacks(instance, &callbacks);
 
-    for (int ii = optind; ii < argc; ++ii) {
-        libcouchbase_remove(instance, argv[ii], strlen(argv[ii]), 0);
+    size_t num_keys = (size_t)(argc - optind);
+    size_t *nkey = calloc(num_keys, sizeof(size_t));
+    for (size_t ii = 0; ii < num_keys; ++ii) {
+        nkey[ii] = strlen(argv[optind + (int)ii]);
+    }
+
+    if (libcouchbase_mremove(instance, NULL, num_keys,
+                             (const void * const *)(argv + optind),
+                             nkey, NULL) != LIBCOUCHBASE_SUCCESS) {
+        fprintf(stderr, "Failed to send requests\n");
+        return 1;
     }
 
 
     libcouchbase_execute(instance);
+    free(nkey);
 
     return 0;
 }
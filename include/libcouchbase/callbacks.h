@@ -17,6 +17,8 @@
 
 /**
  * Definition of the callbacks structure.
+ * The cookie passed to the callbacks for the commands is the command
+ * cookie specified when the command was spooled.
  * @todo Document each function
  *
  * @author Trond Norbye
@@ -34,22 +36,27 @@ extern "C" {
 
     typedef struct {
         void (*get)(libcouchbase_t instance,
+                    const void *cookie,
                     libcouchbase_error_t error,
                     const void *key, size_t nkey,
                     const void *bytes, size_t nbytes,
                     uint32_t flags, uint64_t cas);
         void (*storage)(libcouchbase_t instance,
+                        const void *cookie,
                         libcouchbase_error_t error,
                         const void *key, size_t nkey,
                         uint64_t cas);
         void (*arithmetic)(libcouchbase_t instance,
+                           const void *cookie,
                            libcouchbase_error_t error,
                            const void *key, size_t nkey,
                            uint64_t value, uint64_t cas);
         void (*remove)(libcouchbase_t instance,
+                       const void *cookie,
                        libcouchbase_error_t error,
                        const void *key, size_t nkey);
         void (*touch)(libcouchbase_t instance,
+                      const void *cookie,
                       libcouchbase_error_t error,
                       const void *key, size_t nkey);
         void (*tap_mutation)(libcouchbase_t instance,
@@ -77,6 +84,17 @@ extern "C" {
                                 vbucket_state_t state,
                                 const void *es,
                                 size_t nes);
+        /**
+         * Called with the next chunk of a value we're streaming (see
+         * libcouchbase_set_stream_threshold). The value is complete
+         * when offset + nbytes == total.
+         */
+        void (*get_stream)(libcouchbase_t instance,
+                           const void *cookie,
+                           const void *key, size_t nkey,
+                           const void *bytes, size_t nbytes,
+                           size_t offset, size_t total,
+                           uint32_t flags, uint64_t cas);
     } libcouchbase_callback_t;
 
 #ifdef __cplusplus
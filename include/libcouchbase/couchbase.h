@@ -71,6 +71,54 @@ extern "C" {
                                        const char *bucket,
                                        struct event_base *base);
 
+    /**
+     * Create an instance of libcouchbase running on top of the given
+     * I/O backend.
+     *
+     * @param host The host (with optional port) to connect to retrieve the
+     *             vbucket list from
+     * @param user the username to use
+     * @param passwd The password
+     * @param bucket The bucket to connect to
+     * @param io the I/O backend to use. The instance takes ownership
+     *           of the backend and destroys it in libcouchbase_destroy
+     * @return A handle to libcouchbase, or NULL if an error occured.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_t libcouchbase_create_with_io(const char *host,
+                                               const char *user,
+                                               const char *passwd,
+                                               const char *bucket,
+                                               libcouchbase_io_opt_t *io);
+
+    /**
+     * Create an I/O backend using libevent
+     * @param base the event base to add the events to
+     * @return the backend, or NULL if we failed to allocate memory
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_io_opt_t *libcouchbase_create_libevent_io_opts(struct event_base *base);
+
+    /**
+     * Create an I/O backend using edge-triggered epoll. The backend
+     * runs its own event loop.
+     * @return the backend, or NULL if epoll isn't available
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_io_opt_t *libcouchbase_create_epoll_io_opts(void);
+
+    /**
+     * Create an I/O backend using io_uring. The requests for all of the
+     * servers are submitted to the kernel in one system call for each
+     * iteration of the event loop. The backend runs its own event loop.
+     *
+     * @param registered_buffers try to register the read buffers with
+     *                           the kernel
+     * @return the backend, or NULL if io_uring isn't available
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_io_opt_t *libcouchbase_create_io_uring_io_opts(bool registered_buffers);
+
 
     /**
      * Destroy (and release all allocated resources) an instance of libcouchbase.
@@ -114,6 +162,235 @@ extern "C" {
     void libcouchbase_set_packet_filter(libcouchbase_t instance,
                                         libcouchbase_packet_filter_t filter);
 
+    /**
+     * Specify if the library should keep a copy of the value for the
+     * storage commands until it receives the response from the server.
+     * By default only the header, extras and the key of each command is
+     * kept (that's all that is needed to report the result). Enable this
+     * if you want the complete command to be available so it may be
+     * sent to another server. Commands not written to the socket yet are
+     * always moved when their vbucket moves, but a storage command
+     * already written to a server leaving the cluster fails with
+     * LIBCOUCHBASE_ETMPFAIL unless the values are retained.
+     *
+     * @param instance the instance of libcouchbase
+     * @param enable true to keep the complete commands
+     */
+    LIBCOUCHBASE_API
+    void libcouchbase_set_retain_values(libcouchbase_t instance, bool enable);
+
+    /**
+     * Stream big values to the get_stream callback as the data arrives
+     * from the server instead of buffering the entire value and pass
+     * it to the get callback. This keeps the memory used for each
+     * server connection bounded no matter how big the values are.
+     *
+     * @param instance the instance of libcouchbase
+     * @param nbytes values of this size (or bigger) is streamed. Specify
+     *               0 to disable streaming (the default)
+     */
+    LIBCOUCHBASE_API
+    void libcouchbase_set_stream_threshold(libcouchbase_t instance,
+                                           size_t nbytes);
+
+    /**
+     * Set the number of times a command is sent to another server when
+     * a server reports that it doesn't own the vbucket (as it does
+     * while the cluster is being rebalanced). The command is sent to
+     * the server the vbucket map points to, or the next server if the
+     * map is out of date. Commands may only be sent to another server
+     * if the complete command is available, so storage commands are
+     * only retried if values are retained (see
+     * libcouchbase_set_retain_values).
+     *
+     * @param instance the instance of libcouchbase
+     * @param retries the maximum number of retries for each command
+     *                (0 to disable, the default is 3)
+     */
+    LIBCOUCHBASE_API
+    void libcouchbase_set_max_retries(libcouchbase_t instance,
+                                      unsigned int retries);
+
+    /**
+     * Set the timeout for the commands spooled from now on. If the
+     * server doesn't respond to a command in time, the callback for the
+     * command is called with LIBCOUCHBASE_ETIMEDOUT (and the response
+     * is ignored if it arrives later). The connection to a server that
+     * doesn't respond to its oldest command in time is closed, the other
+     * commands sent on it fail with LIBCOUCHBASE_ETMPFAIL, and we connect
+     * to the server again for the commands spooled from then on. Use
+     * libcouchbase_set_operation_timeout to use another timeout for a
+     * single call.
+     *
+     * @param instance the instance of libcouchbase
+     * @param usec the timeout in microseconds (0 to disable, the
+     *             default is 2.5 seconds)
+     */
+    LIBCOUCHBASE_API
+    void libcouchbase_set_timeout(libcouchbase_t instance, uint32_t usec);
+
+    /**
+     * Get the timeout for the commands
+     * @param instance the instance of libcouchbase
+     * @return the timeout in microseconds
+     */
+    LIBCOUCHBASE_API
+    uint32_t libcouchbase_get_timeout(libcouchbase_t instance);
+
+    /**
+     * Set the timeout for the commands spooled by the next call to a
+     * spool function (libcouchbase_get, libcouchbase_mstore etc) from
+     * the calling thread. The calls after it use the timeout set with
+     * libcouchbase_set_timeout again.
+     *
+     * @param instance the instance of libcouchbase
+     * @param usec the timeout in microseconds (0 to use the timeout of
+     *             the instance)
+     */
+    LIBCOUCHBASE_API
+    void libcouchbase_set_operation_timeout(libcouchbase_t instance,
+                                            uint32_t usec);
+
+    /**
+     * Send the gets to the first replica of the vbucket as well if the
+     * master didn't respond within the given time. The get callback is
+     * called with the first successful response (or the response from
+     * the master if the replica doesn't have the item). A get may be
+     * sent to the replica up to twice the timeout after it was spooled.
+     *
+     * @param instance the instance of libcouchbase
+     * @param usec the number of microseconds to wait for the master
+     *             (0 to disable, the default)
+     * @return LIBCOUCHBASE_SUCCESS, or LIBCOUCHBASE_NOT_SUPPORTED if the
+     *         servers are owned by more than one I/O thread
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_set_hedge_timeout(libcouchbase_t instance,
+                                                        uint32_t usec);
+
+    /**
+     * Enable auto-batching of the commands. By default each spool
+     * function asks the event loop to start sending the command to the
+     * server. With auto-batching enabled the spool functions only add
+     * the commands to the output buffers, and the commands spooled
+     * during an iteration of the event loop are sent together at the
+     * end of it (or when you call libcouchbase_flush).
+     *
+     * @param instance the instance of libcouchbase
+     * @param enable true to enable auto-batching (disabling it flushes
+     *               the current batch)
+     * @return LIBCOUCHBASE_SUCCESS, or LIBCOUCHBASE_NOT_SUPPORTED if the
+     *         servers are owned by more than one I/O thread
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_set_auto_batch(libcouchbase_t instance,
+                                                     bool enable);
+
+    /**
+     * Try to send the commands to the server right away. By default the
+     * commands are sent when the event loop reports that the socket is
+     * writable, which costs an extra iteration of the event loop for
+     * every command sent to an idle server. With eager sending enabled
+     * the data is written to the socket from the spool function (or
+     * when the batch is flushed if auto-batching is enabled) if we're
+     * not already waiting for the socket to become writable, and the
+     * event loop is only used to send the data we couldn't write.
+     *
+     * @param instance the instance of libcouchbase
+     * @param enable true to send the commands eagerly
+     */
+    LIBCOUCHBASE_API
+    void libcouchbase_set_eager_send(libcouchbase_t instance, bool enable);
+
+    /**
+     * Coalesce identical gets. With coalescing enabled a get (without
+     * a new expiration time) for a key we've already spooled a get for
+     * isn't sent to the server if the first get isn't sent yet. The
+     * get callback is called for both of them (with their own cookie)
+     * when we receive the response to the first get. The gets spooled
+     * after a command that may change the value (or after we've started
+     * sending the commands to the server) are never coalesced with the
+     * gets spooled before it. Coalescing is most useful together with
+     * auto-batching (see libcouchbase_set_auto_batch).
+     *
+     * @param instance the instance of libcouchbase
+     * @param enable true to coalesce identical gets (disabled by default)
+     * @return LIBCOUCHBASE_SUCCESS, or LIBCOUCHBASE_NOT_SUPPORTED if the
+     *         servers are owned by more than one I/O thread
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_set_coalesce_gets(libcouchbase_t instance,
+                                                        bool enable);
+
+    /**
+     * Keep the values returned by the gets in an in-process cache. The
+     * gets (without a new expiration time) for the keys in the cache
+     * call the get callback before the spool function returns, without
+     * asking the server. The instance taps the cluster for the keys
+     * only (like libcouchbase_tap_cluster), and a key is dropped from
+     * the cache when it is modified or removed. The least recently
+     * used items are evicted when the cache is full.
+     *
+     * The TAP stream can't be stopped once started, so disabling the
+     * cache only drops the items and stops adding new ones.
+     *
+     * @param instance the instance of libcouchbase
+     * @param nbytes the maximum number of bytes used by the cached items
+     *               (0 to disable the cache, the default)
+     * @param usec the maximum time to keep an item in microseconds (0
+     *             for no limit). The TAP stream doesn't report that
+     *             an item expired, so this should be set if the items
+     *             have an expiration time.
+     * @return LIBCOUCHBASE_SUCCESS, LIBCOUCHBASE_ENOMEM, or
+     *         LIBCOUCHBASE_NOT_SUPPORTED if the servers are owned by
+     *         more than one I/O thread
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_set_near_cache(libcouchbase_t instance,
+                                                     size_t nbytes,
+                                                     uint32_t usec);
+
+    /**
+     * Attach the instance to a cache shared by the processes on the
+     * host (for instance the workers of a prefork server). The cache is
+     * kept in a memory mapped file, and the gets (without a new
+     * expiration time) for the keys in the cache call the get callback
+     * before the spool function returns, without asking the server.
+     *
+     * One of the processes should attach with invalidator set to true.
+     * That instance taps the cluster for the keys only (like
+     * libcouchbase_tap_cluster) and drops the modified keys from the
+     * cache, and the cache is only used for the vbuckets the
+     * invalidator taps (so it must keep running its event loop).
+     *
+     * @param instance the instance of libcouchbase
+     * @param path the file to keep the cache in. The first process to
+     *             attach creates the file, and the file should be
+     *             removed when all of the processes are done with it.
+     *             A file that was never initialized (the creator died)
+     *             or was created by another version of the library is
+     *             replaced by a new one.
+     * @param nbytes the size of the file (at least 4MB). Ignored if the
+     *               file exists.
+     * @param usec the maximum time to keep an item in microseconds (0
+     *             for no limit). Ignored if the file exists. The items
+     *             aren't invalidated if the invalidator dies, so this
+     *             should be set.
+     * @param invalidator set to true for the process invalidating the
+     *                    cache
+     * @return LIBCOUCHBASE_SUCCESS, LIBCOUCHBASE_E2BIG if nbytes is too
+     *         big (32GB), LIBCOUCHBASE_NOT_SUPPORTED if the platform
+     *         doesn't support memory mapped files (or the servers are
+     *         owned by more than one I/O thread), or LIBCOUCHBASE_ERROR
+     *         if the file couldn't be used
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_attach_shared_cache(libcouchbase_t instance,
+                                                          const char *path,
+                                                          size_t nbytes,
+                                                          uint32_t usec,
+                                                          bool invalidator);
+
     /**
      * Set the command handlers
      * @param instance the instance of libcouchbase
@@ -143,6 +420,55 @@ extern "C" {
     LIBCOUCHBASE_API
     void libcouchbase_execute(libcouchbase_t instance);
 
+    /**
+     * Start sending the commands spooled while auto-batching is
+     * enabled. You don't need to call this function if you run the
+     * event loop (the commands are sent at the end of the current
+     * iteration of the loop), but it lets you send the commands
+     * earlier. libcouchbase_execute flushes the commands before it
+     * starts the event loop.
+     *
+     * @param instance the instance containing the requests
+     */
+    LIBCOUCHBASE_API
+    void libcouchbase_flush(libcouchbase_t instance);
+
+    /**
+     * Get the handle for the commands spooled by the last call to one
+     * of the spool functions. You may pass the handle to
+     * libcouchbase_wait to wait for just those commands.
+     *
+     * @param instance the instance containing the requests
+     * @return the handle for the last spool call (0 if no commands are
+     *         spooled yet)
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_operation_t libcouchbase_get_last_operation(libcouchbase_t instance);
+
+    /**
+     * Run the event loop until all of the commands for the given
+     * operations are completed. Unlike libcouchbase_execute this
+     * doesn't wait for the other commands spooled on the instance, but
+     * the event loop keeps on processing their responses (and calls
+     * their callbacks) while we wait. You should not call this function
+     * from within your callbacks.
+     *
+     * @param instance the instance containing the requests
+     * @param operations the operations to wait for
+     * @param num_operations the number of operations
+     * @param usec the maximum number of microseconds to wait (0 to
+     *             wait until the operations are completed). The
+     *             commands not completed when we give up are still
+     *             reported to their callbacks later on.
+     * @return LIBCOUCHBASE_SUCCESS if all of the operations are
+     *         completed, LIBCOUCHBASE_ETIMEDOUT otherwise
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_wait(libcouchbase_t instance,
+                                           const libcouchbase_operation_t *operations,
+                                           size_t num_operations,
+                                           uint32_t usec);
+
     /**
      * Get a number of values from the cache. You need to run the
      * event loop yourself (or call libcouchbase_execute) to retrieve
@@ -152,6 +478,8 @@ extern "C" {
      * for the exp parameter.
      *
      * @param instance the instance used to batch the requests from
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
      * @param num_keys the number of keys to get
      * @param keys the array containing the keys to get
      * @param nkey the array containing the lengths of the keys
@@ -160,6 +488,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_mget(libcouchbase_t instance,
+                                           const void * const *command_cookies,
                                            size_t num_keys,
                                            const void * const *keys,
                                            const size_t *nkey,
@@ -174,6 +503,8 @@ extern "C" {
      * for the exp parameter.
      *
      * @param instance the instance used to batch the requests from
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
      * @param hashkey the key to use for hashing
      * @param nhashkey the number of bytes in hashkey
      * @param num_keys the number of keys to get
@@ -183,6 +514,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_mget_by_key(libcouchbase_t instance,
+                                                  const void * const *command_cookies,
                                                   const void *hashkey,
                                                   size_t nhashkey,
                                                   size_t num_keys,
@@ -190,6 +522,76 @@ extern "C" {
                                                   const size_t *nkey,
                                                   const time_t *exp);
 
+    /**
+     * Get a single value from the cache. Unlike libcouchbase_mget this
+     * uses the normal get command, so the command is completed by the
+     * response from the server (without waiting for a NOOP). You need
+     * to run the event loop yourself (or call libcouchbase_execute) to
+     * retrieve the data.
+     *
+     * @param instance the instance used to batch the requests from
+     * @param command_cookie the cookie passed to the callback for the key
+     * @param key the key to get
+     * @param nkey the number of bytes in the key
+     * @param exp the new expiration time for the object (or NULL to get
+     *            the object without touching it)
+     * @return The status of the operation
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_get(libcouchbase_t instance,
+                                          const void *command_cookie,
+                                          const void *key,
+                                          size_t nkey,
+                                          const time_t *exp);
+
+    /**
+     * Get a single value from the cache. Unlike libcouchbase_mget this
+     * uses the normal get command, so the command is completed by the
+     * response from the server (without waiting for a NOOP). You need
+     * to run the event loop yourself (or call libcouchbase_execute) to
+     * retrieve the data.
+     *
+     * @param instance the instance used to batch the requests from
+     * @param command_cookie the cookie passed to the callback for the key
+     * @param hashkey the key to use for hashing
+     * @param nhashkey the number of bytes in hashkey
+     * @param key the key to get
+     * @param nkey the number of bytes in the key
+     * @param exp the new expiration time for the object (or NULL to get
+     *            the object without touching it)
+     * @return The status of the operation
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_get_by_key(libcouchbase_t instance,
+                                                 const void *command_cookie,
+                                                 const void *hashkey,
+                                                 size_t nhashkey,
+                                                 const void *key,
+                                                 size_t nkey,
+                                                 const time_t *exp);
+
+    /**
+     * Get a number of values from the first replica of their vbucket.
+     * The values are passed to the get callback, and it is called with
+     * LIBCOUCHBASE_KEY_ENOENT if the replica doesn't have the item. The
+     * replica may not have received the latest version of the item.
+     *
+     * @param instance the instance used to batch the requests from
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
+     * @param num_keys the number of keys to get
+     * @param keys the array containing the keys to get
+     * @param nkey the array containing the lengths of the keys
+     * @return The status of the operation (LIBCOUCHBASE_ERROR if one of
+     *         the vbuckets doesn't have a replica, and nothing is sent)
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_get_replica(libcouchbase_t instance,
+                                                  const void * const *command_cookies,
+                                                  size_t num_keys,
+                                                  const void * const *keys,
+                                                  const size_t *nkey);
+
 
     /**
      * Touch (set expiration time) on a number of values in the cache
@@ -197,6 +599,8 @@ extern "C" {
      * libcouchbase_execute) to retrieve the results of the operations.
      *
      * @param instance the instance used to batch the requests from
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
      * @param num_keys the number of keys to get
      * @param keys the array containing the keys to get
      * @param nkey the array containing the lengths of the keys
@@ -204,6 +608,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_mtouch(libcouchbase_t instance,
+                                             const void * const *command_cookies,
                                              size_t num_keys,
                                              const void * const *keys,
                                              const size_t *nkey,
@@ -218,6 +623,8 @@ extern "C" {
      * key.
      *
      * @param instance the instance used to batch the requests from
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
      * @param hashkey the key to use for hashing
      * @param nhashkey the number of bytes in hashkey
      * @param num_keys the number of keys to get
@@ -228,6 +635,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_mtouch_by_key(libcouchbase_t instance,
+                                                    const void * const *command_cookies,
                                                     const void *hashkey,
                                                     size_t nhashkey,
                                                     size_t num_keys,
@@ -241,6 +649,7 @@ extern "C" {
      * run the event loop (or call libcouchbase_execute).
      *
      * @param instance the handle to libcouchbase
+     * @param command_cookie the cookie passed to the callback for the command
      * @param operation constraints for the storage operation (add/replace etc)
      * @param key the key to set
      * @param nkey the number of bytes in the key
@@ -256,6 +665,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_store(libcouchbase_t instance,
+                                            const void *command_cookie,
                                             libcouchbase_storage_t operation,
                                             const void *key, size_t nkey,
                                             const void *bytes, size_t nbytes,
@@ -268,6 +678,7 @@ extern "C" {
      * run the event loop (or call libcouchbase_execute).
      *
      * @param instance the handle to libcouchbase
+     * @param command_cookie the cookie passed to the callback for the command
      * @param operation constraints for the storage operation (add/replace etc)
      * @param hashkey the key to use for hashing
      * @param nhashkey the number of bytes in hashkey
@@ -285,6 +696,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_store_by_key(libcouchbase_t instance,
+                                                   const void *command_cookie,
                                                    libcouchbase_storage_t operation,
                                                    const void *hashkey,
                                                    size_t nhashkey,
@@ -296,12 +708,174 @@ extern "C" {
                                                    time_t exp,
                                                    uint64_t cas);
 
+    /**
+     * Spool a store operation to the cluster without copying the value.
+     * The value is described by a list of chunks of memory owned by the
+     * caller, and the memory must stay valid until the release callback
+     * is called. The release callback is called once all of the data is
+     * sent to the server (it may be called before this function returns,
+     * if the library had to copy the data). If the instance retains the
+     * values (see libcouchbase_set_retain_values) the memory isn't
+     * copied to keep the command, and the release callback isn't called
+     * until we've got the response from the server.
+     *
+     * @param instance the handle to libcouchbase
+     * @param command_cookie the cookie passed to the callback for the command
+     * @param operation constraints for the storage operation (add/replace etc)
+     * @param key the key to set
+     * @param nkey the number of bytes in the key
+     * @param iov the chunks of memory containing the value
+     * @param niov the number of elements in iov
+     * @param flags the user-defined flag section for the item
+     * @param exp When the object should expire
+     * @param cas the cas identifier for the existing object if you want to
+     *            ensure that you're only replacing/append/prepending a
+     *            specific object. Specify 0 if you don't want to limit to
+     *            any cas value.
+     * @param release the function to call when the memory may be released
+     *                (or NULL)
+     * @param cookie the cookie passed to the release function
+     * @return Status of the operation.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_store_iov(libcouchbase_t instance,
+                                                const void *command_cookie,
+                                                libcouchbase_storage_t operation,
+                                                const void *key, size_t nkey,
+                                                const libcouchbase_iov_t *iov,
+                                                size_t niov,
+                                                uint32_t flags, time_t exp,
+                                                uint64_t cas,
+                                                libcouchbase_release_t release,
+                                                const void *cookie);
+
+    /**
+     * Spool a store operation to the cluster without copying the value.
+     * See libcouchbase_store_iov for a description of the memory
+     * ownership.
+     *
+     * @param instance the handle to libcouchbase
+     * @param command_cookie the cookie passed to the callback for the command
+     * @param operation constraints for the storage operation (add/replace etc)
+     * @param hashkey the key to use for hashing
+     * @param nhashkey the number of bytes in hashkey
+     * @param key the key to set
+     * @param nkey the number of bytes in the key
+     * @param iov the chunks of memory containing the value
+     * @param niov the number of elements in iov
+     * @param flags the user-defined flag section for the item
+     * @param exp When the object should expire
+     * @param cas the cas identifier for the existing object (or 0)
+     * @param release the function to call when the memory may be released
+     *                (or NULL)
+     * @param cookie the cookie passed to the release function
+     * @return Status of the operation.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_store_iov_by_key(libcouchbase_t instance,
+                                                       const void *command_cookie,
+                                                       libcouchbase_storage_t operation,
+                                                       const void *hashkey,
+                                                       size_t nhashkey,
+                                                       const void *key,
+                                                       size_t nkey,
+                                                       const libcouchbase_iov_t *iov,
+                                                       size_t niov,
+                                                       uint32_t flags,
+                                                       time_t exp,
+                                                       uint64_t cas,
+                                                       libcouchbase_release_t release,
+                                                       const void *cookie);
+
+    /**
+     * Spool a number of store operations to the cluster. The quiet
+     * versions of the storage commands are used, so the servers only
+     * respond to the commands that fail. The storage callback for the
+     * other commands is called (with a cas value of 0) when the
+     * server responds to a command sent after them. You need to run
+     * the event loop yourself (or call libcouchbase_execute) to
+     * retrieve the results.
+     *
+     * @param instance the handle to libcouchbase
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
+     * @param operation constraints for the storage operation (add/replace etc)
+     * @param num_keys the number of items to store
+     * @param keys the array containing the keys to set
+     * @param nkey the array containing the lengths of the keys
+     * @param bytes the array containing the values to set
+     * @param nbytes the array containing the sizes of the values
+     * @param flags the array containing the user-defined flag section
+     *              for the items (or NULL to use 0 for all of them)
+     * @param exp the array containing when the items should expire (or
+     *            NULL if they shouldn't expire)
+     * @param cas the array containing the cas identifiers for the
+     *            existing objects (or NULL if you don't want to limit
+     *            the operations to any cas value)
+     * @return Status of the operation.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_mstore(libcouchbase_t instance,
+                                             const void * const *command_cookies,
+                                             libcouchbase_storage_t operation,
+                                             size_t num_keys,
+                                             const void * const *keys,
+                                             const size_t *nkey,
+                                             const void * const *bytes,
+                                             const size_t *nbytes,
+                                             const uint32_t *flags,
+                                             const time_t *exp,
+                                             const uint64_t *cas);
+
+    /**
+     * Spool a number of store operations to the cluster. See
+     * libcouchbase_mstore for a description of how the results are
+     * reported.
+     *
+     * Set <code>nhashkey</code> to 0 if you want to hash each individual
+     * key.
+     *
+     * @param instance the handle to libcouchbase
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
+     * @param operation constraints for the storage operation (add/replace etc)
+     * @param hashkey the key to use for hashing
+     * @param nhashkey the number of bytes in hashkey
+     * @param num_keys the number of items to store
+     * @param keys the array containing the keys to set
+     * @param nkey the array containing the lengths of the keys
+     * @param bytes the array containing the values to set
+     * @param nbytes the array containing the sizes of the values
+     * @param flags the array containing the user-defined flag section
+     *              for the items (or NULL)
+     * @param exp the array containing when the items should expire (or
+     *            NULL)
+     * @param cas the array containing the cas identifiers for the
+     *            existing objects (or NULL)
+     * @return Status of the operation.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_mstore_by_key(libcouchbase_t instance,
+                                                    const void * const *command_cookies,
+                                                    libcouchbase_storage_t operation,
+                                                    const void *hashkey,
+                                                    size_t nhashkey,
+                                                    size_t num_keys,
+                                                    const void * const *keys,
+                                                    const size_t *nkey,
+                                                    const void * const *bytes,
+                                                    const size_t *nbytes,
+                                                    const uint32_t *flags,
+                                                    const time_t *exp,
+                                                    const uint64_t *cas);
+
     /**
      * Spool an arithmetic operation to the cluster. The operation <b>may</b> be
      * sent immediately, but you won't be sure (or get the result) until you
      * run the event loop (or call libcouchbase_execute).
      *
      * @param instance the handle to libcouchbase
+     * @param command_cookie the cookie passed to the callback for the command
      * @param key the key to set
      * @param nkey the number of bytes in the key
      * @param delta The amount to add / subtract
@@ -313,6 +887,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_arithmetic(libcouchbase_t instance,
+                                                 const void *command_cookie,
                                                  const void *key, size_t nkey,
                                                  int64_t delta, time_t exp,
                                                  bool create, uint64_t initial);
@@ -323,6 +898,7 @@ extern "C" {
      * run the event loop (or call libcouchbase_execute).
      *
      * @param instance the handle to libcouchbase
+     * @param command_cookie the cookie passed to the callback for the command
      * @param hashkey the key to use for hashing
      * @param nhashkey the number of bytes in hashkey
      * @param key the key to set
@@ -336,6 +912,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_arithmetic_by_key(libcouchbase_t instance,
+                                                        const void *command_cookie,
                                                         const void *hashkey,
                                                         size_t nhashkey,
                                                         const void *key,
@@ -345,12 +922,83 @@ extern "C" {
                                                         bool create,
                                                         uint64_t initial);
 
+    /**
+     * Spool the same arithmetic operation for a number of keys to the
+     * cluster. The quiet versions of the arithmetic commands are used,
+     * so the servers only respond to the commands that fail. The
+     * arithmetic callback for the other commands is called when the
+     * server responds to a command sent after them, and the server
+     * doesn't tell us the new value (so the callback gets 0 for the
+     * value and cas). Use libcouchbase_arithmetic if you need the new
+     * values. You need to run the event loop yourself (or call
+     * libcouchbase_execute) to retrieve the results.
+     *
+     * @param instance the handle to libcouchbase
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
+     * @param num_keys the number of keys to update
+     * @param keys the array containing the keys to update
+     * @param nkey the array containing the lengths of the keys
+     * @param delta The amount to add / subtract
+     * @param exp When the objects should expire
+     * @param create set to true if you want the objects to be created if
+     *               they don't exist.
+     * @param initial The initial value of the objects we create
+     * @return Status of the operation.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_marithmetic(libcouchbase_t instance,
+                                                  const void * const *command_cookies,
+                                                  size_t num_keys,
+                                                  const void * const *keys,
+                                                  const size_t *nkey,
+                                                  int64_t delta, time_t exp,
+                                                  bool create,
+                                                  uint64_t initial);
+
+    /**
+     * Spool the same arithmetic operation for a number of keys to the
+     * cluster. See libcouchbase_marithmetic for a description of how
+     * the results are reported.
+     *
+     * Set <code>nhashkey</code> to 0 if you want to hash each individual
+     * key.
+     *
+     * @param instance the handle to libcouchbase
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
+     * @param hashkey the key to use for hashing
+     * @param nhashkey the number of bytes in hashkey
+     * @param num_keys the number of keys to update
+     * @param keys the array containing the keys to update
+     * @param nkey the array containing the lengths of the keys
+     * @param delta The amount to add / subtract
+     * @param exp When the objects should expire
+     * @param create set to true if you want the objects to be created if
+     *               they don't exist.
+     * @param initial The initial value of the objects we create
+     * @return Status of the operation.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_marithmetic_by_key(libcouchbase_t instance,
+                                                         const void * const *command_cookies,
+                                                         const void *hashkey,
+                                                         size_t nhashkey,
+                                                         size_t num_keys,
+                                                         const void * const *keys,
+                                                         const size_t *nkey,
+                                                         int64_t delta,
+                                                         time_t exp,
+                                                         bool create,
+                                                         uint64_t initial);
+
     /**
      * Spool a remove operation to the cluster. The operation <b>may</b> be
      * sent immediately, but you won't be sure (or get the result) until you
      * run the event loop (or call libcouchbase_execute).
      *
      * @param instance the handle to libcouchbase
+     * @param command_cookie the cookie passed to the callback for the command
      * @param key the key to delete
      * @param nkey the number of bytes in the key
      * @param cas the cas value for the object (or 0 if you don't care)
@@ -358,6 +1006,7 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_remove(libcouchbase_t instance,
+                                             const void *command_cookie,
                                              const void *key, size_t nkey,
                                              uint64_t cas);
 
@@ -367,6 +1016,7 @@ extern "C" {
      * run the event loop (or call libcouchbase_execute).
      *
      * @param instance the handle to libcouchbase
+     * @param command_cookie the cookie passed to the callback for the command
      * @param hashkey the key to use for hashing
      * @param nhashkey the number of bytes in hashkey
      * @param key the key to delete
@@ -376,12 +1026,161 @@ extern "C" {
      */
     LIBCOUCHBASE_API
     libcouchbase_error_t libcouchbase_remove_by_key(libcouchbase_t instance,
+                                                    const void *command_cookie,
                                                     const void *hashkey,
                                                     size_t nhashkey,
                                                     const void *key,
                                                     size_t nkey,
                                                     uint64_t cas);
 
+    /**
+     * Spool remove operations for a number of keys to the cluster. The
+     * DELETEQ command is used, so the servers only respond to the
+     * commands that fail. The remove callback for the other commands is
+     * called when the server responds to a command sent after them.
+     * You need to run the event loop yourself (or call
+     * libcouchbase_execute) to retrieve the results.
+     *
+     * @param instance the handle to libcouchbase
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
+     * @param num_keys the number of keys to delete
+     * @param keys the array containing the keys to delete
+     * @param nkey the array containing the lengths of the keys
+     * @param cas the array containing the cas values for the objects
+     *            (or NULL if you don't care)
+     * @return Status of the operation.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_mremove(libcouchbase_t instance,
+                                              const void * const *command_cookies,
+                                              size_t num_keys,
+                                              const void * const *keys,
+                                              const size_t *nkey,
+                                              const uint64_t *cas);
+
+    /**
+     * Spool remove operations for a number of keys to the cluster. See
+     * libcouchbase_mremove for a description of how the results are
+     * reported.
+     *
+     * Set <code>nhashkey</code> to 0 if you want to hash each individual
+     * key.
+     *
+     * @param instance the handle to libcouchbase
+     * @param command_cookies the cookies passed to the callback for each
+     *                        key (or NULL)
+     * @param hashkey the key to use for hashing
+     * @param nhashkey the number of bytes in hashkey
+     * @param num_keys the number of keys to delete
+     * @param keys the array containing the keys to delete
+     * @param nkey the array containing the lengths of the keys
+     * @param cas the array containing the cas values for the objects
+     *            (or NULL if you don't care)
+     * @return Status of the operation.
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_mremove_by_key(libcouchbase_t instance,
+                                                     const void * const *command_cookies,
+                                                     const void *hashkey,
+                                                     size_t nhashkey,
+                                                     size_t num_keys,
+                                                     const void * const *keys,
+                                                     const size_t *nkey,
+                                                     const uint64_t *cas);
+
+    /**
+     * Start a thread running the event loop for the instance. The
+     * function blocks until the instance received the cluster
+     * configuration. Once the thread is started all callbacks are
+     * called from that thread, and the only functions you may call on
+     * the instance from other threads are libcouchbase_submit and
+     * libcouchbase_stop_io_thread.
+     *
+     * @param instance the handle to libcouchbase
+     * @return Status of the operation (LIBCOUCHBASE_NOT_SUPPORTED if
+     *         the platform doesn't support threads)
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_start_io_thread(libcouchbase_t instance);
+
+    /**
+     * Start a number of threads running event loops for the instance.
+     * The first thread runs the event loop of the instance (and
+     * receives the cluster configuration), and each of the others runs
+     * an event loop of its own. The servers are spread over the
+     * threads, and only the thread owning a server sends the commands
+     * to it and calls the callbacks for them. A task may spool commands
+     * for any key; the commands for servers owned by other threads are
+     * passed on to their owners. Use libcouchbase_submit_by_key to run
+     * a task in the thread owning the server for a key.
+     *
+     * The tasks must not call libcouchbase_execute, libcouchbase_wait or
+     * block in libcouchbase_tap_cluster, and the near cache, the shared
+     * cache, coalescing, hedged reads and batching are not supported
+     * with more than one thread.
+     *
+     * @param instance the handle to libcouchbase
+     * @param nthreads the number of threads to start
+     * @param io the I/O backends for the event loops of the threads
+     *           after the first one (nthreads - 1 of them). The instance
+     *           takes ownership of them (even if the call fails).
+     * @return Status of the operation (LIBCOUCHBASE_NOT_SUPPORTED if
+     *         the platform doesn't support threads, or one of the
+     *         features above is enabled)
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_start_io_threads(libcouchbase_t instance,
+                                                       size_t nthreads,
+                                                       libcouchbase_io_opt_t * const *io);
+
+    /**
+     * Stop the threads running the event loops for the instance and wait
+     * for them to terminate. Tasks submitted but not yet run are dropped.
+     *
+     * @param instance the handle to libcouchbase
+     */
+    LIBCOUCHBASE_API
+    void libcouchbase_stop_io_thread(libcouchbase_t instance);
+
+    /**
+     * Submit a task to be run by the thread running the event loop of
+     * the instance (the first thread). This function may be called from any thread, and
+     * the task may use all of the functions operating on the instance
+     * (for instance to spool operations). Tasks submitted from the same
+     * thread are run in the order they were submitted.
+     *
+     * @param instance the handle to libcouchbase
+     * @param task the task to run
+     * @param arg the argument to pass to the task
+     * @return Status of the operation (LIBCOUCHBASE_ERROR if the I/O
+     *         thread isn't running)
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_submit(libcouchbase_t instance,
+                                             libcouchbase_task_t task,
+                                             void *arg);
+
+    /**
+     * Submit a task to be run by the thread owning the server for a key
+     * (see libcouchbase_start_io_threads). The commands the task spools
+     * for keys on that server are sent without involving other threads.
+     *
+     * @param instance the handle to libcouchbase
+     * @param hashkey the key to pick the thread with
+     * @param nhashkey the number of bytes in hashkey
+     * @param task the task to run
+     * @param arg the argument to pass to the task
+     * @return Status of the operation (LIBCOUCHBASE_ERROR if the I/O
+     *         threads aren't running)
+     */
+    LIBCOUCHBASE_API
+    libcouchbase_error_t libcouchbase_submit_by_key(libcouchbase_t instance,
+                                                    const void *hashkey,
+                                                    size_t nhashkey,
+                                                    libcouchbase_task_t task,
+                                                    void *arg);
+
 #ifdef __cplusplus
 }
 #endif
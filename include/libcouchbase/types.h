@@ -58,7 +58,9 @@ extern "C" {
         LIBCOUCHBASE_NETWORK_ERROR,
         LIBCOUCHBASE_LIBEVENT_ERROR,
         LIBCOUCHBASE_KEY_ENOENT,
-        LIBCOUCHBASE_ERROR
+        LIBCOUCHBASE_ERROR,
+        LIBCOUCHBASE_NOT_SUPPORTED,
+        LIBCOUCHBASE_ETIMEDOUT
     } libcouchbase_error_t;
 
     /**
@@ -88,6 +90,149 @@ extern "C" {
     typedef bool (*libcouchbase_packet_filter_t)(libcouchbase_t instance,
                                                  const void *packet);
 
+    /**
+     * A chunk of memory owned by the caller, used to pass the value to
+     * the storage commands without copying it.
+     */
+    typedef struct {
+        const void *iov_base;
+        size_t iov_len;
+    } libcouchbase_iov_t;
+
+    /**
+     * Callback used to notify the caller that the library no longer
+     * needs the memory passed to it.
+     */
+    typedef void (*libcouchbase_release_t)(libcouchbase_t instance,
+                                           const void *cookie);
+
+    /**
+     * A handle for the commands spooled by a single call to one of the
+     * spool functions (see libcouchbase_get_last_operation)
+     */
+    typedef uint32_t libcouchbase_operation_t;
+
+    /**
+     * A task submitted to an instance from another thread. The task is
+     * run by the thread running the event loop for the instance.
+     */
+    typedef void (*libcouchbase_task_t)(libcouchbase_t instance, void *arg);
+
+#ifdef WIN32
+    typedef intptr_t libcouchbase_socket_t;
+#else
+    typedef int libcouchbase_socket_t;
+#endif
+
+    typedef ptrdiff_t libcouchbase_ssize_t;
+
+    /** The socket is readable */
+#define LIBCOUCHBASE_READ_EVENT 0x02
+    /** The socket is writable */
+#define LIBCOUCHBASE_WRITE_EVENT 0x04
+#define LIBCOUCHBASE_RW_EVENT (LIBCOUCHBASE_READ_EVENT|LIBCOUCHBASE_WRITE_EVENT)
+
+    /**
+     * Callback from the I/O backend when a socket we're watching is
+     * ready, or when a timer expires (sock is then an invalid socket
+     * and which is 0)
+     */
+    typedef void (*libcouchbase_io_handler_t)(libcouchbase_socket_t sock,
+                                              short which,
+                                              void *cb_data);
+
+    struct sockaddr;
+
+    /**
+     * The operations the library use to talk to the network and to be
+     * notified when a socket is ready. Use one of the backends shipped
+     * with the library (libcouchbase_create_libevent_io_opts or
+     * libcouchbase_create_epoll_io_opts), or fill in the table yourself
+     * to run the library in your own event loop.
+     *
+     * All of the socket functions return -1 and store the errno value
+     * in error if they fail. The events are persistent; they stay
+     * active until they're updated or deleted.
+     */
+    typedef struct libcouchbase_io_opt_st {
+        /** Private data for the backend */
+        void *cookie;
+        /** The error code from the last failing socket operation */
+        int error;
+
+        /** Create a non-blocking socket */
+        libcouchbase_socket_t (*socket)(struct libcouchbase_io_opt_st *iops,
+                                        int domain,
+                                        int type,
+                                        int protocol);
+        int (*connect)(struct libcouchbase_io_opt_st *iops,
+                       libcouchbase_socket_t sock,
+                       const struct sockaddr *name,
+                       unsigned int namelen);
+        libcouchbase_ssize_t (*recv)(struct libcouchbase_io_opt_st *iops,
+                                     libcouchbase_socket_t sock,
+                                     void *buffer,
+                                     size_t len,
+                                     int flags);
+        libcouchbase_ssize_t (*send)(struct libcouchbase_io_opt_st *iops,
+                                     libcouchbase_socket_t sock,
+                                     const void *msg,
+                                     size_t len,
+                                     int flags);
+        /** Send the chunks in one operation (may send less than all) */
+        libcouchbase_ssize_t (*sendv)(struct libcouchbase_io_opt_st *iops,
+                                      libcouchbase_socket_t sock,
+                                      const libcouchbase_iov_t *iov,
+                                      size_t niov);
+        void (*close)(struct libcouchbase_io_opt_st *iops,
+                      libcouchbase_socket_t sock);
+
+        void *(*create_event)(struct libcouchbase_io_opt_st *iops);
+        /**
+         * Watch the socket for the events in flags (replacing the
+         * previous set of events and handler)
+         * @return 0 on success, -1 otherwise
+         */
+        int (*update_event)(struct libcouchbase_io_opt_st *iops,
+                            libcouchbase_socket_t sock,
+                            void *event,
+                            short flags,
+                            void *cb_data,
+                            libcouchbase_io_handler_t handler);
+        /** Stop watching the socket */
+        void (*delete_event)(struct libcouchbase_io_opt_st *iops,
+                             libcouchbase_socket_t sock,
+                             void *event);
+        /** Release an event (it may be called from within a handler) */
+        void (*destroy_event)(struct libcouchbase_io_opt_st *iops,
+                              void *event);
+
+        void *(*create_timer)(struct libcouchbase_io_opt_st *iops);
+        /**
+         * Fire the handler once in usec microseconds (replacing the
+         * previous timeout)
+         * @return 0 on success, -1 otherwise
+         */
+        int (*update_timer)(struct libcouchbase_io_opt_st *iops,
+                            void *timer,
+                            uint32_t usec,
+                            void *cb_data,
+                            libcouchbase_io_handler_t handler);
+        void (*delete_timer)(struct libcouchbase_io_opt_st *iops,
+                             void *timer);
+        /** Release a timer (it may be called from within a handler) */
+        void (*destroy_timer)(struct libcouchbase_io_opt_st *iops,
+                              void *timer);
+
+        /** Run the event loop until it's stopped or got nothing to do */
+        void (*run_event_loop)(struct libcouchbase_io_opt_st *iops);
+        /** Make run_event_loop return as soon as possible */
+        void (*stop_event_loop)(struct libcouchbase_io_opt_st *iops);
+
+        /** Release all resources used by the backend */
+        void (*destroy)(struct libcouchbase_io_opt_st *iops);
+    } libcouchbase_io_opt_t;
+
 
 #ifdef __cplusplus
 }
@@ -17,37 +17,37 @@
 #include "internal.h"
 
 /**
- * Spool an arithmetic request
+ * Encode an arithmetic command and add it to the server's output buffer.
  *
- * @author Trond Norbye
- * @todo add documentation
+ * @param instance the handle to libcouchbase
+ * @param command_cookie the cookie passed to the callback for the command
+ * @param quiet set to true to use the quiet version of the command
+ * @param hashkey the key to use for hashing (or NULL to use the key)
+ * @param nhashkey the number of bytes in hashkey
+ * @param key the key to update
+ * @param nkey the number of bytes in the key
+ * @param delta The amount to add / subtract
+ * @param exp When the object should expire
+ * @param create set to true if you want the object to be created if it
+ *               doesn't exist.
+ * @param initial The initial value of the object if we create it
+ * @param out where to store the server the command is sent to
+ * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
  */
-LIBCOUCHBASE_API
-libcouchbase_error_t libcouchbase_arithmetic(libcouchbase_t instance,
-                                             const void *key, size_t nkey,
-                                             int64_t delta, time_t exp,
-                                             bool create, uint64_t initial)
-{
-    return libcouchbase_arithmetic_by_key(instance, NULL, 0, key, nkey,
-                                          delta, exp, create, initial);
-}
-
-LIBCOUCHBASE_API
-libcouchbase_error_t libcouchbase_arithmetic_by_key(libcouchbase_t instance,
-                                                    const void *hashkey,
-                                                    size_t nhashkey,
-                                                    const void *key, size_t nkey,
-                                                    int64_t delta, time_t exp,
-                                                    bool create, uint64_t initial)
+static libcouchbase_error_t encode_arithmetic(libcouchbase_t instance,
+                                              const void *command_cookie,
+                                              bool quiet,
+                                              const void *hashkey,
+                                              size_t nhashkey,
+                                              const void *key, size_t nkey,
+                                              int64_t delta, time_t exp,
+                                              bool create, uint64_t initial,
+                                              libcouchbase_server_t **out)
 {
     uint16_t vb;
     libcouchbase_server_t *server;
     protocol_binary_request_incr req;
 
-    // we need a vbucket config before we can start getting data..
-    libcouchbase_ensure_vbucket_config(instance);
-    assert(instance->vbucket_config);
-
     if (nhashkey != 0) {
         vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
                                                   hashkey, nhashkey);
@@ -57,21 +57,32 @@ libcouchbase_error_t libcouchbase_arithmetic_by_key(libcouchbase_t instance,
     }
 
     server = instance->servers + instance->vb_server_map[vb];
+    *out = server;
     memset(&req, 0, sizeof(req));
     req.message.header.request.magic = PROTOCOL_BINARY_REQ;
-    req.message.header.request.opcode = PROTOCOL_BINARY_CMD_INCREMENT;
+    if (quiet) {
+        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_INCREMENTQ;
+    } else {
+        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_INCREMENT;
+    }
     req.message.header.request.keylen = ntohs((uint16_t)nkey);
     req.message.header.request.extlen = 20;
     req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
     req.message.header.request.vbucket = ntohs(vb);
     req.message.header.request.bodylen = ntohl((uint32_t)(nkey + 20));
-    req.message.header.request.opaque = ++instance->seqno;
+    req.message.header.request.opaque = libcouchbase_server_next_seqno(server);
     req.message.body.delta = ntohll((uint64_t)(delta));
     req.message.body.initial = ntohll(initial);
     req.message.body.expiration = ntohl((uint32_t)exp);
+    libcouchbase_near_cache_invalidate(instance, vb, key, nkey);
+    libcouchbase_shared_cache_invalidate(instance, vb, key, nkey);
 
     if (delta < 0) {
-        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_DECREMENT;
+        if (quiet) {
+            req.message.header.request.opcode = PROTOCOL_BINARY_CMD_DECREMENTQ;
+        } else {
+            req.message.header.request.opcode = PROTOCOL_BINARY_CMD_DECREMENT;
+        }
         req.message.body.delta = ntohll((uint64_t)(delta * -1));
     }
 
@@ -80,10 +91,111 @@ libcouchbase_error_t libcouchbase_arithmetic_by_key(libcouchbase_t instance,
                sizeof(req.message.body.expiration));
     }
 
-    libcouchbase_server_start_packet(server, req.bytes, sizeof(req.bytes));
+    libcouchbase_server_start_packet(server, command_cookie, req.bytes,
+                                     sizeof(req.bytes));
     libcouchbase_server_write_packet(server, key, nkey);
-    libcouchbase_server_end_packet(server);
-    libcouchbase_server_send_packets(server);
+    return libcouchbase_server_end_packet(server);
+}
+
+/**
+ * Spool an arithmetic request
+ *
+ * @author Trond Norbye
+ * @todo add documentation
+ */
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_arithmetic(libcouchbase_t instance,
+                                             const void *command_cookie,
+                                             const void *key, size_t nkey,
+                                             int64_t delta, time_t exp,
+                                             bool create, uint64_t initial)
+{
+    return libcouchbase_arithmetic_by_key(instance, command_cookie, NULL, 0,
+                                          key, nkey, delta, exp, create,
+                                          initial);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_arithmetic_by_key(libcouchbase_t instance,
+                                                    const void *command_cookie,
+                                                    const void *hashkey,
+                                                    size_t nhashkey,
+                                                    const void *key, size_t nkey,
+                                                    int64_t delta, time_t exp,
+                                                    bool create, uint64_t initial)
+{
+    libcouchbase_server_t *server;
+    libcouchbase_error_t ret;
+
+    // we need a vbucket config before we can start getting data..
+    libcouchbase_ensure_vbucket_config(instance);
+    assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
+
+    ret = encode_arithmetic(instance, command_cookie, false,
+                            hashkey, nhashkey, key, nkey,
+                            delta, exp, create, initial, &server);
+    if (ret == LIBCOUCHBASE_SUCCESS) {
+        libcouchbase_server_send_packets(server);
+    }
+
+    return ret;
+}
+
+/**
+ * libcouchbase_marithmetic use the quiet arithmetic commands followed
+ * by a NOOP command to avoid transferring the responses for the
+ * commands that succeed. The success callbacks are generated implicit
+ * by receiving a failure response or the NOOP.
+ */
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_marithmetic(libcouchbase_t instance,
+                                              const void * const *command_cookies,
+                                              size_t num_keys,
+                                              const void * const *keys,
+                                              const size_t *nkey,
+                                              int64_t delta, time_t exp,
+                                              bool create, uint64_t initial)
+{
+    return libcouchbase_marithmetic_by_key(instance, command_cookies, NULL, 0,
+                                           num_keys, keys, nkey, delta, exp,
+                                           create, initial);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_marithmetic_by_key(libcouchbase_t instance,
+                                                     const void * const *command_cookies,
+                                                     const void *hashkey,
+                                                     size_t nhashkey,
+                                                     size_t num_keys,
+                                                     const void * const *keys,
+                                                     const size_t *nkey,
+                                                     int64_t delta, time_t exp,
+                                                     bool create, uint64_t initial)
+{
+    libcouchbase_server_t *server = NULL;
+    libcouchbase_error_t ret = LIBCOUCHBASE_SUCCESS;
+    size_t ii;
+
+    // we need a vbucket config before we can start getting data..
+    libcouchbase_ensure_vbucket_config(instance);
+    assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
+
+    for (ii = 0; ii < num_keys && ret == LIBCOUCHBASE_SUCCESS; ++ii) {
+        ret = encode_arithmetic(instance,
+                                command_cookies ? command_cookies[ii] : NULL,
+                                true,
+                                hashkey, nhashkey, keys[ii], nkey[ii],
+                                delta, exp, create, initial, &server);
+        if (ret == LIBCOUCHBASE_SUCCESS) {
+            libcouchbase_server_fence(server);
+        }
+    }
+
+    if (nhashkey == 0 || server != NULL) {
+        libcouchbase_send_fenced(instance, nhashkey == 0 ? NULL : server);
+    }
 
-    return LIBCOUCHBASE_SUCCESS;
+    return ret;
 }
@@ -0,0 +1,112 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the functions to batch the commands spooled
+ * during an iteration of the event loop. With auto-batching enabled
+ * the spool functions only add the packets to the output buffers, and
+ * a timer firing at the end of the current iteration of the event loop
+ * (or an explicit flush) starts sending the packets. The event for
+ * each server is updated once per batch no matter how many commands
+ * are spooled, and all of the packets are sent with one write.
+ */
+#include "internal.h"
+
+static void flush_timer_handler(libcouchbase_socket_t sock, short which,
+                                void *arg)
+{
+    libcouchbase_t instance = arg;
+    (void)sock;
+    (void)which;
+
+    libcouchbase_flush(instance);
+}
+
+void libcouchbase_batch_add_server(libcouchbase_server_t *server)
+{
+    libcouchbase_t instance = server->instance;
+    libcouchbase_io_opt_t *io = instance->io;
+
+    server->flush_pending = true;
+    if (instance->batch.scheduled) {
+        return;
+    }
+
+    if (instance->batch.timer == NULL) {
+        instance->batch.timer = io->create_timer(io);
+    }
+
+    if (instance->batch.timer != NULL &&
+        io->update_timer(io, instance->batch.timer, 0, instance,
+                         flush_timer_handler) == 0) {
+        instance->batch.scheduled = true;
+    } else {
+        /* We can't delay the packets */
+        server->flush_pending = false;
+        if (server->connected) {
+            libcouchbase_server_start_send(server);
+        }
+    }
+}
+
+void libcouchbase_batch_destroy(libcouchbase_t instance)
+{
+    if (instance->batch.timer != NULL) {
+        instance->io->delete_timer(instance->io, instance->batch.timer);
+        instance->io->destroy_timer(instance->io, instance->batch.timer);
+        instance->batch.timer = NULL;
+    }
+}
+
+LIBCOUCHBASE_API
+void libcouchbase_flush(libcouchbase_t instance)
+{
+    size_t ii;
+
+    /* The servers are only marked while the timer is armed */
+    if (!instance->batch.scheduled) {
+        return;
+    }
+
+    instance->io->delete_timer(instance->io, instance->batch.timer);
+    instance->batch.scheduled = false;
+
+    for (ii = 0; ii < instance->nservers; ++ii) {
+        libcouchbase_server_t *server = instance->servers + ii;
+        if (server->flush_pending) {
+            server->flush_pending = false;
+            if (server->connected) {
+                libcouchbase_server_start_send(server);
+            }
+        }
+    }
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_set_auto_batch(libcouchbase_t instance,
+                                                 bool enable)
+{
+    if (enable && libcouchbase_threads_shared(instance)) {
+        /* The batch is flushed by the event loop of the instance */
+        return LIBCOUCHBASE_NOT_SUPPORTED;
+    }
+    instance->batch.enabled = enable;
+    if (!enable) {
+        libcouchbase_flush(instance);
+    }
+    return LIBCOUCHBASE_SUCCESS;
+}
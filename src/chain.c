@@ -0,0 +1,303 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the functions to operate on a chain of segments
+ * used to queue data we want to send to the servers. Data is never moved
+ * once it is written to a segment, and the segments are recycled through
+ * a pool in the event loop of the calling thread (see shard_t), so the
+ * segments may end up in another pool than the one they came from when
+ * a packet is passed to another thread. The pool is bounded, so the memory used during
+ * a burst of traffic is released once the data is sent.
+ *
+ * A segment may also refer to memory owned by the caller, so that we
+ * may send it without copying. The memory is shared by all of the
+ * segments referring to it (and the command log entry retaining the
+ * packet), and released when the last of them is done with it.
+ */
+#include "internal.h"
+
+/** The number of bytes of data in each segment we allocate */
+static const size_t segment_size = 16384;
+
+/** The maximum number of unused segments to keep in the pool */
+static const size_t max_pooled_segments = 64;
+
+static segment_t *allocate_segment(libcouchbase_t instance)
+{
+    segment_pool_t *pool = &libcouchbase_current_shard(instance)->segment_pool;
+    segment_t *ret = pool->segments;
+    if (ret != NULL) {
+        pool->segments = ret->next;
+        --pool->count;
+    } else {
+        ret = malloc(sizeof(*ret) + segment_size);
+        if (ret == NULL) {
+            return NULL;
+        }
+        ret->data = (char*)(ret + 1);
+        ret->size = segment_size;
+    }
+
+    ret->next = NULL;
+    ret->start = 0;
+    ret->avail = 0;
+    ret->ref = NULL;
+    return ret;
+}
+
+static void release_segment(libcouchbase_t instance, segment_t *segment)
+{
+    segment_pool_t *pool;
+
+    if (segment->size == 0) {
+        /* This segment refers to memory owned by the user */
+        libcouchbase_chain_ref_release(instance, segment->ref);
+        free(segment);
+        return;
+    }
+
+    pool = &libcouchbase_current_shard(instance)->segment_pool;
+    if (pool->count < max_pooled_segments) {
+        segment->next = pool->segments;
+        pool->segments = segment;
+        ++pool->count;
+    } else {
+        free(segment);
+    }
+}
+
+static void append_segment(chain_t *chain, segment_t *segment)
+{
+    if (chain->tail == NULL) {
+        chain->head = segment;
+    } else {
+        chain->tail->next = segment;
+    }
+    chain->tail = segment;
+}
+
+bool libcouchbase_chain_write(libcouchbase_t instance, chain_t *chain,
+                              const void *data, size_t size)
+{
+    const char *ptr = data;
+
+    while (size > 0) {
+        segment_t *segment = chain->tail;
+        size_t chunk;
+
+        /* References (with a size of 0) are never written to */
+        if (segment == NULL || segment->avail >= segment->size) {
+            if ((segment = allocate_segment(instance)) == NULL) {
+                return false;
+            }
+            append_segment(chain, segment);
+        }
+
+        chunk = segment->size - segment->avail;
+        if (chunk > size) {
+            chunk = size;
+        }
+        memcpy(segment->data + segment->avail, ptr, chunk);
+        segment->avail += chunk;
+        chain->nbytes += chunk;
+        ptr += chunk;
+        size -= chunk;
+    }
+
+    return true;
+}
+
+bool libcouchbase_chain_add_ref(chain_t *chain, const void *data, size_t size,
+                                chain_ref_t *ref)
+{
+    segment_t *segment = calloc(1, sizeof(*segment));
+    if (segment == NULL) {
+        return false;
+    }
+
+    segment->data = (char*)data;
+    segment->avail = size;
+    segment->ref = ref;
+    libcouchbase_chain_ref_retain(ref);
+    append_segment(chain, segment);
+    chain->nbytes += size;
+
+    return true;
+}
+
+chain_ref_t *libcouchbase_chain_ref_create(libcouchbase_release_t release,
+                                           const void *cookie)
+{
+    chain_ref_t *ret = malloc(sizeof(*ret));
+    if (ret != NULL) {
+        ret->refcount = 1;
+        ret->release = release;
+        ret->cookie = cookie;
+    }
+    return ret;
+}
+
+void libcouchbase_chain_ref_retain(chain_ref_t *ref)
+{
+    if (ref != NULL) {
+        ++ref->refcount;
+    }
+}
+
+void libcouchbase_chain_ref_release(libcouchbase_t instance, chain_ref_t *ref)
+{
+    if (ref != NULL && --ref->refcount == 0) {
+        if (ref->release != NULL) {
+            ref->release(instance, ref->cookie);
+        }
+        free(ref);
+    }
+}
+
+void libcouchbase_chain_get_mark(chain_t *chain, chain_mark_t *mark)
+{
+    mark->segment = chain->tail;
+    mark->offset = chain->tail ? chain->tail->avail : 0;
+    mark->nbytes = chain->nbytes;
+}
+
+void libcouchbase_chain_copy(chain_t *chain, const chain_mark_t *mark,
+                             void *dest, size_t size)
+{
+    char *ptr = dest;
+    segment_t *segment = mark->segment;
+    size_t offset = mark->offset;
+
+    if (segment == NULL) {
+        segment = chain->head;
+        offset = segment->start;
+    }
+
+    while (size > 0) {
+        size_t chunk;
+        if (offset == segment->avail) {
+            segment = segment->next;
+            assert(segment != NULL);
+            offset = segment->start;
+            continue;
+        }
+
+        chunk = segment->avail - offset;
+        if (chunk > size) {
+            chunk = size;
+        }
+        memcpy(ptr, segment->data + offset, chunk);
+        ptr += chunk;
+        offset += chunk;
+        size -= chunk;
+    }
+}
+
+void libcouchbase_chain_truncate(libcouchbase_t instance, chain_t *chain,
+                                 const chain_mark_t *mark)
+{
+    segment_t *segment;
+
+    if (mark->segment == NULL) {
+        segment = chain->head;
+        chain->head = chain->tail = NULL;
+    } else {
+        segment = mark->segment->next;
+        mark->segment->next = NULL;
+        mark->segment->avail = mark->offset;
+        chain->tail = mark->segment;
+    }
+
+    while (segment != NULL) {
+        segment_t *next = segment->next;
+        release_segment(instance, segment);
+        segment = next;
+    }
+    chain->nbytes = mark->nbytes;
+}
+
+void libcouchbase_chain_move(chain_t *dest, chain_t *src)
+{
+    if (src->head == NULL) {
+        return;
+    }
+
+    append_segment(dest, src->head);
+    dest->tail = src->tail;
+    dest->nbytes += src->nbytes;
+    src->head = src->tail = NULL;
+    src->nbytes = 0;
+}
+
+size_t libcouchbase_chain_get_iov(chain_t *chain, libcouchbase_iov_t *iov,
+                                  size_t max)
+{
+    segment_t *segment = chain->head;
+    size_t ret = 0;
+
+    while (segment != NULL && ret < max) {
+        iov[ret].iov_base = segment->data + segment->start;
+        iov[ret].iov_len = segment->avail - segment->start;
+        ++ret;
+        segment = segment->next;
+    }
+
+    return ret;
+}
+
+void libcouchbase_chain_consume(libcouchbase_t instance, chain_t *chain,
+                                size_t nbytes)
+{
+    assert(nbytes <= chain->nbytes);
+    chain->nbytes -= nbytes;
+
+    while (nbytes > 0) {
+        segment_t *segment = chain->head;
+        size_t chunk = segment->avail - segment->start;
+        if (chunk > nbytes) {
+            segment->start += nbytes;
+            return;
+        }
+
+        nbytes -= chunk;
+        chain->head = segment->next;
+        if (chain->head == NULL) {
+            chain->tail = NULL;
+        }
+        release_segment(instance, segment);
+    }
+}
+
+void libcouchbase_chain_destroy(libcouchbase_t instance, chain_t *chain)
+{
+    chain_mark_t mark;
+    memset(&mark, 0, sizeof(mark));
+    libcouchbase_chain_truncate(instance, chain, &mark);
+}
+
+void libcouchbase_segment_pool_destroy(segment_pool_t *pool)
+{
+    segment_t *segment = pool->segments;
+    while (segment != NULL) {
+        segment_t *next = segment->next;
+        free(segment);
+        segment = next;
+    }
+    pool->segments = NULL;
+    pool->count = 0;
+}
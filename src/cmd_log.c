@@ -0,0 +1,392 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2010 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the functions to operate on the command log. The
+ * command log keeps track of the commands sent to a server that we
+ * haven't received a response for. Looking up the command for a response
+ * and releasing it is O(1), and the packet data is never moved until
+ * more than half of the buffer is unused.
+ */
+#include "internal.h"
+
+/** Don't create a ring with less than 64 entries */
+static const size_t min_log_size = 64;
+
+/**
+ * Make room for another entry in the ring.
+ * @param log the command log to grow
+ * @return true if success, false otherwise
+ */
+static bool grow_ring(cmd_log_t *log)
+{
+    size_t next;
+    size_t ii;
+    cmd_log_entry_t *ptr;
+
+    if (log->count < log->size) {
+        return true;
+    }
+
+    next = log->size ? log->size << 1 : min_log_size;
+    ptr = malloc(next * sizeof(*ptr));
+    if (ptr == NULL) {
+        return false;
+    }
+
+    /* Unwrap the ring while we copy it */
+    for (ii = 0; ii < log->count; ++ii) {
+        ptr[ii] = log->entries[(log->head + ii) & (log->size - 1)];
+    }
+
+    free(log->entries);
+    log->entries = ptr;
+    log->size = next;
+    log->head = 0;
+    return true;
+}
+
+/**
+ * Count a command in the number of commands not completed
+ * @param log the command log with the command
+ * @param entry the entry for the command
+ * @return false if we failed to allocate memory
+ */
+static bool track_command(cmd_log_t *log, const cmd_log_entry_t *entry)
+{
+    if (!libcouchbase_operation_track(log->shard, entry->operation)) {
+        return false;
+    }
+    ++log->shard->outstanding;
+    return true;
+}
+
+/**
+ * Remove a command from the number of commands not completed
+ * @param log the command log with the command
+ * @param entry the entry for the command
+ */
+static void untrack_command(cmd_log_t *log, const cmd_log_entry_t *entry)
+{
+    --log->shard->outstanding;
+    libcouchbase_operation_untrack(log->shard, entry->operation);
+}
+
+/**
+ * Walk a packet in a chain, copying the data we own and collecting
+ * the chunks referring to memory owned by the caller
+ * @param chain the chain with the packet
+ * @param mark the beginning of the packet
+ * @param size the number of bytes in the packet
+ * @param dest where to copy the data we own (or NULL)
+ * @param refs where to store the chunks (or NULL to just count them)
+ * @return the number of chunks referring to memory owned by the caller
+ */
+static size_t walk_packet(chain_t *chain, const chain_mark_t *mark,
+                          size_t size, char *dest, cmd_log_refs_t *refs)
+{
+    segment_t *segment = mark->segment;
+    size_t offset = mark->offset;
+    size_t pos = 0;
+    size_t ret = 0;
+
+    if (segment == NULL) {
+        segment = chain->head;
+        offset = segment->start;
+    }
+
+    while (pos < size) {
+        size_t chunk;
+        if (offset == segment->avail) {
+            segment = segment->next;
+            assert(segment != NULL);
+            offset = segment->start;
+            continue;
+        }
+
+        chunk = segment->avail - offset;
+        if (chunk > size - pos) {
+            chunk = size - pos;
+        }
+        if (segment->size == 0) {
+            if (refs != NULL) {
+                refs->chunks[ret].offset = pos;
+                refs->chunks[ret].data = segment->data + offset;
+                refs->chunks[ret].size = chunk;
+                refs->chunks[ret].ref = segment->ref;
+                libcouchbase_chain_ref_retain(segment->ref);
+            }
+            ++ret;
+        } else if (dest != NULL) {
+            memcpy(dest, segment->data + offset, chunk);
+            dest += chunk;
+        }
+        pos += chunk;
+        offset += chunk;
+    }
+
+    return ret;
+}
+
+/**
+ * Copy a packet to the log buffer. The chunks referring to memory
+ * owned by the caller aren't copied, the entry keeps a reference to
+ * the memory instead.
+ * @param log the command log to copy the packet to
+ * @param entry the entry for the packet
+ * @param chain the chain with the packet
+ * @param mark the beginning of the packet
+ * @param size the number of bytes in the packet
+ * @return true if success, false otherwise
+ */
+static bool retain_packet(cmd_log_t *log, cmd_log_entry_t *entry,
+                          chain_t *chain, const chain_mark_t *mark,
+                          size_t size)
+{
+    size_t nchunks = walk_packet(chain, mark, size, NULL, NULL);
+    char *dest = log->packets.data + log->packets.avail;
+    cmd_log_refs_t *refs;
+    size_t ii;
+
+    if (nchunks == 0) {
+        libcouchbase_chain_copy(chain, mark, dest, size);
+        log->packets.avail += size;
+        return true;
+    }
+
+    refs = malloc(sizeof(*refs) + (nchunks - 1) * sizeof(refs->chunks[0]));
+    if (refs == NULL) {
+        return false;
+    }
+    refs->nchunks = walk_packet(chain, mark, size, dest, refs);
+    for (ii = 0; ii < refs->nchunks; ++ii) {
+        size -= refs->chunks[ii].size;
+    }
+    entry->refs = refs;
+    log->packets.avail += size;
+    return true;
+}
+
+/**
+ * Release the memory owned by the caller the entry refers to
+ * @param log the command log with the entry
+ * @param entry the entry to release the memory for
+ */
+static void release_refs(cmd_log_t *log, cmd_log_entry_t *entry)
+{
+    size_t ii;
+
+    if (entry->refs == NULL) {
+        return;
+    }
+    for (ii = 0; ii < entry->refs->nchunks; ++ii) {
+        libcouchbase_chain_ref_release(log->instance,
+                                       entry->refs->chunks[ii].ref);
+    }
+    free(entry->refs);
+    entry->refs = NULL;
+}
+
+bool libcouchbase_cmd_log_append(cmd_log_t *log, chain_t *chain,
+                                 const chain_mark_t *mark, bool body,
+                                 const void *cookie)
+{
+    protocol_binary_request_header req;
+    cmd_log_entry_t *entry;
+    size_t size = chain->nbytes - mark->nbytes;
+
+    assert(size >= sizeof(req));
+    libcouchbase_chain_copy(chain, mark, &req, sizeof(req));
+    if (!body) {
+        /* The response handlers only need the header, extras and key */
+        size_t nkey = ntohs(req.request.keylen);
+        if (size > sizeof(req) + req.request.extlen + nkey) {
+            size = sizeof(req) + req.request.extlen + nkey;
+        }
+    }
+
+    if (!grow_ring(log) || !grow_buffer(&log->packets, size)) {
+        return false;
+    }
+
+    entry = log->entries + ((log->head + log->count) & (log->size - 1));
+    entry->opaque = req.request.opaque;
+    entry->opcode = req.request.opcode;
+    entry->retries = 0;
+    entry->flags = 0;
+    entry->timer = NULL;
+    entry->cookie = cookie;
+    entry->operation = libcouchbase_current_shard(log->instance)->operation;
+    entry->shared_clock = libcouchbase_shared_cache_clock(log->instance);
+    entry->waiters = NULL;
+    entry->refs = NULL;
+    entry->offset = log->packets.avail;
+    if (!track_command(log, entry)) {
+        return false;
+    }
+    if (!body) {
+        libcouchbase_chain_copy(chain, mark,
+                                log->packets.data + log->packets.avail, size);
+        log->packets.avail += size;
+    } else if (!retain_packet(log, entry, chain, mark, size)) {
+        untrack_command(log, entry);
+        return false;
+    }
+    ++log->count;
+
+    return true;
+}
+
+cmd_log_entry_t *libcouchbase_cmd_log_head(cmd_log_t *log)
+{
+    if (log->count == 0) {
+        return NULL;
+    }
+    return log->entries + log->head;
+}
+
+cmd_log_entry_t *libcouchbase_cmd_log_tail(cmd_log_t *log)
+{
+    if (log->count == 0) {
+        return NULL;
+    }
+    return log->entries + ((log->head + log->count - 1) & (log->size - 1));
+}
+
+cmd_log_entry_t *libcouchbase_cmd_log_entry(cmd_log_t *log, size_t idx)
+{
+    assert(idx < log->count);
+    return log->entries + ((log->head + idx) & (log->size - 1));
+}
+
+cmd_log_entry_t *libcouchbase_cmd_log_at(cmd_log_t *log, uint64_t position)
+{
+    if (position < log->first || position - log->first >= log->count) {
+        return NULL;
+    }
+    return libcouchbase_cmd_log_entry(log, (size_t)(position - log->first));
+}
+
+void libcouchbase_cmd_log_complete(cmd_log_t *log, cmd_log_entry_t *entry)
+{
+    if ((entry->flags & CMD_COMPLETED) == 0) {
+        entry->flags |= CMD_COMPLETED;
+        untrack_command(log, entry);
+    }
+}
+
+protocol_binary_request_header *libcouchbase_cmd_log_packet(cmd_log_t *log,
+                                                            cmd_log_entry_t *entry)
+{
+    return (void*)(log->packets.data + entry->offset);
+}
+
+void libcouchbase_cmd_log_write_body(cmd_log_t *log, cmd_log_entry_t *entry,
+                                     libcouchbase_server_t *dest)
+{
+    protocol_binary_request_header *req = libcouchbase_cmd_log_packet(log,
+                                                                      entry);
+    const char *ptr = (const char *)(req + 1);
+    size_t size = sizeof(*req) + ntohl(req->request.bodylen);
+    size_t pos = sizeof(*req);
+    size_t ii;
+
+    if (entry->refs != NULL) {
+        for (ii = 0; ii < entry->refs->nchunks; ++ii) {
+            size_t offset = entry->refs->chunks[ii].offset;
+            libcouchbase_server_write_packet(dest, ptr, offset - pos);
+            ptr += offset - pos;
+            libcouchbase_server_write_packet_ref(dest,
+                                                 entry->refs->chunks[ii].data,
+                                                 entry->refs->chunks[ii].size,
+                                                 entry->refs->chunks[ii].ref);
+            pos = offset + entry->refs->chunks[ii].size;
+        }
+    }
+    libcouchbase_server_write_packet(dest, ptr, size - pos);
+}
+
+void libcouchbase_cmd_log_pop(cmd_log_t *log)
+{
+    size_t ii;
+    cmd_log_entry_t *entry;
+
+    assert(log->count > 0);
+    entry = log->entries + log->head;
+    if ((entry->flags & CMD_COMPLETED) == 0) {
+        untrack_command(log, entry);
+    }
+    if (entry->timer != NULL) {
+        libcouchbase_timeout_cancel(entry->timer);
+    }
+    if (entry->waiters != NULL) {
+        libcouchbase_release_waiters(log->instance, entry);
+    }
+    release_refs(log, entry);
+    ++log->first;
+
+    log->head = (log->head + 1) & (log->size - 1);
+    if (--log->count == 0) {
+        log->head = 0;
+        log->consumed = 0;
+        log->packets.avail = 0;
+        return;
+    }
+
+    log->consumed = log->entries[log->head].offset;
+    if (log->consumed < log->packets.avail - log->consumed) {
+        return;
+    }
+
+    /* More than half of the buffer is unused, move the data down */
+    memmove(log->packets.data, log->packets.data + log->consumed,
+            log->packets.avail - log->consumed);
+    log->packets.avail -= log->consumed;
+    for (ii = 0; ii < log->count; ++ii) {
+        log->entries[(log->head + ii) & (log->size - 1)].offset -= log->consumed;
+    }
+    log->consumed = 0;
+}
+
+void libcouchbase_cmd_log_destroy(cmd_log_t *log)
+{
+    size_t ii;
+
+    for (ii = 0; ii < log->count; ++ii) {
+        cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(log, ii);
+        if (entry->timer != NULL) {
+            libcouchbase_timeout_cancel(entry->timer);
+        }
+        if ((entry->flags & CMD_COMPLETED) == 0) {
+            untrack_command(log, entry);
+        }
+        if (entry->waiters != NULL) {
+            libcouchbase_release_waiters(log->instance, entry);
+        }
+        release_refs(log, entry);
+    }
+
+    while (log->timers != NULL) {
+        op_timer_t *next = log->timers->next;
+        free(log->timers);
+        log->timers = next;
+    }
+
+    free(log->packets.data);
+    free(log->entries);
+    memset(log, 0, sizeof(*log));
+}
@@ -0,0 +1,287 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the functions to coalesce identical gets. With
+ * coalescing enabled a get for a key we've already spooled a get for
+ * (to the same server, and not written yet) isn't sent. The cookie for
+ * the new get is added to the waiters of the first get instead, and
+ * the result of the first get is reported to all of them.
+ *
+ * The gets we may coalesce with are found through a small direct-mapped
+ * table keyed by the vbucket and key. A slot only refers to the command
+ * log entry of the get (by its position and opaque), and the key is
+ * compared against the packet in the command log. The server bumps its
+ * generation when it writes its output or gets a command that may
+ * change a value, which invalidates all of the slots for the server.
+ */
+#include "internal.h"
+
+/** The number of slots in the table (must be a power of two) */
+#define COALESCE_SLOTS 256
+
+typedef struct coalesce_slot_st {
+    /** The server the get was spooled to */
+    libcouchbase_server_t *server;
+    /** The generation of the server when the get was spooled */
+    uint64_t generation;
+    /** The position of the get in the command log */
+    uint64_t position;
+    /** The opaque field of the get */
+    uint32_t opaque;
+} coalesce_slot_t;
+
+/**
+ * Get the slot for a key (FNV-1a of the vbucket and key)
+ */
+static coalesce_slot_t *get_slot(libcouchbase_t instance, uint16_t vb,
+                                 const void *key, size_t nkey)
+{
+    const unsigned char *ptr = key;
+    uint32_t hash = 2166136261U;
+    size_t ii;
+
+    hash = (hash ^ (vb & 0xff)) * 16777619U;
+    hash = (hash ^ (vb >> 8)) * 16777619U;
+    for (ii = 0; ii < nkey; ++ii) {
+        hash = (hash ^ ptr[ii]) * 16777619U;
+    }
+
+    return instance->coalesce.slots + (hash & (COALESCE_SLOTS - 1));
+}
+
+/**
+ * Count a waiter in the number of commands not completed
+ * @return false if we failed to allocate memory
+ */
+static bool track_waiter(libcouchbase_t instance, const get_waiter_t *waiter)
+{
+    if (!libcouchbase_operation_track(&instance->shard, waiter->operation)) {
+        return false;
+    }
+    ++instance->shard.outstanding;
+    return true;
+}
+
+/**
+ * Remove a waiter from the number of commands not completed, and make
+ * it available for another get
+ */
+static void release_waiter(libcouchbase_t instance, get_waiter_t *waiter)
+{
+    --instance->shard.outstanding;
+    libcouchbase_operation_untrack(&instance->shard, waiter->operation);
+    waiter->next = instance->coalesce.waiters;
+    instance->coalesce.waiters = waiter;
+}
+
+bool libcouchbase_coalesce_get(libcouchbase_server_t *server,
+                               const void *command_cookie,
+                               uint16_t vb,
+                               const void *key, size_t nkey)
+{
+    libcouchbase_t instance = server->instance;
+    coalesce_slot_t *slot;
+    cmd_log_entry_t *entry;
+    protocol_binary_request_header *req;
+    get_waiter_t *waiter;
+    get_waiter_t **tail;
+
+    if (!instance->coalesce.enabled || instance->coalesce.slots == NULL) {
+        return false;
+    }
+
+    slot = get_slot(instance, vb, key, nkey);
+    if (slot->server != server ||
+        slot->generation != server->coalesce_generation) {
+        return false;
+    }
+
+    entry = libcouchbase_cmd_log_at(&server->cmd_log, slot->position);
+    if (entry == NULL || entry->opaque != slot->opaque ||
+        (entry->flags & CMD_COMPLETED)) {
+        return false;
+    }
+
+    req = libcouchbase_cmd_log_packet(&server->cmd_log, entry);
+    if (ntohs(req->request.vbucket) != vb ||
+        ntohs(req->request.keylen) != nkey ||
+        memcmp((const char *)(req + 1) + req->request.extlen, key,
+               nkey) != 0) {
+        return false;
+    }
+
+    if ((waiter = instance->coalesce.waiters) != NULL) {
+        instance->coalesce.waiters = waiter->next;
+    } else if ((waiter = malloc(sizeof(*waiter))) == NULL) {
+        /* Send it as a separate get */
+        return false;
+    }
+    waiter->cookie = command_cookie;
+    waiter->operation = instance->shard.operation;
+    if (!track_waiter(instance, waiter)) {
+        /* Send it as a separate get */
+        waiter->next = instance->coalesce.waiters;
+        instance->coalesce.waiters = waiter;
+        return false;
+    }
+    waiter->next = NULL;
+
+    /* Report the result in the same order as the gets were spooled */
+    for (tail = &entry->waiters; *tail != NULL; tail = &(*tail)->next) {
+        /* empty */
+    }
+    *tail = waiter;
+
+    return true;
+}
+
+void libcouchbase_coalesce_add(libcouchbase_server_t *server)
+{
+    libcouchbase_t instance = server->instance;
+    cmd_log_t *log = &server->cmd_log;
+    cmd_log_entry_t *entry;
+    protocol_binary_request_header *req;
+    coalesce_slot_t *slot;
+
+    if (!instance->coalesce.enabled) {
+        return;
+    }
+
+    if (instance->coalesce.slots == NULL) {
+        instance->coalesce.slots = calloc(COALESCE_SLOTS,
+                                          sizeof(coalesce_slot_t));
+        if (instance->coalesce.slots == NULL) {
+            return;
+        }
+    }
+
+    /* The packet filter may have dropped the get */
+    entry = libcouchbase_cmd_log_tail(log);
+    if (entry == NULL || (entry->opcode != PROTOCOL_BINARY_CMD_GET &&
+                          entry->opcode != PROTOCOL_BINARY_CMD_GETQ)) {
+        return;
+    }
+
+    req = libcouchbase_cmd_log_packet(log, entry);
+    slot = get_slot(instance, ntohs(req->request.vbucket),
+                    (const char *)(req + 1) + req->request.extlen,
+                    ntohs(req->request.keylen));
+    slot->server = server;
+    slot->generation = server->coalesce_generation;
+    slot->position = log->first + log->count - 1;
+    slot->opaque = entry->opaque;
+}
+
+void libcouchbase_coalesce_invalidate(libcouchbase_server_t *server)
+{
+    ++server->coalesce_generation;
+}
+
+void libcouchbase_coalesce_destroy(libcouchbase_t instance)
+{
+    while (instance->coalesce.waiters != NULL) {
+        get_waiter_t *next = instance->coalesce.waiters->next;
+        free(instance->coalesce.waiters);
+        instance->coalesce.waiters = next;
+    }
+    free(instance->coalesce.slots);
+    instance->coalesce.slots = NULL;
+}
+
+void libcouchbase_release_waiters(libcouchbase_t instance,
+                                  cmd_log_entry_t *entry)
+{
+    get_waiter_t *waiter = entry->waiters;
+    entry->waiters = NULL;
+
+    while (waiter != NULL) {
+        get_waiter_t *next = waiter->next;
+        release_waiter(instance, waiter);
+        waiter = next;
+    }
+}
+
+void libcouchbase_get_callback(libcouchbase_t instance,
+                               cmd_log_entry_t *entry,
+                               libcouchbase_error_t error,
+                               const void *key, size_t nkey,
+                               const void *bytes, size_t nbytes,
+                               uint32_t flags, uint64_t cas)
+{
+    get_waiter_t *waiter = entry->waiters;
+    char buffer[256];
+
+    /*
+     * The callbacks may spool new commands, which may move the entry
+     * and the key in the command log
+     */
+    entry->waiters = NULL;
+    if (waiter != NULL && nkey <= sizeof(buffer)) {
+        memcpy(buffer, key, nkey);
+        key = buffer;
+    }
+
+    instance->callbacks.get(instance, entry->cookie, error, key, nkey,
+                            bytes, nbytes, flags, cas);
+    while (waiter != NULL) {
+        get_waiter_t *next = waiter->next;
+        instance->callbacks.get(instance, waiter->cookie, error, key, nkey,
+                                bytes, nbytes, flags, cas);
+        release_waiter(instance, waiter);
+        waiter = next;
+    }
+}
+
+void libcouchbase_get_stream_callback(libcouchbase_t instance,
+                                      cmd_log_entry_t *entry,
+                                      const void *key, size_t nkey,
+                                      const void *bytes, size_t nbytes,
+                                      size_t offset, size_t total,
+                                      uint32_t flags, uint64_t cas)
+{
+    get_waiter_t *waiter;
+    char buffer[256];
+
+    /* The waiters are released when the entry is popped */
+    if (entry->waiters != NULL && nkey <= sizeof(buffer)) {
+        memcpy(buffer, key, nkey);
+        key = buffer;
+    }
+
+    waiter = entry->waiters;
+    instance->callbacks.get_stream(instance, entry->cookie, key, nkey,
+                                   bytes, nbytes, offset, total, flags, cas);
+    while (waiter != NULL) {
+        instance->callbacks.get_stream(instance, waiter->cookie, key, nkey,
+                                       bytes, nbytes, offset, total,
+                                       flags, cas);
+        waiter = waiter->next;
+    }
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_set_coalesce_gets(libcouchbase_t instance,
+                                                    bool enable)
+{
+    if (enable && libcouchbase_threads_shared(instance)) {
+        /* The slots are only touched by the event loop of the instance */
+        return LIBCOUCHBASE_NOT_SUPPORTED;
+    }
+    instance->coalesce.enabled = enable;
+    return LIBCOUCHBASE_SUCCESS;
+}
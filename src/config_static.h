@@ -44,6 +44,19 @@
 #include <unistd.h>
 #endif
 
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#include <time.h>
+
 #ifdef HAVE_WINSOCK2_H
 #include <winsock2.h>
 #endif
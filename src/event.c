@@ -16,74 +16,262 @@
  */
 
 /**
- * This file contains the callback functions used by libevent.
+ * This file contains the callback functions used by the I/O backend.
  *
  * @author Trond Norbye
  * @todo add more documentation
  */
 #include "internal.h"
 
-static void do_read_data(libcouchbase_server_t *c)
+/**
+ * Check if the value in this response should be streamed to the user
+ * instead of being buffered.
+ *
+ * @param c the server the response is from
+ * @param res the header of the response
+ */
+static bool should_stream(libcouchbase_server_t *c,
+                          protocol_binary_response_header *res)
 {
+    libcouchbase_t instance = c->instance;
+    size_t nbytes;
+
+    if (instance->stream_threshold == 0 || !c->connected ||
+        instance->packet_filter != libcouchbase_default_packet_filter ||
+        res->response.magic != PROTOCOL_BINARY_RES ||
+        ntohs(res->response.status) != PROTOCOL_BINARY_RESPONSE_SUCCESS ||
+        res->response.extlen != 4) {
+        return false;
+    }
+
+    switch (res->response.opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GATQ:
+    case PROTOCOL_BINARY_CMD_GET_REPLICA:
+        break;
+    default:
+        return false;
+    }
+
+    nbytes = ntohl(res->response.bodylen) - res->response.extlen -
+        ntohs(res->response.keylen);
+    return nbytes >= instance->stream_threshold;
+}
+
+/**
+ * Start streaming the value of the response if it's big enough
+ *
+ * @param c the server the response is from
+ * @param res the header of the response
+ * @param avail the number of bytes available from the response
+ * @return the number of bytes of the response consumed (0 if the
+ *         response should be processed as a normal packet)
+ */
+static size_t start_stream(libcouchbase_server_t *c,
+                           protocol_binary_response_header *res,
+                           size_t avail)
+{
+    protocol_binary_response_getq *getq = (void*)res;
+    size_t header = sizeof(*res) + res->response.extlen +
+        ntohs(res->response.keylen);
+
+    if (avail < header || !should_stream(c, res)) {
+        return 0;
+    }
+
+    libcouchbase_server_purge_implicit_responses(c, res->response.opaque);
+    assert(libcouchbase_cmd_log_head(&c->cmd_log) != NULL);
+    c->stream.total = ntohl(res->response.bodylen) + sizeof(*res) - header;
+    c->stream.remaining = c->stream.total;
+    c->stream.offset = 0;
+    c->stream.flags = ntohl(getq->message.body.flags);
+    c->stream.cas = res->response.cas;
+    c->stream.deliver = libcouchbase_hedge_resolve(c,
+                                                   libcouchbase_cmd_log_head(&c->cmd_log),
+                                                   true);
+
+    return header;
+}
+
+/**
+ * Pass the next chunk of the value we're streaming to the user
+ *
+ * @param c the server we're streaming the value from
+ * @param data the data read from the server
+ * @param size the number of bytes available
+ * @return the number of bytes consumed
+ */
+static size_t stream_value(libcouchbase_server_t *c, const char *data,
+                           size_t size)
+{
+    libcouchbase_t instance = c->instance;
+    cmd_log_entry_t *entry = libcouchbase_cmd_log_head(&c->cmd_log);
+    protocol_binary_request_header *req;
+    const char *key;
+
+    req = libcouchbase_cmd_log_packet(&c->cmd_log, entry);
+    key = (const char *)(req + 1) + req->request.extlen;
+    if (size > c->stream.remaining) {
+        size = c->stream.remaining;
+    }
+
+    if (c->stream.deliver) {
+        libcouchbase_get_stream_callback(instance, entry, key,
+                                         ntohs(req->request.keylen),
+                                         data, size, c->stream.offset,
+                                         c->stream.total, c->stream.flags,
+                                         c->stream.cas);
+    }
+    c->stream.offset += size;
+    c->stream.remaining -= size;
+    if (c->stream.remaining == 0) {
+        libcouchbase_cmd_log_pop(&c->cmd_log);
+    }
+
+    return size;
+}
+
+/**
+ * Read and dispatch as many packets as possible from the server.
+ *
+ * The input buffer is consumed through a read cursor, so we don't have
+ * to move the remaining data in the buffer every time we've processed a
+ * packet. The (partial) packet left at the end of the buffer is moved
+ * to the beginning of the buffer once before we try to read more data.
+ *
+ * Big values may be streamed to the user as they arrive (see
+ * should_stream), so that we don't have to grow the input buffer to
+ * hold the entire packet.
+ *
+ * @param c the server to read data from
+ * @return false if the connection was closed
+ */
+static bool do_read_data(libcouchbase_server_t *c)
+{
+    libcouchbase_io_opt_t *io = c->shard->io;
     size_t processed;
+    size_t offset = 0;
     const int operations_per_call = 1000;
     int operations = 0;
     protocol_binary_response_header *res;
     protocol_binary_request_header *req;
-
-    grow_buffer(&c->input, 8192);
-    res = (void*)c->input.data;
-    req = (void*)c->input.data;
+    cmd_log_entry_t *entry;
 
     do {
-        ssize_t nr;
-        while (++operations < operations_per_call &&
-               c->input.avail >= sizeof(*req) &&
-               c->input.avail >= (ntohl(req->request.bodylen) + sizeof(*req))) {
+        libcouchbase_ssize_t nr;
+        size_t need = 8192;
+
+        while (++operations < operations_per_call) {
+            size_t avail = c->input.avail - offset;
+
+            if (c->stream.remaining > 0) {
+                if (avail == 0) {
+                    break;
+                }
+                offset += stream_value(c, c->input.data + offset, avail);
+                continue;
+            }
 
-            if (c->instance->packet_filter(c->instance, c->input.data)) {
+            if (avail < sizeof(*req)) {
+                break;
+            }
+
+            req = (void*)(c->input.data + offset);
+            res = (void*)req;
+            if ((processed = start_stream(c, res, avail)) > 0) {
+                offset += processed;
+                continue;
+            }
+
+            processed = ntohl(req->request.bodylen) + sizeof(*req);
+            if (avail < processed) {
+                break;
+            }
+
+            if (c->instance->packet_filter(c->instance, req)) {
                 switch (req->request.magic) {
                 case PROTOCOL_BINARY_REQ:
                     c->instance->request_handler[req->request.opcode](c, req);
                     break;
                 case PROTOCOL_BINARY_RES:
-                    libcouchbase_server_purge_implicit_responses(c, res->response.opaque);
-                    c->instance->response_handler[res->response.opcode](c, res);
-                    req = (protocol_binary_request_header*)c->cmd_log.data;
-                    processed = ntohl(req->request.bodylen) + sizeof(*req);
-                    assert(c->cmd_log.avail >= processed);
-                    memmove(c->cmd_log.data, c->cmd_log.data + processed,
-                            c->cmd_log.avail - processed);
-                    c->cmd_log.avail -= processed;
-                    req = (protocol_binary_request_header*)c->input.data;
+                    if (c->connected) {
+                        libcouchbase_server_purge_implicit_responses(c, res->response.opaque);
+                        entry = libcouchbase_cmd_log_head(&c->cmd_log);
+                        assert(entry != NULL);
+                        if (entry->flags & CMD_COMPLETED) {
+                            /* We've already reported the result */
+                        } else if (ntohs(res->response.status) != PROTOCOL_BINARY_RESPONSE_NOT_MY_VBUCKET ||
+                                   !libcouchbase_server_retry_command(c)) {
+                            c->instance->response_handler[res->response.opcode](c, res);
+                        }
+                        libcouchbase_cmd_log_pop(&c->cmd_log);
+                    } else {
+                        /*
+                         * The only commands we send before we're connected
+                         * are the SASL commands, and they're not in the
+                         * command log
+                         */
+                        c->instance->response_handler[res->response.opcode](c, res);
+                    }
                     break;
                 default:
                     abort();
                 }
             }
 
-            processed = ntohl(req->request.bodylen) + sizeof(*req);
-            memmove(c->input.data, c->input.data + processed,
-                    c->input.avail - processed);
-            c->input.avail -= processed;
+            offset += processed;
+        }
+
+        if (offset > 0) {
+            /* Move the partial packet to the beginning of the buffer */
+            memmove(c->input.data, c->input.data + offset,
+                    c->input.avail - offset);
+            c->input.avail -= offset;
+            offset = 0;
         }
 
         if (operations == operations_per_call) {
             // allow some other connections to process some data as well
-            return ;
+            return true;
         }
 
-        nr = recv(c->sock,
-                  c->input.data + c->input.avail,
-                  c->input.size - c->input.avail,
-                  0);
+        req = (void*)c->input.data;
+        if (c->stream.remaining == 0 && c->input.avail >= sizeof(*req)) {
+            /* Make sure that we've got room for the entire packet */
+            size_t left;
+            res = (void*)req;
+            if (should_stream(c, res)) {
+                /* We only need the header, extras and key */
+                left = sizeof(*res) + res->response.extlen +
+                    ntohs(res->response.keylen);
+            } else {
+                left = ntohl(req->request.bodylen) + sizeof(*req);
+            }
+            left -= c->input.avail;
+            if (left > need) {
+                need = left;
+            }
+        }
+
+        if (!grow_buffer(&c->input, need)) {
+            /* We can't receive the packet, so drop the connection */
+            libcouchbase_server_shutdown(c, PROTOCOL_BINARY_RESPONSE_ENOMEM);
+            return false;
+        }
+
+        nr = io->recv(io, c->sock,
+                      c->input.data + c->input.avail,
+                      c->input.size - c->input.avail,
+                      0);
 
         if (nr == -1) {
-            switch (errno) {
+            switch (io->error) {
             case EINTR:
                 break;
             case EWOULDBLOCK:
-                return;
+                return true;
             default:
                 abort();
             }
@@ -95,12 +283,24 @@ static void do_read_data(libcouchbase_server_t *c)
     } while (true);
 }
 
+/** The maximum number of chunks we'll try to send in one call */
+#define MAX_SEND_IOV 64
+
 static void do_send_data(libcouchbase_server_t *c)
 {
-    do {
-        ssize_t nw = send(c->sock, c->output.data, c->output.avail, 0);
+    libcouchbase_io_opt_t *io = c->shard->io;
+
+    /* Terminate the quiet commands spooled since the last write */
+    libcouchbase_server_write_fence(c);
+    /* New gets can't be coalesced with the gets we're sending */
+    libcouchbase_coalesce_invalidate(c);
+
+    while (libcouchbase_server_has_output(c)) {
+        libcouchbase_iov_t iov[MAX_SEND_IOV];
+        size_t niov = libcouchbase_chain_get_iov(&c->output, iov, MAX_SEND_IOV);
+        libcouchbase_ssize_t nw = io->sendv(io, c->sock, iov, niov);
         if (nw == -1) {
-            switch (errno) {
+            switch (io->error) {
             case EINTR:
                 // retry
                 break;
@@ -109,88 +309,94 @@ static void do_send_data(libcouchbase_server_t *c)
             default:
                 // FIXME!
                 fprintf(stderr, "Failed to write data: %s\n",
-                        strerror(errno));
+                        strerror(io->error));
                 fflush(stderr);
                 abort();
             }
         } else {
-            grow_buffer(&c->cmd_log, (size_t)nw);
-            memcpy(c->cmd_log.data + c->cmd_log.avail,
-                   c->output.data, (size_t)nw);
-            c->cmd_log.avail += (size_t)nw;
-
-            if ((size_t)nw == c->output.avail) {
-                c->output.avail = 0;
-            } else {
-                memmove(c->output.data, c->output.data + nw,
-                        c->output.avail - (size_t)nw);
-                c->output.avail -= (size_t)nw;
-            }
+            libcouchbase_chain_consume(c->instance, &c->output, (size_t)nw);
         }
-    } while (c->output.avail > 0);
+    }
 }
 
-void libcouchbase_server_event_handler(evutil_socket_t sock, short which, void *arg) {
+void libcouchbase_server_event_handler(libcouchbase_socket_t sock, short which, void *arg) {
     libcouchbase_server_t *c = arg;
     (void)sock;
 
-    if (which & EV_READ) {
-        do_read_data(c);
+    if ((which & LIBCOUCHBASE_READ_EVENT) && !do_read_data(c)) {
+        /* The server is connecting again */
+        libcouchbase_maybe_breakout(c->instance);
+        return;
     }
 
-    if (which & EV_WRITE) {
+    if (which & LIBCOUCHBASE_WRITE_EVENT) {
         do_send_data(c);
     }
 
-    if (c->output.avail == 0) {
-        libcouchbase_server_update_event(c, EV_READ,
+    if (!libcouchbase_server_has_output(c)) {
+        libcouchbase_server_update_event(c, LIBCOUCHBASE_READ_EVENT,
                                          libcouchbase_server_event_handler);
     } else {
-        libcouchbase_server_update_event(c, EV_READ | EV_WRITE,
+        libcouchbase_server_update_event(c, LIBCOUCHBASE_RW_EVENT,
                                          libcouchbase_server_event_handler);
     }
 
-    if (c->instance->execute) {
-        bool done = true;
-        libcouchbase_t instance = c->instance;
-        size_t ii;
-        for (ii = 0; ii < instance->nservers; ++ii) {
-            c = instance->servers + ii;
-            if (c->cmd_log.avail || c->output.avail || c->input.avail) {
-                done = false;
-                break;
-            }
-        }
-        if (done) {
-            event_base_loopbreak(instance->ev_base);
+    libcouchbase_maybe_breakout(c->instance);
+}
+
+void libcouchbase_server_start_send(libcouchbase_server_t *c)
+{
+    if (c->instance->eager_send &&
+        (c->ev_flags & LIBCOUCHBASE_WRITE_EVENT) == 0) {
+        /*
+         * The socket isn't waiting for the previous data to be sent,
+         * so we can most likely write the data without blocking (and
+         * save an iteration of the event loop)
+         */
+        do_send_data(c);
+        if (!libcouchbase_server_has_output(c)) {
+            libcouchbase_server_update_event(c, LIBCOUCHBASE_READ_EVENT,
+                                             libcouchbase_server_event_handler);
+            return;
         }
     }
+
+    libcouchbase_server_update_event(c, LIBCOUCHBASE_RW_EVENT,
+                                     libcouchbase_server_event_handler);
+}
+
+void libcouchbase_maybe_breakout(libcouchbase_t instance)
+{
+    /*
+     * We don't need to wait for the responses to the commands
+     * we've already reported to the user (they may never arrive
+     * if the command timed out)
+     */
+    if ((instance->execute && instance->shard.outstanding == 0) ||
+        (instance->wait.noperations > 0 &&
+         libcouchbase_wait_remaining(instance) == 0)) {
+        instance->io->stop_event_loop(instance->io);
+    }
 }
 
 void libcouchbase_server_update_event(libcouchbase_server_t *c, short flags,
-                                      EVENT_HANDLER handler) {
+                                      libcouchbase_io_handler_t handler) {
+    libcouchbase_io_opt_t *io = c->shard->io;
     if (c->ev_flags == flags && c->ev_handler == handler) {
         /* no change */
         return;
     }
     c->ev_handler = handler;
-
-    if (c->ev_flags != 0) {
-        if (event_del(&c->ev_event) == -1) {
-            abort();
-        }
-    }
     c->ev_flags = flags;
-    event_set(&c->ev_event, c->sock, flags | EV_PERSIST, handler, c);
-    event_base_set(c->instance->ev_base, &c->ev_event);
-    if (event_add(&c->ev_event, NULL) == -1) {
+    if (io->update_event(io, c->sock, c->event, flags, c, handler) == -1) {
         abort();
     }
 }
 
 static void breakout_vbucket_state_listener(libcouchbase_server_t *server)
 {
-    event_base_loopbreak(server->instance->ev_base);
+    libcouchbase_io_opt_t *io = server->instance->io;
+    io->stop_event_loop(io);
 }
 
 void libcouchbase_ensure_vbucket_config(libcouchbase_t instance)
@@ -198,7 +404,7 @@ void libcouchbase_ensure_vbucket_config(libcouchbase_t instance)
     if (instance->vbucket_config == NULL) {
         vbucket_state_listener_t old = instance->vbucket_state_listener;
         instance->vbucket_state_listener = breakout_vbucket_state_listener;
-        event_base_loop(instance->ev_base, 0);
+        instance->io->run_event_loop(instance->io);
         instance->vbucket_state_listener = old;
     }
 }
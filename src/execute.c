@@ -34,7 +34,15 @@ void libcouchbase_execute(libcouchbase_t instance)
      * the execute flag to true
      */
     instance->execute = true;
+    libcouchbase_flush(instance);
+
+    /* The commands may all have been served without a server (for
+     * instance from the near cache), and the event loop wouldn't stop
+     * by itself as long as there are events registered */
+    if (instance->shard.outstanding == 0) {
+        return;
+    }
 
     /* Start the event loop and let it run until we're out of commands */
-    event_base_loop(instance->ev_base, 0);
+    instance->io->run_event_loop(instance->io);
 }
@@ -17,27 +17,126 @@
 
 #include "internal.h"
 
+/**
+ * Encode a get (or get and touch) command and add it to the server's
+ * output buffer.
+ *
+ * @param server the server to send the command to
+ * @param command_cookie the cookie passed to the callback for the command
+ * @param quiet set to true to use the quiet version of the command
+ * @param vb the vbucket for the key
+ * @param key the key to get
+ * @param nkey the number of bytes in the key
+ * @param exp the new expiration time for the object (or NULL to get
+ *            the object without touching it)
+ * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
+ */
+static libcouchbase_error_t encode_get(libcouchbase_server_t *server,
+                                       const void *command_cookie,
+                                       bool quiet,
+                                       uint16_t vb,
+                                       const void *key,
+                                       size_t nkey,
+                                       const time_t *exp)
+{
+    protocol_binary_request_gat req;
+
+    memset(&req, 0, sizeof(req));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req.message.header.request.keylen = ntohs((uint16_t)nkey);
+    req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    req.message.header.request.vbucket = ntohs(vb);
+    req.message.header.request.bodylen = ntohl((uint32_t)(nkey));
+    req.message.header.request.opaque = libcouchbase_server_next_seqno(server);
+
+    if (!exp) {
+        req.message.header.request.opcode = quiet ? PROTOCOL_BINARY_CMD_GETQ :
+            PROTOCOL_BINARY_CMD_GET;
+        libcouchbase_server_start_packet(server, command_cookie, req.bytes,
+                                         sizeof(req.bytes) - 4);
+    } else {
+        req.message.header.request.opcode = quiet ? PROTOCOL_BINARY_CMD_GATQ :
+            PROTOCOL_BINARY_CMD_GAT;
+        req.message.header.request.extlen = 4;
+        req.message.body.expiration = ntohl((uint32_t)*exp);
+        req.message.header.request.bodylen = ntohl((uint32_t)(nkey) + 4);
+        libcouchbase_server_start_packet(server, command_cookie, req.bytes,
+                                         sizeof(req.bytes));
+    }
+    libcouchbase_server_write_packet(server, key, nkey);
+    return libcouchbase_server_end_packet(server);
+}
+
+/**
+ * Check if none of the servers would get more than one of the keys.
+ * The keys may then be sent with the normal get command, and we don't
+ * need a NOOP to terminate the batch.
+ *
+ * @param instance the handle to libcouchbase
+ * @param num_keys the number of keys to get
+ * @param keys the array containing the keys to get
+ * @param nkey the array containing the lengths of the keys
+ * @return true if each server gets at most one of the keys
+ */
+static bool one_key_per_server(libcouchbase_t instance,
+                               size_t num_keys,
+                               const void * const *keys,
+                               const size_t *nkey)
+{
+    size_t ii;
+
+    if (num_keys > instance->nservers) {
+        return false;
+    }
+
+    /* We don't expect many keys here, so just compare them all */
+    for (ii = 1; ii < num_keys; ++ii) {
+        int vb = vbucket_get_vbucket_by_key(instance->vbucket_config,
+                                            keys[ii], nkey[ii]);
+        uint16_t idx = instance->vb_server_map[vb];
+        size_t jj;
+
+        for (jj = 0; jj < ii; ++jj) {
+            vb = vbucket_get_vbucket_by_key(instance->vbucket_config,
+                                            keys[jj], nkey[jj]);
+            if (instance->vb_server_map[vb] == idx) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
 /**
  * libcouchbase_mget use the GETQ command followed by a NOOP command to avoid
  * transferring not-found responses. All of the not-found callbacks are
- * generated implicit by receiving a successful get or the NOOP.
+ * generated implicit by receiving a successful get or the NOOP. If each
+ * server only gets a single key we use the GET command instead, and
+ * the not-found responses are sent by the server. With coalescing
+ * enabled a key we've already spooled a get for (and not sent) isn't
+ * sent again (see coalesce.c), and the keys found in the near cache
+ * or the shared cache are reported before we return (see near_cache.c
+ * and shared_cache.c).
  *
  * @author Trond Norbye
  * @todo improve the error handling
  */
 LIBCOUCHBASE_API
 libcouchbase_error_t libcouchbase_mget(libcouchbase_t instance,
+                                       const void * const *command_cookies,
                                        size_t num_keys,
                                        const void * const *keys,
                                        const size_t *nkey,
                                        const time_t *exp)
 {
-    return libcouchbase_mget_by_key(instance, NULL, 0, num_keys,
-                                    keys, nkey, exp);
+    return libcouchbase_mget_by_key(instance, command_cookies, NULL, 0,
+                                    num_keys, keys, nkey, exp);
 }
 
 LIBCOUCHBASE_API
 libcouchbase_error_t libcouchbase_mget_by_key(libcouchbase_t instance,
+                                              const void * const *command_cookies,
                                               const void *hashkey,
                                               size_t nhashkey,
                                               size_t num_keys,
@@ -47,73 +146,119 @@ libcouchbase_error_t libcouchbase_mget_by_key(libcouchbase_t instance,
 {
     uint16_t vb = 0;
     libcouchbase_server_t *server = NULL;
-    protocol_binary_request_noop noop;
+    libcouchbase_error_t ret = LIBCOUCHBASE_SUCCESS;
+    bool quiet;
     size_t ii;
 
     // we need a vbucket config before we can start getting data..
     libcouchbase_ensure_vbucket_config(instance);
     assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
 
     if (nhashkey != 0) {
         vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
                                                   hashkey, nhashkey);
         server = instance->servers + instance->vb_server_map[vb];
+        quiet = num_keys > 1;
+    } else {
+        quiet = !one_key_per_server(instance, num_keys, keys, nkey);
     }
 
-    for (ii = 0; ii < num_keys; ++ii) {
-        protocol_binary_request_gat req;
+    for (ii = 0; ii < num_keys && ret == LIBCOUCHBASE_SUCCESS; ++ii) {
+        const void *cookie = command_cookies ? command_cookies[ii] : NULL;
         if (nhashkey == 0) {
             vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
                                                       keys[ii], nkey[ii]);
             server = instance->servers + instance->vb_server_map[vb];
         }
-
-        memset(&req, 0, sizeof(req));
-        req.message.header.request.magic = PROTOCOL_BINARY_REQ;
-        req.message.header.request.keylen = ntohs((uint16_t)nkey[ii]);
-        req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-        req.message.header.request.vbucket = ntohs(vb);
-        req.message.header.request.bodylen = ntohl((uint32_t)(nkey[ii]));
-        req.message.header.request.opaque = ++instance->seqno;
-
+        if (!exp && (libcouchbase_near_cache_get(instance, cookie,
+                                                 vb, keys[ii], nkey[ii]) ||
+                     libcouchbase_shared_cache_get(instance, cookie,
+                                                   vb, keys[ii], nkey[ii]) ||
+                     libcouchbase_coalesce_get(server, cookie, vb,
+                                               keys[ii], nkey[ii]))) {
+            continue;
+        }
+        ret = encode_get(server, cookie, quiet, vb, keys[ii],
+                         nkey[ii], exp ? exp + ii : NULL);
+        if (ret != LIBCOUCHBASE_SUCCESS) {
+            break;
+        }
         if (!exp) {
-            req.message.header.request.opcode = PROTOCOL_BINARY_CMD_GETQ;
-            libcouchbase_server_start_packet(server, req.bytes,
-                                             sizeof(req.bytes) - 4);
+            libcouchbase_coalesce_add(server);
+        }
+        if (quiet) {
+            libcouchbase_server_fence(server);
         } else {
-            req.message.header.request.opcode = PROTOCOL_BINARY_CMD_GATQ;
-            req.message.header.request.extlen = 4;
-            req.message.body.expiration = ntohl((uint32_t)exp[ii]);
-            req.message.header.request.bodylen = ntohl((uint32_t)(nkey[ii]) + 4);
-            libcouchbase_server_start_packet(server, req.bytes,
-                                             sizeof(req.bytes));
+            libcouchbase_server_send_packets(server);
         }
-        libcouchbase_server_write_packet(server, keys[ii], nkey[ii]);
-        libcouchbase_server_end_packet(server);
     }
 
-    memset(&noop, 0, sizeof(noop));
-    noop.message.header.request.magic = PROTOCOL_BINARY_REQ;
-    noop.message.header.request.opcode = PROTOCOL_BINARY_CMD_NOOP;
-    noop.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    if (quiet) {
+        libcouchbase_send_fenced(instance, nhashkey == 0 ? NULL : server);
+    }
+
+    if (!exp) {
+        libcouchbase_hedge_arm(instance);
+    }
+
+    return ret;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_get(libcouchbase_t instance,
+                                      const void *command_cookie,
+                                      const void *key,
+                                      size_t nkey,
+                                      const time_t *exp)
+{
+    return libcouchbase_get_by_key(instance, command_cookie, NULL, 0,
+                                   key, nkey, exp);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_get_by_key(libcouchbase_t instance,
+                                             const void *command_cookie,
+                                             const void *hashkey,
+                                             size_t nhashkey,
+                                             const void *key,
+                                             size_t nkey,
+                                             const time_t *exp)
+{
+    libcouchbase_server_t *server;
+    libcouchbase_error_t ret;
+    uint16_t vb;
+
+    libcouchbase_ensure_vbucket_config(instance);
+    assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
 
     if (nhashkey == 0) {
-        // We don't know which server we sent the data to, so examine
-        // where to send the noop
-        for (ii = 0; ii < instance->nservers; ++ii) {
-            server = instance->servers + ii;
-            if (server->output.avail > 0 || server->pending.avail > 0) {
-                noop.message.header.request.opaque = ++instance->seqno;
-                libcouchbase_server_complete_packet(server, noop.bytes,
-                                                    sizeof(noop.bytes));
-                libcouchbase_server_send_packets(server);
-            }
-        }
-    } else {
-        noop.message.header.request.opaque = ++instance->seqno;
-        libcouchbase_server_complete_packet(server, noop.bytes,
-                                            sizeof(noop.bytes));
-        libcouchbase_server_send_packets(server);
+        hashkey = key;
+        nhashkey = nkey;
+    }
+    vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
+                                              hashkey, nhashkey);
+    server = instance->servers + instance->vb_server_map[vb];
+    if (!exp && (libcouchbase_near_cache_get(instance, command_cookie, vb,
+                                             key, nkey) ||
+                 libcouchbase_shared_cache_get(instance, command_cookie, vb,
+                                               key, nkey) ||
+                 libcouchbase_coalesce_get(server, command_cookie, vb,
+                                           key, nkey))) {
+        return LIBCOUCHBASE_SUCCESS;
+    }
+    ret = encode_get(server, command_cookie, false, vb, key, nkey, exp);
+    if (ret != LIBCOUCHBASE_SUCCESS) {
+        return ret;
+    }
+    if (!exp) {
+        libcouchbase_coalesce_add(server);
+    }
+    libcouchbase_server_send_packets(server);
+
+    if (!exp) {
+        libcouchbase_hedge_arm(instance);
     }
 
     return LIBCOUCHBASE_SUCCESS;
@@ -46,28 +46,69 @@ static void dummy_response_handler(libcouchbase_server_t *server,
     (void)res;
 }
 
+/**
+ * Get the command we sent to the server for the response we're
+ * currently processing
+ * @param server the server we received the response from
+ * @return the packet we sent to the server
+ */
+static protocol_binary_request_header *get_request(libcouchbase_server_t *server)
+{
+    return libcouchbase_cmd_log_packet(&server->cmd_log,
+                                       libcouchbase_cmd_log_head(&server->cmd_log));
+}
+
+/**
+ * Get the cookie for the command we're currently processing the
+ * response for
+ * @param server the server we received the response from
+ * @return the cookie passed to the call spooling the command
+ */
+static const void *get_cookie(libcouchbase_server_t *server)
+{
+    return libcouchbase_cmd_log_head(&server->cmd_log)->cookie;
+}
+
 static void getq_response_handler(libcouchbase_server_t *server,
                                   protocol_binary_response_header *res)
 {
     libcouchbase_t root = server->instance;
     protocol_binary_response_getq *getq = (void*)res;
-    protocol_binary_request_header *req = (void*)server->cmd_log.data;
+    protocol_binary_request_header *req = get_request(server);
+    cmd_log_entry_t *entry = libcouchbase_cmd_log_head(&server->cmd_log);
     const char *key = (const char *)(req + 1) + req->request.extlen;
     size_t nkey = ntohs(req->request.keylen);
     uint16_t status = ntohs(res->response.status);
     size_t nbytes = ntohl(res->response.bodylen);
     nbytes -= res->response.extlen;
     assert(req->request.opaque == res->response.opaque);
+    if (!libcouchbase_hedge_resolve(server, entry,
+                                    status == PROTOCOL_BINARY_RESPONSE_SUCCESS)) {
+        return;
+    }
+
     if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
         const char *bytes = (const char *)res;
         bytes += sizeof(getq->bytes);
-        root->callbacks.get(root, LIBCOUCHBASE_SUCCESS, key, nkey,
-                            bytes, nbytes,
-                            ntohl(getq->message.body.flags),
-                            res->response.cas);
+        if (entry->opcode != PROTOCOL_BINARY_CMD_GET_REPLICA) {
+            libcouchbase_near_cache_store(root, entry->opaque,
+                                          ntohs(req->request.vbucket),
+                                          key, nkey, bytes, nbytes,
+                                          ntohl(getq->message.body.flags),
+                                          res->response.cas);
+            libcouchbase_shared_cache_store(root, entry->shared_clock,
+                                            ntohs(req->request.vbucket),
+                                            key, nkey, bytes, nbytes,
+                                            ntohl(getq->message.body.flags),
+                                            res->response.cas);
+        }
+        libcouchbase_get_callback(root, entry, LIBCOUCHBASE_SUCCESS,
+                                  key, nkey, bytes, nbytes,
+                                  ntohl(getq->message.body.flags),
+                                  res->response.cas);
     } else {
-        root->callbacks.get(root, LIBCOUCHBASE_KEY_ENOENT, key, nkey,
-                            NULL, 0, 0, 0);
+        libcouchbase_get_callback(root, entry, LIBCOUCHBASE_KEY_ENOENT,
+                                  key, nkey, NULL, 0, 0, 0);
     }
 }
 
@@ -75,7 +116,8 @@ static void delete_response_handler(libcouchbase_server_t *server,
                                     protocol_binary_response_header *res)
 {
     libcouchbase_t root = server->instance;
-    protocol_binary_request_header *req = (void*)server->cmd_log.data;
+    protocol_binary_request_header *req = get_request(server);
+    const void *cookie = get_cookie(server);
     const char *key = (const char *)(req + 1);
     size_t nkey = ntohs(req->request.keylen);
     uint16_t status = ntohs(res->response.status);
@@ -83,9 +125,11 @@ static void delete_response_handler(libcouchbase_server_t *server,
 
     assert(req->request.opaque == res->response.opaque);
     if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
-        root->callbacks.remove(root, LIBCOUCHBASE_SUCCESS, key, nkey);
+        root->callbacks.remove(root, cookie, LIBCOUCHBASE_SUCCESS,
+                               key, nkey);
     } else {
-        root->callbacks.remove(root, LIBCOUCHBASE_ERROR, key, nkey);
+        root->callbacks.remove(root, cookie, LIBCOUCHBASE_ERROR,
+                               key, nkey);
     }
 }
 
@@ -93,7 +137,8 @@ static void storage_response_handler(libcouchbase_server_t *server,
                                      protocol_binary_response_header *res)
 {
     libcouchbase_t root = server->instance;
-    protocol_binary_request_header *req = (void*)server->cmd_log.data;
+    protocol_binary_request_header *req = get_request(server);
+    const void *cookie = get_cookie(server);
 
 
     const char *key = (const char*)(req + 1);
@@ -103,11 +148,11 @@ static void storage_response_handler(libcouchbase_server_t *server,
 
     assert(req->request.opaque == res->response.opaque);
     if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
-        root->callbacks.storage(root, LIBCOUCHBASE_SUCCESS, key, nkey,
-                                res->response.cas);
+        root->callbacks.storage(root, cookie, LIBCOUCHBASE_SUCCESS,
+                                key, nkey, res->response.cas);
     } else {
-        root->callbacks.storage(root, LIBCOUCHBASE_ERROR, key, nkey,
-                                res->response.cas);
+        root->callbacks.storage(root, cookie, LIBCOUCHBASE_ERROR,
+                                key, nkey, res->response.cas);
     }
 }
 
@@ -115,7 +160,8 @@ static void arithmetic_response_handler(libcouchbase_server_t *server,
                                         protocol_binary_response_header *res)
 {
     libcouchbase_t root = server->instance;
-    protocol_binary_request_header *req = (void*)server->cmd_log.data;
+    protocol_binary_request_header *req = get_request(server);
+    const void *cookie = get_cookie(server);
     const char *key = (const char *)(req + 1);
     size_t nkey = ntohs(req->request.keylen);
     uint16_t status = ntohs(res->response.status);
@@ -126,12 +172,12 @@ static void arithmetic_response_handler(libcouchbase_server_t *server,
         uint64_t value;
         memcpy(&value, res + 1, sizeof(value));
         value = ntohll(value);
-        root->callbacks.arithmetic(root, LIBCOUCHBASE_SUCCESS, key, nkey,
-                                   value,
+        root->callbacks.arithmetic(root, cookie, LIBCOUCHBASE_SUCCESS,
+                                   key, nkey, value,
                                    res->response.cas);
     } else {
-        root->callbacks.arithmetic(root, LIBCOUCHBASE_ERROR, key, nkey,
-                                   0, 0);
+        root->callbacks.arithmetic(root, cookie, LIBCOUCHBASE_ERROR,
+                                   key, nkey, 0, 0);
     }
 }
 
@@ -152,6 +198,10 @@ static void tap_mutation_handler(libcouchbase_server_t *server,
     uint32_t nbytes = ntohl(req->request.bodylen) - req->request.extlen - nes - nkey;
 
     libcouchbase_t root = server->instance;
+    libcouchbase_near_cache_invalidate(root, ntohs(req->request.vbucket),
+                                       key, nkey);
+    libcouchbase_shared_cache_invalidate(root, ntohs(req->request.vbucket),
+                                         key, nkey);
     root->callbacks.tap_mutation(root, key, nkey, data, nbytes,
                                  flags, exp, es, nes);
 }
@@ -167,6 +217,10 @@ static void tap_deletion_handler(libcouchbase_server_t *server,
     uint16_t nes = ntohs(deletion->message.body.tap.enginespecific_length);
     char *key = es + nes;
     libcouchbase_t root = server->instance;
+    libcouchbase_near_cache_invalidate(root, ntohs(req->request.vbucket),
+                                       key, nkey);
+    libcouchbase_shared_cache_invalidate(root, ntohs(req->request.vbucket),
+                                         key, nkey);
     root->callbacks.tap_deletion(root, key, nkey, es, nes);
 }
 
@@ -179,6 +233,8 @@ static void tap_flush_handler(libcouchbase_server_t *server,
     char *es = packet + sizeof(flush->bytes);
     uint16_t nes = ntohs(flush->message.body.tap.enginespecific_length);
     libcouchbase_t root = server->instance;
+    libcouchbase_near_cache_flush(root);
+    libcouchbase_shared_cache_flush(root);
     root->callbacks.tap_flush(root, es, nes);
 }
 
@@ -244,8 +300,8 @@ static void sasl_list_mech_response_handler(libcouchbase_server_t *server,
     libcouchbase_server_buffer_write_packet(server, &server->output, data, len);
     libcouchbase_server_buffer_end_packet(server, &server->output);
 
-    // send the data and add it to libevent..
-    libcouchbase_server_event_handler(0, EV_WRITE, server);
+    // send the data and add it to the event loop..
+    libcouchbase_server_event_handler(0, LIBCOUCHBASE_WRITE_EVENT, server);
 }
 
 static void sasl_auth_response_handler(libcouchbase_server_t *server,
@@ -284,7 +340,8 @@ static void touch_response_handler(libcouchbase_server_t *server,
                                     protocol_binary_response_header *res)
 {
     libcouchbase_t root = server->instance;
-    protocol_binary_request_header *req = (void*)server->cmd_log.data;
+    protocol_binary_request_header *req = get_request(server);
+    const void *cookie = get_cookie(server);
     const char *key = (const char *)(req + 1);
     size_t nkey = ntohs(req->request.keylen);
     uint16_t status = ntohs(res->response.status);
@@ -292,9 +349,11 @@ static void touch_response_handler(libcouchbase_server_t *server,
 
     assert(req->request.opaque == res->response.opaque);
     if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS) {
-        root->callbacks.touch(root, LIBCOUCHBASE_SUCCESS, key, nkey);
+        root->callbacks.touch(root, cookie, LIBCOUCHBASE_SUCCESS,
+                              key, nkey);
     } else {
-        root->callbacks.touch(root, LIBCOUCHBASE_ERROR, key, nkey);
+        root->callbacks.touch(root, cookie, LIBCOUCHBASE_ERROR,
+                              key, nkey);
     }
 }
 
@@ -345,45 +404,109 @@ static void dummy_tap_vbucket_set_callback(libcouchbase_t instance,
 }
 
 static void dummy_get_callback(libcouchbase_t instance,
+                               const void *cookie,
                                libcouchbase_error_t error,
                                const void *key, size_t nkey,
                                const void *bytes, size_t nbytes,
                                uint32_t flags, uint64_t cas)
 {
-    (void)instance; (void)error; (void)key; (void)nkey;
+    (void)instance; (void)cookie; (void)error; (void)key; (void)nkey;
     (void)bytes; (void)nbytes; (void)flags; (void)cas;
 }
 
+static void dummy_get_stream_callback(libcouchbase_t instance,
+                                      const void *cookie,
+                                      const void *key, size_t nkey,
+                                      const void *bytes, size_t nbytes,
+                                      size_t offset, size_t total,
+                                      uint32_t flags, uint64_t cas)
+{
+    (void)instance; (void)cookie; (void)key; (void)nkey; (void)bytes;
+    (void)nbytes;
+    (void)offset; (void)total; (void)flags; (void)cas;
+}
+
 static void dummy_storage_callback(libcouchbase_t instance,
+                                   const void *cookie,
                                    libcouchbase_error_t error,
                                    const void *key, size_t nkey,
                                    uint64_t cas)
 {
-    (void)instance; (void)error; (void)key; (void)nkey;
+    (void)instance; (void)cookie; (void)error; (void)key; (void)nkey;
     (void)cas;
 }
 
 static void dummy_arithmetic_callback(libcouchbase_t instance,
+                                      const void *cookie,
                                       libcouchbase_error_t error,
                                       const void *key, size_t nkey,
                                       uint64_t value, uint64_t cas)
 {
-    (void)instance; (void)error; (void)key; (void)nkey;
+    (void)instance; (void)cookie; (void)error; (void)key; (void)nkey;
     (void)value; (void)cas;
 }
 
 static void dummy_remove_callback(libcouchbase_t instance,
+                                  const void *cookie,
                                   libcouchbase_error_t error,
                                   const void *key, size_t nkey)
 {
-    (void)instance; (void)error; (void)key; (void)nkey;
+    (void)instance; (void)cookie; (void)error; (void)key; (void)nkey;
 }
 
 static void dummy_touch_callback(libcouchbase_t instance,
+                                 const void *cookie,
                                  libcouchbase_error_t error,
                                  const void *key, size_t nkey)
 {
-    (void)instance; (void)error; (void)key; (void)nkey;
+    (void)instance; (void)cookie; (void)error; (void)key; (void)nkey;
+}
+
+void libcouchbase_fail_request(libcouchbase_t instance,
+                               const void *cookie,
+                               uint8_t opcode,
+                               const void *key, size_t nkey,
+                               libcouchbase_error_t error)
+{
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+    case PROTOCOL_BINARY_CMD_GET_REPLICA:
+        instance->callbacks.get(instance, cookie, error, key, nkey,
+                                NULL, 0, 0, 0);
+        break;
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        instance->callbacks.storage(instance, cookie, error, key, nkey, 0);
+        break;
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        instance->callbacks.remove(instance, cookie, error, key, nkey);
+        break;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        instance->callbacks.arithmetic(instance, cookie, error, key, nkey,
+                                       0, 0);
+        break;
+    case PROTOCOL_BINARY_CMD_TOUCH:
+        instance->callbacks.touch(instance, cookie, error, key, nkey);
+        break;
+    default:
+        /* Nobody waits for the result */
+        break;
+    }
 }
 
 void libcouchbase_initialize_packet_handlers(libcouchbase_t instance)
@@ -400,6 +523,7 @@ void libcouchbase_initialize_packet_handlers(libcouchbase_t instance)
     instance->callbacks.tap_opaque = dummy_tap_opaque_callback;
     instance->callbacks.tap_vbucket_set = dummy_tap_vbucket_set_callback;
     instance->callbacks.get = dummy_get_callback;
+    instance->callbacks.get_stream = dummy_get_stream_callback;
     instance->callbacks.storage = dummy_storage_callback;
     instance->callbacks.arithmetic = dummy_arithmetic_callback;
     instance->callbacks.remove = dummy_remove_callback;
@@ -414,15 +538,26 @@ void libcouchbase_initialize_packet_handlers(libcouchbase_t instance)
 
     instance->response_handler[PROTOCOL_BINARY_CMD_GETQ] = getq_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_GATQ] = getq_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_GET] = getq_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_GAT] = getq_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_GET_REPLICA] = getq_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_ADD] = storage_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_DELETE] = delete_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_REPLACE] = storage_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_SET] = storage_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_APPEND] = storage_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_PREPEND] = storage_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_ADDQ] = storage_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_REPLACEQ] = storage_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_SETQ] = storage_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_APPENDQ] = storage_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_PREPENDQ] = storage_response_handler;
 
     instance->response_handler[PROTOCOL_BINARY_CMD_INCREMENT] = arithmetic_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_DECREMENT] = arithmetic_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_INCREMENTQ] = arithmetic_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_DECREMENTQ] = arithmetic_response_handler;
+    instance->response_handler[PROTOCOL_BINARY_CMD_DELETEQ] = delete_response_handler;
 
     instance->response_handler[PROTOCOL_BINARY_CMD_SASL_LIST_MECHS] = sasl_list_mech_response_handler;
     instance->response_handler[PROTOCOL_BINARY_CMD_SASL_AUTH] = sasl_auth_response_handler;
@@ -438,6 +573,10 @@ void libcouchbase_set_callbacks(libcouchbase_t instance,
         instance->callbacks.get = callbacks->get;
     }
 
+    if (callbacks->get_stream != NULL) {
+        instance->callbacks.get_stream = callbacks->get_stream;
+    }
+
     if (callbacks->storage != NULL) {
         instance->callbacks.storage = callbacks->storage;
     }
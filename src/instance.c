@@ -23,7 +23,8 @@
  */
 #include "internal.h"
 
-static bool default_packet_filter(libcouchbase_t instance, const void *data)
+bool libcouchbase_default_packet_filter(libcouchbase_t instance,
+                                        const void *data)
 {
     (void)instance;
     (void)data;
@@ -36,6 +37,21 @@ libcouchbase_t libcouchbase_create(const char *host,
                                    const char *passwd,
                                    const char *bucket,
                                    struct event_base *base)
+{
+    libcouchbase_io_opt_t *io = libcouchbase_create_libevent_io_opts(base);
+    if (io == NULL) {
+        return NULL;
+    }
+
+    return libcouchbase_create_with_io(host, user, passwd, bucket, io);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_t libcouchbase_create_with_io(const char *host,
+                                           const char *user,
+                                           const char *passwd,
+                                           const char *bucket,
+                                           libcouchbase_io_opt_t *io)
 {
     libcouchbase_t ret;
     char *p;
@@ -49,12 +65,20 @@ libcouchbase_t libcouchbase_create(const char *host,
     }
 
     if (sasl_client_init(NULL) != SASL_OK) {
+        io->destroy(io);
         return NULL;
     }
 
     if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        io->destroy(io);
         return NULL;
     }
+    ret->io = io;
+    ret->sock = INVALID_SOCKET;
+    ret->shard.instance = ret;
+    ret->shard.io = io;
+    ret->shard.packet.mark.offset = (size_t)-1;
+    libcouchbase_timeout_init(&ret->shard);
     libcouchbase_initialize_packet_handlers(ret);
 
     ret->host = strdup(host);
@@ -75,9 +99,9 @@ libcouchbase_t libcouchbase_create(const char *host,
         return NULL;
     }
 
-    ret->sock = -1;
-    ret->ev_base = base;
-    ret->packet_filter = default_packet_filter;
+    ret->packet_filter = libcouchbase_default_packet_filter;
+    ret->max_retries = 3;
+    ret->timeout.usec = 2500000;
 
     return ret;
 }
@@ -86,19 +110,31 @@ LIBCOUCHBASE_API
 void libcouchbase_destroy(libcouchbase_t instance)
 {
     size_t ii;
+    libcouchbase_stop_io_thread(instance);
     free(instance->host);
     free(instance->user);
     free(instance->passwd);
     free(instance->bucket);
 
+    if (instance->event != NULL) {
+        instance->io->delete_event(instance->io, instance->sock,
+                                   instance->event);
+        instance->io->destroy_event(instance->io, instance->event);
+    }
+
     if (instance->sock != INVALID_SOCKET) {
-        EVUTIL_CLOSESOCKET(instance->sock);
+        instance->io->close(instance->io, instance->sock);
     }
 
     if (instance->ai != NULL) {
         freeaddrinfo(instance->ai);
     }
 
+    if (instance->hedge.timer != NULL) {
+        instance->io->delete_timer(instance->io, instance->hedge.timer);
+        instance->io->destroy_timer(instance->io, instance->hedge.timer);
+    }
+
     if (instance->vbucket_config != NULL) {
         vbucket_config_destroy(instance->vbucket_config);
     }
@@ -107,6 +143,14 @@ void libcouchbase_destroy(libcouchbase_t instance)
         libcouchbase_server_destroy(instance->servers + ii);
     }
     free(instance->servers);
+    libcouchbase_timeout_destroy(&instance->shard);
+    libcouchbase_batch_destroy(instance);
+    libcouchbase_wait_destroy(instance);
+    libcouchbase_coalesce_destroy(instance);
+    libcouchbase_near_cache_destroy(instance);
+    libcouchbase_shared_cache_destroy(instance);
+    libcouchbase_segment_pool_destroy(&instance->shard.segment_pool);
+    instance->io->destroy(instance->io);
 
     memset(instance, 0xff, sizeof(*instance));
     free(instance);
@@ -160,12 +204,233 @@ static int sasl_get_password(sasl_conn_t *conn, void *context, int id,
 }
 
 /**
- * Update the list of servers and connect to the new ones
+ * Look for a server with the given name ("hostname:port") in the list
+ * of servers we had before the configuration changed.
+ *
+ * @param servers the old list of servers
+ * @param nservers the number of servers in the old list
+ * @param name the name to search for
+ * @return the server, or NULL if it isn't in the list (or already moved)
+ */
+static libcouchbase_server_t *find_server(libcouchbase_server_t *servers,
+                                          size_t nservers,
+                                          const char *name)
+{
+    size_t ii;
+    const char *port = strchr(name, ':');
+    size_t nhost = (size_t)(port - name);
+
+    for (ii = 0; ii < nservers; ++ii) {
+        libcouchbase_server_t *server = servers + ii;
+        if (server->hostname != NULL &&
+            strlen(server->hostname) == nhost &&
+            memcmp(server->hostname, name, nhost) == 0 &&
+            strcmp(server->port, port + 1) == 0) {
+            return server;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Get the size of the packet at the beginning of a chain
+ */
+static size_t unsent_packet_size(chain_t *unsent,
+                                 protocol_binary_request_header *req)
+{
+    chain_mark_t mark;
+    memset(&mark, 0, sizeof(mark));
+    libcouchbase_chain_copy(unsent, &mark, req, sizeof(*req));
+    return sizeof(*req) + ntohl(req->request.bodylen);
+}
+
+/**
+ * Skip the packets in the beginning of the unsent chain that aren't in
+ * the command log (the TAP_CONNECT), keeping them for the server if it
+ * stays in the cluster
+ */
+static void skip_untracked(libcouchbase_server_t *server, chain_t *unsent,
+                           const cmd_log_entry_t *entry, bool keep)
+{
+    libcouchbase_t instance = server->instance;
+
+    while (unsent->nbytes > 0) {
+        protocol_binary_request_header req;
+        size_t size = unsent_packet_size(unsent, &req);
+        char *packet;
+
+        if (entry != NULL && req.request.opaque == entry->opaque) {
+            return;
+        }
+
+        if (keep && (packet = malloc(size)) != NULL) {
+            chain_mark_t mark;
+            memset(&mark, 0, sizeof(mark));
+            libcouchbase_chain_copy(unsent, &mark, packet, size);
+            libcouchbase_server_buffer_complete_packet(server, &server->pending,
+                                                       packet, size);
+            free(packet);
+        }
+        libcouchbase_chain_consume(instance, unsent, size);
+    }
+}
+
+/**
+ * Check if any of the commands sent to a server that stays in the
+ * cluster belong to a vbucket now hosted by another server.
+ *
+ * @param instance the instance (with the new list of servers)
+ * @param server the server
+ * @param old_map the vbucket map before the configuration changed
+ * @param old_nvbuckets the number of vbuckets in old_map
+ * @param origin the index of the server in the old list of servers
+ */
+static bool has_moved_commands(libcouchbase_t instance,
+                               libcouchbase_server_t *server,
+                               const uint16_t *old_map,
+                               uint16_t old_nvbuckets,
+                               size_t origin)
+{
+    size_t idx = (size_t)(server - instance->servers);
+    size_t ii;
+
+    for (ii = 0; ii < server->cmd_log.count; ++ii) {
+        cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(&server->cmd_log, ii);
+        protocol_binary_request_header *req;
+        uint16_t vb;
+
+        if (entry->opcode == PROTOCOL_BINARY_CMD_NOOP ||
+            entry->opcode == PROTOCOL_BINARY_CMD_GET_REPLICA ||
+            (entry->flags & CMD_COMPLETED)) {
+            continue;
+        }
+
+        req = libcouchbase_cmd_log_packet(&server->cmd_log, entry);
+        vb = ntohs(req->request.vbucket);
+        if (vb < instance->nvbuckets && instance->vb_server_map[vb] != idx &&
+            (vb >= old_nvbuckets || old_map[vb] == origin)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Move the commands from a server to the servers now hosting their
+ * vbuckets.
+ *
+ * The commands still in the pending buffer (we're not connected to the
+ * server yet) are sent from the packets in the buffer, and the ones for
+ * vbuckets the server still hosts are sent to it again. Once a command
+ * is written to the socket only the header and the key is kept in the
+ * command log, so a storage command sent to a server leaving the
+ * cluster fails with LIBCOUCHBASE_ETMPFAIL unless the values are
+ * retained (see libcouchbase_set_retain_values). Commands written to a
+ * server that stays in the cluster are left alone; the server responds
+ * with NOT_MY_VBUCKET, and libcouchbase_server_retry_command sends them
+ * to the new owner.
+ *
+ * @param instance the instance (with the new list of servers)
+ * @param server the server
+ * @param removed true if the server is being removed
+ */
+static void reroute_commands(libcouchbase_t instance,
+                             libcouchbase_server_t *server,
+                             bool removed)
+{
+    cmd_log_entry_t *entry;
+    chain_t unsent;
+    chain_t *pending = NULL;
+    size_t count = server->cmd_log.count;
+    size_t ii;
+
+    memset(&unsent, 0, sizeof(unsent));
+    if (!server->connected) {
+        /* The commands sent to the server itself are added again */
+        libcouchbase_chain_move(&unsent, &server->pending);
+        pending = &unsent;
+    } else if (server->stream.remaining > 0) {
+        /* We can't resume a value we've started to pass to the user */
+        libcouchbase_server_fail_command(server,
+                                         PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+        server->stream.remaining = 0;
+        --count;
+    }
+
+    for (ii = 0; ii < count; ++ii) {
+        protocol_binary_request_header *req;
+        libcouchbase_server_t *dest = NULL;
+        size_t size = 0;
+        size_t idx;
+
+        entry = libcouchbase_cmd_log_head(&server->cmd_log);
+        if (pending != NULL) {
+            protocol_binary_request_header hdr;
+            skip_untracked(server, pending, entry, !removed);
+            assert(pending->nbytes > 0);
+            size = unsent_packet_size(pending, &hdr);
+        }
+
+        if (entry->opcode == PROTOCOL_BINARY_CMD_NOOP ||
+            (entry->flags & CMD_COMPLETED)) {
+            /*
+             * The quiet commands are sent as normal commands, and the
+             * other get of a hedged read reported the result
+             */
+            libcouchbase_cmd_log_pop(&server->cmd_log);
+        } else {
+            req = libcouchbase_cmd_log_packet(&server->cmd_log, entry);
+            if (!removed && entry->opcode == PROTOCOL_BINARY_CMD_GET_REPLICA) {
+                dest = server;
+            } else {
+                idx = instance->vb_server_map[ntohs(req->request.vbucket)];
+                if (idx < instance->nservers) {
+                    dest = instance->servers + idx;
+                }
+            }
+
+            if (dest != NULL &&
+                (pending != NULL ?
+                 libcouchbase_server_requeue_unsent(server, pending, dest) :
+                 libcouchbase_server_requeue_command(server, dest, 0))) {
+                libcouchbase_server_send_packets(dest);
+                libcouchbase_cmd_log_pop(&server->cmd_log);
+            } else {
+                /* We don't have the entire packet (or a server to send it to) */
+                libcouchbase_server_fail_command(server,
+                                                 PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+            }
+        }
+
+        if (pending != NULL) {
+            libcouchbase_chain_consume(instance, pending, size);
+        }
+    }
+
+    if (pending != NULL) {
+        skip_untracked(server, pending, NULL, !removed);
+    }
+}
+
+/**
+ * Update the list of servers and connect to the new ones. Servers
+ * present in both the old and the new configuration keep their
+ * connection (and all of the commands sent to them), and the commands
+ * sent to servers no longer part of the cluster (or for vbuckets now
+ * hosted by another server) are moved to the server now hosting the
+ * vbucket (see reroute_commands).
+ *
+ * The servers are owned by the event loops of the I/O threads (see
+ * thread.c). We park the other threads while we update the list, so
+ * we may touch all of the servers. A server present in both lists
+ * stays with its thread, and new servers are given to the thread with
+ * the fewest servers.
+ *
  * @param instance the instance to update the serverlist for.
  *
  * @todo use non-blocking connects and timeouts
- * @todo try to reshuffle all pending operations!
- * @todo use the diff functionality to avoid reshuffle all of the pending ops
  */
 static void libcouchbase_update_serverlist(libcouchbase_t instance)
 {
@@ -173,6 +438,14 @@ static void libcouchbase_update_serverlist(libcouchbase_t instance)
     uint16_t max;
     size_t num;
     const char *passwd;
+    libcouchbase_server_t *old_servers;
+    size_t old_nservers;
+    uint16_t *old_map;
+    uint16_t old_nvbuckets;
+    bool *created;
+    size_t *origin;
+    libcouchbase_server_t *servers;
+    VBUCKET_CONFIG_HANDLE config;
 
     sasl_callback_t sasl_callbacks[4] = {
         { SASL_CB_USER, (int(*)(void))&sasl_get_username, instance },
@@ -181,31 +454,77 @@ static void libcouchbase_update_serverlist(libcouchbase_t instance)
         { SASL_CB_LIST_END, NULL, NULL }
     };
 
-    if (instance->vbucket_config != NULL) {
-        vbucket_config_destroy(instance->vbucket_config);
-    }
-
-    instance->vbucket_config = vbucket_config_parse_string(instance->vbucket_stream.input.data);
-    if (instance->vbucket_config == NULL) {
+    libcouchbase_threads_pause(instance);
+    config = vbucket_config_parse_string(instance->vbucket_stream.input.data);
+    if (config == NULL) {
         // ERROR SYNTAX ERROR
         fprintf(stdout, "Syntax Error [%s]\n", instance->vbucket_stream.input.data);
+        if (instance->vbucket_config != NULL) {
+            vbucket_config_destroy(instance->vbucket_config);
+            instance->vbucket_config = NULL;
+        }
+        libcouchbase_threads_resume(instance);
         return;
     }
 
-    // @todo we shouldn't kill all of them, but fix that later on (remember
-    // to cancel all ongoing crap etc..
-    for (ii = 0; ii < instance->nservers; ++ii) {
-        libcouchbase_server_destroy(instance->servers + ii);
+    max = (uint16_t)vbucket_config_get_num_vbuckets(config);
+    num = (size_t)vbucket_config_get_num_servers(config);
+
+    servers = calloc(num, sizeof(libcouchbase_server_t));
+    created = calloc(num, sizeof(bool));
+    origin = calloc(num, sizeof(size_t));
+    if (servers == NULL || created == NULL || origin == NULL) {
+        /* Keep using the servers we've got until the next update */
+        free(servers);
+        free(created);
+        free(origin);
+        vbucket_config_destroy(config);
+        libcouchbase_threads_resume(instance);
+        return;
     }
-    free(instance->servers);
-    instance->servers = NULL;
-    instance->nservers = 0;
 
-    max = (uint16_t)vbucket_config_get_num_vbuckets(instance->vbucket_config);
-    num = (size_t)vbucket_config_get_num_servers(instance->vbucket_config);
+    if (instance->vbucket_config != NULL) {
+        vbucket_config_destroy(instance->vbucket_config);
+    }
+    instance->vbucket_config = config;
 
+    libcouchbase_hedge_reset(instance);
+    old_servers = instance->servers;
+    old_nservers = instance->nservers;
     instance->nservers = num;
-    instance->servers = calloc(num, sizeof(libcouchbase_server_t));
+    instance->servers = servers;
+
+    /*
+     * Keep the servers we already know about. The event handlers
+     * refer to the server object, so they must be updated when we
+     * move it to the new list
+     */
+    for (ii = 0; ii < num; ++ii) {
+        libcouchbase_server_t *server;
+        libcouchbase_io_opt_t *io;
+        server = find_server(old_servers, old_nservers,
+                             vbucket_config_get_server(instance->vbucket_config,
+                                                       (int)ii));
+        if (server == NULL || server->event == NULL) {
+            /* A new server (or one we failed to initialize) */
+            created[ii] = true;
+            origin[ii] = (size_t)-1;
+            continue;
+        }
+
+        origin[ii] = (size_t)(server - old_servers);
+        instance->servers[ii] = *server;
+        server->hostname = NULL;
+        server = instance->servers + ii;
+        libcouchbase_timeout_server_moved(server);
+        io = server->shard->io;
+        if (server->ev_flags != 0 &&
+            io->update_event(io, server->sock, server->event,
+                             server->ev_flags, server,
+                             server->ev_handler) == -1) {
+            abort();
+        }
+    }
 
     instance->sasl.name = vbucket_config_get_user(instance->vbucket_config);
     memset(instance->sasl.password.buffer, 0,
@@ -223,26 +542,67 @@ static void libcouchbase_update_serverlist(libcouchbase_t instance)
      * It would have been nice if I could query libvbucket for the number
      * of vbuckets a server got, but there isn't at the moment..
      */
+    old_map = instance->vb_server_map;
+    old_nvbuckets = instance->nvbuckets;
     instance->nvbuckets = max;
-    free(instance->vb_server_map);
     instance->vb_server_map = calloc(max, sizeof(uint16_t));
     for (ii = 0; ii < max; ++ii) {
         int idx = vbucket_get_master(instance->vbucket_config, (int)ii);
         instance->vb_server_map[ii] = (uint16_t)idx;
     }
+    libcouchbase_near_cache_config_changed(instance, old_map, old_nvbuckets,
+                                           origin);
+    libcouchbase_shared_cache_config_changed(instance, old_map, old_nvbuckets,
+                                             origin);
+
+    /*
+     * Now initialize the new servers. The commands for a server we
+     * fail to initialize stay in the pending buffer until they time
+     * out (or the next configuration update replaces the server)
+     */
+    for (ii = 0; ii < num; ++ii) {
+        if (created[ii]) {
+            instance->servers[ii].instance = instance;
+            instance->servers[ii].shard = libcouchbase_shard_for_new_server(instance);
+            ++instance->servers[ii].shard->nservers;
+            (void)libcouchbase_server_initialize(instance->servers + ii,
+                                                 (int)ii);
+        }
+    }
+
+    /* Move the commands from the servers that left the cluster */
+    for (ii = 0; ii < old_nservers; ++ii) {
+        if (old_servers[ii].hostname != NULL) {
+            reroute_commands(instance, old_servers + ii, true);
+            libcouchbase_server_destroy(old_servers + ii);
+        }
+    }
+    free(old_servers);
 
-    /* Now initialize the servers */
-    for (ii = 0; ii < (size_t)num; ++ii) {
-        instance->servers[ii].instance = instance;
-        libcouchbase_server_initialize(instance->servers + ii, (int)ii);
+    /* And the commands not sent yet for the vbuckets that moved between
+     * the servers that stay in the cluster (the ones already sent are
+     * retried when the server responds with NOT_MY_VBUCKET) */
+    for (ii = 0; ii < num; ++ii) {
+        if (!created[ii] && !instance->servers[ii].connected &&
+            has_moved_commands(instance, instance->servers + ii, old_map,
+                               old_nvbuckets, origin[ii])) {
+            reroute_commands(instance, instance->servers + ii, false);
+        }
     }
+    free(old_map);
+    free(origin);
 
-    /* Notify anyone interested in this event... */
+    /* Notify anyone interested in the new servers... */
     if (instance->vbucket_state_listener != NULL) {
         for (ii = 0; ii < instance->nservers; ++ii) {
-            instance->vbucket_state_listener(instance->servers + ii);
+            if (created[ii]) {
+                instance->vbucket_state_listener(instance->servers + ii);
+            }
         }
     }
+
+    free(created);
+    libcouchbase_threads_resume(instance);
 }
 
 /**
@@ -364,19 +724,20 @@ bool grow_buffer(buffer_t *buffer, size_t min_free) {
 }
 
 /**
- * Callback from libevent when we read from the REST socket
+ * Callback from the I/O backend when we read from the REST socket
  * @param sock the readable socket
  * @param which what kind of events we may do
  * @param arg pointer to the libcouchbase instance
  */
-static void vbucket_stream_handler(evutil_socket_t sock, short which, void *arg)
+static void vbucket_stream_handler(libcouchbase_socket_t sock, short which, void *arg)
 {
     libcouchbase_t instance = arg;
-    ssize_t nr;
+    libcouchbase_io_opt_t *io = instance->io;
+    libcouchbase_ssize_t nr;
     size_t avail;
     buffer_t *buffer = &instance->vbucket_stream.input;
     assert(sock != INVALID_SOCKET);
-    assert((which & EV_WRITE) == 0);
+    assert((which & LIBCOUCHBASE_WRITE_EVENT) == 0);
 
     do {
         if (!grow_buffer(buffer, 1)) {
@@ -386,16 +747,17 @@ static void vbucket_stream_handler(evutil_socket_t sock, short which, void *arg)
         }
 
         avail = (buffer->size - buffer->avail);
-        nr = recv(instance->sock, buffer->data + buffer->avail, avail, 0);
+        nr = io->recv(io, instance->sock, buffer->data + buffer->avail, avail, 0);
         if (nr < 0) {
-            switch (errno) {
+            switch (io->error) {
             case EINTR:
                 break;
             case EWOULDBLOCK:
                 return ;
             default:
                 /* ERROR READING SOCKET!! */
-                fprintf(stderr, "Failed to read from socket: %s\n", strerror(errno));
+                fprintf(stderr, "Failed to read from socket: %s\n",
+                        strerror(io->error));
                 return ;
             }
         } else if (nr == 0) {
@@ -506,7 +868,7 @@ libcouchbase_error_t libcouchbase_connect(libcouchbase_t instance)
                            &val, length);
                 break;
             }
-            EVUTIL_CLOSESOCKET(instance->sock);
+            instance->io->close(instance->io, instance->sock);
             instance->sock = -1;
         }
         ai = ai->ai_next;
@@ -523,7 +885,8 @@ libcouchbase_error_t libcouchbase_connect(libcouchbase_t instance)
         nw = send(instance->sock, buffer + offset, (size_t)(len - offset), 0);
         if (nw == -1) {
             if (errno != EINTR) {
-                EVUTIL_CLOSESOCKET(instance->sock);
+                instance->io->close(instance->io, instance->sock);
+                instance->sock = INVALID_SOCKET;
                 return LIBCOUCHBASE_NETWORK_ERROR;
             }
         } else {
@@ -531,16 +894,20 @@ libcouchbase_error_t libcouchbase_connect(libcouchbase_t instance)
         }
     } while (offset < len);
 
-    if (evutil_make_socket_nonblocking(instance->sock) != 0) {
-        EVUTIL_CLOSESOCKET(instance->sock);
+    if (libcouchbase_make_socket_nonblocking(instance->sock) != 0) {
+        instance->io->close(instance->io, instance->sock);
+        instance->sock = INVALID_SOCKET;
         return LIBCOUCHBASE_NETWORK_ERROR;
     }
 
-    instance->ev_flags = EV_READ | EV_PERSIST;
-    event_set(&instance->ev_event, instance->sock,
-              instance->ev_flags, vbucket_stream_handler, instance);
-    event_base_set(instance->ev_base, &instance->ev_event);
-    if (event_add(&instance->ev_event, NULL) == -1) {
+    instance->event = instance->io->create_event(instance->io);
+    if (instance->event == NULL) {
+        return LIBCOUCHBASE_ENOMEM;
+    }
+
+    if (instance->io->update_event(instance->io, instance->sock,
+                                   instance->event, LIBCOUCHBASE_READ_EVENT,
+                                   instance, vbucket_stream_handler) == -1) {
         return LIBCOUCHBASE_LIBEVENT_ERROR;
     }
 
@@ -554,3 +921,32 @@ void libcouchbase_set_packet_filter(libcouchbase_t instance,
 {
     instance->packet_filter = filter;
 }
+
+LIBCOUCHBASE_API
+void libcouchbase_set_retain_values(libcouchbase_t instance, bool enable)
+{
+    instance->retain_values = enable;
+}
+
+LIBCOUCHBASE_API
+void libcouchbase_set_stream_threshold(libcouchbase_t instance,
+                                       size_t nbytes)
+{
+    instance->stream_threshold = nbytes;
+}
+
+LIBCOUCHBASE_API
+void libcouchbase_set_max_retries(libcouchbase_t instance,
+                                  unsigned int retries)
+{
+    if (retries > UINT8_MAX) {
+        retries = UINT8_MAX;
+    }
+    instance->max_retries = (uint8_t)retries;
+}
+
+LIBCOUCHBASE_API
+void libcouchbase_set_eager_send(libcouchbase_t instance, bool enable)
+{
+    instance->eager_send = enable;
+}
@@ -22,11 +22,6 @@
 #include <assert.h>
 #include <errno.h>
 #ifndef WIN32
-#include <event.h>
-#else
-#include "myevent.h"
-#endif
-#ifndef WIN32
 #include <stdbool.h>
 #endif
 #include <stddef.h>
@@ -39,13 +34,8 @@
 #include <libvbucket/vbucket.h>
 #include <libcouchbase/couchbase.h>
 #include <sasl/sasl.h>
-
-/*
- * libevent2 define evutil_socket_t so that it'll automagically work
- * on windows
- */
-#ifndef evutil_socket_t
-#define evutil_socket_t int
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
 #endif
 
 #ifdef __cplusplus
@@ -54,8 +44,6 @@ extern "C" {
     struct libcouchbase_server_st;
     typedef struct libcouchbase_server_st libcouchbase_server_t;
 
-    typedef void (*EVENT_HANDLER)(evutil_socket_t fd, short which, void *arg);
-
     typedef void (*REQUEST_HANDLER)(libcouchbase_server_t *instance, protocol_binary_request_header *req);
     typedef void (*RESPONSE_HANDLER)(libcouchbase_server_t *instance,
                                      protocol_binary_response_header *res);
@@ -67,6 +55,366 @@ extern "C" {
     } buffer_t;
     bool grow_buffer(buffer_t *buffer, size_t min_free);
 
+    /**
+     * Memory owned by the caller. The release function is called when
+     * the last segment (or command log entry) referring to the memory is
+     * released.
+     */
+    typedef struct {
+        /** The number of segments and log entries referring to the memory */
+        unsigned int refcount;
+        /** The function to call when the memory may be released */
+        libcouchbase_release_t release;
+        /** The cookie to pass to the release function */
+        const void *cookie;
+    } chain_ref_t;
+
+    /**
+     * The data we're sending to a server is stored in a chain of
+     * segments. A segment either contains data we've copied, or refers
+     * to memory owned by the caller (in which case size is 0).
+     */
+    typedef struct segment_st {
+        struct segment_st *next;
+        /** The data in the segment */
+        char *data;
+        /** The number of bytes allocated for data (0 for references) */
+        size_t size;
+        /** The offset of the first byte in data not sent */
+        size_t start;
+        /** The number of bytes of data in the segment */
+        size_t avail;
+        /** The memory a reference belongs to (or NULL) */
+        chain_ref_t *ref;
+    } segment_t;
+
+    typedef struct {
+        segment_t *head;
+        segment_t *tail;
+        /** The number of bytes in the chain not sent */
+        size_t nbytes;
+    } chain_t;
+
+    /**
+     * A position in a chain, used to locate the beginning of the
+     * packet we're building.
+     */
+    typedef struct {
+        /** The segment at the end of the chain (or NULL if it was empty) */
+        segment_t *segment;
+        /** The number of bytes in that segment */
+        size_t offset;
+        /** The number of bytes in the chain */
+        size_t nbytes;
+    } chain_mark_t;
+
+    /** Unused segments ready to be used by any chain in the instance */
+    typedef struct {
+        segment_t *segments;
+        size_t count;
+    } segment_pool_t;
+
+    bool libcouchbase_chain_write(libcouchbase_t instance, chain_t *chain,
+                                  const void *data, size_t size);
+    bool libcouchbase_chain_add_ref(chain_t *chain, const void *data,
+                                    size_t size, chain_ref_t *ref);
+    chain_ref_t *libcouchbase_chain_ref_create(libcouchbase_release_t release,
+                                               const void *cookie);
+    void libcouchbase_chain_ref_retain(chain_ref_t *ref);
+    void libcouchbase_chain_ref_release(libcouchbase_t instance,
+                                        chain_ref_t *ref);
+    void libcouchbase_chain_get_mark(chain_t *chain, chain_mark_t *mark);
+    void libcouchbase_chain_copy(chain_t *chain, const chain_mark_t *mark,
+                                 void *dest, size_t size);
+    void libcouchbase_chain_truncate(libcouchbase_t instance, chain_t *chain,
+                                     const chain_mark_t *mark);
+    void libcouchbase_chain_move(chain_t *dest, chain_t *src);
+    size_t libcouchbase_chain_get_iov(chain_t *chain, libcouchbase_iov_t *iov,
+                                      size_t max);
+    void libcouchbase_chain_consume(libcouchbase_t instance, chain_t *chain,
+                                    size_t nbytes);
+    void libcouchbase_chain_destroy(libcouchbase_t instance, chain_t *chain);
+    void libcouchbase_segment_pool_destroy(segment_pool_t *pool);
+
+    /**
+     * The timer for a command in the timer wheel (see timeout.c). The
+     * timer locates the command through the server and the position of
+     * the command in the command log of the server (the entries in the
+     * log are moved when the log grows).
+     */
+    typedef struct op_timer_st {
+        struct op_timer_st *next;
+        struct op_timer_st *prev;
+        /** The time (in milliseconds) the command times out */
+        uint64_t expires;
+        libcouchbase_server_t *server;
+        /** The position of the command in the command log */
+        uint64_t position;
+    } op_timer_t;
+
+    /**
+     * A get coalesced with an identical get spooled earlier (see
+     * coalesce.c). The result of the earlier get is reported to the
+     * cookie as well.
+     */
+    typedef struct get_waiter_st {
+        struct get_waiter_st *next;
+        /** The cookie to pass to the callback */
+        const void *cookie;
+        /** The operation the get belongs to */
+        libcouchbase_operation_t operation;
+    } get_waiter_t;
+
+    /**
+     * The chunks of a retained packet referring to memory owned by the
+     * caller. They're not copied to the command log, so the log keeps a
+     * reference to the memory instead.
+     */
+    typedef struct {
+        /** The number of chunks */
+        size_t nchunks;
+        struct {
+            /** The offset of the chunk in the packet */
+            size_t offset;
+            const char *data;
+            size_t size;
+            /** The memory the chunk belongs to (or NULL) */
+            chain_ref_t *ref;
+        } chunks[1];
+    } cmd_log_refs_t;
+
+    /**
+     * Every command we send to a server is tracked by an entry in the
+     * command log of the server. The server sends the responses in the
+     * same order as it received the commands, so the entry for a
+     * response is always found at the head of the log (after we've
+     * purged the implicit responses for the quiet commands).
+     */
+    typedef struct {
+        /** The opaque field of the command */
+        uint32_t opaque;
+        /** The opcode of the command */
+        uint8_t opcode;
+        /** The number of times the command is sent to another server */
+        uint8_t retries;
+        /** The CMD_ flags for the command */
+        uint8_t flags;
+        /** The index of the server with the other command of the hedged read */
+        uint16_t peer_server;
+        /** The opaque field of the other command of the hedged read */
+        uint32_t peer_opaque;
+        /** The position of the other command in its command log */
+        uint64_t peer_position;
+        /** The timer for the command (NULL if it doesn't time out) */
+        op_timer_t *timer;
+        /** The cookie to pass to the callback for the command */
+        const void *cookie;
+        /** The operation (spool call) the command belongs to */
+        libcouchbase_operation_t operation;
+        /** The clock of the shared cache when the command was spooled */
+        uint32_t shared_clock;
+        /** The gets coalesced with this get */
+        get_waiter_t *waiters;
+        /** The chunks of the packet not copied to the log (or NULL) */
+        cmd_log_refs_t *refs;
+        /** The offset of the packet in the command log buffer */
+        size_t offset;
+    } cmd_log_entry_t;
+
+/** The command is the get sent to the master in a hedged read */
+#define CMD_HEDGE_MASTER 0x01
+/** The command is the get sent to the replica in a hedged read */
+#define CMD_HEDGE_REPLICA 0x02
+/**
+ * The user got the result of the command (it timed out, or the other
+ * command of a hedged read completed), or there is no result to report.
+ * The response from the server is ignored.
+ */
+#define CMD_COMPLETED 0x04
+
+#ifndef PROTOCOL_BINARY_CMD_GET_REPLICA
+#define PROTOCOL_BINARY_CMD_GET_REPLICA 0x83
+#endif
+
+    typedef struct {
+        /**
+         * A copy of the packets we've sent (or are about to send). Unless
+         * the instance is configured to retain the values, only the
+         * header, extras and key is kept for each packet (and the
+         * values sent from memory owned by the caller are referred to
+         * by the entry instead of copied).
+         */
+        buffer_t packets;
+        /** The number of bytes in the beginning of packets not in use */
+        size_t consumed;
+        /** The ring of entries (the size is always a power of two) */
+        cmd_log_entry_t *entries;
+        /** The number of slots in the ring */
+        size_t size;
+        /** The index of the oldest entry in the ring */
+        size_t head;
+        /** The number of entries in the ring */
+        size_t count;
+        /** The instance the commands belong to */
+        libcouchbase_t instance;
+        /** The event loop tracking the commands not completed yet */
+        struct shard_st *shard;
+        /** The position of the oldest entry (counting from the first
+         * command added to the log) */
+        uint64_t first;
+        /** Unused timers */
+        op_timer_t *timers;
+    } cmd_log_t;
+
+    bool libcouchbase_cmd_log_append(cmd_log_t *log, chain_t *chain,
+                                     const chain_mark_t *mark, bool body,
+                                     const void *cookie);
+    cmd_log_entry_t *libcouchbase_cmd_log_head(cmd_log_t *log);
+    cmd_log_entry_t *libcouchbase_cmd_log_tail(cmd_log_t *log);
+    cmd_log_entry_t *libcouchbase_cmd_log_entry(cmd_log_t *log, size_t idx);
+    cmd_log_entry_t *libcouchbase_cmd_log_at(cmd_log_t *log,
+                                             uint64_t position);
+    void libcouchbase_cmd_log_complete(cmd_log_t *log,
+                                       cmd_log_entry_t *entry);
+    protocol_binary_request_header *libcouchbase_cmd_log_packet(cmd_log_t *log,
+                                                                cmd_log_entry_t *entry);
+    void libcouchbase_cmd_log_write_body(cmd_log_t *log,
+                                         cmd_log_entry_t *entry,
+                                         libcouchbase_server_t *dest);
+    void libcouchbase_cmd_log_pop(cmd_log_t *log);
+    void libcouchbase_cmd_log_destroy(cmd_log_t *log);
+
+    /**
+     * A task submitted from another thread. Tasks are kept in a lock-free
+     * queue with multiple producers and a single consumer (the thread
+     * running the event loop).
+     */
+    typedef struct submit_task_st {
+        struct submit_task_st *next;
+        libcouchbase_task_t task;
+        void *arg;
+    } submit_task_t;
+
+    typedef struct {
+        /** The last task in the queue (updated by the producers) */
+        submit_task_t *head;
+        /** The next task to run (only used by the consumer) */
+        submit_task_t *tail;
+        /** Placeholder so that the queue is never empty */
+        submit_task_t stub;
+    } submit_queue_t;
+
+    /**
+     * The number of commands not completed yet for an operation (see
+     * wait.c)
+     */
+    typedef struct op_count_st {
+        /** The operation (0 if the slot is unused) */
+        libcouchbase_operation_t operation;
+        size_t count;
+    } op_count_t;
+
+    /**
+     * The state owned by one event loop: the event loop of the instance,
+     * or the one of an I/O thread (see thread.c). Each server belongs to
+     * one of them, and only the thread running the event loop touches
+     * the server (and the commands sent to it).
+     */
+    typedef struct shard_st {
+        /** The instance the event loop belongs to */
+        libcouchbase_t instance;
+        /** The I/O backend running the event loop */
+        libcouchbase_io_opt_t *io;
+        /** The opaque field of the last command spooled to its servers */
+        uint32_t seqno;
+        /** The handle for the commands spooled by the last spool call */
+        libcouchbase_operation_t operation;
+        /** The timeout for the commands spooled by the last spool call
+         * (0 to use the timeout of the instance) */
+        uint32_t op_timeout;
+        /** The timeout for the next spool call (see
+         * libcouchbase_set_operation_timeout) */
+        uint32_t next_op_timeout;
+        /** The number of commands for its servers not completed yet */
+        size_t outstanding;
+        /**
+         * The same number for each operation, in a hash table with
+         * linear probing (see wait.c)
+         */
+        struct {
+            op_count_t *slots;
+            /** The number of slots (0 or a power of two) */
+            size_t size;
+            /** The number of slots in use */
+            size_t count;
+        } op_counts;
+        /** The number of servers owned by the event loop */
+        size_t nservers;
+        /** The segments available for the output chains */
+        segment_pool_t segment_pool;
+
+        /** The packet being built (see packet.c) */
+        struct {
+            /**
+             * The beginning of the packet (offset is set to (size_t)-1
+             * when we're not building a packet)
+             */
+            chain_mark_t mark;
+            /** The chain we're writing the packet to */
+            chain_t *chain;
+            /** The command cookie for the packet */
+            const void *cookie;
+            /** Did we run out of memory while building the packet */
+            bool failed;
+        } packet;
+
+        /** The timer wheel for the command timeouts (see timeout.c) */
+        struct {
+            /** The current time of the wheel (in milliseconds) */
+            uint64_t current;
+            /** The number of timers in the wheel */
+            size_t count;
+            /** The time the I/O timer fires (if armed) */
+            uint64_t deadline;
+            void *timer;
+            bool armed;
+            /** The list heads for the slots on each level of the wheel */
+            op_timer_t slots[4][64];
+        } timeout;
+
+        /** The packets built for servers owned by other threads */
+        struct {
+            /** The chain we build the packets in */
+            chain_t chain;
+            /** The packets not passed to the owners yet */
+            struct forward_st *head;
+            struct forward_st *tail;
+        } forward;
+
+#ifdef HAVE_PTHREAD_H
+        pthread_t thread;
+        /** Is the thread running */
+        bool running;
+        /** Set (in the I/O thread) when the thread should stop */
+        bool stop;
+        /** The tasks submitted to the thread */
+        submit_queue_t queue;
+        /**
+         * The tasks parking and stopping the thread, so that we never
+         * fail to allocate them (they're not released after they run)
+         */
+        struct {
+            submit_task_t pause;
+            submit_task_t stop;
+        } tasks;
+        /** Is a wakeup written to the socket and not yet consumed */
+        int wakeup_pending;
+        /** sock[0] is watched by the event loop, sock[1] written to */
+        libcouchbase_socket_t sock[2];
+        void *event;
+#endif
+    } shard_t;
+
     typedef void (*vbucket_state_listener_t)(libcouchbase_server_t *server);
 
     struct libcouchbase_st {
@@ -80,12 +428,10 @@ extern "C" {
         char *passwd;
         /** The bucket to use */
         char *bucket;
-        /** The event base this instance is connected to */
-        struct event_base *ev_base;
-        /** The event item representing _this_ object */
-        struct event ev_event;
-        /** The curret set of flags */
-        short ev_flags;
+        /** The I/O backend used by this instance */
+        libcouchbase_io_opt_t *io;
+        /** The event watching the REST socket */
+        void *event;
 
         /** The current vbucket config handle */
         VBUCKET_CONFIG_HANDLE vbucket_config;
@@ -96,7 +442,7 @@ extern "C" {
             size_t chunk_size;
         } vbucket_stream;
 
-        evutil_socket_t sock;
+        libcouchbase_socket_t sock;
         struct addrinfo *ai;
 
         /** The number of couchbase server in the configuration */
@@ -125,12 +471,111 @@ extern "C" {
 
         struct {
             libcouchbase_tap_filter_t filter;
+            /** Should the TAP streams only contain the keys */
+            bool keys_only;
         } tap;
 
 
         libcouchbase_callback_t callbacks;
 
-        uint32_t seqno;
+        /** The event loop of the instance (see shard_t) */
+        shard_t shard;
+
+        /** Should the command log keep the body of the packets */
+        bool retain_values;
+
+        /** Should we try to send the packets from the spool functions */
+        bool eager_send;
+
+        struct {
+            /** Are identical gets spooled before a flush coalesced */
+            bool enabled;
+            /** The gets we may coalesce new gets with (see coalesce.c) */
+            struct coalesce_slot_st *slots;
+            /** Unused waiters */
+            get_waiter_t *waiters;
+        } coalesce;
+
+        /** The near cache (see near_cache.c), or NULL if not enabled */
+        struct near_cache_st *near_cache;
+
+        /**
+         * The shared cache (see shared_cache.c), or NULL if the instance
+         * isn't attached to one
+         */
+        struct shared_cache_st *shared_cache;
+
+        /**
+         * Values of this size (or bigger) is passed to the get_stream
+         * callback as they arrive (0 to disable streaming)
+         */
+        size_t stream_threshold;
+
+        /**
+         * The number of times we'll send a command to another server
+         * when the server responds with NOT_MY_VBUCKET
+         */
+        uint8_t max_retries;
+
+        /** The command timeouts (the timer wheels are in the shards) */
+        struct {
+            /** The timeout for new commands (0 to disable) */
+            uint32_t usec;
+        } timeout;
+
+        /** Send gets to the replica if the master is slow (see replica.c) */
+        struct {
+            /** The hedge timeout (0 to disable) */
+            uint32_t usec;
+            void *timer;
+            bool armed;
+            /** The sequence number when the timer was started */
+            uint32_t seqno;
+        } hedge;
+
+        /** Send the spooled commands once per iteration (see batch.c) */
+        struct {
+            bool enabled;
+            void *timer;
+            /** Is the flush timer armed */
+            bool scheduled;
+        } batch;
+
+#ifdef HAVE_PTHREAD_H
+        /** The I/O threads running the event loops (see thread.c) */
+        struct {
+            /** The number of threads (0 unless they're running) */
+            size_t count;
+            /** The event loops of the threads (the first is instance->shard) */
+            shard_t **shards;
+            /** Set (by the first thread) while the others are paused */
+            bool paused;
+            /** Incremented every time the list of servers is replaced */
+            uint64_t config;
+            /** The number of threads parked while we pause them */
+            size_t nparked;
+            /** Incremented every time the paused threads are resumed */
+            uint64_t generation;
+            pthread_mutex_t mutex;
+            pthread_cond_t cond;
+            /**
+             * Held (for writing) while the configuration is updated, so
+             * that other threads may look up the owner of a key
+             */
+            pthread_rwlock_t config_lock;
+        } threads;
+#endif
+
+        struct {
+            /** The operations libcouchbase_wait is waiting for */
+            const libcouchbase_operation_t *operations;
+            /** The number of operations (0 unless we're waiting) */
+            size_t noperations;
+            /** The timer for the timeout (created on demand) */
+            void *timer;
+            /** Did the timer fire */
+            bool timedout;
+        } wait;
         bool execute;
         const void *cookie;
     };
@@ -144,74 +589,275 @@ extern "C" {
         /** The servers port */
         char *port;
         /** The socket to the server */
-        evutil_socket_t sock;
+        libcouchbase_socket_t sock;
         /** The address information for this server (the one to release) */
         struct addrinfo *root_ai;
         /** The address information for this server (the one we're trying) */
         struct addrinfo *curr_ai;
         /** The output buffer for this server */
-        buffer_t output;
-        /** The sent buffer for this server so that we can resend the
+        chain_t output;
+        /** The commands sent to this server so that we can resend the
          * command to another server if the bucket is moved... */
-        buffer_t cmd_log;
+        cmd_log_t cmd_log;
         /**
          * The pending buffer where we write data until we're in a
          * connected state;
          */
-        buffer_t pending;
-        /** offset to the beginning of the packet being built */
-        size_t current_packet;
+        chain_t pending;
         /** The input buffer for this server */
         buffer_t input;
+        /** The value currently being streamed to the user */
+        struct {
+            /** The number of bytes left of the value (0 if not streaming) */
+            size_t remaining;
+            /** The number of bytes passed to the user so far */
+            size_t offset;
+            /** The total size of the value */
+            size_t total;
+            uint32_t flags;
+            uint64_t cas;
+            /** Should the value be passed to the user (see replica.c) */
+            bool deliver;
+        } stream;
         /** The SASL object used for this server */
         sasl_conn_t *sasl_conn;
         /** The event item representing _this_ object */
-        struct event ev_event;
+        void *event;
         /** The curret set of flags */
         short ev_flags;
         /** Is this server in a connected state (done with sasl auth) */
         bool connected;
+        /** Should the packets be sent when the batch is flushed */
+        bool flush_pending;
+        /** Should a NOOP follow the quiet commands in the output */
+        bool fence_pending;
+        /** Did the oldest command time out (see timeout.c) */
+        bool hung;
+        /**
+         * Incremented when we write the output, or spool a command
+         * other than a plain get (gets are only coalesced with gets
+         * spooled in the same generation)
+         */
+        uint64_t coalesce_generation;
         /** The current event handler */
-        EVENT_HANDLER ev_handler;
+        libcouchbase_io_handler_t ev_handler;
         /* Pointer back to the instance */
         libcouchbase_t instance;
+        /** The event loop owning the server */
+        shard_t *shard;
     };
 
     void libcouchbase_server_purge_implicit_responses(libcouchbase_server_t *c,
                                                       uint32_t seqno);
+    /**
+     * Request a NOOP after the quiet commands spooled for a server. The
+     * server only responds to the quiet commands that fail, and the
+     * other results are reported when we receive the response to the
+     * NOOP. The NOOP isn't added to the output until we start writing
+     * it to the server, so all of the quiet commands spooled until then
+     * share a single NOOP.
+     *
+     * @param server the server the quiet command was sent to
+     */
+    void libcouchbase_server_fence(libcouchbase_server_t *server);
+    /**
+     * Add the NOOP requested by libcouchbase_server_fence (if any) to
+     * the output for the server.
+     *
+     * @param server the server about to write its output
+     */
+    void libcouchbase_server_write_fence(libcouchbase_server_t *server);
+    /**
+     * Start sending the quiet commands spooled by a multi-key call.
+     *
+     * @param instance the instance the commands were spooled on
+     * @param server the server the commands were sent to, or NULL if
+     *               they may have been sent to any of the servers
+     */
+    void libcouchbase_send_fenced(libcouchbase_t instance,
+                                  libcouchbase_server_t *server);
     void libcouchbase_server_destroy(libcouchbase_server_t *server);
+    /**
+     * Fail the command at the head of the command log by passing a
+     * response with the given status to the response handler.
+     */
+    void libcouchbase_server_fail_command(libcouchbase_server_t *server,
+                                          uint16_t status);
+    /**
+     * Close the connection to a server that stopped responding (or that
+     * we can't read from), fail all of the commands sent to it and
+     * connect again (for the commands spooled from now on).
+     *
+     * @param server the server to shut down
+     * @param status the status to fail the commands with
+     */
+    void libcouchbase_server_shutdown(libcouchbase_server_t *server,
+                                      uint16_t status);
+    /**
+     * Remove the commands that timed out before we managed to connect to
+     * a server from its command log (and the packets from the output
+     * waiting for the connection), so they aren't sent once we connect.
+     *
+     * @param server the server that isn't connected
+     */
+    void libcouchbase_server_drop_expired(libcouchbase_server_t *server);
+    /**
+     * Send the command at the head of the command log to another server
+     * (with a new sequence number). The command isn't removed from the
+     * log of the server.
+     *
+     * @param server the server with the command
+     * @param dest the server to send the command to
+     * @param retries the number of times the command has been retried
+     * @return false if the complete command isn't in the log (or we
+     *         ran out of memory, or the packet filter dropped it)
+     */
+    bool libcouchbase_server_requeue_command(libcouchbase_server_t *server,
+                                             libcouchbase_server_t *dest,
+                                             uint8_t retries);
+    /**
+     * Send the command at the head of the command log to another server,
+     * taking the packet from the chain of packets not written to the
+     * socket yet (so we don't need a copy of the value in the log).
+     *
+     * @param server the server with the command
+     * @param unsent the chain starting with the packet for the command
+     * @param dest the server to send the command to
+     * @return false if we ran out of memory (or the packet filter
+     *         dropped it)
+     */
+    bool libcouchbase_server_requeue_unsent(libcouchbase_server_t *server,
+                                            chain_t *unsent,
+                                            libcouchbase_server_t *dest);
+    /**
+     * Try to send the command at the head of the command log to the
+     * server hosting the vbucket after the server responded with
+     * NOT_MY_VBUCKET.
+     *
+     * @return true if the command was sent to another server
+     */
+    bool libcouchbase_server_retry_command(libcouchbase_server_t *server);
+
+    /**
+     * Start the hedge timer (if enabled) for the gets just spooled
+     */
+    void libcouchbase_hedge_arm(libcouchbase_t instance);
+    /**
+     * Check if we should report the result of a command to the user (it
+     * may be part of a hedged read)
+     *
+     * @param server the server the command was sent to
+     * @param entry the command log entry for the command
+     * @param success if the command succeeded
+     * @return true if the result should be passed to the user
+     */
+    bool libcouchbase_hedge_resolve(libcouchbase_server_t *server,
+                                    cmd_log_entry_t *entry,
+                                    bool success);
+    /**
+     * Release a command from a hedged read because it can't be
+     * completed (the server left the cluster or doesn't own the vbucket)
+     *
+     * @param server the server the command was sent to
+     * @param entry the command log entry for the command
+     * @return true if the other command reports the result to the user
+     *         (and this command should be dropped)
+     */
+    bool libcouchbase_hedge_release(libcouchbase_server_t *server,
+                                    cmd_log_entry_t *entry);
+    /**
+     * Let the masters report the result of all hedged reads. The
+     * commands refer to each other through the server index, so this
+     * must be called before the list of servers change.
+     */
+    void libcouchbase_hedge_reset(libcouchbase_t instance);
+
+    void libcouchbase_timeout_init(shard_t *shard);
+    void libcouchbase_timeout_destroy(shard_t *shard);
+    /**
+     * Start tracking the command just added to the command log of the
+     * server (start the timer if the command may time out)
+     */
+    void libcouchbase_timeout_start(libcouchbase_server_t *server);
+    /**
+     * Remove the timer from the wheel (the command got its response)
+     */
+    void libcouchbase_timeout_cancel(op_timer_t *timer);
+    /**
+     * Move the timer from a command to the same command sent to another
+     * server (the command keeps its deadline)
+     */
+    void libcouchbase_timeout_move(cmd_log_entry_t *from,
+                                   libcouchbase_server_t *server,
+                                   cmd_log_entry_t *to);
+    /**
+     * Update the timers for the commands of a server moved to another
+     * location in the list of servers
+     */
+    void libcouchbase_timeout_server_moved(libcouchbase_server_t *server);
+    /**
+     * Move the timers for the commands of a server to the wheel of the
+     * event loop now owning the server
+     * @param server the server (already updated with its new owner)
+     * @param from the event loop owning the server before
+     */
+    void libcouchbase_timeout_shard_moved(libcouchbase_server_t *server,
+                                          shard_t *from);
+
+    /**
+     * Stop the event loop if we're in libcouchbase_execute and all
+     * of the commands are completed (or in libcouchbase_wait and all
+     * of the commands we're waiting for are completed)
+     */
+    void libcouchbase_maybe_breakout(libcouchbase_t instance);
+
+    /**
+     * Get the current time from a monotonic clock in milliseconds
+     */
+    uint64_t libcouchbase_get_msec(void);
     void libcouchbase_server_connected(libcouchbase_server_t *server);
 
-    void libcouchbase_server_initialize(libcouchbase_server_t *server,
+    /**
+     * Initialize a server and start connecting to it
+     * @param server the server to initialize
+     * @param servernum the index of the server in the configuration
+     * @return false if we failed to create the event for the socket (the
+     *         server isn't connected, and it is replaced on the next
+     *         configuration update)
+     */
+    bool libcouchbase_server_initialize(libcouchbase_server_t *server,
                                         int servernum);
 
 
 
     void libcouchbase_server_buffer_start_packet(libcouchbase_server_t *c,
-                                                 buffer_t *buff,
+                                                 chain_t *buff,
                                                  const void *data,
                                                  size_t size);
 
     void libcouchbase_server_buffer_write_packet(libcouchbase_server_t *c,
-                                                 buffer_t *buff,
+                                                 chain_t *buff,
                                                  const void *data,
                                                  size_t size);
 
     void libcouchbase_server_buffer_end_packet(libcouchbase_server_t *c,
-                                               buffer_t *buff);
+                                               chain_t *buff);
 
     void libcouchbase_server_buffer_complete_packet(libcouchbase_server_t *c,
-                                                    buffer_t *buff,
+                                                    chain_t *buff,
                                                     const void *data,
                                                     size_t size);
 
     /**
      * Initiate a new packet to be sent
      * @param c the server connection to send it to
+     * @param command_cookie the cookie to pass to the callback for the
+     *                       command
      * @param data pointer to data to include in the packet
      * @param size the size of the data to include
      */
     void libcouchbase_server_start_packet(libcouchbase_server_t *c,
+                                          const void *command_cookie,
                                           const void *data,
                                           size_t size);
     /**
@@ -224,38 +870,369 @@ extern "C" {
                                           const void *data,
                                           size_t size);
     /**
-     * Mark this packet complete
+     * Write data owned by the caller to the current packet. The data is
+     * sent directly from the callers memory if possible (otherwise it is
+     * copied), and the release function is called when the library no
+     * longer needs the memory.
+     * @param c the server connection to send it to
+     * @param iov the chunks of memory to include in the packet
+     * @param niov the number of elements in iov
+     * @param release the function to call when the memory may be released
+     * @param cookie the cookie to pass to the release function
+     */
+    void libcouchbase_server_write_packet_iov(libcouchbase_server_t *c,
+                                              const libcouchbase_iov_t *iov,
+                                              size_t niov,
+                                              libcouchbase_release_t release,
+                                              const void *cookie);
+    /**
+     * Write a chunk of memory owned by the caller to the current packet
+     * (the memory is copied if the user installed a packet filter)
+     * @param c the server connection to send it to
+     * @param data the chunk of memory to include in the packet
+     * @param size the number of bytes in the chunk
+     * @param ref the memory the chunk belongs to (or NULL)
+     */
+    void libcouchbase_server_write_packet_ref(libcouchbase_server_t *c,
+                                              const void *data,
+                                              size_t size,
+                                              chain_ref_t *ref);
+    /**
+     * Mark this packet complete. The packet is removed from the output
+     * if we failed to build it.
+     * @param c the server connection to send it to
+     * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
      */
-    void libcouchbase_server_end_packet(libcouchbase_server_t *c);
+    libcouchbase_error_t libcouchbase_server_end_packet(libcouchbase_server_t *c);
 
     /**
      * Create a complete packet (to avoid calling start + end)
      * @param c the server connection to send it to
+     * @param command_cookie the cookie to pass to the callback for the
+     *                       command
      * @param data pointer to data to include in the packet
      * @param size the size of the data to include
+     * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
      */
-    void libcouchbase_server_complete_packet(libcouchbase_server_t *c,
-                                             const void *data,
-                                             size_t size);
+    libcouchbase_error_t libcouchbase_server_complete_packet(libcouchbase_server_t *c,
+                                                             const void *command_cookie,
+                                                             const void *data,
+                                                             size_t size);
     /**
      * Start sending packets
      * @param server the server to start send data to
      */
     void libcouchbase_server_send_packets(libcouchbase_server_t *server);
 
+    /**
+     * Send the packets for the server when the current batch is
+     * flushed (at the end of the current iteration of the event loop)
+     * @param server the server with packets to send
+     */
+    void libcouchbase_batch_add_server(libcouchbase_server_t *server);
+    void libcouchbase_batch_destroy(libcouchbase_t instance);
+
+    /**
+     * Start a new operation. All of the commands spooled until the
+     * next call belong to the new operation.
+     * @param instance the instance to spool the commands for
+     */
+    void libcouchbase_operation_begin(libcouchbase_t instance);
+
+    /**
+     * Count a command in the commands not completed for its operation
+     * @param shard the event loop owning the server the command is for
+     * @param operation the operation the command belongs to
+     * @return false if we failed to allocate memory
+     */
+    bool libcouchbase_operation_track(shard_t *shard,
+                                      libcouchbase_operation_t operation);
+
+    /**
+     * Remove a command from the commands not completed for its operation
+     * @param shard the event loop the command is counted in
+     * @param operation the operation the command belongs to
+     */
+    void libcouchbase_operation_untrack(shard_t *shard,
+                                        libcouchbase_operation_t operation);
+    void libcouchbase_operation_counts_destroy(shard_t *shard);
+
+    /**
+     * Get the number of commands not completed for the operations
+     * libcouchbase_wait is waiting for
+     * @param instance the instance to check
+     * @return the number of commands (0 if we're not waiting)
+     */
+    size_t libcouchbase_wait_remaining(libcouchbase_t instance);
+    void libcouchbase_wait_destroy(libcouchbase_t instance);
+
+    /**
+     * Try to coalesce a get with an identical get spooled earlier in
+     * the current generation of the server.
+     * @param server the server the get would be sent to
+     * @param command_cookie the cookie for the new get
+     * @param vb the vbucket for the key
+     * @param key the key to get
+     * @param nkey the number of bytes in the key
+     * @return true if the get is coalesced (and shouldn't be sent)
+     */
+    bool libcouchbase_coalesce_get(libcouchbase_server_t *server,
+                                   const void *command_cookie,
+                                   uint16_t vb,
+                                   const void *key, size_t nkey);
+    /**
+     * Remember the get just spooled to the server (the last command in
+     * its command log), so that identical gets may be coalesced with it.
+     * @param server the server the get was spooled to
+     */
+    void libcouchbase_coalesce_add(libcouchbase_server_t *server);
+    /**
+     * Stop coalescing gets with the gets spooled to the server so far
+     * (the output is written, or the value may change)
+     */
+    void libcouchbase_coalesce_invalidate(libcouchbase_server_t *server);
+    void libcouchbase_coalesce_destroy(libcouchbase_t instance);
+    /**
+     * Release the gets coalesced with a command without reporting
+     * anything to them.
+     */
+    void libcouchbase_release_waiters(libcouchbase_t instance,
+                                      cmd_log_entry_t *entry);
+    /**
+     * Report the result of a get to the get callback for the command
+     * and all of the gets coalesced with it.
+     */
+    void libcouchbase_get_callback(libcouchbase_t instance,
+                                   cmd_log_entry_t *entry,
+                                   libcouchbase_error_t error,
+                                   const void *key, size_t nkey,
+                                   const void *bytes, size_t nbytes,
+                                   uint32_t flags, uint64_t cas);
+    /**
+     * Pass the next chunk of a streamed value to the get_stream
+     * callback for the command and all of the gets coalesced with it.
+     */
+    void libcouchbase_get_stream_callback(libcouchbase_t instance,
+                                          cmd_log_entry_t *entry,
+                                          const void *key, size_t nkey,
+                                          const void *bytes, size_t nbytes,
+                                          size_t offset, size_t total,
+                                          uint32_t flags, uint64_t cas);
+
+    /**
+     * Report the value of a key from the near cache to the get callback
+     * @param instance the instance to get the key for
+     * @param command_cookie the cookie for the get
+     * @param vb the vbucket for the key
+     * @param key the key to get
+     * @param nkey the number of bytes in the key
+     * @return true if the key was found (and the callback called)
+     */
+    bool libcouchbase_near_cache_get(libcouchbase_t instance,
+                                     const void *command_cookie,
+                                     uint16_t vb,
+                                     const void *key, size_t nkey);
+    /**
+     * Add the value returned by a get to the near cache (unless the
+     * key may have been invalidated after the get was sent)
+     * @param instance the instance the get was sent from
+     * @param opaque the opaque field of the get
+     */
+    void libcouchbase_near_cache_store(libcouchbase_t instance,
+                                       uint32_t opaque,
+                                       uint16_t vb,
+                                       const void *key, size_t nkey,
+                                       const void *bytes, size_t nbytes,
+                                       uint32_t flags, uint64_t cas);
+    /**
+     * Drop a key from the near cache (the value changed, or we're
+     * sending a command that may change it)
+     */
+    void libcouchbase_near_cache_invalidate(libcouchbase_t instance,
+                                            uint16_t vb,
+                                            const void *key, size_t nkey);
+    /**
+     * Drop all of the keys from the near cache
+     */
+    void libcouchbase_near_cache_flush(libcouchbase_t instance);
+    /**
+     * Mark a vbucket as covered by the TAP stream (the near cache is
+     * only used for the keys in the covered vbuckets)
+     */
+    void libcouchbase_near_cache_cover(libcouchbase_t instance, uint16_t vb);
+    /**
+     * Update the near cache for a new vbucket map.
+     * @param instance the instance with the new map
+     * @param old_map the previous vbucket map
+     * @param old_nvbuckets the number of vbuckets in old_map
+     * @param origin the index in the previous list of servers for each
+     *               server in the new list ((size_t)-1 if it's new)
+     */
+    void libcouchbase_near_cache_config_changed(libcouchbase_t instance,
+                                                const uint16_t *old_map,
+                                                uint16_t old_nvbuckets,
+                                                const size_t *origin);
+    void libcouchbase_near_cache_destroy(libcouchbase_t instance);
+
+    /**
+     * Report the value of a key from the shared cache to the get callback
+     * @return true if the key was found (and the callback called)
+     */
+    bool libcouchbase_shared_cache_get(libcouchbase_t instance,
+                                       const void *command_cookie,
+                                       uint16_t vb,
+                                       const void *key, size_t nkey);
+    /**
+     * Add the value returned by a get to the shared cache (unless the
+     * key may have been invalidated after the get was sent)
+     * @param instance the instance the get was sent from
+     * @param sent the clock of the shared cache when the get was spooled
+     */
+    void libcouchbase_shared_cache_store(libcouchbase_t instance,
+                                         uint32_t sent,
+                                         uint16_t vb,
+                                         const void *key, size_t nkey,
+                                         const void *bytes, size_t nbytes,
+                                         uint32_t flags, uint64_t cas);
+    /**
+     * Get the current clock of the shared cache (0 if not attached)
+     */
+    uint32_t libcouchbase_shared_cache_clock(libcouchbase_t instance);
+    void libcouchbase_shared_cache_invalidate(libcouchbase_t instance,
+                                              uint16_t vb,
+                                              const void *key, size_t nkey);
+    void libcouchbase_shared_cache_flush(libcouchbase_t instance);
+    /**
+     * Mark a vbucket as covered by the TAP stream (only used by the
+     * process invalidating the shared cache)
+     */
+    void libcouchbase_shared_cache_cover(libcouchbase_t instance, uint16_t vb);
+    /**
+     * Update the shared cache for a new vbucket map (see
+     * libcouchbase_near_cache_config_changed)
+     */
+    void libcouchbase_shared_cache_config_changed(libcouchbase_t instance,
+                                                  const uint16_t *old_map,
+                                                  uint16_t old_nvbuckets,
+                                                  const size_t *origin);
+    void libcouchbase_shared_cache_destroy(libcouchbase_t instance);
+    /**
+     * Start a keys-only TAP stream on all of the servers of the instance
+     * (used to invalidate the near cache)
+     */
+    void libcouchbase_tap_keys(libcouchbase_t instance);
+
+    /**
+     * Check if the server got any data to send
+     * @param server the server to check
+     * @return true if there is data waiting to be sent
+     */
+    bool libcouchbase_server_has_output(libcouchbase_server_t *server);
+
 
 
 
     void libcouchbase_server_update_event(libcouchbase_server_t *c, short flags,
-                                          EVENT_HANDLER handler);
-    void libcouchbase_server_event_handler(evutil_socket_t sock, short which, void *arg);
+                                          libcouchbase_io_handler_t handler);
+    void libcouchbase_server_event_handler(libcouchbase_socket_t sock, short which, void *arg);
+    /**
+     * Start sending the packets in the output buffer of a connected
+     * server. With eager sending enabled the data is written right away
+     * if the server isn't waiting for the socket to become writable, and
+     * we only ask the event loop to tell us when the socket becomes
+     * writable if we couldn't send all of the data.
+     */
+    void libcouchbase_server_start_send(libcouchbase_server_t *c);
 
     void libcouchbase_initialize_packet_handlers(libcouchbase_t instance);
 
+    /**
+     * Report the failure of a command we never got to log (for instance
+     * a packet forwarded to another thread) to the callback for its
+     * opcode.
+     *
+     * @param instance the instance the command was spooled on
+     * @param cookie the command cookie
+     * @param opcode the opcode of the command
+     * @param key the key of the command
+     * @param nkey the number of bytes in the key
+     * @param error the error to report
+     */
+    void libcouchbase_fail_request(libcouchbase_t instance,
+                                   const void *cookie,
+                                   uint8_t opcode,
+                                   const void *key, size_t nkey,
+                                   libcouchbase_error_t error);
+    bool libcouchbase_default_packet_filter(libcouchbase_t instance,
+                                            const void *data);
+
     void libcouchbase_ensure_vbucket_config(libcouchbase_t instance);
 
     int libcouchbase_base64_encode(const char *src, char *dst, size_t sz);
 
+    int libcouchbase_make_socket_nonblocking(libcouchbase_socket_t sock);
+
+    /**
+     * Get the event loop of the calling thread (the event loop of the
+     * instance unless we're called from one of its I/O threads)
+     */
+    shard_t *libcouchbase_current_shard(libcouchbase_t instance);
+    /**
+     * Pick the event loop to own a new server (the one owning the
+     * fewest servers)
+     */
+    shard_t *libcouchbase_shard_for_new_server(libcouchbase_t instance);
+    /**
+     * May the calling thread touch the server (it's running the event
+     * loop owning the server, or the other threads are paused)
+     */
+    bool libcouchbase_server_is_local(libcouchbase_server_t *server);
+    /**
+     * Get the opaque field for a new command for the server. Commands
+     * built on another thread get 0, and the owner sets the opaque field
+     * when it adds them to the command log.
+     */
+    uint32_t libcouchbase_server_next_seqno(libcouchbase_server_t *server);
+    /**
+     * Pass the packet built in the forward chain of the calling thread
+     * to the thread owning the server. The packet is sent the next time
+     * we call libcouchbase_forward_flush.
+     *
+     * @param server the server the packet is built for
+     * @param command_cookie the cookie for the command
+     * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
+     */
+    libcouchbase_error_t libcouchbase_forward_packet(libcouchbase_server_t *server,
+                                                     const void *command_cookie);
+    /**
+     * Let a NOOP follow the packet just passed to
+     * libcouchbase_forward_packet (see libcouchbase_server_fence)
+     */
+    void libcouchbase_forward_fence(libcouchbase_t instance);
+    /**
+     * Set the number of times the command just passed to
+     * libcouchbase_forward_packet has been retried
+     */
+    void libcouchbase_forward_retries(libcouchbase_t instance,
+                                      uint8_t retries);
+    /**
+     * Submit the packets built by the calling thread for servers owned
+     * by other threads to their owners
+     */
+    void libcouchbase_forward_flush(libcouchbase_t instance);
+    /**
+     * Park the other I/O threads so that the calling thread (running
+     * the event loop of the instance) may update the list of servers.
+     */
+    void libcouchbase_threads_pause(libcouchbase_t instance);
+    void libcouchbase_threads_resume(libcouchbase_t instance);
+    /**
+     * Are the servers owned by more than one I/O thread (the caches
+     * and the state shared by the spool functions are only touched by
+     * a single thread)
+     */
+    bool libcouchbase_threads_shared(libcouchbase_t instance);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,552 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains an I/O backend using edge-triggered epoll.
+ *
+ * Each socket is added to the epoll set once (for both read and write)
+ * when it is first watched, so changing the set of events we're
+ * interested in never needs a system call. The kernel only tells us
+ * when a socket _becomes_ ready, so we remember the readiness until a
+ * recv or send through this backend tells us that the socket would
+ * block. An event is called again (without waiting in epoll) as long as
+ * it's ready for something it watches.
+ */
+#include "internal.h"
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <time.h>
+
+/** The maximum number of chunks we'll pass to the kernel in one call */
+#define MAX_IOV 64
+
+/** The maximum number of events we'll get from the kernel in one call */
+#define MAX_EVENTS 64
+
+struct epoll_io_event {
+    libcouchbase_socket_t sock;
+    /** The events we're watching (0 if we're not watching the socket) */
+    short flags;
+    /** The events the socket is ready for */
+    short ready;
+    /** Is the socket added to the epoll set */
+    bool added;
+    /** Is the event destroyed (it's released at the end of the loop) */
+    bool destroyed;
+    void *cb_data;
+    libcouchbase_io_handler_t handler;
+    struct epoll_io_event *next;
+};
+
+struct epoll_io_timer {
+    /** Is the timer active */
+    bool active;
+    /** Is the timer destroyed (it's released at the end of the loop) */
+    bool destroyed;
+    /** When the timer expires (in usec on the monotonic clock) */
+    uint64_t expiry;
+    void *cb_data;
+    libcouchbase_io_handler_t handler;
+    struct epoll_io_timer *next;
+};
+
+struct epoll_io_cookie {
+    int epfd;
+    bool stop;
+    /** All of the events created */
+    struct epoll_io_event *events;
+    /** All of the timers created */
+    struct epoll_io_timer *timers;
+    /** A map from the socket to the event added for it */
+    struct epoll_io_event **sockets;
+    size_t nsockets;
+};
+
+static uint64_t get_monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static struct epoll_io_event *get_socket_event(libcouchbase_io_opt_t *iops,
+                                               libcouchbase_socket_t sock)
+{
+    struct epoll_io_cookie *ep = iops->cookie;
+    if (sock < 0 || (size_t)sock >= ep->nsockets) {
+        return NULL;
+    }
+    return ep->sockets[sock];
+}
+
+/**
+ * The socket reported that it would block, so we need to wait for the
+ * kernel to tell us that it is ready again
+ */
+static void clear_ready(libcouchbase_io_opt_t *iops,
+                        libcouchbase_socket_t sock,
+                        short which)
+{
+    struct epoll_io_event *ev = get_socket_event(iops, sock);
+    if (ev != NULL && (iops->error == EWOULDBLOCK || iops->error == EAGAIN)) {
+        ev->ready &= (short)~which;
+    }
+}
+
+static libcouchbase_socket_t epoll_io_socket(libcouchbase_io_opt_t *iops,
+                                             int domain,
+                                             int type,
+                                             int protocol)
+{
+    libcouchbase_socket_t sock = socket(domain, type, protocol);
+    if (sock == INVALID_SOCKET) {
+        iops->error = errno;
+    } else if (libcouchbase_make_socket_nonblocking(sock) != 0) {
+        iops->error = errno;
+        close(sock);
+        sock = INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+static int epoll_io_connect(libcouchbase_io_opt_t *iops,
+                            libcouchbase_socket_t sock,
+                            const struct sockaddr *name,
+                            unsigned int namelen)
+{
+    int ret = connect(sock, name, (socklen_t)namelen);
+    if (ret == -1) {
+        iops->error = errno;
+    }
+    return ret;
+}
+
+static libcouchbase_ssize_t epoll_io_recv(libcouchbase_io_opt_t *iops,
+                                          libcouchbase_socket_t sock,
+                                          void *buffer,
+                                          size_t len,
+                                          int flags)
+{
+    libcouchbase_ssize_t ret = recv(sock, buffer, len, flags);
+    if (ret < 0) {
+        iops->error = errno;
+        clear_ready(iops, sock, LIBCOUCHBASE_READ_EVENT);
+    }
+    return ret;
+}
+
+static libcouchbase_ssize_t epoll_io_send(libcouchbase_io_opt_t *iops,
+                                          libcouchbase_socket_t sock,
+                                          const void *msg,
+                                          size_t len,
+                                          int flags)
+{
+    libcouchbase_ssize_t ret = send(sock, msg, len, flags);
+    if (ret < 0) {
+        iops->error = errno;
+        clear_ready(iops, sock, LIBCOUCHBASE_WRITE_EVENT);
+    }
+    return ret;
+}
+
+static libcouchbase_ssize_t epoll_io_sendv(libcouchbase_io_opt_t *iops,
+                                           libcouchbase_socket_t sock,
+                                           const libcouchbase_iov_t *iov,
+                                           size_t niov)
+{
+    struct iovec vec[MAX_IOV];
+    struct msghdr msg;
+    libcouchbase_ssize_t ret;
+    size_t ii;
+
+    if (niov > MAX_IOV) {
+        niov = MAX_IOV;
+    }
+    for (ii = 0; ii < niov; ++ii) {
+        vec[ii].iov_base = (void*)iov[ii].iov_base;
+        vec[ii].iov_len = iov[ii].iov_len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = niov;
+    ret = sendmsg(sock, &msg, 0);
+    if (ret < 0) {
+        iops->error = errno;
+        clear_ready(iops, sock, LIBCOUCHBASE_WRITE_EVENT);
+    }
+    return ret;
+}
+
+static void epoll_io_close(libcouchbase_io_opt_t *iops,
+                           libcouchbase_socket_t sock)
+{
+    (void)iops;
+    close(sock);
+}
+
+static void *epoll_io_create_event(libcouchbase_io_opt_t *iops)
+{
+    struct epoll_io_cookie *ep = iops->cookie;
+    struct epoll_io_event *ret = calloc(1, sizeof(*ret));
+    if (ret != NULL) {
+        ret->sock = INVALID_SOCKET;
+        ret->next = ep->events;
+        ep->events = ret;
+    }
+    return ret;
+}
+
+static void epoll_io_delete_event(libcouchbase_io_opt_t *iops,
+                                  libcouchbase_socket_t sock,
+                                  void *event)
+{
+    struct epoll_io_cookie *ep = iops->cookie;
+    struct epoll_io_event *ev = event;
+    (void)sock;
+
+    if (ev->added) {
+        /* The socket may already be closed, so ignore errors */
+        struct epoll_event ee;
+        memset(&ee, 0, sizeof(ee));
+        (void)epoll_ctl(ep->epfd, EPOLL_CTL_DEL, ev->sock, &ee);
+        if (get_socket_event(iops, ev->sock) == ev) {
+            ep->sockets[ev->sock] = NULL;
+        }
+        ev->added = false;
+    }
+    ev->sock = INVALID_SOCKET;
+    ev->flags = 0;
+    ev->ready = 0;
+}
+
+static int epoll_io_update_event(libcouchbase_io_opt_t *iops,
+                                 libcouchbase_socket_t sock,
+                                 void *event,
+                                 short flags,
+                                 void *cb_data,
+                                 libcouchbase_io_handler_t handler)
+{
+    struct epoll_io_cookie *ep = iops->cookie;
+    struct epoll_io_event *ev = event;
+
+    if (ev->added && ev->sock != sock) {
+        epoll_io_delete_event(iops, ev->sock, ev);
+    }
+
+    if (!ev->added) {
+        struct epoll_event ee;
+
+        if ((size_t)sock >= ep->nsockets) {
+            size_t num = ep->nsockets ? ep->nsockets : 64;
+            struct epoll_io_event **sockets;
+            while (num <= (size_t)sock) {
+                num <<= 1;
+            }
+            sockets = realloc(ep->sockets, num * sizeof(*sockets));
+            if (sockets == NULL) {
+                return -1;
+            }
+            memset(sockets + ep->nsockets, 0,
+                   (num - ep->nsockets) * sizeof(*sockets));
+            ep->sockets = sockets;
+            ep->nsockets = num;
+        }
+
+        memset(&ee, 0, sizeof(ee));
+        ee.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ee.data.ptr = ev;
+        if (epoll_ctl(ep->epfd, EPOLL_CTL_ADD, sock, &ee) == -1) {
+            iops->error = errno;
+            return -1;
+        }
+        ep->sockets[sock] = ev;
+        ev->sock = sock;
+        ev->ready = 0;
+        ev->added = true;
+    }
+
+    ev->flags = flags;
+    ev->cb_data = cb_data;
+    ev->handler = handler;
+    return 0;
+}
+
+static void epoll_io_destroy_event(libcouchbase_io_opt_t *iops,
+                                   void *event)
+{
+    struct epoll_io_event *ev = event;
+    epoll_io_delete_event(iops, ev->sock, ev);
+    ev->destroyed = true;
+}
+
+static void *epoll_io_create_timer(libcouchbase_io_opt_t *iops)
+{
+    struct epoll_io_cookie *ep = iops->cookie;
+    struct epoll_io_timer *ret = calloc(1, sizeof(*ret));
+    if (ret != NULL) {
+        ret->next = ep->timers;
+        ep->timers = ret;
+    }
+    return ret;
+}
+
+static int epoll_io_update_timer(libcouchbase_io_opt_t *iops,
+                                 void *timer,
+                                 uint32_t usec,
+                                 void *cb_data,
+                                 libcouchbase_io_handler_t handler)
+{
+    struct epoll_io_timer *tm = timer;
+    (void)iops;
+
+    tm->active = true;
+    tm->expiry = get_monotonic_usec() + usec;
+    tm->cb_data = cb_data;
+    tm->handler = handler;
+    return 0;
+}
+
+static void epoll_io_delete_timer(libcouchbase_io_opt_t *iops,
+                                  void *timer)
+{
+    struct epoll_io_timer *tm = timer;
+    (void)iops;
+    tm->active = false;
+}
+
+static void epoll_io_destroy_timer(libcouchbase_io_opt_t *iops,
+                                   void *timer)
+{
+    struct epoll_io_timer *tm = timer;
+    (void)iops;
+    tm->active = false;
+    tm->destroyed = true;
+}
+
+/**
+ * Release the events and timers destroyed while we were running the
+ * handlers
+ */
+static void purge_destroyed(struct epoll_io_cookie *ep)
+{
+    struct epoll_io_event **ev = &ep->events;
+    struct epoll_io_timer **tm = &ep->timers;
+
+    while (*ev != NULL) {
+        if ((*ev)->destroyed) {
+            struct epoll_io_event *next = (*ev)->next;
+            free(*ev);
+            *ev = next;
+        } else {
+            ev = &(*ev)->next;
+        }
+    }
+
+    while (*tm != NULL) {
+        if ((*tm)->destroyed) {
+            struct epoll_io_timer *next = (*tm)->next;
+            free(*tm);
+            *tm = next;
+        } else {
+            tm = &(*tm)->next;
+        }
+    }
+}
+
+/**
+ * Get the number of milliseconds to wait in epoll
+ * @return the timeout, or -2 if there is nothing to wait for
+ */
+static int get_timeout(struct epoll_io_cookie *ep)
+{
+    struct epoll_io_event *ev;
+    struct epoll_io_timer *tm;
+    bool watching = false;
+    uint64_t next = UINT64_MAX;
+    uint64_t now;
+
+    for (ev = ep->events; ev != NULL; ev = ev->next) {
+        if (ev->ready & ev->flags) {
+            return 0;
+        }
+        if (ev->flags != 0) {
+            watching = true;
+        }
+    }
+
+    for (tm = ep->timers; tm != NULL; tm = tm->next) {
+        if (tm->active && tm->expiry < next) {
+            next = tm->expiry;
+        }
+    }
+
+    if (next == UINT64_MAX) {
+        return watching ? -1 : -2;
+    }
+
+    now = get_monotonic_usec();
+    if (next <= now) {
+        return 0;
+    }
+    /* Round up so that we don't wake up before the timer expires */
+    return (int)((next - now + 999) / 1000);
+}
+
+static void run_timers(struct epoll_io_cookie *ep)
+{
+    struct epoll_io_timer *tm;
+    uint64_t now = get_monotonic_usec();
+
+    for (tm = ep->timers; tm != NULL && !ep->stop; tm = tm->next) {
+        if (tm->active && tm->expiry <= now) {
+            tm->active = false;
+            tm->handler(INVALID_SOCKET, 0, tm->cb_data);
+        }
+    }
+}
+
+static void run_events(struct epoll_io_cookie *ep)
+{
+    struct epoll_io_event *ev;
+
+    for (ev = ep->events; ev != NULL && !ep->stop; ev = ev->next) {
+        short which = ev->ready & ev->flags;
+        if (which != 0) {
+            ev->handler(ev->sock, which, ev->cb_data);
+        }
+    }
+}
+
+static void epoll_io_run_event_loop(libcouchbase_io_opt_t *iops)
+{
+    struct epoll_io_cookie *ep = iops->cookie;
+    struct epoll_event events[MAX_EVENTS];
+
+    ep->stop = false;
+    while (!ep->stop) {
+        int timeout = get_timeout(ep);
+        int nevents;
+        int ii;
+
+        if (timeout == -2) {
+            /* Nothing left to wait for */
+            break;
+        }
+
+        nevents = epoll_wait(ep->epfd, events, MAX_EVENTS, timeout);
+        if (nevents == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            abort();
+        }
+
+        for (ii = 0; ii < nevents; ++ii) {
+            struct epoll_io_event *ev = events[ii].data.ptr;
+            uint32_t ee = events[ii].events;
+            if (ee & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ev->ready |= LIBCOUCHBASE_READ_EVENT;
+            }
+            if (ee & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                ev->ready |= LIBCOUCHBASE_WRITE_EVENT;
+            }
+        }
+
+        run_events(ep);
+        run_timers(ep);
+        purge_destroyed(ep);
+    }
+}
+
+static void epoll_io_stop_event_loop(libcouchbase_io_opt_t *iops)
+{
+    struct epoll_io_cookie *ep = iops->cookie;
+    ep->stop = true;
+}
+
+static void epoll_io_destroy(libcouchbase_io_opt_t *iops)
+{
+    struct epoll_io_cookie *ep = iops->cookie;
+    struct epoll_io_event *ev;
+    struct epoll_io_timer *tm;
+
+    for (ev = ep->events; ev != NULL; ev = ev->next) {
+        ev->destroyed = true;
+    }
+    for (tm = ep->timers; tm != NULL; tm = tm->next) {
+        tm->destroyed = true;
+    }
+    purge_destroyed(ep);
+
+    close(ep->epfd);
+    free(ep->sockets);
+    free(ep);
+    free(iops);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_io_opt_t *libcouchbase_create_epoll_io_opts(void)
+{
+    libcouchbase_io_opt_t *ret = calloc(1, sizeof(*ret));
+    struct epoll_io_cookie *ep = calloc(1, sizeof(*ep));
+
+    if (ret == NULL || ep == NULL) {
+        free(ret);
+        free(ep);
+        return NULL;
+    }
+
+    if ((ep->epfd = epoll_create(MAX_EVENTS)) == -1) {
+        free(ret);
+        free(ep);
+        return NULL;
+    }
+
+    ret->cookie = ep;
+    ret->socket = epoll_io_socket;
+    ret->connect = epoll_io_connect;
+    ret->recv = epoll_io_recv;
+    ret->send = epoll_io_send;
+    ret->sendv = epoll_io_sendv;
+    ret->close = epoll_io_close;
+    ret->create_event = epoll_io_create_event;
+    ret->update_event = epoll_io_update_event;
+    ret->delete_event = epoll_io_delete_event;
+    ret->destroy_event = epoll_io_destroy_event;
+    ret->create_timer = epoll_io_create_timer;
+    ret->update_timer = epoll_io_update_timer;
+    ret->delete_timer = epoll_io_delete_timer;
+    ret->destroy_timer = epoll_io_destroy_timer;
+    ret->run_event_loop = epoll_io_run_event_loop;
+    ret->stop_event_loop = epoll_io_stop_event_loop;
+    ret->destroy = epoll_io_destroy;
+
+    return ret;
+}
+
+#else
+
+LIBCOUCHBASE_API
+libcouchbase_io_opt_t *libcouchbase_create_epoll_io_opts(void)
+{
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,281 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the I/O backend running on top of libevent.
+ */
+#include "internal.h"
+#ifndef WIN32
+#include <event.h>
+#else
+#include "myevent.h"
+#endif
+
+/** The maximum number of chunks we'll pass to the kernel in one call */
+#define MAX_IOV 64
+
+/** An event (or a timer) in libevent */
+struct libevent_event {
+    struct event ev;
+    /** The flags the event is added with (0 if it isn't added) */
+    short flags;
+};
+
+static int get_error(void)
+{
+#ifdef WIN32
+    switch (WSAGetLastError()) {
+    case WSAEINTR:
+        return EINTR;
+    case WSAEWOULDBLOCK:
+        return EWOULDBLOCK;
+    case WSAEINPROGRESS:
+        return EINPROGRESS;
+    case WSAEALREADY:
+        return EALREADY;
+    case WSAEISCONN:
+        return EISCONN;
+    default:
+        return EINVAL;
+    }
+#else
+    return errno;
+#endif
+}
+
+static libcouchbase_socket_t libevent_socket(libcouchbase_io_opt_t *iops,
+                                             int domain,
+                                             int type,
+                                             int protocol)
+{
+    libcouchbase_socket_t sock = socket(domain, type, protocol);
+    if (sock == INVALID_SOCKET) {
+        iops->error = get_error();
+    } else if (evutil_make_socket_nonblocking(sock) != 0) {
+        iops->error = get_error();
+        EVUTIL_CLOSESOCKET(sock);
+        sock = INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+static int libevent_connect(libcouchbase_io_opt_t *iops,
+                            libcouchbase_socket_t sock,
+                            const struct sockaddr *name,
+                            unsigned int namelen)
+{
+    int ret = connect(sock, name, (socklen_t)namelen);
+    if (ret == SOCKET_ERROR) {
+        iops->error = get_error();
+#ifdef WIN32
+        /* Windows report EWOULDBLOCK for a connect in progress */
+        if (iops->error == EWOULDBLOCK) {
+            iops->error = EINPROGRESS;
+        }
+#endif
+    }
+    return ret;
+}
+
+static libcouchbase_ssize_t libevent_recv(libcouchbase_io_opt_t *iops,
+                                          libcouchbase_socket_t sock,
+                                          void *buffer,
+                                          size_t len,
+                                          int flags)
+{
+    libcouchbase_ssize_t ret = recv(sock, buffer, len, flags);
+    if (ret < 0) {
+        iops->error = get_error();
+    }
+    return ret;
+}
+
+static libcouchbase_ssize_t libevent_send(libcouchbase_io_opt_t *iops,
+                                          libcouchbase_socket_t sock,
+                                          const void *msg,
+                                          size_t len,
+                                          int flags)
+{
+    libcouchbase_ssize_t ret = send(sock, msg, len, flags);
+    if (ret < 0) {
+        iops->error = get_error();
+    }
+    return ret;
+}
+
+static libcouchbase_ssize_t libevent_sendv(libcouchbase_io_opt_t *iops,
+                                           libcouchbase_socket_t sock,
+                                           const libcouchbase_iov_t *iov,
+                                           size_t niov)
+{
+#ifdef WIN32
+    /* Just send the first chunk, and let the caller try again */
+    (void)niov;
+    return libevent_send(iops, sock, iov[0].iov_base, iov[0].iov_len, 0);
+#else
+    struct iovec vec[MAX_IOV];
+    struct msghdr msg;
+    libcouchbase_ssize_t ret;
+    size_t ii;
+
+    if (niov > MAX_IOV) {
+        niov = MAX_IOV;
+    }
+    for (ii = 0; ii < niov; ++ii) {
+        vec[ii].iov_base = (void*)iov[ii].iov_base;
+        vec[ii].iov_len = iov[ii].iov_len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = niov;
+    ret = sendmsg(sock, &msg, 0);
+    if (ret < 0) {
+        iops->error = get_error();
+    }
+    return ret;
+#endif
+}
+
+static void libevent_close(libcouchbase_io_opt_t *iops,
+                           libcouchbase_socket_t sock)
+{
+    (void)iops;
+    EVUTIL_CLOSESOCKET(sock);
+}
+
+static void *libevent_create_event(libcouchbase_io_opt_t *iops)
+{
+    (void)iops;
+    return calloc(1, sizeof(struct libevent_event));
+}
+
+static int libevent_update_event(libcouchbase_io_opt_t *iops,
+                                 libcouchbase_socket_t sock,
+                                 void *event,
+                                 short flags,
+                                 void *cb_data,
+                                 libcouchbase_io_handler_t handler)
+{
+    struct libevent_event *ev = event;
+
+    if (ev->flags != 0 && event_del(&ev->ev) == -1) {
+        return -1;
+    }
+
+    ev->flags = flags;
+    event_set(&ev->ev, sock, flags | EV_PERSIST, handler, cb_data);
+    event_base_set(iops->cookie, &ev->ev);
+    return event_add(&ev->ev, NULL);
+}
+
+static void libevent_delete_event(libcouchbase_io_opt_t *iops,
+                                  libcouchbase_socket_t sock,
+                                  void *event)
+{
+    struct libevent_event *ev = event;
+    (void)iops;
+    (void)sock;
+
+    if (ev->flags != 0) {
+        if (event_del(&ev->ev) == -1) {
+            abort();
+        }
+        ev->flags = 0;
+    }
+}
+
+static void libevent_destroy_event(libcouchbase_io_opt_t *iops,
+                                   void *event)
+{
+    libevent_delete_event(iops, INVALID_SOCKET, event);
+    free(event);
+}
+
+static int libevent_update_timer(libcouchbase_io_opt_t *iops,
+                                 void *timer,
+                                 uint32_t usec,
+                                 void *cb_data,
+                                 libcouchbase_io_handler_t handler)
+{
+    struct libevent_event *ev = timer;
+    struct timeval tmo;
+
+    if (ev->flags != 0 && event_del(&ev->ev) == -1) {
+        return -1;
+    }
+
+    ev->flags = EV_TIMEOUT;
+    event_set(&ev->ev, INVALID_SOCKET, 0, handler, cb_data);
+    event_base_set(iops->cookie, &ev->ev);
+    tmo.tv_sec = usec / 1000000;
+    tmo.tv_usec = usec % 1000000;
+    return event_add(&ev->ev, &tmo);
+}
+
+static void libevent_delete_timer(libcouchbase_io_opt_t *iops,
+                                  void *timer)
+{
+    libevent_delete_event(iops, INVALID_SOCKET, timer);
+}
+
+static void libevent_run_event_loop(libcouchbase_io_opt_t *iops)
+{
+    event_base_loop(iops->cookie, 0);
+}
+
+static void libevent_stop_event_loop(libcouchbase_io_opt_t *iops)
+{
+    event_base_loopbreak(iops->cookie);
+}
+
+static void libevent_destroy(libcouchbase_io_opt_t *iops)
+{
+    /* The event base is owned by the caller */
+    free(iops);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_io_opt_t *libcouchbase_create_libevent_io_opts(struct event_base *base)
+{
+    libcouchbase_io_opt_t *ret = calloc(1, sizeof(*ret));
+    if (ret == NULL) {
+        return NULL;
+    }
+
+    ret->cookie = base;
+    ret->socket = libevent_socket;
+    ret->connect = libevent_connect;
+    ret->recv = libevent_recv;
+    ret->send = libevent_send;
+    ret->sendv = libevent_sendv;
+    ret->close = libevent_close;
+    ret->create_event = libevent_create_event;
+    ret->update_event = libevent_update_event;
+    ret->delete_event = libevent_delete_event;
+    ret->destroy_event = libevent_destroy_event;
+    ret->create_timer = libevent_create_event;
+    ret->update_timer = libevent_update_timer;
+    ret->delete_timer = libevent_delete_timer;
+    ret->destroy_timer = libevent_destroy_event;
+    ret->run_event_loop = libevent_run_event_loop;
+    ret->stop_event_loop = libevent_stop_event_loop;
+    ret->destroy = libevent_destroy;
+
+    return ret;
+}
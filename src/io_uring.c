@@ -0,0 +1,1151 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains an I/O backend using io_uring on Linux. We're
+ * using the system calls directly so that we don't add another
+ * dependency.
+ *
+ * The library expects to be told when a socket is ready and then call
+ * recv/send until it would block. To map that onto io_uring we keep a
+ * read request in the kernel for each socket, and recv hands out the
+ * data from the completed request. sendv copies the data into a buffer
+ * for the socket, and the buffers for all of the sockets are sent at
+ * the beginning of the next iteration of the event loop. All of the
+ * requests queued during an iteration are submitted in the same system
+ * call as we wait for the completions, so the number of system calls
+ * doesn't depend on the number of servers.
+ *
+ * The read buffers may be registered with the kernel (so that it
+ * doesn't have to map them for every request).
+ */
+#include "internal.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <time.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+/** The number of entries in the submission queue */
+#define RING_ENTRIES 256
+
+/** The size of the buffer we read into for each socket */
+#define READ_BUFFER_SIZE 32768
+
+/** The size of the buffer for the data we're sending to each socket */
+#define WRITE_BUFFER_SIZE 65536
+
+/** The number of read buffers we try to register with the kernel */
+#define NUM_FIXED_BUFFERS 64
+
+/** The kind of request is stored in the low bits of user_data */
+#define OP_RECV 0
+#define OP_SEND 1
+#define OP_POLL 2
+#define OP_TIMEOUT 3
+#define OP_CANCEL 4
+#define OP_MASK 7
+
+struct uring_event;
+
+struct uring_socket {
+    libcouchbase_socket_t sock;
+    /** The event watching the socket (if any) */
+    struct uring_event *event;
+    /** The number of requests for this socket in the kernel */
+    int inflight;
+    /** The socket is closed (release it when inflight reach 0) */
+    bool closed;
+    /** We're waiting for the connect to complete */
+    bool connecting;
+    /** The poll for the connect completed */
+    bool writable;
+    /** Is there a poll for the socket in the kernel */
+    bool poll_posted;
+    /** Have we started to read from the socket */
+    bool started;
+
+    struct {
+        char *data;
+        /** The index of the registered buffer (-1 if not registered) */
+        int index;
+        size_t start;
+        size_t avail;
+        /** Is there a read request in the kernel */
+        bool posted;
+        bool eof;
+        int error;
+    } input;
+
+    struct {
+        char *data;
+        size_t start;
+        size_t avail;
+        /** Is there a send request in the kernel */
+        bool posted;
+        int error;
+    } output;
+
+    struct uring_socket *next;
+};
+
+struct uring_event {
+    struct uring_socket *socket;
+    /** The events we're watching (0 if we're not watching the socket) */
+    short flags;
+    /** Is the event destroyed (it's released at the end of the loop) */
+    bool destroyed;
+    void *cb_data;
+    libcouchbase_io_handler_t handler;
+    struct uring_event *next;
+};
+
+struct uring_timer {
+    /** Is the timer active */
+    bool active;
+    /** Is the timer destroyed (it's released at the end of the loop) */
+    bool destroyed;
+    /** When the timer expires (in usec on the monotonic clock) */
+    uint64_t expiry;
+    void *cb_data;
+    libcouchbase_io_handler_t handler;
+    struct uring_timer *next;
+};
+
+struct uring_cookie {
+    int fd;
+    bool stop;
+
+    struct {
+        unsigned *head;
+        unsigned *tail;
+        unsigned *mask;
+        unsigned *entries;
+        unsigned *array;
+        struct io_uring_sqe *sqes;
+        /** The tail including the entries not yet published */
+        unsigned local_tail;
+        void *ring;
+        size_t ring_size;
+        size_t sqes_size;
+    } sq;
+
+    struct {
+        unsigned *head;
+        unsigned *tail;
+        unsigned *mask;
+        struct io_uring_cqe *cqes;
+        void *ring;
+        size_t ring_size;
+    } cq;
+
+    /** The number of entries queued but not submitted */
+    unsigned queued;
+    /** The number of requests queued or in the kernel */
+    unsigned inflight;
+
+    /** The number of timeout requests in the kernel */
+    unsigned ntimeouts;
+    /** When the first of them expires */
+    uint64_t timeout_expiry;
+    /** The timeout passed to the kernel (it's copied on submission) */
+    struct __kernel_timespec ts;
+
+    struct uring_event *events;
+    struct uring_timer *timers;
+    /** All of the sockets (including those closed and not released) */
+    struct uring_socket *sockets;
+    /** A map from the socket to the open socket */
+    struct uring_socket **socket_map;
+    size_t nsocket_map;
+
+    /** The registered read buffers (NULL if not in use) */
+    char *fixed;
+    bool fixed_used[NUM_FIXED_BUFFERS];
+};
+
+static uint64_t get_monotonic_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * Publish the queued entries and submit them to the kernel
+ * @param ur the ring
+ * @param wait the number of completions to wait for
+ * @return the number of entries submitted, or -1 on error
+ */
+static int submit(struct uring_cookie *ur, unsigned int wait)
+{
+    long ret;
+
+    __atomic_store_n(ur->sq.tail, ur->sq.local_tail, __ATOMIC_RELEASE);
+    do {
+        ret = syscall(__NR_io_uring_enter, ur->fd, ur->queued, wait,
+                      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret > 0) {
+        ur->queued -= (unsigned int)ret;
+    }
+    return (int)ret;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_cookie *ur, void *ptr,
+                                    unsigned int op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    if (ur->sq.local_tail - __atomic_load_n(ur->sq.head, __ATOMIC_ACQUIRE) >=
+        *ur->sq.entries) {
+        /* The queue is full; let the kernel have the entries we've got */
+        if (submit(ur, 0) == -1 ||
+            ur->sq.local_tail - __atomic_load_n(ur->sq.head, __ATOMIC_ACQUIRE) >=
+            *ur->sq.entries) {
+            abort();
+        }
+    }
+
+    idx = ur->sq.local_tail & *ur->sq.mask;
+    sqe = ur->sq.sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)ptr | op;
+    ur->sq.array[idx] = idx;
+    ++ur->sq.local_tail;
+    ++ur->queued;
+    ++ur->inflight;
+
+    return sqe;
+}
+
+static struct uring_socket *get_socket(libcouchbase_io_opt_t *iops,
+                                       libcouchbase_socket_t sock)
+{
+    struct uring_cookie *ur = iops->cookie;
+    if (sock < 0 || (size_t)sock >= ur->nsocket_map) {
+        return NULL;
+    }
+    return ur->socket_map[sock];
+}
+
+static struct uring_socket *create_socket(libcouchbase_io_opt_t *iops,
+                                          libcouchbase_socket_t sock)
+{
+    struct uring_cookie *ur = iops->cookie;
+    struct uring_socket *ret;
+
+    if ((size_t)sock >= ur->nsocket_map) {
+        size_t num = ur->nsocket_map ? ur->nsocket_map : 64;
+        struct uring_socket **map;
+        while (num <= (size_t)sock) {
+            num <<= 1;
+        }
+        map = realloc(ur->socket_map, num * sizeof(*map));
+        if (map == NULL) {
+            return NULL;
+        }
+        memset(map + ur->nsocket_map, 0,
+               (num - ur->nsocket_map) * sizeof(*map));
+        ur->socket_map = map;
+        ur->nsocket_map = num;
+    }
+
+    if ((ret = calloc(1, sizeof(*ret))) == NULL) {
+        return NULL;
+    }
+    ret->sock = sock;
+    ret->input.index = -1;
+    ret->next = ur->sockets;
+    ur->sockets = ret;
+    ur->socket_map[sock] = ret;
+
+    return ret;
+}
+
+static void release_socket(struct uring_cookie *ur, struct uring_socket *s)
+{
+    struct uring_socket **ptr = &ur->sockets;
+    while (*ptr != s) {
+        ptr = &(*ptr)->next;
+    }
+    *ptr = s->next;
+
+    if (s->input.index != -1) {
+        ur->fixed_used[s->input.index] = false;
+    } else {
+        free(s->input.data);
+    }
+    free(s->output.data);
+    free(s);
+}
+
+/**
+ * Start reading from a connected socket
+ */
+static bool start_io(struct uring_cookie *ur, struct uring_socket *s)
+{
+    int flags;
+    int ii;
+
+    if (s->started) {
+        return true;
+    }
+
+    if (ur->fixed != NULL) {
+        for (ii = 0; ii < NUM_FIXED_BUFFERS; ++ii) {
+            if (!ur->fixed_used[ii]) {
+                ur->fixed_used[ii] = true;
+                s->input.index = ii;
+                s->input.data = ur->fixed + (size_t)ii * READ_BUFFER_SIZE;
+                break;
+            }
+        }
+    }
+
+    if (s->input.data == NULL) {
+        s->input.data = malloc(READ_BUFFER_SIZE);
+    }
+    s->output.data = malloc(WRITE_BUFFER_SIZE);
+    if (s->input.data == NULL || s->output.data == NULL) {
+        return false;
+    }
+
+    /* Let the kernel wait for the data instead of failing with EAGAIN */
+    flags = fcntl(s->sock, F_GETFL, 0);
+    if (flags != -1) {
+        (void)fcntl(s->sock, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    s->started = true;
+    s->connecting = false;
+    s->writable = false;
+    return true;
+}
+
+/**
+ * Get the number of bytes we may add to the output buffer
+ */
+static size_t output_space(struct uring_socket *s)
+{
+    if (s->output.posted) {
+        /* We can't move the data being sent */
+        return WRITE_BUFFER_SIZE - s->output.start - s->output.avail;
+    }
+    return WRITE_BUFFER_SIZE - s->output.avail;
+}
+
+static short socket_ready(struct uring_socket *s)
+{
+    short ret = 0;
+
+    if (s->connecting) {
+        return s->writable ? LIBCOUCHBASE_WRITE_EVENT : 0;
+    }
+
+    if (s->started) {
+        if (s->input.avail > 0 || s->input.eof || s->input.error != 0) {
+            ret |= LIBCOUCHBASE_READ_EVENT;
+        }
+        if (output_space(s) > 0 || s->output.error != 0) {
+            ret |= LIBCOUCHBASE_WRITE_EVENT;
+        }
+    }
+
+    return ret;
+}
+
+static libcouchbase_socket_t uring_socket(libcouchbase_io_opt_t *iops,
+                                          int domain,
+                                          int type,
+                                          int protocol)
+{
+    libcouchbase_socket_t sock = socket(domain, type, protocol);
+    if (sock == INVALID_SOCKET) {
+        iops->error = errno;
+    } else if (libcouchbase_make_socket_nonblocking(sock) != 0 ||
+               create_socket(iops, sock) == NULL) {
+        iops->error = errno;
+        close(sock);
+        sock = INVALID_SOCKET;
+    }
+
+    return sock;
+}
+
+static int uring_connect(libcouchbase_io_opt_t *iops,
+                         libcouchbase_socket_t sock,
+                         const struct sockaddr *name,
+                         unsigned int namelen)
+{
+    struct uring_socket *s = get_socket(iops, sock);
+    int ret = connect(sock, name, (socklen_t)namelen);
+
+    if (ret == -1) {
+        iops->error = errno;
+    }
+
+    if (s != NULL) {
+        if (ret == 0 || iops->error == EISCONN) {
+            if (!start_io(iops->cookie, s)) {
+                iops->error = ENOMEM;
+                return -1;
+            }
+        } else if (iops->error == EINPROGRESS || iops->error == EALREADY) {
+            s->connecting = true;
+            s->writable = false;
+        }
+    }
+
+    return ret;
+}
+
+static libcouchbase_ssize_t uring_recv(libcouchbase_io_opt_t *iops,
+                                       libcouchbase_socket_t sock,
+                                       void *buffer,
+                                       size_t len,
+                                       int flags)
+{
+    struct uring_socket *s = get_socket(iops, sock);
+    libcouchbase_ssize_t ret;
+
+    if (s == NULL || !s->started) {
+        if ((ret = recv(sock, buffer, len, flags)) == -1) {
+            iops->error = errno;
+        }
+        return ret;
+    }
+
+    if (s->input.avail > 0) {
+        if (len > s->input.avail) {
+            len = s->input.avail;
+        }
+        memcpy(buffer, s->input.data + s->input.start, len);
+        s->input.start += len;
+        s->input.avail -= len;
+        return (libcouchbase_ssize_t)len;
+    }
+
+    if (s->input.error != 0) {
+        iops->error = s->input.error;
+        return -1;
+    }
+
+    if (s->input.eof) {
+        return 0;
+    }
+
+    iops->error = EWOULDBLOCK;
+    return -1;
+}
+
+static libcouchbase_ssize_t uring_sendv(libcouchbase_io_opt_t *iops,
+                                        libcouchbase_socket_t sock,
+                                        const libcouchbase_iov_t *iov,
+                                        size_t niov)
+{
+    struct uring_socket *s = get_socket(iops, sock);
+    size_t space;
+    size_t ret = 0;
+    size_t ii;
+
+    if (s == NULL || !s->started) {
+        iops->error = ENOTCONN;
+        return -1;
+    }
+
+    if (s->output.error != 0) {
+        iops->error = s->output.error;
+        return -1;
+    }
+
+    if (!s->output.posted && s->output.start > 0) {
+        memmove(s->output.data, s->output.data + s->output.start,
+                s->output.avail);
+        s->output.start = 0;
+    }
+
+    if ((space = output_space(s)) == 0) {
+        iops->error = EWOULDBLOCK;
+        return -1;
+    }
+
+    for (ii = 0; ii < niov && space > 0; ++ii) {
+        size_t chunk = iov[ii].iov_len;
+        if (chunk > space) {
+            chunk = space;
+        }
+        memcpy(s->output.data + s->output.start + s->output.avail,
+               iov[ii].iov_base, chunk);
+        s->output.avail += chunk;
+        space -= chunk;
+        ret += chunk;
+    }
+
+    return (libcouchbase_ssize_t)ret;
+}
+
+static libcouchbase_ssize_t uring_send(libcouchbase_io_opt_t *iops,
+                                       libcouchbase_socket_t sock,
+                                       const void *msg,
+                                       size_t len,
+                                       int flags)
+{
+    libcouchbase_iov_t iov;
+    (void)flags;
+    iov.iov_base = msg;
+    iov.iov_len = len;
+    return uring_sendv(iops, sock, &iov, 1);
+}
+
+static void uring_close(libcouchbase_io_opt_t *iops,
+                        libcouchbase_socket_t sock)
+{
+    struct uring_cookie *ur = iops->cookie;
+    struct uring_socket *s = get_socket(iops, sock);
+
+    if (s != NULL) {
+        ur->socket_map[sock] = NULL;
+        if (s->event != NULL) {
+            s->event->socket = NULL;
+            s->event = NULL;
+        }
+        s->closed = true;
+        if (s->inflight == 0) {
+            release_socket(ur, s);
+        } else {
+            /* Make the requests in the kernel complete */
+            if (s->poll_posted) {
+                struct io_uring_sqe *sqe = get_sqe(ur, NULL, OP_CANCEL);
+                sqe->opcode = IORING_OP_POLL_REMOVE;
+                sqe->fd = -1;
+                sqe->addr = (uint64_t)(uintptr_t)s | OP_POLL;
+            }
+            (void)shutdown(sock, SHUT_RDWR);
+        }
+    }
+
+    close(sock);
+}
+
+static void *uring_create_event(libcouchbase_io_opt_t *iops)
+{
+    struct uring_cookie *ur = iops->cookie;
+    struct uring_event *ret = calloc(1, sizeof(*ret));
+    if (ret != NULL) {
+        ret->next = ur->events;
+        ur->events = ret;
+    }
+    return ret;
+}
+
+static int uring_update_event(libcouchbase_io_opt_t *iops,
+                              libcouchbase_socket_t sock,
+                              void *event,
+                              short flags,
+                              void *cb_data,
+                              libcouchbase_io_handler_t handler)
+{
+    struct uring_event *ev = event;
+    struct uring_socket *s = get_socket(iops, sock);
+
+    if (s == NULL) {
+        /* The socket wasn't created by us, so it's already connected */
+        if ((s = create_socket(iops, sock)) == NULL) {
+            iops->error = ENOMEM;
+            return -1;
+        }
+    }
+
+    if (ev->socket != s) {
+        if (ev->socket != NULL) {
+            ev->socket->event = NULL;
+        }
+        ev->socket = s;
+    }
+    s->event = ev;
+    ev->flags = flags;
+    ev->cb_data = cb_data;
+    ev->handler = handler;
+
+    if (!s->connecting && !start_io(iops->cookie, s)) {
+        iops->error = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void uring_delete_event(libcouchbase_io_opt_t *iops,
+                               libcouchbase_socket_t sock,
+                               void *event)
+{
+    struct uring_event *ev = event;
+    (void)iops;
+    (void)sock;
+
+    if (ev->socket != NULL) {
+        ev->socket->event = NULL;
+        ev->socket = NULL;
+    }
+    ev->flags = 0;
+}
+
+static void uring_destroy_event(libcouchbase_io_opt_t *iops,
+                                void *event)
+{
+    struct uring_event *ev = event;
+    uring_delete_event(iops, INVALID_SOCKET, ev);
+    ev->destroyed = true;
+}
+
+static void *uring_create_timer(libcouchbase_io_opt_t *iops)
+{
+    struct uring_cookie *ur = iops->cookie;
+    struct uring_timer *ret = calloc(1, sizeof(*ret));
+    if (ret != NULL) {
+        ret->next = ur->timers;
+        ur->timers = ret;
+    }
+    return ret;
+}
+
+static int uring_update_timer(libcouchbase_io_opt_t *iops,
+                              void *timer,
+                              uint32_t usec,
+                              void *cb_data,
+                              libcouchbase_io_handler_t handler)
+{
+    struct uring_timer *tm = timer;
+    (void)iops;
+
+    tm->active = true;
+    tm->expiry = get_monotonic_usec() + usec;
+    tm->cb_data = cb_data;
+    tm->handler = handler;
+    return 0;
+}
+
+static void uring_delete_timer(libcouchbase_io_opt_t *iops,
+                               void *timer)
+{
+    struct uring_timer *tm = timer;
+    (void)iops;
+    tm->active = false;
+}
+
+static void uring_destroy_timer(libcouchbase_io_opt_t *iops,
+                                void *timer)
+{
+    struct uring_timer *tm = timer;
+    (void)iops;
+    tm->active = false;
+    tm->destroyed = true;
+}
+
+/**
+ * Queue the requests we need for all of the sockets
+ */
+static void queue_requests(struct uring_cookie *ur)
+{
+    struct uring_socket *s;
+
+    for (s = ur->sockets; s != NULL; s = s->next) {
+        struct io_uring_sqe *sqe;
+        if (s->closed) {
+            continue;
+        }
+
+        if (s->connecting) {
+            if (!s->poll_posted && !s->writable && s->event != NULL &&
+                (s->event->flags & LIBCOUCHBASE_WRITE_EVENT)) {
+                sqe = get_sqe(ur, s, OP_POLL);
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = s->sock;
+                sqe->poll_events = POLLOUT;
+                s->poll_posted = true;
+                ++s->inflight;
+            }
+            continue;
+        }
+
+        if (!s->started) {
+            continue;
+        }
+
+        if (!s->input.posted && s->input.avail == 0 && !s->input.eof &&
+            s->input.error == 0) {
+            sqe = get_sqe(ur, s, OP_RECV);
+            sqe->fd = s->sock;
+            sqe->addr = (uint64_t)(uintptr_t)s->input.data;
+            sqe->len = READ_BUFFER_SIZE;
+            if (s->input.index != -1) {
+                sqe->opcode = IORING_OP_READ_FIXED;
+                sqe->buf_index = (uint16_t)s->input.index;
+            } else {
+                sqe->opcode = IORING_OP_RECV;
+            }
+            s->input.posted = true;
+            ++s->inflight;
+        }
+
+        if (!s->output.posted && s->output.avail > 0 &&
+            s->output.error == 0) {
+            sqe = get_sqe(ur, s, OP_SEND);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = s->sock;
+            sqe->addr = (uint64_t)(uintptr_t)(s->output.data + s->output.start);
+            sqe->len = (uint32_t)s->output.avail;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            s->output.posted = true;
+            ++s->inflight;
+        }
+    }
+}
+
+/**
+ * Queue a timeout request if a timer expires before the one in the
+ * kernel (if any). The timeout completes when another request
+ * completes, so we don't leave them behind in the kernel.
+ */
+static void queue_timeout(struct uring_cookie *ur)
+{
+    struct uring_timer *tm;
+    struct io_uring_sqe *sqe;
+    uint64_t next = UINT64_MAX;
+    uint64_t now;
+
+    for (tm = ur->timers; tm != NULL; tm = tm->next) {
+        if (tm->active && tm->expiry < next) {
+            next = tm->expiry;
+        }
+    }
+
+    if (next == UINT64_MAX || (ur->ntimeouts > 0 && next >= ur->timeout_expiry)) {
+        return;
+    }
+
+    now = get_monotonic_usec();
+    next = next > now ? next - now : 0;
+    ur->ts.tv_sec = (long long)(next / 1000000);
+    ur->ts.tv_nsec = (long long)(next % 1000000) * 1000;
+    sqe = get_sqe(ur, NULL, OP_TIMEOUT);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&ur->ts;
+    sqe->len = 1;
+    sqe->off = 1;
+    ++ur->ntimeouts;
+    ur->timeout_expiry = now + next;
+}
+
+static void complete_request(struct uring_cookie *ur, uint64_t user_data,
+                             int32_t res)
+{
+    struct uring_socket *s = (void*)(uintptr_t)(user_data & ~(uint64_t)OP_MASK);
+
+    --ur->inflight;
+    switch (user_data & OP_MASK) {
+    case OP_TIMEOUT:
+        if (--ur->ntimeouts == 0) {
+            ur->timeout_expiry = UINT64_MAX;
+        }
+        return;
+    case OP_CANCEL:
+        return;
+    case OP_RECV:
+        s->input.posted = false;
+        if (res > 0) {
+            s->input.start = 0;
+            s->input.avail = (size_t)res;
+        } else if (res == 0) {
+            s->input.eof = true;
+        } else if (res != -EAGAIN && res != -EINTR) {
+            s->input.error = -res;
+        }
+        break;
+    case OP_SEND:
+        s->output.posted = false;
+        if (res > 0) {
+            s->output.start += (size_t)res;
+            s->output.avail -= (size_t)res;
+            if (s->output.avail == 0) {
+                s->output.start = 0;
+            }
+        } else if (res < 0 && res != -EAGAIN && res != -EINTR) {
+            s->output.error = -res;
+        }
+        break;
+    case OP_POLL:
+        s->poll_posted = false;
+        s->writable = true;
+        break;
+    default:
+        abort();
+    }
+
+    if (--s->inflight == 0 && s->closed) {
+        release_socket(ur, s);
+    }
+}
+
+static void reap_completions(struct uring_cookie *ur)
+{
+    unsigned int head = *ur->cq.head;
+    unsigned int tail = __atomic_load_n(ur->cq.tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = ur->cq.cqes + (head & *ur->cq.mask);
+        complete_request(ur, cqe->user_data, cqe->res);
+        ++head;
+    }
+    __atomic_store_n(ur->cq.head, head, __ATOMIC_RELEASE);
+}
+
+static bool have_ready_events(struct uring_cookie *ur)
+{
+    struct uring_event *ev;
+    for (ev = ur->events; ev != NULL; ev = ev->next) {
+        if (ev->socket != NULL && (socket_ready(ev->socket) & ev->flags)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check if there is anything we could wait for (a socket we're
+ * watching or an active timer)
+ */
+static bool have_work(struct uring_cookie *ur)
+{
+    struct uring_event *ev;
+    struct uring_timer *tm;
+
+    for (ev = ur->events; ev != NULL; ev = ev->next) {
+        if (ev->socket != NULL && ev->flags != 0) {
+            return true;
+        }
+    }
+
+    for (tm = ur->timers; tm != NULL; tm = tm->next) {
+        if (tm->active) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void run_events(struct uring_cookie *ur)
+{
+    struct uring_event *ev;
+
+    for (ev = ur->events; ev != NULL && !ur->stop; ev = ev->next) {
+        if (ev->socket != NULL) {
+            short which = socket_ready(ev->socket) & ev->flags;
+            if (which != 0) {
+                ev->handler(ev->socket->sock, which, ev->cb_data);
+            }
+        }
+    }
+}
+
+static void run_timers(struct uring_cookie *ur)
+{
+    struct uring_timer *tm;
+    uint64_t now = get_monotonic_usec();
+
+    for (tm = ur->timers; tm != NULL && !ur->stop; tm = tm->next) {
+        if (tm->active && tm->expiry <= now) {
+            tm->active = false;
+            tm->handler(INVALID_SOCKET, 0, tm->cb_data);
+        }
+    }
+}
+
+/**
+ * Release the events and timers destroyed while we were running the
+ * handlers
+ */
+static void purge_destroyed(struct uring_cookie *ur)
+{
+    struct uring_event **ev = &ur->events;
+    struct uring_timer **tm = &ur->timers;
+
+    while (*ev != NULL) {
+        if ((*ev)->destroyed) {
+            struct uring_event *next = (*ev)->next;
+            free(*ev);
+            *ev = next;
+        } else {
+            ev = &(*ev)->next;
+        }
+    }
+
+    while (*tm != NULL) {
+        if ((*tm)->destroyed) {
+            struct uring_timer *next = (*tm)->next;
+            free(*tm);
+            *tm = next;
+        } else {
+            tm = &(*tm)->next;
+        }
+    }
+}
+
+static void uring_run_event_loop(libcouchbase_io_opt_t *iops)
+{
+    struct uring_cookie *ur = iops->cookie;
+
+    ur->stop = false;
+    while (!ur->stop) {
+        bool ready;
+
+        queue_requests(ur);
+        queue_timeout(ur);
+        ready = have_ready_events(ur);
+        if (!ready && !have_work(ur)) {
+            /* Nothing left to wait for, but send what we've got */
+            if (ur->queued > 0) {
+                (void)submit(ur, 0);
+            }
+            break;
+        }
+
+        /* Submit everything and wait in the same call */
+        if (submit(ur, ready ? 0 : 1) == -1 &&
+            errno != EBUSY && errno != EAGAIN) {
+            abort();
+        }
+
+        reap_completions(ur);
+        run_events(ur);
+        run_timers(ur);
+        purge_destroyed(ur);
+    }
+}
+
+static void uring_stop_event_loop(libcouchbase_io_opt_t *iops)
+{
+    struct uring_cookie *ur = iops->cookie;
+    ur->stop = true;
+}
+
+static void uring_destroy(libcouchbase_io_opt_t *iops)
+{
+    struct uring_cookie *ur = iops->cookie;
+    struct uring_event *ev;
+    struct uring_timer *tm;
+    struct uring_socket *s;
+
+    /*
+     * Wait for the requests using our buffers to complete before we
+     * release them
+     */
+    for (s = ur->sockets; s != NULL; s = s->next) {
+        if (!s->closed) {
+            (void)shutdown(s->sock, SHUT_RDWR);
+        }
+    }
+    while (ur->sockets != NULL) {
+        bool busy = false;
+        s = ur->sockets;
+        while (s != NULL) {
+            struct uring_socket *next = s->next;
+            if (s->inflight == 0) {
+                release_socket(ur, s);
+            } else {
+                busy = true;
+            }
+            s = next;
+        }
+        if (busy) {
+            if (submit(ur, 1) == -1 && errno != EBUSY && errno != EAGAIN) {
+                break;
+            }
+            reap_completions(ur);
+        }
+    }
+
+    for (ev = ur->events; ev != NULL; ev = ev->next) {
+        ev->destroyed = true;
+    }
+    for (tm = ur->timers; tm != NULL; tm = tm->next) {
+        tm->destroyed = true;
+    }
+    purge_destroyed(ur);
+
+    munmap(ur->sq.sqes, ur->sq.sqes_size);
+    if (ur->cq.ring != ur->sq.ring) {
+        munmap(ur->cq.ring, ur->cq.ring_size);
+    }
+    munmap(ur->sq.ring, ur->sq.ring_size);
+    close(ur->fd);
+    free(ur->fixed);
+    free(ur->socket_map);
+    free(ur);
+    free(iops);
+}
+
+static bool setup_ring(struct uring_cookie *ur)
+{
+    struct io_uring_params p;
+    char *sq;
+    char *cq;
+
+    memset(&p, 0, sizeof(p));
+    if ((ur->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) < 0) {
+        return false;
+    }
+
+    ur->sq.ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq.ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->cq.ring_size > ur->sq.ring_size) {
+            ur->sq.ring_size = ur->cq.ring_size;
+        }
+        ur->cq.ring_size = ur->sq.ring_size;
+    }
+
+    ur->sq.ring = mmap(NULL, ur->sq.ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq.ring == MAP_FAILED) {
+        close(ur->fd);
+        return false;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->cq.ring = ur->sq.ring;
+    } else {
+        ur->cq.ring = mmap(NULL, ur->cq.ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ur->fd,
+                           IORING_OFF_CQ_RING);
+        if (ur->cq.ring == MAP_FAILED) {
+            munmap(ur->sq.ring, ur->sq.ring_size);
+            close(ur->fd);
+            return false;
+        }
+    }
+
+    ur->sq.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sq.sqes = mmap(NULL, ur->sq.sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sq.sqes == MAP_FAILED) {
+        if (ur->cq.ring != ur->sq.ring) {
+            munmap(ur->cq.ring, ur->cq.ring_size);
+        }
+        munmap(ur->sq.ring, ur->sq.ring_size);
+        close(ur->fd);
+        return false;
+    }
+
+    sq = ur->sq.ring;
+    ur->sq.head = (unsigned *)(sq + p.sq_off.head);
+    ur->sq.tail = (unsigned *)(sq + p.sq_off.tail);
+    ur->sq.mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ur->sq.entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    ur->sq.array = (unsigned *)(sq + p.sq_off.array);
+    ur->sq.local_tail = *ur->sq.tail;
+
+    cq = ur->cq.ring;
+    ur->cq.head = (unsigned *)(cq + p.cq_off.head);
+    ur->cq.tail = (unsigned *)(cq + p.cq_off.tail);
+    ur->cq.mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ur->cq.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return true;
+}
+
+static void register_buffers(struct uring_cookie *ur)
+{
+    struct iovec iov[NUM_FIXED_BUFFERS];
+    int ii;
+
+    if ((ur->fixed = malloc((size_t)NUM_FIXED_BUFFERS * READ_BUFFER_SIZE)) == NULL) {
+        return;
+    }
+
+    for (ii = 0; ii < NUM_FIXED_BUFFERS; ++ii) {
+        iov[ii].iov_base = ur->fixed + (size_t)ii * READ_BUFFER_SIZE;
+        iov[ii].iov_len = READ_BUFFER_SIZE;
+    }
+
+    if (syscall(__NR_io_uring_register, ur->fd, IORING_REGISTER_BUFFERS,
+                iov, NUM_FIXED_BUFFERS) != 0) {
+        /* Probably hit the limit of locked memory; use normal buffers */
+        free(ur->fixed);
+        ur->fixed = NULL;
+    }
+}
+
+LIBCOUCHBASE_API
+libcouchbase_io_opt_t *libcouchbase_create_io_uring_io_opts(bool registered_buffers)
+{
+    libcouchbase_io_opt_t *ret = calloc(1, sizeof(*ret));
+    struct uring_cookie *ur = calloc(1, sizeof(*ur));
+
+    if (ret == NULL || ur == NULL || !setup_ring(ur)) {
+        free(ret);
+        free(ur);
+        return NULL;
+    }
+
+    ur->timeout_expiry = UINT64_MAX;
+    if (registered_buffers) {
+        register_buffers(ur);
+    }
+
+    ret->cookie = ur;
+    ret->socket = uring_socket;
+    ret->connect = uring_connect;
+    ret->recv = uring_recv;
+    ret->send = uring_send;
+    ret->sendv = uring_sendv;
+    ret->close = uring_close;
+    ret->create_event = uring_create_event;
+    ret->update_event = uring_update_event;
+    ret->delete_event = uring_delete_event;
+    ret->destroy_event = uring_destroy_event;
+    ret->create_timer = uring_create_timer;
+    ret->update_timer = uring_update_timer;
+    ret->delete_timer = uring_delete_timer;
+    ret->destroy_timer = uring_destroy_timer;
+    ret->run_event_loop = uring_run_event_loop;
+    ret->stop_event_loop = uring_stop_event_loop;
+    ret->destroy = uring_destroy;
+
+    return ret;
+}
+
+#else
+
+LIBCOUCHBASE_API
+libcouchbase_io_opt_t *libcouchbase_create_io_uring_io_opts(bool registered_buffers)
+{
+    (void)registered_buffers;
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,468 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the near cache: an in-process cache of the values
+ * returned by the gets. The gets for the keys in the cache are served
+ * without asking the server, and the cache is kept coherent with the
+ * cluster through a keys-only TAP stream on the instance (a mutation
+ * or deletion of a key drops it from the cache).
+ *
+ * The cache is bounded by the number of bytes used by the items, and
+ * uses the CLOCK algorithm to pick the items to evict: a hit sets the
+ * referenced bit of the item, and the hand clears the bit of the items
+ * it passes until it finds an item not referenced since the last time.
+ *
+ * A response to a get may arrive after we've seen the invalidation of
+ * the key, in which case the value in the response may be stale. We
+ * remember the sequence number of the last invalidation for a range of
+ * keys, and don't cache a value if the key may have been invalidated
+ * after the get was sent. The cache is only used for the vbuckets
+ * covered by the TAP stream.
+ */
+#include "internal.h"
+
+/** The number of invalidation stamps (must be a power of two) */
+#define NEAR_CACHE_STAMPS 1024
+
+/** Don't create a hash table with less than 256 buckets */
+#define NEAR_CACHE_MIN_BUCKETS 256
+
+typedef struct near_cache_item_st {
+    /** The next item in the hash bucket */
+    struct near_cache_item_st *next;
+    /** The neighbours in the clock */
+    struct near_cache_item_st *clock_next;
+    struct near_cache_item_st *clock_prev;
+    /** The time (in milliseconds) the item was stored */
+    uint64_t stored;
+    uint64_t cas;
+    uint32_t hash;
+    uint32_t flags;
+    size_t nbytes;
+    uint16_t vb;
+    uint16_t nkey;
+    /** Was the item used since the hand passed it */
+    bool referenced;
+    /** Is the item in the hash table */
+    bool linked;
+    /** Are we passing the value to the user */
+    bool pinned;
+    /** The key followed by the value */
+    char data[1];
+} near_cache_item_t;
+
+typedef struct near_cache_st {
+    /** The maximum number of bytes used by the items */
+    size_t limit;
+    /** The number of bytes used by the items */
+    size_t used;
+    /** The number of items */
+    size_t count;
+    /** The maximum age of an item in milliseconds (0 for no limit) */
+    uint64_t max_age;
+    /** The hash table (the size is always a power of two) */
+    near_cache_item_t **buckets;
+    size_t nbuckets;
+    /** The next item to consider for eviction */
+    near_cache_item_t *hand;
+    /** The sequence number of the last invalidation for the keys */
+    uint32_t stamps[NEAR_CACHE_STAMPS];
+    /** The sequence number of the last time we dropped all items */
+    uint32_t flushed;
+    /** The vbuckets covered by the TAP stream */
+    bool *covered;
+    uint16_t ncovered;
+} near_cache_t;
+
+/** The number of bytes we count for an item */
+static size_t item_size(size_t nkey, size_t nbytes)
+{
+    return sizeof(near_cache_item_t) + nkey + nbytes;
+}
+
+static uint32_t hash_key(uint16_t vb, const void *key, size_t nkey)
+{
+    const unsigned char *ptr = key;
+    uint32_t hash = 2166136261U;
+    size_t ii;
+
+    hash = (hash ^ (vb & 0xff)) * 16777619U;
+    hash = (hash ^ (vb >> 8)) * 16777619U;
+    for (ii = 0; ii < nkey; ++ii) {
+        hash = (hash ^ ptr[ii]) * 16777619U;
+    }
+    return hash;
+}
+
+/**
+ * Check if an invalidation with the given sequence number happened
+ * after a get was sent (the sequence numbers wrap)
+ * @param instance the instance the get was sent from
+ * @param opaque the opaque field of the get
+ * @param stamp the sequence number of the invalidation
+ */
+static bool invalidated_since(libcouchbase_t instance, uint32_t opaque,
+                              uint32_t stamp)
+{
+    return (uint32_t)(stamp - opaque) <= (uint32_t)(instance->shard.seqno - opaque);
+}
+
+static bool is_covered(near_cache_t *cache, uint16_t vb)
+{
+    return vb < cache->ncovered && cache->covered[vb];
+}
+
+static near_cache_item_t **find_item(near_cache_t *cache, uint32_t hash,
+                                     uint16_t vb, const void *key,
+                                     size_t nkey)
+{
+    near_cache_item_t **ptr = cache->buckets + (hash & (cache->nbuckets - 1));
+
+    while (*ptr != NULL) {
+        near_cache_item_t *item = *ptr;
+        if (item->hash == hash && item->vb == vb && item->nkey == nkey &&
+            memcmp(item->data, key, nkey) == 0) {
+            break;
+        }
+        ptr = &item->next;
+    }
+    return ptr;
+}
+
+/**
+ * Remove an item from the hash table and the clock. The item is
+ * released unless we're passing its value to the user.
+ */
+static void unlink_item(near_cache_t *cache, near_cache_item_t *item)
+{
+    near_cache_item_t **ptr = cache->buckets + (item->hash & (cache->nbuckets - 1));
+
+    while (*ptr != item) {
+        ptr = &(*ptr)->next;
+    }
+    *ptr = item->next;
+
+    if (item->clock_next == item) {
+        cache->hand = NULL;
+    } else {
+        if (cache->hand == item) {
+            cache->hand = item->clock_next;
+        }
+        item->clock_prev->clock_next = item->clock_next;
+        item->clock_next->clock_prev = item->clock_prev;
+    }
+
+    cache->used -= item_size(item->nkey, item->nbytes);
+    --cache->count;
+    item->linked = false;
+    if (!item->pinned) {
+        free(item);
+    }
+}
+
+/**
+ * Evict items until there is room for the given number of bytes
+ */
+static void make_room(near_cache_t *cache, size_t size)
+{
+    while (cache->hand != NULL && cache->used + size > cache->limit) {
+        near_cache_item_t *item = cache->hand;
+        if (item->referenced) {
+            item->referenced = false;
+            cache->hand = item->clock_next;
+        } else {
+            unlink_item(cache, item);
+        }
+    }
+}
+
+/**
+ * Double the size of the hash table (if we can)
+ */
+static void grow_table(near_cache_t *cache)
+{
+    size_t next = cache->nbuckets << 1;
+    near_cache_item_t **buckets = calloc(next, sizeof(*buckets));
+    size_t ii;
+
+    if (buckets == NULL) {
+        /* Use longer chains */
+        return;
+    }
+
+    for (ii = 0; ii < cache->nbuckets; ++ii) {
+        near_cache_item_t *item = cache->buckets[ii];
+        while (item != NULL) {
+            near_cache_item_t *next_item = item->next;
+            near_cache_item_t **ptr = buckets + (item->hash & (next - 1));
+            item->next = *ptr;
+            *ptr = item;
+            item = next_item;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = next;
+}
+
+static void drop_all(near_cache_t *cache)
+{
+    while (cache->hand != NULL) {
+        unlink_item(cache, cache->hand);
+    }
+}
+
+bool libcouchbase_near_cache_get(libcouchbase_t instance,
+                                 const void *command_cookie,
+                                 uint16_t vb,
+                                 const void *key, size_t nkey)
+{
+    near_cache_t *cache = instance->near_cache;
+    near_cache_item_t *item;
+
+    if (cache == NULL || !is_covered(cache, vb)) {
+        return false;
+    }
+
+    item = *find_item(cache, hash_key(vb, key, nkey), vb, key, nkey);
+    if (item == NULL) {
+        return false;
+    }
+
+    if (cache->max_age != 0 &&
+        libcouchbase_get_msec() - item->stored > cache->max_age) {
+        unlink_item(cache, item);
+        return false;
+    }
+
+    /* The callback may invalidate the item */
+    item->referenced = true;
+    item->pinned = true;
+    instance->callbacks.get(instance, command_cookie, LIBCOUCHBASE_SUCCESS,
+                            item->data, item->nkey,
+                            item->data + item->nkey, item->nbytes,
+                            item->flags, item->cas);
+    item->pinned = false;
+    if (!item->linked) {
+        free(item);
+    }
+
+    return true;
+}
+
+void libcouchbase_near_cache_store(libcouchbase_t instance,
+                                   uint32_t opaque,
+                                   uint16_t vb,
+                                   const void *key, size_t nkey,
+                                   const void *bytes, size_t nbytes,
+                                   uint32_t flags, uint64_t cas)
+{
+    near_cache_t *cache = instance->near_cache;
+    near_cache_item_t **ptr;
+    near_cache_item_t *item;
+    uint32_t hash;
+    size_t size = item_size(nkey, nbytes);
+
+    if (cache == NULL || !is_covered(cache, vb) || size > cache->limit) {
+        return;
+    }
+
+    hash = hash_key(vb, key, nkey);
+    if (invalidated_since(instance, opaque,
+                          cache->stamps[hash & (NEAR_CACHE_STAMPS - 1)]) ||
+        invalidated_since(instance, opaque, cache->flushed)) {
+        return;
+    }
+
+    if ((item = *find_item(cache, hash, vb, key, nkey)) != NULL) {
+        unlink_item(cache, item);
+    }
+
+    make_room(cache, size);
+    if ((item = malloc(size)) == NULL) {
+        return;
+    }
+
+    item->stored = libcouchbase_get_msec();
+    item->cas = cas;
+    item->hash = hash;
+    item->flags = flags;
+    item->nbytes = nbytes;
+    item->vb = vb;
+    item->nkey = (uint16_t)nkey;
+    item->referenced = false;
+    item->linked = true;
+    item->pinned = false;
+    memcpy(item->data, key, nkey);
+    memcpy(item->data + nkey, bytes, nbytes);
+
+    if (cache->count >= cache->nbuckets) {
+        grow_table(cache);
+    }
+    ptr = cache->buckets + (hash & (cache->nbuckets - 1));
+    item->next = *ptr;
+    *ptr = item;
+
+    /* Insert it just behind the hand (it is considered last) */
+    if (cache->hand == NULL) {
+        item->clock_next = item->clock_prev = item;
+        cache->hand = item;
+    } else {
+        item->clock_next = cache->hand;
+        item->clock_prev = cache->hand->clock_prev;
+        item->clock_prev->clock_next = item;
+        cache->hand->clock_prev = item;
+    }
+
+    cache->used += size;
+    ++cache->count;
+}
+
+void libcouchbase_near_cache_invalidate(libcouchbase_t instance,
+                                        uint16_t vb,
+                                        const void *key, size_t nkey)
+{
+    near_cache_t *cache = instance->near_cache;
+    near_cache_item_t *item;
+    uint32_t hash;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    hash = hash_key(vb, key, nkey);
+    cache->stamps[hash & (NEAR_CACHE_STAMPS - 1)] = instance->shard.seqno;
+    if ((item = *find_item(cache, hash, vb, key, nkey)) != NULL) {
+        unlink_item(cache, item);
+    }
+}
+
+void libcouchbase_near_cache_flush(libcouchbase_t instance)
+{
+    near_cache_t *cache = instance->near_cache;
+
+    if (cache != NULL) {
+        cache->flushed = instance->shard.seqno;
+        drop_all(cache);
+    }
+}
+
+void libcouchbase_near_cache_cover(libcouchbase_t instance, uint16_t vb)
+{
+    near_cache_t *cache = instance->near_cache;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache->ncovered != instance->nvbuckets) {
+        bool *covered = calloc(instance->nvbuckets, sizeof(bool));
+        if (covered == NULL) {
+            return;
+        }
+        free(cache->covered);
+        cache->covered = covered;
+        cache->ncovered = instance->nvbuckets;
+    }
+
+    if (vb < cache->ncovered) {
+        cache->covered[vb] = true;
+    }
+}
+
+void libcouchbase_near_cache_config_changed(libcouchbase_t instance,
+                                            const uint16_t *old_map,
+                                            uint16_t old_nvbuckets,
+                                            const size_t *origin)
+{
+    near_cache_t *cache = instance->near_cache;
+    uint16_t ii;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    /* We may have missed invalidations while the vbuckets moved */
+    libcouchbase_near_cache_flush(instance);
+
+    if (cache->ncovered != old_nvbuckets ||
+        cache->ncovered != instance->nvbuckets) {
+        free(cache->covered);
+        cache->covered = NULL;
+        cache->ncovered = 0;
+        return;
+    }
+
+    /* The streams only cover the vbuckets the server had when we
+     * connected, so a vbucket is still covered if it didn't move */
+    for (ii = 0; ii < cache->ncovered; ++ii) {
+        size_t idx = instance->vb_server_map[ii];
+        if (idx >= instance->nservers || origin[idx] != old_map[ii]) {
+            cache->covered[ii] = false;
+        }
+    }
+}
+
+void libcouchbase_near_cache_destroy(libcouchbase_t instance)
+{
+    near_cache_t *cache = instance->near_cache;
+
+    if (cache != NULL) {
+        drop_all(cache);
+        free(cache->covered);
+        free(cache->buckets);
+        free(cache);
+        instance->near_cache = NULL;
+    }
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_set_near_cache(libcouchbase_t instance,
+                                                 size_t nbytes,
+                                                 uint32_t usec)
+{
+    near_cache_t *cache = instance->near_cache;
+
+    if (libcouchbase_threads_shared(instance)) {
+        /* The cache is only touched by the event loop of the instance */
+        return LIBCOUCHBASE_NOT_SUPPORTED;
+    }
+
+    if (cache == NULL) {
+        if (nbytes == 0) {
+            return LIBCOUCHBASE_SUCCESS;
+        }
+        if ((cache = calloc(1, sizeof(*cache))) == NULL ||
+            (cache->buckets = calloc(NEAR_CACHE_MIN_BUCKETS,
+                                     sizeof(*cache->buckets))) == NULL) {
+            free(cache);
+            return LIBCOUCHBASE_ENOMEM;
+        }
+        cache->nbuckets = NEAR_CACHE_MIN_BUCKETS;
+        instance->near_cache = cache;
+        libcouchbase_tap_keys(instance);
+    }
+
+    /* A disabled cache keeps the TAP stream (we can't stop it) */
+    cache->limit = nbytes;
+    cache->max_age = (usec + 999) / 1000;
+    make_room(cache, 0);
+
+    return LIBCOUCHBASE_SUCCESS;
+}
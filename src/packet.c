@@ -25,31 +25,27 @@
 #include "internal.h"
 
 void libcouchbase_server_buffer_start_packet(libcouchbase_server_t *c,
-                                             buffer_t *buff,
+                                             chain_t *buff,
                                              const void *data,
                                              size_t size)
 {
-    (void)c;
-    if (size > 0) {
-        grow_buffer(buff, size);
-        memcpy(buff->data + buff->avail, data, size);
-        buff->avail += size;
+    if (size > 0 && !libcouchbase_chain_write(c->instance, buff, data, size)) {
+        libcouchbase_current_shard(c->instance)->packet.failed = true;
     }
 }
 
 void libcouchbase_server_buffer_write_packet(libcouchbase_server_t *c,
-                                             buffer_t *buff,
+                                             chain_t *buff,
                                              const void *data,
                                              size_t size)
 {
-    (void)c;
-    grow_buffer(buff, size);
-    memcpy(buff->data + buff->avail, data, size);
-    buff->avail += size;
+    if (!libcouchbase_chain_write(c->instance, buff, data, size)) {
+        libcouchbase_current_shard(c->instance)->packet.failed = true;
+    }
 }
 
 void libcouchbase_server_buffer_end_packet(libcouchbase_server_t *c,
-                                           buffer_t *buff)
+                                           chain_t *buff)
 {
     (void)c;
     (void)buff;
@@ -57,69 +53,213 @@ void libcouchbase_server_buffer_end_packet(libcouchbase_server_t *c,
 }
 
 void libcouchbase_server_buffer_complete_packet(libcouchbase_server_t *c,
-                                                buffer_t *buff,
+                                                chain_t *buff,
                                                 const void *data,
                                                 size_t size)
 {
-    (void)c;
-    grow_buffer(buff, size);
-    memcpy(buff->data + buff->avail, data, size);
-    buff->avail += size;
+    if (!libcouchbase_chain_write(c->instance, buff, data, size)) {
+        libcouchbase_current_shard(c->instance)->packet.failed = true;
+    }
+}
+
+/**
+ * Get the chain we should write packets to for a server
+ * @param c the server to write to
+ * @return the chain to write to
+ */
+static chain_t *get_chain(libcouchbase_server_t *c)
+{
+    if (!libcouchbase_server_is_local(c)) {
+        /* The packet is passed to the thread owning the server */
+        return &libcouchbase_current_shard(c->instance)->forward.chain;
+    }
+    if (c->connected) {
+        return &c->output;
+    }
+    return &c->pending;
+}
+
+/**
+ * The value of a key may change when we send anything but a get, so
+ * the gets spooled after it can't be coalesced with the gets spooled
+ * before it
+ * @param c the server the packet is sent to
+ * @param data the beginning of the packet
+ * @param size the number of bytes in data
+ */
+static void invalidate_coalesced(libcouchbase_server_t *c,
+                                 const void *data, size_t size)
+{
+    const protocol_binary_request_header *req = data;
+    if (size < sizeof(*req) ||
+        (req->request.opcode != PROTOCOL_BINARY_CMD_GET &&
+         req->request.opcode != PROTOCOL_BINARY_CMD_GETQ)) {
+        libcouchbase_coalesce_invalidate(c);
+    }
+}
+
+/**
+ * Add a packet to the command log of the server, or pass it on to the
+ * thread owning the server.
+ *
+ * @param c the server the packet is sent to
+ * @param chain the chain containing the packet
+ * @param mark the beginning of the packet
+ * @param command_cookie the cookie passed to the callback for the command
+ * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
+ */
+static libcouchbase_error_t track_packet(libcouchbase_server_t *c,
+                                         chain_t *chain,
+                                         const chain_mark_t *mark,
+                                         const void *command_cookie)
+{
+    if (!libcouchbase_server_is_local(c)) {
+        return libcouchbase_forward_packet(c, command_cookie);
+    }
+
+    if (!libcouchbase_cmd_log_append(&c->cmd_log, chain, mark,
+                                     c->instance->retain_values,
+                                     command_cookie)) {
+        return LIBCOUCHBASE_ENOMEM;
+    }
+    libcouchbase_timeout_start(c);
+    return LIBCOUCHBASE_SUCCESS;
 }
 
 void libcouchbase_server_start_packet(libcouchbase_server_t *c,
+                                      const void *command_cookie,
                                       const void *data,
                                       size_t size)
 {
-    assert(c->current_packet == (size_t)-1);
-    if (c->connected) {
-        c->current_packet = c->output.avail;
-        libcouchbase_server_buffer_start_packet(c, &c->output, data, size);
-    } else {
-        c->current_packet = c->pending.avail;
-        libcouchbase_server_buffer_start_packet(c, &c->pending, data, size);
-    }
+    shard_t *shard = libcouchbase_current_shard(c->instance);
+    chain_t *chain = get_chain(c);
+    assert(shard->packet.mark.offset == (size_t)-1);
+    invalidate_coalesced(c, data, size);
+    libcouchbase_chain_get_mark(chain, &shard->packet.mark);
+    shard->packet.chain = chain;
+    shard->packet.cookie = command_cookie;
+    shard->packet.failed = false;
+    libcouchbase_server_buffer_start_packet(c, chain, data, size);
 }
 
 void libcouchbase_server_write_packet(libcouchbase_server_t *c,
                                       const void *data,
                                       size_t size)
 {
-    if (c->connected) {
-        libcouchbase_server_buffer_write_packet(c, &c->output, data, size);
-    } else {
-        libcouchbase_server_buffer_write_packet(c, &c->pending, data, size);
+    shard_t *shard = libcouchbase_current_shard(c->instance);
+    libcouchbase_server_buffer_write_packet(c, shard->packet.chain,
+                                            data, size);
+}
+
+void libcouchbase_server_write_packet_ref(libcouchbase_server_t *c,
+                                          const void *data,
+                                          size_t size,
+                                          chain_ref_t *ref)
+{
+    shard_t *shard = libcouchbase_current_shard(c->instance);
+
+    /*
+     * The packet filter expects the complete packet in a contiguous
+     * block of memory, so we have to copy the data if the user
+     * installed one. The references aren't shared between threads,
+     * so we copy the data for packets passed to another thread too.
+     */
+    if (c->instance->packet_filter != libcouchbase_default_packet_filter ||
+        !libcouchbase_server_is_local(c)) {
+        libcouchbase_server_write_packet(c, data, size);
+    } else if (size > 0 &&
+               !libcouchbase_chain_add_ref(shard->packet.chain, data,
+                                           size, ref)) {
+        shard->packet.failed = true;
     }
 }
 
-void libcouchbase_server_end_packet(libcouchbase_server_t *c)
+void libcouchbase_server_write_packet_iov(libcouchbase_server_t *c,
+                                          const libcouchbase_iov_t *iov,
+                                          size_t niov,
+                                          libcouchbase_release_t release,
+                                          const void *cookie)
 {
-    buffer_t *buff;
+    shard_t *shard = libcouchbase_current_shard(c->instance);
+    chain_ref_t *ref = NULL;
+    size_t ii;
 
-    if (c->connected) {
-        buff = &c->output;
-    } else {
-        buff = &c->pending;
+    if (release != NULL &&
+        (ref = libcouchbase_chain_ref_create(release, cookie)) == NULL) {
+        shard->packet.failed = true;
+        release(c->instance, cookie);
+        return;
     }
 
-    if (!c->instance->packet_filter(c->instance, buff->data + c->current_packet)) {
-        buff->avail = c->current_packet;
+    for (ii = 0; ii < niov && !shard->packet.failed; ++ii) {
+        libcouchbase_server_write_packet_ref(c, iov[ii].iov_base,
+                                             iov[ii].iov_len, ref);
     }
-    assert(c->current_packet != (size_t)-1);
-    c->current_packet = (size_t)-1;
+
+    /* The memory is released when all of the segments are sent (or
+     * right away if we copied the data) */
+    libcouchbase_chain_ref_release(c->instance, ref);
 }
 
-void libcouchbase_server_complete_packet(libcouchbase_server_t *c,
-                                         const void *data,
-                                         size_t size)
+libcouchbase_error_t libcouchbase_server_end_packet(libcouchbase_server_t *c)
 {
-    assert(c->current_packet == (size_t)-1);
-    if (c->instance->packet_filter(c->instance, data)) {
-        if (c->connected) {
-            libcouchbase_server_buffer_complete_packet(c, &c->output, data, size);
+    shard_t *shard = libcouchbase_current_shard(c->instance);
+    chain_t *chain = shard->packet.chain;
+    libcouchbase_error_t ret = LIBCOUCHBASE_SUCCESS;
+    bool keep = true;
+
+    assert(shard->packet.mark.offset != (size_t)-1);
+    if (shard->packet.failed) {
+        ret = LIBCOUCHBASE_ENOMEM;
+    } else if (c->instance->packet_filter != libcouchbase_default_packet_filter) {
+        size_t size = chain->nbytes - shard->packet.mark.nbytes;
+        char *packet = malloc(size);
+        if (packet == NULL) {
+            ret = LIBCOUCHBASE_ENOMEM;
         } else {
-            libcouchbase_server_buffer_complete_packet(c, &c->pending,
-                                                       data, size);
+            libcouchbase_chain_copy(chain, &shard->packet.mark, packet, size);
+            keep = c->instance->packet_filter(c->instance, packet);
+            free(packet);
         }
     }
+
+    if (ret == LIBCOUCHBASE_SUCCESS && keep) {
+        ret = track_packet(c, chain, &shard->packet.mark,
+                           shard->packet.cookie);
+    }
+
+    if (ret != LIBCOUCHBASE_SUCCESS || !keep) {
+        /* Don't send a partial packet (or one we can't track) */
+        libcouchbase_chain_truncate(c->instance, chain, &shard->packet.mark);
+    }
+    shard->packet.mark.offset = (size_t)-1;
+    return ret;
+}
+
+libcouchbase_error_t libcouchbase_server_complete_packet(libcouchbase_server_t *c,
+                                                         const void *command_cookie,
+                                                         const void *data,
+                                                         size_t size)
+{
+    shard_t *shard = libcouchbase_current_shard(c->instance);
+    chain_t *chain;
+    chain_mark_t mark;
+
+    assert(shard->packet.mark.offset == (size_t)-1);
+    invalidate_coalesced(c, data, size);
+    if (!c->instance->packet_filter(c->instance, data)) {
+        return LIBCOUCHBASE_SUCCESS;
+    }
+
+    chain = get_chain(c);
+    libcouchbase_chain_get_mark(chain, &mark);
+    shard->packet.failed = false;
+    libcouchbase_server_buffer_complete_packet(c, chain, data, size);
+    if (!shard->packet.failed &&
+        track_packet(c, chain, &mark, command_cookie) == LIBCOUCHBASE_SUCCESS) {
+        return LIBCOUCHBASE_SUCCESS;
+    }
+
+    libcouchbase_chain_truncate(c->instance, chain, &mark);
+    return LIBCOUCHBASE_ENOMEM;
 }
@@ -17,6 +17,66 @@
 
 #include "internal.h"
 
+/**
+ * Encode a delete command and add it to the server's output buffer.
+ *
+ * @param instance the handle to libcouchbase
+ * @param command_cookie the cookie passed to the callback for the command
+ * @param quiet set to true to use the quiet version of the command
+ * @param hashkey the key to use for hashing (or NULL to use the key)
+ * @param nhashkey the number of bytes in hashkey
+ * @param key the key to delete
+ * @param nkey the number of bytes in the key
+ * @param cas the cas value for the object (or 0 if you don't care)
+ * @param out where to store the server the command is sent to
+ * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
+ */
+static libcouchbase_error_t encode_remove(libcouchbase_t instance,
+                                          const void *command_cookie,
+                                          bool quiet,
+                                          const void *hashkey,
+                                          size_t nhashkey,
+                                          const void *key, size_t nkey,
+                                          uint64_t cas,
+                                          libcouchbase_server_t **out)
+{
+    uint16_t vb;
+    libcouchbase_server_t *server;
+    protocol_binary_request_delete req;
+
+    if (nhashkey != 0) {
+        vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
+                                                  hashkey, nhashkey);
+    } else {
+        vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
+                                                  key, nkey);
+    }
+
+    server = instance->servers + instance->vb_server_map[vb];
+    *out = server;
+    memset(&req, 0, sizeof(req));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    if (quiet) {
+        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_DELETEQ;
+    } else {
+        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_DELETE;
+    }
+    req.message.header.request.keylen = ntohs((uint16_t)nkey);
+    req.message.header.request.extlen = 0;
+    req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    req.message.header.request.vbucket = ntohs(vb);
+    req.message.header.request.bodylen = ntohl((uint32_t)nkey);
+    req.message.header.request.opaque = libcouchbase_server_next_seqno(server);
+    req.message.header.request.cas = cas;
+    libcouchbase_near_cache_invalidate(instance, vb, key, nkey);
+    libcouchbase_shared_cache_invalidate(instance, vb, key, nkey);
+
+    libcouchbase_server_start_packet(server, command_cookie, req.bytes,
+                                     sizeof(req.bytes));
+    libcouchbase_server_write_packet(server, key, nkey);
+    return libcouchbase_server_end_packet(server);
+}
+
 /**
  * Send a delete command to the correct server
  *
@@ -25,51 +85,90 @@
  */
 LIBCOUCHBASE_API
 libcouchbase_error_t libcouchbase_remove(libcouchbase_t instance,
+                                         const void *command_cookie,
                                          const void *key, size_t nkey,
                                          uint64_t cas)
 {
-    return libcouchbase_remove_by_key(instance, NULL, 0, key, nkey, cas);
+    return libcouchbase_remove_by_key(instance, command_cookie, NULL, 0,
+                                      key, nkey, cas);
 }
 
 LIBCOUCHBASE_API
 libcouchbase_error_t libcouchbase_remove_by_key(libcouchbase_t instance,
+                                                const void *command_cookie,
                                                 const void *hashkey,
                                                 size_t nhashkey,
                                                 const void *key, size_t nkey,
                                                 uint64_t cas)
 {
-    uint16_t vb;
     libcouchbase_server_t *server;
-    protocol_binary_request_delete req;
+    libcouchbase_error_t ret;
 
     // we need a vbucket config before we can start removing the item..
     libcouchbase_ensure_vbucket_config(instance);
     assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
 
-    if (nhashkey != 0) {
-        vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
-                                                  hashkey, nhashkey);
-    } else {
-        vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
-                                                  key, nkey);
+    ret = encode_remove(instance, command_cookie, false,
+                        hashkey, nhashkey, key, nkey, cas, &server);
+    if (ret == LIBCOUCHBASE_SUCCESS) {
+        libcouchbase_server_send_packets(server);
     }
 
-    server = instance->servers + instance->vb_server_map[vb];
-    memset(&req, 0, sizeof(req));
-    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
-    req.message.header.request.opcode = PROTOCOL_BINARY_CMD_DELETE;
-    req.message.header.request.keylen = ntohs((uint16_t)nkey);
-    req.message.header.request.extlen = 0;
-    req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
-    req.message.header.request.vbucket = ntohs(vb);
-    req.message.header.request.bodylen = ntohl((uint32_t)nkey);
-    req.message.header.request.opaque = ++instance->seqno;
-    req.message.header.request.cas = cas;
+    return ret;
+}
 
-    libcouchbase_server_start_packet(server, req.bytes, sizeof(req.bytes));
-    libcouchbase_server_write_packet(server, key, nkey);
-    libcouchbase_server_end_packet(server);
-    libcouchbase_server_send_packets(server);
+/**
+ * libcouchbase_mremove use the DELETEQ command followed by a NOOP
+ * command to avoid transferring the responses for the items we
+ * removed. The success callbacks are generated implicit by receiving
+ * a failure response or the NOOP.
+ */
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_mremove(libcouchbase_t instance,
+                                          const void * const *command_cookies,
+                                          size_t num_keys,
+                                          const void * const *keys,
+                                          const size_t *nkey,
+                                          const uint64_t *cas)
+{
+    return libcouchbase_mremove_by_key(instance, command_cookies, NULL, 0,
+                                       num_keys, keys, nkey, cas);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_mremove_by_key(libcouchbase_t instance,
+                                                 const void * const *command_cookies,
+                                                 const void *hashkey,
+                                                 size_t nhashkey,
+                                                 size_t num_keys,
+                                                 const void * const *keys,
+                                                 const size_t *nkey,
+                                                 const uint64_t *cas)
+{
+    libcouchbase_server_t *server = NULL;
+    libcouchbase_error_t ret = LIBCOUCHBASE_SUCCESS;
+    size_t ii;
+
+    // we need a vbucket config before we can start removing the items..
+    libcouchbase_ensure_vbucket_config(instance);
+    assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
+
+    for (ii = 0; ii < num_keys && ret == LIBCOUCHBASE_SUCCESS; ++ii) {
+        ret = encode_remove(instance,
+                            command_cookies ? command_cookies[ii] : NULL,
+                            true,
+                            hashkey, nhashkey, keys[ii], nkey[ii],
+                            cas ? cas[ii] : 0, &server);
+        if (ret == LIBCOUCHBASE_SUCCESS) {
+            libcouchbase_server_fence(server);
+        }
+    }
+
+    if (nhashkey == 0 || server != NULL) {
+        libcouchbase_send_fenced(instance, nhashkey == 0 ? NULL : server);
+    }
 
-    return LIBCOUCHBASE_SUCCESS;
+    return ret;
 }
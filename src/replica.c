@@ -0,0 +1,333 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the functions to read from the replicas, and the
+ * logic for hedged reads: if the master didn't respond to a get within
+ * the hedge timeout, the get is sent to the first replica as well. The
+ * user gets the first successful response (or the response from the
+ * master), and the other response is suppressed.
+ *
+ * The two commands of a hedged read refer to each other through the
+ * server index and opaque stored in their command log entries.
+ */
+#include "internal.h"
+
+/**
+ * Send a GET_REPLICA for a key to a server
+ * @param server the server to send the command to
+ * @param command_cookie the cookie passed to the callback for the command
+ * @param vb the vbucket for the key
+ * @param key the key to get
+ * @param nkey the number of bytes in the key
+ * @param entry where to store the entry in the command log for the
+ *              command (NULL if the packet filter dropped it)
+ * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
+ */
+static libcouchbase_error_t send_get_replica(libcouchbase_server_t *server,
+                                             const void *command_cookie,
+                                             uint16_t vb,
+                                             const void *key, size_t nkey,
+                                             cmd_log_entry_t **entry)
+{
+    protocol_binary_request_get req;
+    libcouchbase_error_t ret;
+    cmd_log_entry_t *tail;
+    memset(&req, 0, sizeof(req));
+    req.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    req.message.header.request.opcode = PROTOCOL_BINARY_CMD_GET_REPLICA;
+    req.message.header.request.keylen = ntohs((uint16_t)nkey);
+    req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    req.message.header.request.vbucket = ntohs(vb);
+    req.message.header.request.bodylen = ntohl((uint32_t)nkey);
+    req.message.header.request.opaque = libcouchbase_server_next_seqno(server);
+
+    libcouchbase_server_start_packet(server, command_cookie, req.bytes,
+                                     sizeof(req.bytes));
+    libcouchbase_server_write_packet(server, key, nkey);
+    if ((ret = libcouchbase_server_end_packet(server)) != LIBCOUCHBASE_SUCCESS) {
+        return ret;
+    }
+    libcouchbase_server_send_packets(server);
+
+    tail = libcouchbase_cmd_log_tail(&server->cmd_log);
+    if (tail == NULL || tail->opaque != req.message.header.request.opaque) {
+        /* Dropped by the packet filter */
+        tail = NULL;
+    }
+    if (entry != NULL) {
+        *entry = tail;
+    }
+    return LIBCOUCHBASE_SUCCESS;
+}
+
+/** The flags for a command being part of a hedged read */
+#define CMD_HEDGE (CMD_HEDGE_MASTER | CMD_HEDGE_REPLICA)
+
+/**
+ * Locate the other command of a hedged read
+ * @param instance the instance the command belongs to
+ * @param entry the entry to find the peer for
+ * @param log where to store the command log with the peer (OUT)
+ * @return the entry for the other command, or NULL if it's gone
+ */
+static cmd_log_entry_t *find_peer(libcouchbase_t instance,
+                                  cmd_log_entry_t *entry,
+                                  cmd_log_t **log)
+{
+    cmd_log_entry_t *peer;
+
+    if (entry->peer_server >= instance->nservers) {
+        return NULL;
+    }
+    *log = &instance->servers[entry->peer_server].cmd_log;
+    peer = libcouchbase_cmd_log_at(*log, entry->peer_position);
+    if (peer == NULL || peer->opaque != entry->peer_opaque) {
+        return NULL;
+    }
+    return peer;
+}
+
+bool libcouchbase_hedge_resolve(libcouchbase_server_t *server,
+                                cmd_log_entry_t *entry,
+                                bool success)
+{
+    cmd_log_entry_t *peer;
+    cmd_log_t *log;
+
+    if (entry->flags & CMD_COMPLETED) {
+        return false;
+    }
+
+    if ((entry->flags & CMD_HEDGE) == 0) {
+        return true;
+    }
+
+    peer = find_peer(server->instance, entry, &log);
+    if ((entry->flags & CMD_HEDGE_REPLICA) && !success) {
+        /* The replica may be behind, so let the master answer */
+        if (peer != NULL) {
+            peer->flags &= (uint8_t)~CMD_HEDGE;
+        }
+        return false;
+    }
+
+    if (peer != NULL) {
+        /* Report the result to the gets coalesced with the peer too */
+        if (entry->waiters == NULL) {
+            entry->waiters = peer->waiters;
+            peer->waiters = NULL;
+        }
+        libcouchbase_cmd_log_complete(log, peer);
+    }
+    return true;
+}
+
+bool libcouchbase_hedge_release(libcouchbase_server_t *server,
+                                cmd_log_entry_t *entry)
+{
+    cmd_log_entry_t *peer;
+    cmd_log_t *log;
+
+    if (entry->flags & CMD_COMPLETED) {
+        return true;
+    }
+
+    if ((entry->flags & CMD_HEDGE) == 0) {
+        return false;
+    }
+
+    peer = find_peer(server->instance, entry, &log);
+    if (peer != NULL) {
+        /* Let the other command report the result */
+        peer->flags &= (uint8_t)~CMD_HEDGE;
+        if (peer->waiters == NULL) {
+            peer->waiters = entry->waiters;
+            entry->waiters = NULL;
+        }
+        return true;
+    }
+
+    /* The master is still responsible for the result */
+    return (entry->flags & CMD_HEDGE_REPLICA) != 0;
+}
+
+void libcouchbase_hedge_reset(libcouchbase_t instance)
+{
+    size_t ii;
+
+    for (ii = 0; ii < instance->nservers; ++ii) {
+        cmd_log_t *log = &instance->servers[ii].cmd_log;
+        size_t jj;
+
+        for (jj = 0; jj < log->count; ++jj) {
+            cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(log, jj);
+            if (entry->flags & CMD_HEDGE_REPLICA) {
+                libcouchbase_cmd_log_complete(log, entry);
+            }
+            entry->flags &= (uint8_t)~CMD_HEDGE;
+        }
+    }
+}
+
+/**
+ * Send the gets the masters haven't responded to within the hedge
+ * timeout to the first replica.
+ */
+static void hedge_timer_handler(libcouchbase_socket_t sock, short which,
+                                void *arg)
+{
+    libcouchbase_t instance = arg;
+    libcouchbase_operation_t operation = instance->shard.operation;
+    bool pending = false;
+    size_t ii;
+    (void)sock;
+    (void)which;
+
+    instance->hedge.armed = false;
+    for (ii = 0; ii < instance->nservers; ++ii) {
+        cmd_log_t *log = &instance->servers[ii].cmd_log;
+        size_t jj;
+
+        for (jj = 0; jj < log->count; ++jj) {
+            cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(log, jj);
+            cmd_log_entry_t *replica;
+            protocol_binary_request_header *req;
+            uint16_t vb;
+            int idx;
+
+            if ((entry->flags & (CMD_HEDGE | CMD_COMPLETED)) != 0 ||
+                (jj == 0 && instance->servers[ii].stream.remaining > 0) ||
+                (entry->opcode != PROTOCOL_BINARY_CMD_GETQ &&
+                 entry->opcode != PROTOCOL_BINARY_CMD_GET)) {
+                continue;
+            }
+
+            if (entry->opaque > instance->hedge.seqno) {
+                /* Sent after the timer was started */
+                pending = true;
+                continue;
+            }
+
+            req = libcouchbase_cmd_log_packet(log, entry);
+            vb = ntohs(req->request.vbucket);
+            idx = vbucket_get_replica(instance->vbucket_config, vb, 0);
+            if (idx < 0 || (size_t)idx >= instance->nservers ||
+                (size_t)idx == ii) {
+                continue;
+            }
+
+            /* Sending the command may move the entries in the log of
+             * the replica (but not in this log) */
+            instance->shard.operation = entry->operation;
+            if (send_get_replica(instance->servers + idx, entry->cookie, vb,
+                                 (const char*)(req + 1) + req->request.extlen,
+                                 ntohs(req->request.keylen),
+                                 &replica) != LIBCOUCHBASE_SUCCESS) {
+                replica = NULL;
+            }
+            instance->shard.operation = operation;
+            if (replica == NULL) {
+                continue;
+            }
+            entry->flags |= CMD_HEDGE_MASTER;
+            entry->peer_server = (uint16_t)idx;
+            entry->peer_opaque = replica->opaque;
+            /* The replica was appended to the tail of its log */
+            entry->peer_position = instance->servers[idx].cmd_log.first +
+                instance->servers[idx].cmd_log.count - 1;
+            replica->flags |= CMD_HEDGE_REPLICA;
+            replica->peer_server = (uint16_t)ii;
+            replica->peer_opaque = entry->opaque;
+            replica->peer_position = log->first + jj;
+        }
+    }
+
+    if (pending) {
+        libcouchbase_hedge_arm(instance);
+    }
+}
+
+void libcouchbase_hedge_arm(libcouchbase_t instance)
+{
+    libcouchbase_io_opt_t *io = instance->io;
+
+    if (instance->hedge.usec == 0 || instance->hedge.armed) {
+        return;
+    }
+
+    if (instance->hedge.timer == NULL &&
+        (instance->hedge.timer = io->create_timer(io)) == NULL) {
+        return;
+    }
+
+    instance->hedge.seqno = instance->shard.seqno;
+    if (io->update_timer(io, instance->hedge.timer, instance->hedge.usec,
+                         instance, hedge_timer_handler) == 0) {
+        instance->hedge.armed = true;
+    }
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_set_hedge_timeout(libcouchbase_t instance,
+                                                    uint32_t usec)
+{
+    if (usec > 0 && libcouchbase_threads_shared(instance)) {
+        /* The hedge timer looks at the command logs of all of the
+         * servers from the event loop of the instance */
+        return LIBCOUCHBASE_NOT_SUPPORTED;
+    }
+    instance->hedge.usec = usec;
+    return LIBCOUCHBASE_SUCCESS;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_get_replica(libcouchbase_t instance,
+                                              const void * const *command_cookies,
+                                              size_t num_keys,
+                                              const void * const *keys,
+                                              const size_t *nkey)
+{
+    libcouchbase_error_t ret = LIBCOUCHBASE_SUCCESS;
+    size_t ii;
+
+    // we need a vbucket config before we can start getting data..
+    libcouchbase_ensure_vbucket_config(instance);
+    assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
+
+    /* Don't send anything unless we've got a replica for all of them */
+    for (ii = 0; ii < num_keys; ++ii) {
+        int vb = vbucket_get_vbucket_by_key(instance->vbucket_config,
+                                            keys[ii], nkey[ii]);
+        int idx = vbucket_get_replica(instance->vbucket_config, vb, 0);
+        if (idx < 0 || (size_t)idx >= instance->nservers) {
+            return LIBCOUCHBASE_ERROR;
+        }
+    }
+
+    for (ii = 0; ii < num_keys && ret == LIBCOUCHBASE_SUCCESS; ++ii) {
+        int vb = vbucket_get_vbucket_by_key(instance->vbucket_config,
+                                            keys[ii], nkey[ii]);
+        int idx = vbucket_get_replica(instance->vbucket_config, vb, 0);
+        ret = send_get_replica(instance->servers + idx,
+                               command_cookies ? command_cookies[ii] : NULL,
+                               (uint16_t)vb, keys[ii], nkey[ii], NULL);
+    }
+
+    return ret;
+}
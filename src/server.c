@@ -30,22 +30,19 @@
  */
 void libcouchbase_server_destroy(libcouchbase_server_t *server)
 {
-    /* Cancel all pending commands */
-    libcouchbase_server_purge_implicit_responses(server,
-                                                 server->instance->seqno);
+    libcouchbase_io_opt_t *io = server->shard->io;
 
     if (server->sasl_conn != NULL) {
         sasl_dispose(&server->sasl_conn);
     }
 
-    if (server->ev_flags != 0) {
-        if (event_del(&server->ev_event) == -1) {
-            abort();
-        }
+    if (server->event != NULL) {
+        io->delete_event(io, server->sock, server->event);
+        io->destroy_event(io, server->event);
     }
 
     if (server->sock != INVALID_SOCKET) {
-        EVUTIL_CLOSESOCKET(server->sock);
+        io->close(io, server->sock);
     }
 
     if (server->root_ai != NULL) {
@@ -53,10 +50,11 @@ void libcouchbase_server_destroy(libcouchbase_server_t *server)
     }
 
     free(server->hostname);
-    free(server->output.data);
-    free(server->cmd_log.data);
-    free(server->pending.data);
+    libcouchbase_chain_destroy(server->instance, &server->output);
+    libcouchbase_cmd_log_destroy(&server->cmd_log);
+    libcouchbase_chain_destroy(server->instance, &server->pending);
     free(server->input.data);
+    --server->shard->nservers;
     memset(server, 0xff, sizeof(*server));
 }
 
@@ -68,7 +66,7 @@ void libcouchbase_server_destroy(libcouchbase_server_t *server)
  * @param buffz The size of the output buffer
  * @return true if success, false otherwise
  */
-static bool get_local_address(evutil_socket_t sock,
+static bool get_local_address(libcouchbase_socket_t sock,
                               char *buffer,
                               size_t bufsz)
 {
@@ -95,7 +93,7 @@ static bool get_local_address(evutil_socket_t sock,
  * @param buffz The size of the output buffer
  * @return true if success, false otherwise
  */
-static bool get_remote_address(evutil_socket_t sock,
+static bool get_remote_address(libcouchbase_socket_t sock,
                                char *buffer,
                                size_t bufsz)
 {
@@ -130,8 +128,8 @@ static void start_sasl_auth_server(libcouchbase_server_t *server)
 
     libcouchbase_server_buffer_complete_packet(server, &server->output,
                                                req.bytes, sizeof(req.bytes));
-    // send the data and add it to libevent..
-    libcouchbase_server_event_handler(0, EV_WRITE, server);
+    // send the data and add it to the event loop..
+    libcouchbase_server_event_handler(0, LIBCOUCHBASE_WRITE_EVENT, server);
 }
 
 void libcouchbase_server_connected(libcouchbase_server_t *server)
@@ -139,14 +137,10 @@ void libcouchbase_server_connected(libcouchbase_server_t *server)
     server->connected = true;
 
     // move all pending data!
-    if (server->pending.avail > 0) {
-        grow_buffer(&server->output, server->pending.avail);
-        memcpy(server->output.data + server->output.avail,
-               server->pending.data, server->pending.avail);
-        server->output.avail += server->pending.avail;
-        server->pending.avail = 0;
+    if (server->pending.nbytes > 0) {
+        libcouchbase_chain_move(&server->output, &server->pending);
         // Send the pending data!
-        libcouchbase_server_event_handler(0, EV_WRITE, server);
+        libcouchbase_server_event_handler(0, LIBCOUCHBASE_WRITE_EVENT, server);
     }
 }
 
@@ -170,7 +164,7 @@ static void socket_connected(libcouchbase_server_t *server)
     }
 
     // Set the correct event handler
-    libcouchbase_server_update_event(server, EV_READ,
+    libcouchbase_server_update_event(server, LIBCOUCHBASE_READ_EVENT,
                                      libcouchbase_server_event_handler);
 }
 
@@ -178,7 +172,7 @@ static bool server_connect(libcouchbase_server_t *server);
 static void try_next_server_connect(libcouchbase_server_t *server);
 
 
-static void server_connect_handler(evutil_socket_t sock, short which, void *arg)
+static void server_connect_handler(libcouchbase_socket_t sock, short which, void *arg)
 {
     libcouchbase_server_t *server = arg;
     (void)sock;
@@ -189,16 +183,17 @@ static void server_connect_handler(evutil_socket_t sock, short which, void *arg)
 }
 
 static bool server_connect(libcouchbase_server_t *server) {
+    libcouchbase_io_opt_t *io = server->shard->io;
     bool retry;
     do {
         retry = false;
-        if (connect(server->sock, server->curr_ai->ai_addr,
-                    server->curr_ai->ai_addrlen) == 0) {
+        if (io->connect(io, server->sock, server->curr_ai->ai_addr,
+                        (unsigned int)server->curr_ai->ai_addrlen) == 0) {
             // connected
             socket_connected(server);
             return true;
         } else {
-            switch (errno) {
+            switch (io->error) {
             case EINTR:
                 retry = true;
                 break;
@@ -207,7 +202,7 @@ static bool server_connect(libcouchbase_server_t *server) {
                 return true;
             case EINPROGRESS: /* First call to connect */
                 libcouchbase_server_update_event(server,
-                                                 EV_WRITE,
+                                                 LIBCOUCHBASE_WRITE_EVENT,
                                                  server_connect_handler);
                 return true;
             case EALREADY: /* Subsequent calls to connect */
@@ -215,8 +210,14 @@ static bool server_connect(libcouchbase_server_t *server) {
 
             default:
                 fprintf(stderr, "connect fail: %s\n",
-                        strerror(errno));
-                EVUTIL_CLOSESOCKET(server->sock);
+                        strerror(io->error));
+                if (server->ev_flags != 0) {
+                    io->delete_event(io, server->sock, server->event);
+                    server->ev_flags = 0;
+                    server->ev_handler = NULL;
+                }
+                io->close(io, server->sock);
+                server->sock = INVALID_SOCKET;
                 return false;
             }
         }
@@ -226,17 +227,12 @@ static bool server_connect(libcouchbase_server_t *server) {
 }
 
 static void try_next_server_connect(libcouchbase_server_t *server) {
+    libcouchbase_io_opt_t *io = server->shard->io;
     while (server->curr_ai != NULL) {
-        server->sock = socket(server->curr_ai->ai_family,
-                              server->curr_ai->ai_socktype,
-                              server->curr_ai->ai_protocol);
-        if (server->sock != -1) {
-            if (evutil_make_socket_nonblocking(server->sock) != 0) {
-                EVUTIL_CLOSESOCKET(server->sock);
-                server->curr_ai = server->curr_ai->ai_next;
-                continue;
-            }
-
+        server->sock = io->socket(io, server->curr_ai->ai_family,
+                                  server->curr_ai->ai_socktype,
+                                  server->curr_ai->ai_protocol);
+        if (server->sock != INVALID_SOCKET) {
             if (server_connect(server)) {
                 return ;
             }
@@ -248,7 +244,7 @@ static void try_next_server_connect(libcouchbase_server_t *server) {
 }
 
 
-void libcouchbase_server_initialize(libcouchbase_server_t *server, int servernum)
+bool libcouchbase_server_initialize(libcouchbase_server_t *server, int servernum)
 {
     /* Initialize all members */
     char *p;
@@ -256,12 +252,20 @@ void libcouchbase_server_initialize(libcouchbase_server_t *server, int servernum
     struct addrinfo hints;
     const char *n = vbucket_config_get_server(server->instance->vbucket_config,
                                               servernum);
-    server->current_packet = (size_t)-1;
+    server->cmd_log.instance = server->instance;
+    server->cmd_log.shard = server->shard;
+    server->sock = INVALID_SOCKET;
     server->hostname = strdup(n);
     p = strchr(server->hostname, ':');
     *p = '\0';
     server->port = p + 1;
 
+    server->event = server->shard->io->create_event(server->shard->io);
+    if (server->event == NULL) {
+        /* We can't watch the socket, so don't connect */
+        return false;
+    }
+
     memset(&hints, 0, sizeof(hints));
     hints.ai_flags = AI_PASSIVE;
     hints.ai_socktype = SOCK_STREAM;
@@ -276,38 +280,445 @@ void libcouchbase_server_initialize(libcouchbase_server_t *server, int servernum
         server->sock = -1;
         server->root_ai = NULL;
     }
+    return true;
+}
+
+bool libcouchbase_server_has_output(libcouchbase_server_t *server)
+{
+    return server->output.nbytes > 0;
 }
 
 void libcouchbase_server_send_packets(libcouchbase_server_t *server)
 {
-    if (server->connected) {
-        libcouchbase_server_update_event(server, EV_READ|EV_WRITE,
-                                         libcouchbase_server_event_handler);
+    if (!libcouchbase_server_is_local(server)) {
+        /* Let the thread owning the server send it */
+        libcouchbase_forward_flush(server->instance);
+    } else if (server->instance->batch.enabled) {
+        libcouchbase_batch_add_server(server);
+    } else if (server->connected) {
+        libcouchbase_server_start_send(server);
+    }
+}
+
+void libcouchbase_server_fail_command(libcouchbase_server_t *server,
+                                      uint16_t status)
+{
+    cmd_log_entry_t *entry = libcouchbase_cmd_log_head(&server->cmd_log);
+    protocol_binary_request_header *req;
+    protocol_binary_response_header res;
+
+    assert(entry != NULL);
+    req = libcouchbase_cmd_log_packet(&server->cmd_log, entry);
+    memset(&res, 0, sizeof(res));
+    res.response.magic = PROTOCOL_BINARY_RES;
+    res.response.opcode = req->request.opcode;
+    res.response.status = htons(status);
+    res.response.opaque = req->request.opaque;
+
+    server->instance->response_handler[res.response.opcode](server, &res);
+    libcouchbase_cmd_log_pop(&server->cmd_log);
+}
+
+void libcouchbase_server_shutdown(libcouchbase_server_t *server,
+                                  uint16_t status)
+{
+    libcouchbase_io_opt_t *io = server->shard->io;
+    cmd_log_entry_t *entry;
+
+    if (server->ev_flags != 0) {
+        io->delete_event(io, server->sock, server->event);
+        server->ev_flags = 0;
+        server->ev_handler = NULL;
+    }
+    if (server->sock != INVALID_SOCKET) {
+        io->close(io, server->sock);
+        server->sock = INVALID_SOCKET;
+    }
+    if (server->sasl_conn != NULL) {
+        sasl_dispose(&server->sasl_conn);
+    }
+    server->connected = false;
+    server->fence_pending = false;
+    server->input.avail = 0;
+
+    /* The commands we didn't get a response for may or may not have
+     * been executed, so we can't send them again */
+    while ((entry = libcouchbase_cmd_log_head(&server->cmd_log)) != NULL) {
+        if (entry->opcode == PROTOCOL_BINARY_CMD_NOOP ||
+            (entry->flags & CMD_COMPLETED)) {
+            libcouchbase_cmd_log_pop(&server->cmd_log);
+        } else {
+            libcouchbase_server_fail_command(server, status);
+        }
+    }
+    server->stream.remaining = 0;
+    libcouchbase_chain_destroy(server->instance, &server->output);
+
+    server->curr_ai = server->root_ai;
+    try_next_server_connect(server);
+}
+
+/**
+ * Move the packet at the beginning of a chain to the end of another
+ * @return false if we failed to allocate memory
+ */
+static bool move_packet(libcouchbase_t instance, chain_t *from, chain_t *to,
+                        size_t size)
+{
+    chain_mark_t mark;
+    char *packet;
+    bool success;
+
+    if ((packet = malloc(size)) == NULL) {
+        return false;
+    }
+    memset(&mark, 0, sizeof(mark));
+    libcouchbase_chain_copy(from, &mark, packet, size);
+    success = libcouchbase_chain_write(instance, to, packet, size);
+    free(packet);
+    if (success) {
+        libcouchbase_chain_consume(instance, from, size);
+    }
+    return success;
+}
+
+void libcouchbase_server_drop_expired(libcouchbase_server_t *server)
+{
+    libcouchbase_t instance = server->instance;
+    chain_t *pending = &server->pending;
+    cmd_log_entry_t *entry;
+    chain_t kept;
+    bool failed = false;
+
+    memset(&kept, 0, sizeof(kept));
+    while (!failed &&
+           (entry = libcouchbase_cmd_log_head(&server->cmd_log)) != NULL &&
+           (entry->flags & CMD_COMPLETED)) {
+        while (pending->nbytes > 0) {
+            protocol_binary_request_header req;
+            chain_mark_t mark;
+            size_t size;
+
+            memset(&mark, 0, sizeof(mark));
+            libcouchbase_chain_copy(pending, &mark, &req, sizeof(req));
+            size = sizeof(req) + ntohl(req.request.bodylen);
+            if (req.request.opaque == entry->opaque) {
+                libcouchbase_chain_consume(instance, pending, size);
+                break;
+            }
+            /* Keep the packets that aren't in the command log (the
+             * TAP_CONNECT) */
+            if (!move_packet(instance, pending, &kept, size)) {
+                failed = true;
+                break;
+            }
+        }
+        if (!failed) {
+            libcouchbase_cmd_log_pop(&server->cmd_log);
+        }
+    }
+
+    /* The packets we kept go in front of the ones we didn't drop */
+    libcouchbase_chain_move(&kept, pending);
+    libcouchbase_chain_move(pending, &kept);
+}
+
+/**
+ * Get the opcode to use when we send a quiet command to another server.
+ * The NOOP terminating the quiet commands is still sent to the original
+ * server, so we send the normal version of the command instead.
+ */
+static uint8_t get_resend_opcode(uint8_t opcode)
+{
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_GETQ:
+        return PROTOCOL_BINARY_CMD_GET;
+    case PROTOCOL_BINARY_CMD_GATQ:
+        return PROTOCOL_BINARY_CMD_GAT;
+    case PROTOCOL_BINARY_CMD_ADDQ:
+        return PROTOCOL_BINARY_CMD_ADD;
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        return PROTOCOL_BINARY_CMD_REPLACE;
+    case PROTOCOL_BINARY_CMD_SETQ:
+        return PROTOCOL_BINARY_CMD_SET;
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+        return PROTOCOL_BINARY_CMD_APPEND;
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        return PROTOCOL_BINARY_CMD_PREPEND;
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        return PROTOCOL_BINARY_CMD_DELETE;
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+        return PROTOCOL_BINARY_CMD_INCREMENT;
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        return PROTOCOL_BINARY_CMD_DECREMENT;
+    default:
+        return opcode;
+    }
+}
+
+/**
+ * Send the command at the head of the command log to another server
+ *
+ * @param server the server with the command
+ * @param unsent the chain with the packet at its beginning (or NULL to
+ *               use the packet in the command log)
+ * @param dest the server to send the command to
+ * @param retries the number of times the command has been retried
+ * @return false if we don't have the complete command (or ran out of
+ *         memory, or the packet filter dropped it)
+ */
+static bool requeue_command(libcouchbase_server_t *server,
+                            chain_t *unsent,
+                            libcouchbase_server_t *dest,
+                            uint8_t retries)
+{
+    libcouchbase_t instance = server->instance;
+    shard_t *shard = libcouchbase_current_shard(instance);
+    cmd_log_entry_t *entry = libcouchbase_cmd_log_head(&server->cmd_log);
+    protocol_binary_request_header *req;
+    protocol_binary_request_header hdr;
+    libcouchbase_operation_t operation = shard->operation;
+    uint32_t timeout = shard->op_timeout;
+    libcouchbase_error_t error;
+    char *packet = NULL;
+    size_t bodylen;
+
+    assert(entry != NULL);
+    req = libcouchbase_cmd_log_packet(&server->cmd_log, entry);
+    bodylen = ntohl(req->request.bodylen);
+    if (req->request.keylen == 0) {
+        return false;
+    }
+
+    if (unsent != NULL) {
+        chain_mark_t mark;
+        if ((packet = malloc(sizeof(hdr) + bodylen)) == NULL) {
+            return false;
+        }
+        memset(&mark, 0, sizeof(mark));
+        libcouchbase_chain_copy(unsent, &mark, packet, sizeof(hdr) + bodylen);
+    } else if (!instance->retain_values &&
+               bodylen > req->request.extlen + ntohs(req->request.keylen)) {
+        return false;
+    }
+
+    memcpy(&hdr, req, sizeof(hdr));
+    hdr.request.opcode = get_resend_opcode(hdr.request.opcode);
+    hdr.request.opaque = libcouchbase_server_next_seqno(dest);
+    /* The command is still a part of the same operation (and keeps its
+     * deadline if the server is local, see libcouchbase_timeout_move) */
+    shard->operation = entry->operation;
+    shard->op_timeout = 0;
+    libcouchbase_server_start_packet(dest, entry->cookie, &hdr, sizeof(hdr));
+    if (packet != NULL) {
+        libcouchbase_server_write_packet(dest, packet + sizeof(hdr), bodylen);
+        free(packet);
+    } else {
+        libcouchbase_cmd_log_write_body(&server->cmd_log, entry, dest);
+    }
+    error = libcouchbase_server_end_packet(dest);
+    shard->operation = operation;
+    shard->op_timeout = timeout;
+    if (error != LIBCOUCHBASE_SUCCESS) {
+        return false;
+    }
+
+    if (!libcouchbase_server_is_local(dest)) {
+        /* The owner of the server starts a new timer for it */
+        libcouchbase_forward_retries(instance, retries);
+        return true;
+    }
+
+    if ((entry = libcouchbase_cmd_log_tail(&dest->cmd_log)) != NULL &&
+        entry->opaque == hdr.request.opaque) {
+        cmd_log_entry_t *head = libcouchbase_cmd_log_head(&server->cmd_log);
+        /* The command keeps its deadline and the gets coalesced with it */
+        libcouchbase_timeout_move(head, dest, entry);
+        entry->waiters = head->waiters;
+        head->waiters = NULL;
+        entry->retries = retries;
+        return true;
+    }
+
+    /* Dropped by the packet filter */
+    return false;
+}
+
+bool libcouchbase_server_requeue_command(libcouchbase_server_t *server,
+                                         libcouchbase_server_t *dest,
+                                         uint8_t retries)
+{
+    return requeue_command(server, NULL, dest, retries);
+}
+
+bool libcouchbase_server_requeue_unsent(libcouchbase_server_t *server,
+                                        chain_t *unsent,
+                                        libcouchbase_server_t *dest)
+{
+    return requeue_command(server, unsent, dest, 0);
+}
+
+bool libcouchbase_server_retry_command(libcouchbase_server_t *server)
+{
+    libcouchbase_t instance = server->instance;
+    cmd_log_entry_t *entry = libcouchbase_cmd_log_head(&server->cmd_log);
+    protocol_binary_request_header *req;
+    uint8_t retries = entry->retries;
+    int vb;
+    int idx;
+
+    if (libcouchbase_hedge_release(server, entry)) {
+        /* The other get of the hedged read reports the result */
+        return true;
+    }
+
+    if (retries >= instance->max_retries ||
+        entry->opcode == PROTOCOL_BINARY_CMD_GET_REPLICA) {
+        return false;
+    }
+
+    req = libcouchbase_cmd_log_packet(&server->cmd_log, entry);
+    vb = ntohs(req->request.vbucket);
+    if (vb >= instance->nvbuckets) {
+        return false;
+    }
+
+    /* A configuration received after the command was sent may already
+     * have moved the vbucket. Otherwise let libvbucket figure out which
+     * server to try next (it uses the fast forward map if the cluster is
+     * being rebalanced) */
+    idx = instance->vb_server_map[vb];
+    if (instance->servers + idx == server) {
+        idx = vbucket_found_incorrect_master(instance->vbucket_config, vb,
+                                             (int)(server - instance->servers));
+    }
+    if (idx < 0 || (size_t)idx >= instance->nservers ||
+        instance->servers + idx == server) {
+        return false;
+    }
+    instance->vb_server_map[vb] = (uint16_t)idx;
+
+    if (!libcouchbase_server_requeue_command(server, instance->servers + idx,
+                                             (uint8_t)(retries + 1))) {
+        return false;
+    }
+    libcouchbase_server_send_packets(instance->servers + idx);
+
+    return true;
+}
+
+void libcouchbase_server_fence(libcouchbase_server_t *server)
+{
+    if (libcouchbase_server_is_local(server)) {
+        server->fence_pending = true;
+    } else {
+        /* The owner adds the NOOP after the command */
+        libcouchbase_forward_fence(server->instance);
+    }
+}
+
+void libcouchbase_server_write_fence(libcouchbase_server_t *server)
+{
+    protocol_binary_request_noop noop;
+
+    if (!server->fence_pending) {
+        return;
+    }
+    server->fence_pending = false;
+
+    memset(&noop, 0, sizeof(noop));
+    noop.message.header.request.magic = PROTOCOL_BINARY_REQ;
+    noop.message.header.request.opcode = PROTOCOL_BINARY_CMD_NOOP;
+    noop.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
+    noop.message.header.request.opaque = libcouchbase_server_next_seqno(server);
+    if (libcouchbase_server_complete_packet(server, NULL, noop.bytes,
+                                            sizeof(noop.bytes)) != LIBCOUCHBASE_SUCCESS) {
+        /* Try again the next time we write the output */
+        server->fence_pending = true;
     }
 }
 
+void libcouchbase_send_fenced(libcouchbase_t instance,
+                              libcouchbase_server_t *server)
+{
+    size_t ii;
+
+    if (server != NULL) {
+        libcouchbase_server_send_packets(server);
+        return;
+    }
+
+    // Only the servers we spooled quiet commands to need to send them
+    for (ii = 0; ii < instance->nservers; ++ii) {
+        server = instance->servers + ii;
+        if (libcouchbase_server_is_local(server) && server->fence_pending) {
+            libcouchbase_server_send_packets(server);
+        }
+    }
+
+    /* And the other threads send the commands for their servers */
+    libcouchbase_forward_flush(instance);
+}
+
 void libcouchbase_server_purge_implicit_responses(libcouchbase_server_t *c, uint32_t seqno)
 {
-    protocol_binary_request_header *req = (void*)c->cmd_log.data;
-    while (c->cmd_log.avail >= sizeof(*req) &&
-           c->cmd_log.avail >= (ntohl(req->request.bodylen) + sizeof(*req)) &&
-           req->request.opaque < seqno) {
-        size_t processed;
-        switch (req->request.opcode) {
+    libcouchbase_t instance = c->instance;
+    cmd_log_entry_t *entry;
+    while ((entry = libcouchbase_cmd_log_head(&c->cmd_log)) != NULL &&
+           entry->opaque < seqno) {
+        protocol_binary_request_header *req;
+        const char *key;
+        size_t nkey;
+
+        req = libcouchbase_cmd_log_packet(&c->cmd_log, entry);
+        key = (const char *)(req + 1) + req->request.extlen;
+        nkey = ntohs(req->request.keylen);
+
+        /*
+         * A missing response to a quiet get means that the item
+         * doesn't exist, and for the other quiet commands it means
+         * that the command succeeded (but the server doesn't tell us
+         * the new cas or value)
+         */
+        switch (entry->opcode) {
         case PROTOCOL_BINARY_CMD_GATQ:
         case PROTOCOL_BINARY_CMD_GETQ:
-            c->instance->callbacks.get(c->instance, LIBCOUCHBASE_KEY_ENOENT,
-                                       (char*)(req + 1) + req->request.extlen,
-                                       ntohs(req->request.keylen),
-                                       NULL, 0, 0, 0);
+            if (libcouchbase_hedge_resolve(c, entry, false)) {
+                libcouchbase_get_callback(instance, entry,
+                                          LIBCOUCHBASE_KEY_ENOENT,
+                                          key, nkey, NULL, 0, 0, 0);
+            }
+            break;
+        case PROTOCOL_BINARY_CMD_ADDQ:
+        case PROTOCOL_BINARY_CMD_REPLACEQ:
+        case PROTOCOL_BINARY_CMD_SETQ:
+        case PROTOCOL_BINARY_CMD_APPENDQ:
+        case PROTOCOL_BINARY_CMD_PREPENDQ:
+            if ((entry->flags & CMD_COMPLETED) == 0) {
+                instance->callbacks.storage(instance, entry->cookie,
+                                            LIBCOUCHBASE_SUCCESS,
+                                            key, nkey, 0);
+            }
+            break;
+        case PROTOCOL_BINARY_CMD_DELETEQ:
+            if ((entry->flags & CMD_COMPLETED) == 0) {
+                instance->callbacks.remove(instance, entry->cookie,
+                                           LIBCOUCHBASE_SUCCESS,
+                                           key, nkey);
+            }
+            break;
+        case PROTOCOL_BINARY_CMD_INCREMENTQ:
+        case PROTOCOL_BINARY_CMD_DECREMENTQ:
+            if ((entry->flags & CMD_COMPLETED) == 0) {
+                instance->callbacks.arithmetic(instance, entry->cookie,
+                                               LIBCOUCHBASE_SUCCESS,
+                                               key, nkey, 0, 0);
+            }
             break;
         default:
             abort();
         }
 
-        processed = ntohl(req->request.bodylen) + sizeof(*req);
-        memmove(c->cmd_log.data, c->cmd_log.data + processed,
-                c->cmd_log.avail - processed);
-        c->cmd_log.avail -= processed;
+        libcouchbase_cmd_log_pop(&c->cmd_log);
     }
 }
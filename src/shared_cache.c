@@ -0,0 +1,1036 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the shared cache: a cache of the values returned
+ * by the gets kept in a memory mapped file, so that all of the
+ * processes on a host attached to it may use the values. One of the
+ * processes (the invalidator) taps the cluster for the keys only and
+ * drops the keys modified in the cluster from the cache.
+ *
+ * The segment contains a header, the index and the slab pages. The
+ * index is an open addressing hash table where a key may be in any of
+ * the PROBES slots following its hash. Each slot is protected by a
+ * sequence lock: a process updating the slot makes the sequence number
+ * odd while it changes the slot, and the readers copy the item and
+ * check that the sequence number didn't change while they copied it.
+ * An item is only released after it is removed from its slot, so a
+ * reader never uses the memory of a released item.
+ *
+ * The items are allocated from slab classes of power of two sizes.
+ * Pages are given to the classes on demand, and the free chunks of a
+ * class are kept in a lock-free stack (the head is tagged to avoid the
+ * ABA problem). When we run out of memory a clock hand walks the index
+ * and evicts the items not referenced since the hand passed them.
+ *
+ * A response to a get may arrive after the key was invalidated. Every
+ * invalidation bumps the clock in the header and stores the new value
+ * in the stamp for the key, and the command log entry remembers the
+ * clock when the get was sent. A value is only stored if the stamp of
+ * the key is older than the get, and the stamp is checked again after
+ * the item is published (the invalidator bumps the stamp before it
+ * looks for the key), so one of them always sees the other.
+ *
+ * The lock of a slot contains the pid of the process holding it, and
+ * the lock of a process that died while it held a slot is taken over
+ * by the next process locking the slot. The items in the cache aren't
+ * invalidated if the invalidator dies, so a maximum age should be set
+ * for the items.
+ *
+ * The creator of the segment holds an exclusive lock on the file until
+ * the segment is initialized. A segment that is never initialized (the
+ * creator died) or was created by another version of the library is
+ * removed (under the lock), and a new one is created.
+ */
+#include "internal.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+/** "LCBS" */
+#define SHARED_CACHE_MAGIC 0x4c434253
+#define SHARED_CACHE_VERSION 2
+
+/** The number of slots a key may be stored in */
+#define PROBES 16
+
+/** The number of invalidation stamps (must be a power of two) */
+#define SHARED_CACHE_STAMPS 4096
+
+/** The size of the slab pages */
+#define PAGE_SIZE_SHIFT 18
+#define SLAB_PAGE_SIZE ((size_t)1 << PAGE_SIZE_SHIFT)
+
+/** The slab classes are 64 bytes to the page size */
+#define MIN_CHUNK_SHIFT 6
+#define NCLASSES (PAGE_SIZE_SHIFT - MIN_CHUNK_SHIFT + 1)
+
+/** The offsets are stored in units of 8 bytes */
+#define OFFSET_SHIFT 3
+
+/** The number of slots the clock hand looks at before we give up */
+#define EVICT_STEPS 1024
+
+/** The number of times we try to lock a busy slot */
+#define LOCK_SPINS 1000
+
+/** Don't create a segment smaller than this */
+#define MIN_SEGMENT_SIZE ((size_t)4 << 20)
+
+/** The number of times we try to attach to a segment */
+#define ATTACH_ATTEMPTS 3
+
+typedef struct {
+    /**
+     * The sequence number in the low 32 bits (odd while a process
+     * updates the slot), and the pid of that process in the high 32 bits
+     */
+    uint64_t seq;
+    uint32_t hash;
+    /** The offset of the item (0 if the slot is free) */
+    uint32_t item;
+    /** Was the item used since the clock hand passed it */
+    uint32_t referenced;
+    uint32_t pad;
+} shared_slot_t;
+
+typedef struct {
+    /** The next free chunk (only used while the chunk is free) */
+    uint32_t next;
+    uint8_t cls;
+    uint8_t pad;
+    uint16_t vb;
+    uint16_t nkey;
+    uint16_t pad2;
+    uint32_t flags;
+    uint32_t nbytes;
+    /** The time (in milliseconds) the item was stored */
+    uint64_t stored;
+    uint64_t cas;
+    /** The key followed by the value */
+    char data[1];
+} shared_item_t;
+
+typedef struct {
+    /** Set when the segment is initialized */
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    /** The maximum age of an item in milliseconds (0 for no limit) */
+    uint64_t max_age;
+    uint64_t slot_offset;
+    uint64_t page_offset;
+    uint32_t nslots;
+    uint32_t npages;
+    /** The next page not given to a slab class */
+    uint32_t next_page;
+    /** The position of the clock hand */
+    uint32_t hand;
+    /** Bumped for every invalidation */
+    uint32_t clock;
+    /** The clock the last time we dropped all items */
+    uint32_t flushed;
+    /** The tagged head of the free list for each class */
+    uint64_t free_chunks[NCLASSES];
+    /** The clock of the last invalidation of the keys */
+    uint32_t stamps[SHARED_CACHE_STAMPS];
+    /** The vbuckets covered by the TAP stream of the invalidator */
+    uint8_t covered[65536 / 8];
+} shared_header_t;
+
+typedef struct shared_cache_st {
+    char *base;
+    size_t size;
+    shared_header_t *header;
+    shared_slot_t *slots;
+    /** Does this instance tap the cluster for the cache */
+    bool invalidator;
+} shared_cache_t;
+
+static shared_item_t *get_item(shared_cache_t *cache, uint32_t offset)
+{
+    return (void*)(cache->base + ((size_t)offset << OFFSET_SHIFT));
+}
+
+static uint32_t hash_key(uint16_t vb, const void *key, size_t nkey)
+{
+    const unsigned char *ptr = key;
+    uint32_t hash = 2166136261U;
+    size_t ii;
+
+    hash = (hash ^ (vb & 0xff)) * 16777619U;
+    hash = (hash ^ (vb >> 8)) * 16777619U;
+    for (ii = 0; ii < nkey; ++ii) {
+        hash = (hash ^ ptr[ii]) * 16777619U;
+    }
+    return hash;
+}
+
+static shared_slot_t *get_slot(shared_cache_t *cache, uint32_t hash,
+                               int probe)
+{
+    return cache->slots + ((hash + (uint32_t)probe) & (cache->header->nslots - 1));
+}
+
+static uint32_t *get_stamp(shared_cache_t *cache, uint32_t hash)
+{
+    return cache->header->stamps + (hash & (SHARED_CACHE_STAMPS - 1));
+}
+
+/**
+ * Check if an invalidation happened after the get was sent (the clock
+ * wraps)
+ * @param cache the cache
+ * @param sent the clock when the get was sent
+ * @param stamp the clock of the invalidation
+ */
+static bool invalidated_since(shared_cache_t *cache, uint32_t sent,
+                              uint32_t stamp)
+{
+    uint32_t now = __atomic_load_n(&cache->header->clock, __ATOMIC_SEQ_CST);
+    return (uint32_t)(stamp - sent - 1) < (uint32_t)(now - sent);
+}
+
+static bool may_store(shared_cache_t *cache, uint32_t sent, uint32_t hash)
+{
+    return !invalidated_since(cache, sent,
+                              __atomic_load_n(get_stamp(cache, hash),
+                                              __ATOMIC_SEQ_CST)) &&
+        !invalidated_since(cache, sent,
+                           __atomic_load_n(&cache->header->flushed,
+                                           __ATOMIC_SEQ_CST));
+}
+
+static bool is_covered(shared_cache_t *cache, uint16_t vb)
+{
+    uint8_t bits = __atomic_load_n(cache->header->covered + (vb >> 3),
+                                   __ATOMIC_ACQUIRE);
+    return (bits & (1 << (vb & 7))) != 0;
+}
+
+/**
+ * Check if the process holding a lock is gone
+ * @param seq the value of the lock
+ */
+static bool owner_is_dead(uint64_t seq)
+{
+    pid_t pid = (pid_t)(seq >> 32);
+    return pid != 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+/**
+ * Try to lock a slot. The lock held by a process that died is taken
+ * over (the slot is consistent at all times, but the item the process
+ * was releasing may be lost).
+ * @param slot the slot to lock
+ * @param spin set to true to wait for a busy slot (for a while)
+ * @return the sequence number to pass to unlock_slot, or 0 if we
+ *         couldn't lock the slot
+ */
+static uint32_t lock_slot(shared_slot_t *slot, bool spin)
+{
+    uint64_t self = (uint64_t)getpid() << 32;
+    uint64_t checked = 0;
+    int ii;
+
+    for (ii = 0; ii < LOCK_SPINS; ++ii) {
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        uint64_t next;
+
+        if ((seq & 1) == 0) {
+            next = self | (uint32_t)(seq + 1);
+        } else if (seq != checked && owner_is_dead(seq)) {
+            next = self | (uint32_t)seq;
+        } else {
+            /* Don't ask the kernel about the same owner again */
+            checked = seq;
+            next = 0;
+        }
+
+        if (next != 0 &&
+            __atomic_compare_exchange_n(&slot->seq, &seq, next, false,
+                                        __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED)) {
+            return (uint32_t)next;
+        }
+        if (!spin) {
+            break;
+        }
+    }
+    return 0;
+}
+
+static void unlock_slot(shared_slot_t *slot, uint32_t seq)
+{
+    __atomic_store_n(&slot->seq, (uint64_t)(uint32_t)(seq + 1),
+                     __ATOMIC_SEQ_CST);
+}
+
+static void free_chunk(shared_cache_t *cache, uint32_t offset)
+{
+    shared_item_t *item = get_item(cache, offset);
+    uint64_t *head = cache->header->free_chunks + item->cls;
+    uint64_t old = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+
+    do {
+        item->next = (uint32_t)old;
+        next = (((old >> 32) + 1) << 32) | offset;
+    } while (!__atomic_compare_exchange_n(head, &old, next, false,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_ACQUIRE));
+}
+
+static uint32_t pop_chunk(shared_cache_t *cache, int cls)
+{
+    uint64_t *head = cache->header->free_chunks + cls;
+    uint64_t old = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    uint32_t offset;
+
+    do {
+        if ((offset = (uint32_t)old) == 0) {
+            return 0;
+        }
+        /* The chunk may be taken by someone else (the tag catches it) */
+        next = (((old >> 32) + 1) << 32) |
+            __atomic_load_n(&get_item(cache, offset)->next, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(head, &old, next, false,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+
+    return offset;
+}
+
+/**
+ * Give the next unused page to a slab class
+ * @return the offset of the first chunk of the page (the rest of the
+ *         chunks are added to the free list), or 0 if we're out of pages
+ */
+static uint32_t carve_page(shared_cache_t *cache, int cls)
+{
+    shared_header_t *header = cache->header;
+    uint32_t page = __atomic_load_n(&header->next_page, __ATOMIC_RELAXED);
+    size_t chunk = (size_t)1 << (MIN_CHUNK_SHIFT + cls);
+    size_t start;
+    size_t ii;
+
+    /* Don't move past the last page (so the counter can't wrap) */
+    do {
+        if (page >= header->npages) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&header->next_page, &page,
+                                          page + 1, false,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    start = header->page_offset + (size_t)page * SLAB_PAGE_SIZE;
+    for (ii = chunk; ii < SLAB_PAGE_SIZE; ii += chunk) {
+        uint32_t offset = (uint32_t)((start + ii) >> OFFSET_SHIFT);
+        get_item(cache, offset)->cls = (uint8_t)cls;
+        free_chunk(cache, offset);
+    }
+
+    return (uint32_t)(start >> OFFSET_SHIFT);
+}
+
+/**
+ * Remove the item from a locked slot and release it
+ */
+static void clear_slot(shared_cache_t *cache, shared_slot_t *slot)
+{
+    uint32_t offset = slot->item;
+    slot->item = 0;
+    slot->referenced = 0;
+    if (offset != 0) {
+        free_chunk(cache, offset);
+    }
+}
+
+/**
+ * Move the clock hand, and evict the items not used since the last
+ * time the hand passed them
+ * @param cache the cache
+ * @param cls stop when we've released a chunk of this class
+ */
+static void evict(shared_cache_t *cache, int cls)
+{
+    shared_header_t *header = cache->header;
+    int ii;
+
+    for (ii = 0; ii < EVICT_STEPS; ++ii) {
+        uint32_t pos = __atomic_fetch_add(&header->hand, 1, __ATOMIC_RELAXED);
+        shared_slot_t *slot = cache->slots + (pos & (header->nslots - 1));
+        uint32_t seq;
+        bool found;
+
+        if (__atomic_load_n(&slot->item, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        if (__atomic_exchange_n(&slot->referenced, 0, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        if ((seq = lock_slot(slot, false)) == 0) {
+            continue;
+        }
+        found = slot->item != 0 && get_item(cache, slot->item)->cls == cls;
+        clear_slot(cache, slot);
+        unlock_slot(slot, seq);
+        if (found) {
+            return;
+        }
+    }
+}
+
+static uint32_t alloc_chunk(shared_cache_t *cache, int cls)
+{
+    uint32_t offset;
+
+    if ((offset = pop_chunk(cache, cls)) == 0 &&
+        (offset = carve_page(cache, cls)) == 0) {
+        evict(cache, cls);
+        offset = pop_chunk(cache, cls);
+    }
+
+    return offset;
+}
+
+/**
+ * Get the slab class for an item
+ * @return the class, or -1 if the item is too big
+ */
+static int get_class(size_t size)
+{
+    int cls;
+
+    for (cls = 0; cls < NCLASSES; ++cls) {
+        if (size <= ((size_t)1 << (MIN_CHUNK_SHIFT + cls))) {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Check if the item in a locked slot is the given key
+ */
+static bool is_key(shared_cache_t *cache, shared_slot_t *slot,
+                   uint32_t hash, uint16_t vb, const void *key, size_t nkey)
+{
+    shared_item_t *item;
+
+    if (slot->item == 0 || slot->hash != hash) {
+        return false;
+    }
+    item = get_item(cache, slot->item);
+    return item->vb == vb && item->nkey == nkey &&
+        memcmp(item->data, key, nkey) == 0;
+}
+
+/**
+ * Remove a key from all of the slots it may be stored in
+ */
+static void remove_key(shared_cache_t *cache, uint32_t hash, uint16_t vb,
+                       const void *key, size_t nkey)
+{
+    int ii;
+
+    for (ii = 0; ii < PROBES; ++ii) {
+        shared_slot_t *slot = get_slot(cache, hash, ii);
+        uint32_t seq;
+
+        if (__atomic_load_n(&slot->hash, __ATOMIC_SEQ_CST) != hash ||
+            __atomic_load_n(&slot->item, __ATOMIC_SEQ_CST) == 0) {
+            continue;
+        }
+
+        /* A live process may hold the slot for a while, so we can't
+         * wait forever */
+        if ((seq = lock_slot(slot, true)) != 0) {
+            if (is_key(cache, slot, hash, vb, key, nkey)) {
+                clear_slot(cache, slot);
+            }
+            unlock_slot(slot, seq);
+        }
+    }
+}
+
+/**
+ * Lock the slot to store a key in: a free slot, the slot with the
+ * old value for the key, or the first slot not recently used.
+ * @return the locked slot (and its sequence number in seq) or NULL
+ */
+static shared_slot_t *find_free_slot(shared_cache_t *cache, uint32_t hash,
+                                     uint16_t vb, const void *key,
+                                     size_t nkey, uint32_t *seq)
+{
+    int ii;
+
+    for (ii = 0; ii < PROBES; ++ii) {
+        shared_slot_t *slot = get_slot(cache, hash, ii);
+        if ((*seq = lock_slot(slot, false)) != 0) {
+            if (slot->item == 0 ||
+                is_key(cache, slot, hash, vb, key, nkey)) {
+                return slot;
+            }
+            unlock_slot(slot, *seq);
+        }
+    }
+
+    for (ii = 0; ii < PROBES; ++ii) {
+        shared_slot_t *slot = get_slot(cache, hash, ii);
+        if (!__atomic_exchange_n(&slot->referenced, 0, __ATOMIC_RELAXED) &&
+            (*seq = lock_slot(slot, false)) != 0) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+bool libcouchbase_shared_cache_get(libcouchbase_t instance,
+                                   const void *command_cookie,
+                                   uint16_t vb,
+                                   const void *key, size_t nkey)
+{
+    shared_cache_t *cache = instance->shared_cache;
+    uint32_t hash;
+    int ii;
+
+    if (cache == NULL || !is_covered(cache, vb)) {
+        return false;
+    }
+
+    hash = hash_key(vb, key, nkey);
+    for (ii = 0; ii < PROBES; ++ii) {
+        shared_slot_t *slot = get_slot(cache, hash, ii);
+        uint64_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        uint32_t offset;
+        shared_item_t item;
+        char *copy;
+        size_t size;
+
+        if ((seq & 1) != 0 ||
+            __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) != hash ||
+            (offset = __atomic_load_n(&slot->item, __ATOMIC_RELAXED)) == 0) {
+            continue;
+        }
+
+        /* The item may change under our feet, so validate the copy
+         * before we use it */
+        memcpy(&item, get_item(cache, offset), sizeof(item));
+        size = (size_t)item.nkey + item.nbytes;
+        if (item.cls >= NCLASSES || item.vb != vb || item.nkey != nkey ||
+            size + offsetof(shared_item_t, data) >
+            ((size_t)1 << (MIN_CHUNK_SHIFT + item.cls)) ||
+            (copy = malloc(size)) == NULL) {
+            continue;
+        }
+        memcpy(copy, get_item(cache, offset)->data, size);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq ||
+            memcmp(copy, key, nkey) != 0) {
+            free(copy);
+            continue;
+        }
+
+        if (cache->header->max_age != 0 &&
+            libcouchbase_get_msec() - item.stored > cache->header->max_age) {
+            free(copy);
+            return false;
+        }
+
+        __atomic_store_n(&slot->referenced, 1, __ATOMIC_RELAXED);
+        instance->callbacks.get(instance, command_cookie,
+                                LIBCOUCHBASE_SUCCESS, copy, nkey,
+                                copy + nkey, item.nbytes,
+                                item.flags, item.cas);
+        free(copy);
+        return true;
+    }
+
+    return false;
+}
+
+void libcouchbase_shared_cache_store(libcouchbase_t instance,
+                                     uint32_t sent,
+                                     uint16_t vb,
+                                     const void *key, size_t nkey,
+                                     const void *bytes, size_t nbytes,
+                                     uint32_t flags, uint64_t cas)
+{
+    shared_cache_t *cache = instance->shared_cache;
+    shared_slot_t *slot;
+    shared_item_t *item;
+    uint32_t offset;
+    uint32_t hash;
+    uint32_t seq;
+    int cls;
+
+    if (cache == NULL || !is_covered(cache, vb) ||
+        (cls = get_class(offsetof(shared_item_t, data) + nkey + nbytes)) < 0) {
+        return;
+    }
+
+    hash = hash_key(vb, key, nkey);
+    if (!may_store(cache, sent, hash) ||
+        (offset = alloc_chunk(cache, cls)) == 0) {
+        return;
+    }
+
+    item = get_item(cache, offset);
+    item->cls = (uint8_t)cls;
+    item->vb = vb;
+    item->nkey = (uint16_t)nkey;
+    item->flags = flags;
+    item->nbytes = (uint32_t)nbytes;
+    item->stored = libcouchbase_get_msec();
+    item->cas = cas;
+    memcpy(item->data, key, nkey);
+    memcpy(item->data + nkey, bytes, nbytes);
+
+    if ((slot = find_free_slot(cache, hash, vb, key, nkey, &seq)) == NULL) {
+        free_chunk(cache, offset);
+        return;
+    }
+    clear_slot(cache, slot);
+    slot->hash = hash;
+    slot->item = offset;
+    unlock_slot(slot, seq);
+
+    /* The invalidator may have missed the item we just published */
+    if (!may_store(cache, sent, hash)) {
+        remove_key(cache, hash, vb, key, nkey);
+    }
+}
+
+uint32_t libcouchbase_shared_cache_clock(libcouchbase_t instance)
+{
+    shared_cache_t *cache = instance->shared_cache;
+
+    if (cache == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&cache->header->clock, __ATOMIC_SEQ_CST);
+}
+
+void libcouchbase_shared_cache_invalidate(libcouchbase_t instance,
+                                          uint16_t vb,
+                                          const void *key, size_t nkey)
+{
+    shared_cache_t *cache = instance->shared_cache;
+    uint32_t hash;
+    uint32_t clock;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    hash = hash_key(vb, key, nkey);
+    clock = __atomic_add_fetch(&cache->header->clock, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(get_stamp(cache, hash), clock, __ATOMIC_SEQ_CST);
+    remove_key(cache, hash, vb, key, nkey);
+}
+
+void libcouchbase_shared_cache_flush(libcouchbase_t instance)
+{
+    shared_cache_t *cache = instance->shared_cache;
+    uint32_t clock;
+    uint32_t ii;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    clock = __atomic_add_fetch(&cache->header->clock, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cache->header->flushed, clock, __ATOMIC_SEQ_CST);
+    for (ii = 0; ii < cache->header->nslots; ++ii) {
+        shared_slot_t *slot = cache->slots + ii;
+        uint32_t seq;
+
+        if (__atomic_load_n(&slot->item, __ATOMIC_SEQ_CST) != 0 &&
+            (seq = lock_slot(slot, true)) != 0) {
+            clear_slot(cache, slot);
+            unlock_slot(slot, seq);
+        }
+    }
+}
+
+void libcouchbase_shared_cache_cover(libcouchbase_t instance, uint16_t vb)
+{
+    shared_cache_t *cache = instance->shared_cache;
+
+    if (cache != NULL && cache->invalidator) {
+        __atomic_fetch_or(cache->header->covered + (vb >> 3),
+                          (uint8_t)(1 << (vb & 7)), __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Stop using the cache for a vbucket
+ */
+static void uncover(shared_cache_t *cache, uint16_t vb)
+{
+    __atomic_fetch_and(cache->header->covered + (vb >> 3),
+                       (uint8_t)~(1 << (vb & 7)), __ATOMIC_RELEASE);
+}
+
+void libcouchbase_shared_cache_config_changed(libcouchbase_t instance,
+                                              const uint16_t *old_map,
+                                              uint16_t old_nvbuckets,
+                                              const size_t *origin)
+{
+    shared_cache_t *cache = instance->shared_cache;
+    uint32_t ii;
+
+    if (cache == NULL || !cache->invalidator) {
+        return;
+    }
+
+    /* See libcouchbase_near_cache_config_changed */
+    for (ii = 0; ii < 65536; ++ii) {
+        size_t idx;
+
+        if (ii >= old_nvbuckets || old_nvbuckets != instance->nvbuckets) {
+            uncover(cache, (uint16_t)ii);
+            continue;
+        }
+        idx = instance->vb_server_map[ii];
+        if (idx >= instance->nservers || origin[idx] != old_map[ii]) {
+            uncover(cache, (uint16_t)ii);
+        }
+    }
+    libcouchbase_shared_cache_flush(instance);
+}
+
+/**
+ * Initialize a segment we've just created
+ */
+static void init_segment(shared_cache_t *cache, uint32_t usec)
+{
+    shared_header_t *header = cache->header;
+    size_t offset = (sizeof(*header) + 4095) & ~(size_t)4095;
+    uint32_t nslots = 1024;
+
+    /* Assume that the average item is about 1k */
+    while ((size_t)nslots * 2 * 1024 <= cache->size) {
+        nslots <<= 1;
+    }
+
+    header->version = SHARED_CACHE_VERSION;
+    header->size = cache->size;
+    header->max_age = ((uint64_t)usec + 999) / 1000;
+    header->slot_offset = offset;
+    header->nslots = nslots;
+    offset += (size_t)nslots * sizeof(shared_slot_t);
+    offset = (offset + SLAB_PAGE_SIZE - 1) & ~(SLAB_PAGE_SIZE - 1);
+    header->page_offset = offset;
+    header->npages = (uint32_t)((cache->size - offset) / SLAB_PAGE_SIZE);
+    /* Everything else is 0 (the file is created with ftruncate) */
+    __atomic_store_n(&header->magic, SHARED_CACHE_MAGIC, __ATOMIC_RELEASE);
+}
+
+/**
+ * Remove a segment we can't use: its creator died before it was
+ * initialized, or it was created by another version of the library.
+ * The creator holds the lock on the file until the segment is
+ * initialized, so check it again once we hold the lock, and only
+ * remove the path if it still refers to the same file.
+ * @param fd the file descriptor for the segment
+ * @param path the path to the segment
+ * @return true if we should try to attach again
+ */
+static bool remove_stale_segment(int fd, const char *path)
+{
+    struct stat st;
+    struct stat current;
+    uint32_t ident[2];
+    uint64_t size;
+    bool valid;
+
+    if (flock(fd, LOCK_EX) == -1) {
+        return false;
+    }
+
+    valid = fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= MIN_SEGMENT_SIZE &&
+        pread(fd, ident, sizeof(ident),
+              offsetof(shared_header_t, magic)) == sizeof(ident) &&
+        pread(fd, &size, sizeof(size),
+              offsetof(shared_header_t, size)) == sizeof(size) &&
+        ident[0] == SHARED_CACHE_MAGIC &&
+        ident[1] == SHARED_CACHE_VERSION &&
+        size == (uint64_t)st.st_size;
+
+    /* Someone may have replaced it already */
+    if (!valid && stat(path, &current) == 0 &&
+        current.st_dev == st.st_dev && current.st_ino == st.st_ino) {
+        unlink(path);
+    }
+
+    flock(fd, LOCK_UN);
+    return true;
+}
+
+/**
+ * Open (or create) the file with the segment, and map it
+ * @param stale set to true if the segment couldn't be used and we
+ *              should try again
+ * @return LIBCOUCHBASE_SUCCESS if the segment is ready to use
+ */
+static libcouchbase_error_t map_segment(shared_cache_t *cache,
+                                        const char *path, size_t nbytes,
+                                        uint32_t usec, bool *stale)
+{
+    struct stat st;
+    bool created = false;
+    int fd;
+    int ii;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) != -1) {
+        /* Keep the others from removing it until it is initialized */
+        if (flock(fd, LOCK_EX) == -1) {
+            close(fd);
+            unlink(path);
+            return LIBCOUCHBASE_ERROR;
+        }
+        if (ftruncate(fd, (off_t)nbytes) == -1) {
+            close(fd);
+            unlink(path);
+            return LIBCOUCHBASE_ENOMEM;
+        }
+        created = true;
+    } else if (errno != EEXIST || (fd = open(path, O_RDWR)) == -1) {
+        return LIBCOUCHBASE_ERROR;
+    }
+
+    /* Wait for the creator to set the size of the file */
+    for (ii = 0; ii < 100; ++ii) {
+        if (fstat(fd, &st) == -1) {
+            close(fd);
+            return LIBCOUCHBASE_ERROR;
+        }
+        if (st.st_size > 0) {
+            break;
+        }
+        usleep(10000);
+    }
+
+    cache->size = (size_t)st.st_size;
+    if (cache->size < MIN_SEGMENT_SIZE) {
+        *stale = remove_stale_segment(fd, path);
+        close(fd);
+        return LIBCOUCHBASE_ERROR;
+    }
+
+    cache->base = mmap(NULL, cache->size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+    if (cache->base == MAP_FAILED) {
+        cache->base = NULL;
+        close(fd);
+        return LIBCOUCHBASE_ENOMEM;
+    }
+    cache->header = (void*)cache->base;
+
+    if (created) {
+        init_segment(cache, usec);
+        /* The mapping keeps the file open, so closing it doesn't
+         * release the lock */
+        flock(fd, LOCK_UN);
+    } else {
+        /* Wait for the creator to initialize the segment */
+        for (ii = 0; ii < 100; ++ii) {
+            if (__atomic_load_n(&cache->header->magic,
+                                __ATOMIC_ACQUIRE) == SHARED_CACHE_MAGIC) {
+                break;
+            }
+            usleep(10000);
+        }
+        if (cache->header->magic != SHARED_CACHE_MAGIC ||
+            cache->header->version != SHARED_CACHE_VERSION ||
+            cache->header->size != cache->size) {
+            *stale = remove_stale_segment(fd, path);
+            close(fd);
+            return LIBCOUCHBASE_ERROR;
+        }
+    }
+    close(fd);
+
+    cache->slots = (void*)(cache->base + cache->header->slot_offset);
+    return LIBCOUCHBASE_SUCCESS;
+}
+
+void libcouchbase_shared_cache_destroy(libcouchbase_t instance)
+{
+    shared_cache_t *cache = instance->shared_cache;
+    uint32_t ii;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache->invalidator) {
+        /* Nobody invalidates the items any more */
+        for (ii = 0; ii < 65536; ++ii) {
+            uncover(cache, (uint16_t)ii);
+        }
+        libcouchbase_shared_cache_flush(instance);
+    }
+
+    munmap(cache->base, cache->size);
+    free(cache);
+    instance->shared_cache = NULL;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_attach_shared_cache(libcouchbase_t instance,
+                                                      const char *path,
+                                                      size_t nbytes,
+                                                      uint32_t usec,
+                                                      bool invalidator)
+{
+    shared_cache_t *cache;
+    libcouchbase_error_t error;
+    int ii;
+
+    if (instance->shared_cache != NULL) {
+        return LIBCOUCHBASE_ERROR;
+    }
+
+    if (libcouchbase_threads_shared(instance)) {
+        /* The cache is only touched by the event loop of the instance */
+        return LIBCOUCHBASE_NOT_SUPPORTED;
+    }
+
+    if (nbytes < MIN_SEGMENT_SIZE) {
+        return LIBCOUCHBASE_ERROR;
+    }
+
+    /* The offsets are 32 bits */
+    if ((uint64_t)nbytes > ((uint64_t)UINT32_MAX << OFFSET_SHIFT)) {
+        return LIBCOUCHBASE_E2BIG;
+    }
+
+    if ((cache = calloc(1, sizeof(*cache))) == NULL) {
+        return LIBCOUCHBASE_ENOMEM;
+    }
+
+    for (ii = 0; ii < ATTACH_ATTEMPTS; ++ii) {
+        bool stale = false;
+
+        if ((error = map_segment(cache, path, nbytes, usec,
+                                 &stale)) == LIBCOUCHBASE_SUCCESS) {
+            break;
+        }
+        if (cache->base != NULL) {
+            munmap(cache->base, cache->size);
+            cache->base = NULL;
+        }
+        if (!stale) {
+            break;
+        }
+    }
+
+    if (error != LIBCOUCHBASE_SUCCESS) {
+        free(cache);
+        return error;
+    }
+
+    cache->invalidator = invalidator;
+    instance->shared_cache = cache;
+    if (invalidator) {
+        libcouchbase_tap_keys(instance);
+    }
+
+    return LIBCOUCHBASE_SUCCESS;
+}
+
+#else
+
+bool libcouchbase_shared_cache_get(libcouchbase_t instance,
+                                   const void *command_cookie,
+                                   uint16_t vb,
+                                   const void *key, size_t nkey)
+{
+    (void)instance; (void)command_cookie; (void)vb; (void)key; (void)nkey;
+    return false;
+}
+
+void libcouchbase_shared_cache_store(libcouchbase_t instance,
+                                     uint32_t sent,
+                                     uint16_t vb,
+                                     const void *key, size_t nkey,
+                                     const void *bytes, size_t nbytes,
+                                     uint32_t flags, uint64_t cas)
+{
+    (void)instance; (void)sent; (void)vb; (void)key; (void)nkey;
+    (void)bytes; (void)nbytes; (void)flags; (void)cas;
+}
+
+uint32_t libcouchbase_shared_cache_clock(libcouchbase_t instance)
+{
+    (void)instance;
+    return 0;
+}
+
+void libcouchbase_shared_cache_invalidate(libcouchbase_t instance,
+                                          uint16_t vb,
+                                          const void *key, size_t nkey)
+{
+    (void)instance; (void)vb; (void)key; (void)nkey;
+}
+
+void libcouchbase_shared_cache_flush(libcouchbase_t instance)
+{
+    (void)instance;
+}
+
+void libcouchbase_shared_cache_cover(libcouchbase_t instance, uint16_t vb)
+{
+    (void)instance; (void)vb;
+}
+
+void libcouchbase_shared_cache_config_changed(libcouchbase_t instance,
+                                              const uint16_t *old_map,
+                                              uint16_t old_nvbuckets,
+                                              const size_t *origin)
+{
+    (void)instance; (void)old_map; (void)old_nvbuckets; (void)origin;
+}
+
+void libcouchbase_shared_cache_destroy(libcouchbase_t instance)
+{
+    (void)instance;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_attach_shared_cache(libcouchbase_t instance,
+                                                      const char *path,
+                                                      size_t nbytes,
+                                                      uint32_t usec,
+                                                      bool invalidator)
+{
+    (void)instance; (void)path; (void)nbytes; (void)usec; (void)invalidator;
+    return LIBCOUCHBASE_NOT_SUPPORTED;
+}
+
+#endif
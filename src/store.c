@@ -17,44 +17,50 @@
 #include "internal.h"
 
 /**
- * Spool a store request
+ * Encode a store request and add it to the server's output buffer.
  *
- * @author Trond Norbye
- * @todo add documentation
- * @todo fix the expiration so that it works relative/absolute etc..
- * @todo we might want to wait to write the data to the sockets if the
- *       user want to run a batch of store requests?
+ * @param instance the handle to libcouchbase
+ * @param command_cookie the cookie passed to the callback for the command
+ * @param operation constraints for the storage operation
+ * @param quiet set to true to use the quiet version of the command
+ * @param hashkey the key to use for hashing (or NULL to use the key)
+ * @param nhashkey the number of bytes in hashkey
+ * @param key the key to set
+ * @param nkey the number of bytes in the key
+ * @param iov the chunks of memory containing the value
+ * @param niov the number of elements in iov
+ * @param flags the user-defined flag section for the item
+ * @param exp When the object should expire
+ * @param cas the cas identifier for the existing object (or 0)
+ * @param copy set to true if the value should be copied
+ * @param release the function to call when the memory may be released
+ * @param cookie the cookie passed to the release function
+ * @param out where to store the server the command is sent to
+ * @return LIBCOUCHBASE_SUCCESS or LIBCOUCHBASE_ENOMEM
  */
-LIBCOUCHBASE_API
-libcouchbase_error_t libcouchbase_store(libcouchbase_t instance,
-                                        libcouchbase_storage_t operation,
-                                        const void *key, size_t nkey,
-                                        const void *bytes, size_t nbytes,
-                                        uint32_t flags, time_t exp,
-                                        uint64_t cas)
-{
-    return libcouchbase_store_by_key(instance, operation, NULL, 0, key, nkey,
-                                     bytes, nbytes, flags, exp, cas);
-}
-
-libcouchbase_error_t libcouchbase_store_by_key(libcouchbase_t instance,
-                                               libcouchbase_storage_t operation,
-                                               const void *hashkey,
-                                               size_t nhashkey,
-                                               const void *key, size_t nkey,
-                                               const void *bytes, size_t nbytes,
-                                               uint32_t flags, time_t exp,
-                                               uint64_t cas)
+static libcouchbase_error_t encode_store(libcouchbase_t instance,
+                                         const void *command_cookie,
+                                         libcouchbase_storage_t operation,
+                                         bool quiet,
+                                         const void *hashkey,
+                                         size_t nhashkey,
+                                         const void *key, size_t nkey,
+                                         const libcouchbase_iov_t *iov,
+                                         size_t niov,
+                                         uint32_t flags, time_t exp,
+                                         uint64_t cas, bool copy,
+                                         libcouchbase_release_t release,
+                                         const void *cookie,
+                                         libcouchbase_server_t **out)
 {
     uint16_t vb;
     libcouchbase_server_t *server;
     protocol_binary_request_set req;
+    uint8_t opcode;
     size_t headersize;
     size_t bodylen;
-
-    // we need a vbucket config before we can start getting data..
-    libcouchbase_ensure_vbucket_config(instance);
-    assert(instance->vbucket_config);
+    size_t nbytes = 0;
+    size_t ii;
 
     if (nhashkey != 0) {
         vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
@@ -64,51 +70,250 @@ libcouchbase_error_t libcouchbase_store_by_key(libcouchbase_t instance,
                                                   key, nkey);
     }
 
+    for (ii = 0; ii < niov; ++ii) {
+        nbytes += iov[ii].iov_len;
+    }
+
     server = instance->servers + instance->vb_server_map[vb];
+    *out = server;
     memset(&req, 0, sizeof(req));
     req.message.header.request.magic = PROTOCOL_BINARY_REQ;
     req.message.header.request.keylen = ntohs((uint16_t)nkey);
     req.message.header.request.extlen = 8;
     req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
     req.message.header.request.vbucket = ntohs(vb);
-    req.message.header.request.opaque = ++instance->seqno;
+    req.message.header.request.opaque = libcouchbase_server_next_seqno(server);
     req.message.header.request.cas = cas;
     req.message.body.flags = flags;
     req.message.body.expiration = htonl((uint32_t)exp);
+    libcouchbase_near_cache_invalidate(instance, vb, key, nkey);
+    libcouchbase_shared_cache_invalidate(instance, vb, key, nkey);
 
     headersize = sizeof(req.bytes);
     switch (operation) {
     case LIBCOUCHBASE_ADD:
-        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_ADD;
+        opcode = quiet ? PROTOCOL_BINARY_CMD_ADDQ : PROTOCOL_BINARY_CMD_ADD;
         break;
     case LIBCOUCHBASE_REPLACE:
-        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_REPLACE;
+        opcode = quiet ? PROTOCOL_BINARY_CMD_REPLACEQ : PROTOCOL_BINARY_CMD_REPLACE;
         break;
     case LIBCOUCHBASE_SET:
-        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_SET;
+        opcode = quiet ? PROTOCOL_BINARY_CMD_SETQ : PROTOCOL_BINARY_CMD_SET;
         break;
     case LIBCOUCHBASE_APPEND:
-        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_APPEND;
+        opcode = quiet ? PROTOCOL_BINARY_CMD_APPENDQ : PROTOCOL_BINARY_CMD_APPEND;
         req.message.header.request.extlen = 0;
         headersize -= 8;
         break;
     case LIBCOUCHBASE_PREPEND:
-        req.message.header.request.opcode = PROTOCOL_BINARY_CMD_PREPEND;
+        opcode = quiet ? PROTOCOL_BINARY_CMD_PREPENDQ : PROTOCOL_BINARY_CMD_PREPEND;
         req.message.header.request.extlen = 0;
         headersize -= 8;
         break;
     default:
         abort();
     }
+    req.message.header.request.opcode = opcode;
 
     bodylen = nkey + nbytes + req.message.header.request.extlen;
     req.message.header.request.bodylen = htonl((uint32_t)bodylen);
 
-    libcouchbase_server_start_packet(server, &req, headersize);
+    libcouchbase_server_start_packet(server, command_cookie, &req, headersize);
     libcouchbase_server_write_packet(server, key, nkey);
-    libcouchbase_server_write_packet(server, bytes, nbytes);
-    libcouchbase_server_end_packet(server);
-    libcouchbase_server_send_packets(server);
+    if (copy) {
+        for (ii = 0; ii < niov; ++ii) {
+            libcouchbase_server_write_packet(server, iov[ii].iov_base,
+                                             iov[ii].iov_len);
+        }
+    } else {
+        libcouchbase_server_write_packet_iov(server, iov, niov,
+                                             release, cookie);
+    }
+    return libcouchbase_server_end_packet(server);
+}
+
+/**
+ * Spool a single store request and start sending it
+ *
+ * @see encode_store for a description of the parameters
+ */
+static libcouchbase_error_t spool_store(libcouchbase_t instance,
+                                        const void *command_cookie,
+                                        libcouchbase_storage_t operation,
+                                        const void *hashkey,
+                                        size_t nhashkey,
+                                        const void *key, size_t nkey,
+                                        const libcouchbase_iov_t *iov,
+                                        size_t niov,
+                                        uint32_t flags, time_t exp,
+                                        uint64_t cas, bool copy,
+                                        libcouchbase_release_t release,
+                                        const void *cookie)
+{
+    libcouchbase_server_t *server;
+    libcouchbase_error_t ret;
+
+    // we need a vbucket config before we can start getting data..
+    libcouchbase_ensure_vbucket_config(instance);
+    assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
+
+    ret = encode_store(instance, command_cookie, operation, false,
+                       hashkey, nhashkey, key, nkey, iov, niov,
+                       flags, exp, cas, copy, release, cookie, &server);
+    if (ret == LIBCOUCHBASE_SUCCESS) {
+        libcouchbase_server_send_packets(server);
+    }
+
+    return ret;
+}
+
+/**
+ * Spool a store request
+ *
+ * @author Trond Norbye
+ * @todo add documentation
+ * @todo fix the expiration so that it works relative/absolute etc..
+ * @todo we might want to wait to write the data to the sockets if the
+ *       user want to run a batch of store requests?
+ */
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_store(libcouchbase_t instance,
+                                        const void *command_cookie,
+                                        libcouchbase_storage_t operation,
+                                        const void *key, size_t nkey,
+                                        const void *bytes, size_t nbytes,
+                                        uint32_t flags, time_t exp,
+                                        uint64_t cas)
+{
+    return libcouchbase_store_by_key(instance, command_cookie, operation,
+                                     NULL, 0, key, nkey, bytes, nbytes,
+                                     flags, exp, cas);
+}
+
+libcouchbase_error_t libcouchbase_store_by_key(libcouchbase_t instance,
+                                               const void *command_cookie,
+                                               libcouchbase_storage_t operation,
+                                               const void *hashkey,
+                                               size_t nhashkey,
+                                               const void *key, size_t nkey,
+                                               const void *bytes, size_t nbytes,
+                                               uint32_t flags, time_t exp,
+                                               uint64_t cas)
+{
+    libcouchbase_iov_t iov;
+    iov.iov_base = bytes;
+    iov.iov_len = nbytes;
+    return spool_store(instance, command_cookie, operation, hashkey,
+                       nhashkey, key, nkey, &iov, 1, flags, exp, cas, true,
+                       NULL, NULL);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_store_iov(libcouchbase_t instance,
+                                            const void *command_cookie,
+                                            libcouchbase_storage_t operation,
+                                            const void *key, size_t nkey,
+                                            const libcouchbase_iov_t *iov,
+                                            size_t niov,
+                                            uint32_t flags, time_t exp,
+                                            uint64_t cas,
+                                            libcouchbase_release_t release,
+                                            const void *cookie)
+{
+    return libcouchbase_store_iov_by_key(instance, command_cookie,
+                                         operation, NULL, 0,
+                                         key, nkey, iov, niov, flags, exp,
+                                         cas, release, cookie);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_store_iov_by_key(libcouchbase_t instance,
+                                                   const void *command_cookie,
+                                                   libcouchbase_storage_t operation,
+                                                   const void *hashkey,
+                                                   size_t nhashkey,
+                                                   const void *key,
+                                                   size_t nkey,
+                                                   const libcouchbase_iov_t *iov,
+                                                   size_t niov,
+                                                   uint32_t flags,
+                                                   time_t exp,
+                                                   uint64_t cas,
+                                                   libcouchbase_release_t release,
+                                                   const void *cookie)
+{
+    return spool_store(instance, command_cookie, operation, hashkey,
+                       nhashkey, key, nkey, iov, niov, flags, exp, cas, false,
+                       release, cookie);
+}
+
+/**
+ * libcouchbase_mstore use the quiet storage commands followed by a NOOP
+ * command to avoid transferring the responses for the successful
+ * commands. The success callbacks are generated implicit by receiving
+ * a failure response or the NOOP.
+ */
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_mstore(libcouchbase_t instance,
+                                         const void * const *command_cookies,
+                                         libcouchbase_storage_t operation,
+                                         size_t num_keys,
+                                         const void * const *keys,
+                                         const size_t *nkey,
+                                         const void * const *bytes,
+                                         const size_t *nbytes,
+                                         const uint32_t *flags,
+                                         const time_t *exp,
+                                         const uint64_t *cas)
+{
+    return libcouchbase_mstore_by_key(instance, command_cookies, operation,
+                                      NULL, 0, num_keys, keys, nkey,
+                                      bytes, nbytes, flags, exp, cas);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_mstore_by_key(libcouchbase_t instance,
+                                                const void * const *command_cookies,
+                                                libcouchbase_storage_t operation,
+                                                const void *hashkey,
+                                                size_t nhashkey,
+                                                size_t num_keys,
+                                                const void * const *keys,
+                                                const size_t *nkey,
+                                                const void * const *bytes,
+                                                const size_t *nbytes,
+                                                const uint32_t *flags,
+                                                const time_t *exp,
+                                                const uint64_t *cas)
+{
+    libcouchbase_server_t *server = NULL;
+    libcouchbase_error_t ret = LIBCOUCHBASE_SUCCESS;
+    size_t ii;
+
+    // we need a vbucket config before we can start getting data..
+    libcouchbase_ensure_vbucket_config(instance);
+    assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
+
+    for (ii = 0; ii < num_keys && ret == LIBCOUCHBASE_SUCCESS; ++ii) {
+        libcouchbase_iov_t iov;
+        iov.iov_base = bytes[ii];
+        iov.iov_len = nbytes[ii];
+        ret = encode_store(instance,
+                           command_cookies ? command_cookies[ii] : NULL,
+                           operation, true,
+                           hashkey, nhashkey, keys[ii], nkey[ii], &iov, 1,
+                           flags ? flags[ii] : 0, exp ? exp[ii] : 0,
+                           cas ? cas[ii] : 0, true, NULL, NULL, &server);
+        if (ret == LIBCOUCHBASE_SUCCESS) {
+            libcouchbase_server_fence(server);
+        }
+    }
+
+    if (nhashkey == 0 || server != NULL) {
+        libcouchbase_send_fenced(instance, nhashkey == 0 ? NULL : server);
+    }
 
-    return LIBCOUCHBASE_SUCCESS;
+    return ret;
 }
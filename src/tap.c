@@ -24,9 +24,17 @@
 
 #include "internal.h"
 
+#ifndef TAP_CONNECT_REQUEST_KEYS_ONLY
+#define TAP_CONNECT_REQUEST_KEYS_ONLY 0x20
+#endif
+
 static void tap_vbucket_state_listener(libcouchbase_server_t *server)
 {
     libcouchbase_t instance = server->instance;
+    /* The server doesn't respond to TAP_CONNECT, so it can't be in the
+     * command log (we may send other commands on the connection) */
+    chain_t *chain = server->connected ? &server->output : &server->pending;
+    uint32_t flags = TAP_CONNECT_FLAG_LIST_VBUCKETS;
     // Locate this index:
     size_t idx;
     size_t bodylen;
@@ -56,19 +64,26 @@ static void tap_vbucket_state_listener(libcouchbase_server_t *server)
     req.message.header.request.extlen = 4;
     req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
     req.message.header.request.bodylen = htonl((uint32_t)bodylen);
-    req.message.body.flags = htonl(TAP_CONNECT_FLAG_LIST_VBUCKETS);
+    if (instance->tap.keys_only) {
+        flags |= TAP_CONNECT_REQUEST_KEYS_ONLY;
+    }
+    req.message.body.flags = htonl(flags);
 
-    libcouchbase_server_start_packet(server, req.bytes, sizeof(req.bytes));
+    libcouchbase_server_buffer_start_packet(server, chain, req.bytes,
+                                            sizeof(req.bytes));
 
     val = htons(total);
-    libcouchbase_server_write_packet(server, &val, sizeof(val));
+    libcouchbase_server_buffer_write_packet(server, chain, &val, sizeof(val));
     for (ii = 0; ii < instance->nvbuckets; ++ii) {
         if (instance->vb_server_map[ii] == idx) {
             val = htons((uint16_t)ii);
-            libcouchbase_server_write_packet(server, &val, sizeof(val));
+            libcouchbase_server_buffer_write_packet(server, chain, &val,
+                                                    sizeof(val));
+            libcouchbase_near_cache_cover(instance, (uint16_t)ii);
+            libcouchbase_shared_cache_cover(instance, (uint16_t)ii);
         }
     }
-    libcouchbase_server_end_packet(server);
+    libcouchbase_server_buffer_end_packet(server, chain);
 
     libcouchbase_server_send_packets(server);
 }
@@ -84,6 +99,28 @@ void libcouchbase_tap_cluster(libcouchbase_t instance,
 
     /* Start the event loop and dump everything */
     if (block) {
-        event_base_loop(instance->ev_base, 0);
+        instance->io->run_event_loop(instance->io);
+    }
+}
+
+void libcouchbase_tap_keys(libcouchbase_t instance)
+{
+    size_t ii;
+
+    if (instance->vbucket_state_listener == tap_vbucket_state_listener) {
+        /* The servers are already tapped (with the vbuckets they have) */
+        for (ii = 0; ii < instance->nvbuckets; ++ii) {
+            libcouchbase_near_cache_cover(instance, (uint16_t)ii);
+            libcouchbase_shared_cache_cover(instance, (uint16_t)ii);
+        }
+        return;
+    }
+
+    instance->tap.keys_only = true;
+    instance->vbucket_state_listener = tap_vbucket_state_listener;
+
+    /* The listener is only notified about the servers created later */
+    for (ii = 0; ii < instance->nservers; ++ii) {
+        tap_vbucket_state_listener(instance->servers + ii);
     }
 }
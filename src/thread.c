@@ -0,0 +1,1057 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the code to run the event loops of an instance in
+ * I/O threads. Each thread runs its own event loop (see shard_t), and
+ * owns a subset of the servers of the instance. Only the owner touches
+ * a server (its connection, output and command log), so no locks are
+ * needed on the paths sending commands and processing responses.
+ *
+ * Other threads submit tasks to a thread through a lock-free queue, and
+ * wake up the event loop by writing to a socket watched by the event
+ * loop. A task may spool commands for any key. The packets for servers
+ * owned by other threads are built in the forward chain of the calling
+ * thread, and submitted to the owner once the task is done.
+ *
+ * The first thread runs the event loop of the instance, and receives
+ * the configuration updates. It parks the other threads while it
+ * replaces the list of servers, so that each thread finds its servers
+ * (and the commands sent to them) updated when it resumes. A server
+ * stays with its thread as long as it is part of the cluster, and new
+ * servers are given to the thread owning the fewest servers.
+ */
+#include "internal.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/**
+ * A packet built for a server owned by another thread. The packet is
+ * submitted as a task to the owner, and added to the output and the
+ * command log of the server when the task runs.
+ */
+typedef struct forward_st {
+    /** The task submitted to the owner (the task is released with it) */
+    submit_task_t task;
+    /** The index of the server in the list of servers */
+    size_t server;
+    /** The list of servers the index refers to (see threads.config) */
+    uint64_t config;
+    /** The packet */
+    chain_t packet;
+    /** The command cookie for the packet */
+    const void *cookie;
+    /** The operation the command belongs to */
+    libcouchbase_operation_t operation;
+    /** The timeout for the command (0 to use the timeout of the instance) */
+    uint32_t timeout;
+    /** The number of times the command has been retried */
+    uint8_t retries;
+    /** Should a NOOP follow the packet */
+    bool fence;
+} forward_t;
+
+/** The event loop run by the calling thread (NULL unless an I/O thread) */
+static __thread shard_t *current_shard;
+
+static void queue_init(submit_queue_t *queue)
+{
+    queue->stub.next = NULL;
+    queue->head = queue->tail = &queue->stub;
+}
+
+/* May be called from any thread */
+static void queue_push(submit_queue_t *queue, submit_task_t *task)
+{
+    submit_task_t *prev;
+    task->next = NULL;
+    prev = __atomic_exchange_n(&queue->head, task, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+/*
+ * Only called from the I/O thread. Returns NULL if the queue is empty,
+ * or if a producer is in the middle of adding a task (it will wake us
+ * up once it is done)
+ */
+static submit_task_t *queue_pop(submit_queue_t *queue)
+{
+    submit_task_t *tail = queue->tail;
+    submit_task_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    queue_push(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+/* May be called from any thread */
+static void shard_submit_task(shard_t *shard, submit_task_t *task)
+{
+    queue_push(&shard->queue, task);
+
+    /* Only the first task after the event loop drained the socket
+     * needs to wake it up */
+    if (__atomic_exchange_n(&shard->wakeup_pending, 1,
+                            __ATOMIC_SEQ_CST) == 0) {
+        char c = 0;
+        ssize_t nw;
+        do {
+            nw = send(shard->sock[1], &c, 1, 0);
+        } while (nw == -1 && errno == EINTR);
+        /* EAGAIN means that the socket is full of wakeups already */
+    }
+}
+
+/* May be called from any thread */
+static libcouchbase_error_t shard_submit(shard_t *shard,
+                                         libcouchbase_task_t task,
+                                         void *arg)
+{
+    submit_task_t *t;
+
+    if ((t = malloc(sizeof(*t))) == NULL) {
+        return LIBCOUCHBASE_ENOMEM;
+    }
+    t->task = task;
+    t->arg = arg;
+    shard_submit_task(shard, t);
+
+    return LIBCOUCHBASE_SUCCESS;
+}
+
+shard_t *libcouchbase_current_shard(libcouchbase_t instance)
+{
+    if (current_shard != NULL && current_shard->instance == instance) {
+        return current_shard;
+    }
+    return &instance->shard;
+}
+
+shard_t *libcouchbase_shard_for_new_server(libcouchbase_t instance)
+{
+    shard_t *ret = &instance->shard;
+    size_t ii;
+
+    for (ii = 1; ii < instance->threads.count; ++ii) {
+        if (instance->threads.shards[ii]->nservers < ret->nservers) {
+            ret = instance->threads.shards[ii];
+        }
+    }
+
+    return ret;
+}
+
+bool libcouchbase_server_is_local(libcouchbase_server_t *server)
+{
+    return server->shard == libcouchbase_current_shard(server->instance) ||
+        server->instance->threads.paused;
+}
+
+uint32_t libcouchbase_server_next_seqno(libcouchbase_server_t *server)
+{
+    if (!libcouchbase_server_is_local(server)) {
+        return 0;
+    }
+    return ++server->shard->seqno;
+}
+
+libcouchbase_error_t libcouchbase_forward_packet(libcouchbase_server_t *server,
+                                                 const void *command_cookie)
+{
+    libcouchbase_t instance = server->instance;
+    shard_t *shard = libcouchbase_current_shard(instance);
+    forward_t *fwd = calloc(1, sizeof(*fwd));
+
+    if (fwd == NULL) {
+        return LIBCOUCHBASE_ENOMEM;
+    }
+
+    fwd->task.arg = fwd;
+    fwd->server = (size_t)(server - instance->servers);
+    fwd->config = instance->threads.config;
+    libcouchbase_chain_move(&fwd->packet, &shard->forward.chain);
+    fwd->cookie = command_cookie;
+    fwd->operation = shard->operation;
+    fwd->timeout = shard->op_timeout;
+
+    if (shard->forward.tail == NULL) {
+        shard->forward.head = fwd;
+    } else {
+        shard->forward.tail->task.next = &fwd->task;
+    }
+    shard->forward.tail = fwd;
+
+    return LIBCOUCHBASE_SUCCESS;
+}
+
+void libcouchbase_forward_fence(libcouchbase_t instance)
+{
+    shard_t *shard = libcouchbase_current_shard(instance);
+    assert(shard->forward.tail != NULL);
+    shard->forward.tail->fence = true;
+}
+
+void libcouchbase_forward_retries(libcouchbase_t instance, uint8_t retries)
+{
+    shard_t *shard = libcouchbase_current_shard(instance);
+    assert(shard->forward.tail != NULL);
+    shard->forward.tail->retries = retries;
+}
+
+/**
+ * Look up the server a forwarded packet should be sent to. If the list
+ * of servers changed after the packet was built, we send it to the
+ * server now hosting the vbucket.
+ *
+ * @param instance the instance the packet was built for
+ * @param fwd the packet
+ * @return the server, or NULL if there is no server for the vbucket
+ */
+static libcouchbase_server_t *forward_target(libcouchbase_t instance,
+                                             forward_t *fwd)
+{
+    if (fwd->config != instance->threads.config) {
+        protocol_binary_request_header req;
+        chain_mark_t mark;
+        uint16_t vb;
+        int idx;
+
+        memset(&mark, 0, sizeof(mark));
+        libcouchbase_chain_copy(&fwd->packet, &mark, &req, sizeof(req));
+        vb = ntohs(req.request.vbucket);
+        if (vb >= instance->nvbuckets) {
+            return NULL;
+        }
+        if (req.request.opcode == PROTOCOL_BINARY_CMD_GET_REPLICA) {
+            idx = vbucket_get_replica(instance->vbucket_config, vb, 0);
+        } else {
+            idx = instance->vb_server_map[vb];
+        }
+        if (idx < 0) {
+            return NULL;
+        }
+        fwd->server = (size_t)idx;
+        fwd->config = instance->threads.config;
+    }
+
+    if (fwd->server >= instance->nservers) {
+        return NULL;
+    }
+    return instance->servers + fwd->server;
+}
+
+/**
+ * Release a forwarded packet we couldn't send, and report the failure to
+ * the callback for the command. The packet is released before we call
+ * the callback, because the callback may spool new commands.
+ *
+ * @param instance the instance the packet was built for
+ * @param chain the chain with the packet
+ * @param mark the beginning of the packet
+ * @param truncate set to true to truncate the chain at the mark (false
+ *                 to destroy the chain)
+ * @param cookie the command cookie for the packet
+ * @param error the error to report
+ */
+static void fail_packet(libcouchbase_t instance, chain_t *chain,
+                        const chain_mark_t *mark, bool truncate,
+                        const void *cookie, libcouchbase_error_t error)
+{
+    protocol_binary_request_header req;
+    /* Big enough for the extras and any key the server accepts */
+    char buffer[sizeof(req) + 255 + 256];
+    char *data = buffer;
+    size_t nkey;
+    size_t size;
+
+    libcouchbase_chain_copy(chain, mark, &req, sizeof(req));
+    nkey = ntohs(req.request.keylen);
+    size = sizeof(req) + req.request.extlen + nkey;
+    if (size > sizeof(buffer) && (data = malloc(size)) == NULL) {
+        /* Report it without the key */
+        nkey = 0;
+    } else {
+        libcouchbase_chain_copy(chain, mark, data, size);
+    }
+
+    if (truncate) {
+        libcouchbase_chain_truncate(instance, chain, mark);
+    } else {
+        libcouchbase_chain_destroy(instance, chain);
+    }
+
+    libcouchbase_fail_request(instance, cookie, req.request.opcode,
+                              nkey ? data + sizeof(req) + req.request.extlen : NULL,
+                              nkey, error);
+    if (data != buffer) {
+        free(data);
+    }
+}
+
+/**
+ * Release a forwarded packet nobody will send (see fail_packet)
+ */
+static void fail_forwarded(libcouchbase_t instance, forward_t *fwd,
+                           libcouchbase_error_t error)
+{
+    chain_mark_t mark;
+    memset(&mark, 0, sizeof(mark));
+    fail_packet(instance, &fwd->packet, &mark, false, fwd->cookie, error);
+}
+
+/**
+ * Add a forwarded packet to the output and the command log of the
+ * server (running in the thread owning the server).
+ */
+static void forward_add(libcouchbase_server_t *server, forward_t *fwd)
+{
+    libcouchbase_t instance = server->instance;
+    shard_t *shard = server->shard;
+    chain_t *chain = server->connected ? &server->output : &server->pending;
+    protocol_binary_request_header *req;
+    libcouchbase_operation_t operation = shard->operation;
+    uint32_t timeout = shard->op_timeout;
+    chain_mark_t mark;
+    bool success;
+
+    /* The header is always copied to the first segment of the packet */
+    assert(fwd->packet.head->size > 0 &&
+           fwd->packet.head->avail - fwd->packet.head->start >= sizeof(*req));
+    req = (void*)(fwd->packet.head->data + fwd->packet.head->start);
+    req->request.opaque = ++shard->seqno;
+
+    libcouchbase_chain_get_mark(chain, &mark);
+    libcouchbase_chain_move(chain, &fwd->packet);
+    /* The command is still a part of the operation it was spooled in */
+    shard->operation = fwd->operation;
+    shard->op_timeout = fwd->timeout;
+    success = libcouchbase_cmd_log_append(&server->cmd_log, chain, &mark,
+                                          instance->retain_values,
+                                          fwd->cookie);
+    if (success) {
+        libcouchbase_cmd_log_tail(&server->cmd_log)->retries = fwd->retries;
+        libcouchbase_timeout_start(server);
+    }
+    shard->operation = operation;
+    shard->op_timeout = timeout;
+    if (!success) {
+        fail_packet(instance, chain, &mark, true, fwd->cookie,
+                    LIBCOUCHBASE_ENOMEM);
+        return;
+    }
+
+    if (fwd->fence) {
+        libcouchbase_server_fence(server);
+    }
+    libcouchbase_server_send_packets(server);
+}
+
+static void forward_task(libcouchbase_t instance, void *arg)
+{
+    forward_t *fwd = arg;
+    libcouchbase_server_t *server = forward_target(instance, fwd);
+    shard_t *shard = libcouchbase_current_shard(instance);
+    forward_t *next;
+
+    if (server == NULL) {
+        /* The vbucket isn't served by anyone */
+        fail_forwarded(instance, fwd, LIBCOUCHBASE_ERROR);
+        return;
+    }
+
+    if (server->shard == shard) {
+        forward_add(server, fwd);
+        return;
+    }
+
+    /* The server moved to another thread after the packet was sent
+     * here, so pass it on (the task is released when we return) */
+    if ((next = malloc(sizeof(*next))) == NULL) {
+        fail_forwarded(instance, fwd, LIBCOUCHBASE_ENOMEM);
+        return;
+    }
+    *next = *fwd;
+    next->task.arg = next;
+    next->task.next = NULL;
+    memset(&fwd->packet, 0, sizeof(fwd->packet));
+    if (shard->forward.tail == NULL) {
+        shard->forward.head = next;
+    } else {
+        shard->forward.tail->task.next = &next->task;
+    }
+    shard->forward.tail = next;
+}
+
+void libcouchbase_forward_flush(libcouchbase_t instance)
+{
+    shard_t *shard = libcouchbase_current_shard(instance);
+    forward_t *fwd = shard->forward.head;
+
+    shard->forward.head = shard->forward.tail = NULL;
+    while (fwd != NULL) {
+        forward_t *next = (forward_t*)fwd->task.next;
+        libcouchbase_server_t *server = forward_target(instance, fwd);
+
+        if (server == NULL) {
+            fail_forwarded(instance, fwd, LIBCOUCHBASE_ERROR);
+            free(fwd);
+        } else {
+            fwd->task.task = forward_task;
+            shard_submit_task(server->shard, &fwd->task);
+        }
+        fwd = next;
+    }
+}
+
+/**
+ * Release a task that has run (the tasks embedded in the shard are
+ * reused)
+ */
+static void free_task(shard_t *shard, submit_task_t *task)
+{
+    if (task != &shard->tasks.pause && task != &shard->tasks.stop) {
+        free(task);
+    }
+}
+
+/**
+ * Release a task we won't run
+ */
+static void release_task(shard_t *shard, submit_task_t *task)
+{
+    if (task->task == forward_task) {
+        forward_t *fwd = task->arg;
+        libcouchbase_chain_destroy(shard->instance, &fwd->packet);
+    }
+    free_task(shard, task);
+}
+
+static void wakeup_handler(libcouchbase_socket_t sock, short which,
+                           void *arg)
+{
+    shard_t *shard = arg;
+    libcouchbase_io_opt_t *io = shard->io;
+    submit_task_t *task;
+    char buffer[64];
+    (void)which;
+
+    /* Drain the socket before we clear the pending flag so that a
+     * new wakeup always leaves data in the socket */
+    while (io->recv(io, sock, buffer, sizeof(buffer), 0) > 0) {
+        /* empty */
+    }
+    __atomic_store_n(&shard->wakeup_pending, 0, __ATOMIC_SEQ_CST);
+
+    while ((task = queue_pop(&shard->queue)) != NULL) {
+        task->task(shard->instance, task->arg);
+        free_task(shard, task);
+    }
+
+    /* Pass on the packets the tasks spooled for the other threads */
+    libcouchbase_forward_flush(shard->instance);
+}
+
+static void stop_task(libcouchbase_t instance, void *arg)
+{
+    shard_t *shard = arg;
+    (void)instance;
+    shard->stop = true;
+    shard->io->stop_event_loop(shard->io);
+}
+
+/**
+ * Park the thread until the first thread is done updating the list
+ * of servers
+ */
+static void pause_task(libcouchbase_t instance, void *arg)
+{
+    uint64_t generation;
+    (void)arg;
+
+    pthread_mutex_lock(&instance->threads.mutex);
+    generation = instance->threads.generation;
+    ++instance->threads.nparked;
+    pthread_cond_broadcast(&instance->threads.cond);
+    while (generation == instance->threads.generation) {
+        pthread_cond_wait(&instance->threads.cond, &instance->threads.mutex);
+    }
+    pthread_mutex_unlock(&instance->threads.mutex);
+}
+
+void libcouchbase_threads_pause(libcouchbase_t instance)
+{
+    size_t ii;
+
+    if (instance->threads.count < 2) {
+        return;
+    }
+
+    /* A thread is done with its pause task once it is parked, so we
+     * may reuse it */
+    for (ii = 1; ii < instance->threads.count; ++ii) {
+        shard_t *shard = instance->threads.shards[ii];
+        shard->tasks.pause.task = pause_task;
+        shard->tasks.pause.arg = NULL;
+        shard_submit_task(shard, &shard->tasks.pause);
+    }
+
+    pthread_mutex_lock(&instance->threads.mutex);
+    while (instance->threads.nparked < instance->threads.count - 1) {
+        pthread_cond_wait(&instance->threads.cond, &instance->threads.mutex);
+    }
+    pthread_mutex_unlock(&instance->threads.mutex);
+
+    /* The threads may look up the owner of a key until they're parked */
+    pthread_rwlock_wrlock(&instance->threads.config_lock);
+    instance->threads.paused = true;
+    ++instance->threads.config;
+}
+
+void libcouchbase_threads_resume(libcouchbase_t instance)
+{
+    if (instance->threads.count < 2) {
+        return;
+    }
+
+    instance->threads.paused = false;
+    pthread_rwlock_unlock(&instance->threads.config_lock);
+
+    pthread_mutex_lock(&instance->threads.mutex);
+    instance->threads.nparked = 0;
+    ++instance->threads.generation;
+    pthread_cond_broadcast(&instance->threads.cond);
+    pthread_mutex_unlock(&instance->threads.mutex);
+}
+
+static void *io_thread_main(void *arg)
+{
+    shard_t *shard = arg;
+
+    current_shard = shard;
+    /* The event loop may be stopped by others (for instance when
+     * we receive a new configuration), so keep running until we're
+     * told to stop */
+    while (!shard->stop) {
+        shard->io->run_event_loop(shard->io);
+    }
+    current_shard = NULL;
+
+    return NULL;
+}
+
+/**
+ * Remove the commands of a server we failed to move from the counts of
+ * the event loop we tried to move it to
+ *
+ * @param server the server we tried to move
+ * @param shard the event loop we tried to move it to
+ * @param count the number of entries in the command log we counted
+ */
+static void untrack_moved(libcouchbase_server_t *server, shard_t *shard,
+                          size_t count)
+{
+    size_t ii;
+
+    for (ii = 0; ii < count; ++ii) {
+        cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(&server->cmd_log, ii);
+        if ((entry->flags & CMD_COMPLETED) == 0) {
+            libcouchbase_operation_untrack(shard, entry->operation);
+        }
+    }
+}
+
+/**
+ * Move a server to another event loop. Only called when the thread
+ * owning the server isn't running it.
+ *
+ * @param server the server to move
+ * @param shard the event loop to move it to
+ */
+static void move_server(libcouchbase_server_t *server, shard_t *shard)
+{
+    shard_t *from = server->shard;
+    size_t ii;
+
+    if (from == shard) {
+        return;
+    }
+
+    /* The commands not completed are counted by the owner */
+    for (ii = 0; ii < server->cmd_log.count; ++ii) {
+        cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(&server->cmd_log, ii);
+        if ((entry->flags & CMD_COMPLETED) == 0 &&
+            !libcouchbase_operation_track(shard, entry->operation)) {
+            /* Keep it where it is */
+            untrack_moved(server, shard, ii);
+            return;
+        }
+    }
+
+    if (server->event != NULL) {
+        void *event = shard->io->create_event(shard->io);
+        if (event == NULL) {
+            /* Keep it where it is */
+            untrack_moved(server, shard, server->cmd_log.count);
+            return;
+        }
+        from->io->delete_event(from->io, server->sock, server->event);
+        from->io->destroy_event(from->io, server->event);
+        server->event = event;
+        if (server->ev_flags != 0 &&
+            shard->io->update_event(shard->io, server->sock, server->event,
+                                    server->ev_flags, server,
+                                    server->ev_handler) == -1) {
+            abort();
+        }
+    }
+
+    --from->nservers;
+    ++shard->nservers;
+    server->shard = shard;
+    server->cmd_log.shard = shard;
+    libcouchbase_timeout_shard_moved(server, from);
+
+    for (ii = 0; ii < server->cmd_log.count; ++ii) {
+        cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(&server->cmd_log, ii);
+        if ((entry->flags & CMD_COMPLETED) == 0) {
+            --from->outstanding;
+            libcouchbase_operation_untrack(from, entry->operation);
+            ++shard->outstanding;
+        }
+    }
+}
+
+/**
+ * Create the event loop for another I/O thread
+ */
+static shard_t *create_shard(libcouchbase_t instance,
+                             libcouchbase_io_opt_t *io)
+{
+    shard_t *ret = calloc(1, sizeof(*ret));
+    if (ret == NULL) {
+        io->destroy(io);
+        return NULL;
+    }
+
+    ret->instance = instance;
+    ret->io = io;
+    /* The opaque fields must keep increasing for the servers moved
+     * from the event loop of the instance */
+    ret->seqno = instance->shard.seqno;
+    ret->packet.mark.offset = (size_t)-1;
+    ret->sock[0] = ret->sock[1] = INVALID_SOCKET;
+    libcouchbase_timeout_init(ret);
+
+    return ret;
+}
+
+static void destroy_shard(libcouchbase_t instance, shard_t *shard)
+{
+    libcouchbase_timeout_destroy(shard);
+    libcouchbase_operation_counts_destroy(shard);
+    libcouchbase_chain_destroy(instance, &shard->forward.chain);
+    libcouchbase_segment_pool_destroy(&shard->segment_pool);
+    shard->io->destroy(shard->io);
+    free(shard);
+}
+
+/**
+ * Start watching the socket other threads use to wake up the event loop
+ */
+static libcouchbase_error_t start_wakeup(shard_t *shard)
+{
+    libcouchbase_io_opt_t *io = shard->io;
+    int sock[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) == -1) {
+        return LIBCOUCHBASE_NETWORK_ERROR;
+    }
+    shard->sock[0] = sock[0];
+    shard->sock[1] = sock[1];
+    queue_init(&shard->queue);
+    shard->wakeup_pending = 0;
+    shard->stop = false;
+
+    if (libcouchbase_make_socket_nonblocking(sock[0]) != 0 ||
+        libcouchbase_make_socket_nonblocking(sock[1]) != 0) {
+        return LIBCOUCHBASE_NETWORK_ERROR;
+    }
+
+    shard->event = io->create_event(io);
+    if (shard->event == NULL) {
+        return LIBCOUCHBASE_ENOMEM;
+    }
+
+    if (io->update_event(io, sock[0], shard->event, LIBCOUCHBASE_READ_EVENT,
+                         shard, wakeup_handler) == -1) {
+        return LIBCOUCHBASE_ERROR;
+    }
+
+    return LIBCOUCHBASE_SUCCESS;
+}
+
+static void release_wakeup(shard_t *shard)
+{
+    libcouchbase_io_opt_t *io = shard->io;
+    submit_task_t *task;
+
+    if (shard->sock[0] == INVALID_SOCKET) {
+        return;
+    }
+
+    while ((task = queue_pop(&shard->queue)) != NULL) {
+        release_task(shard, task);
+    }
+
+    if (shard->event != NULL) {
+        io->delete_event(io, shard->sock[0], shard->event);
+        io->destroy_event(io, shard->event);
+        shard->event = NULL;
+    }
+    io->close(io, shard->sock[0]);
+    io->close(io, shard->sock[1]);
+    shard->sock[0] = shard->sock[1] = INVALID_SOCKET;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_start_io_threads(libcouchbase_t instance,
+                                                   size_t nthreads,
+                                                   libcouchbase_io_opt_t * const *io)
+{
+    libcouchbase_error_t ret = LIBCOUCHBASE_SUCCESS;
+    shard_t **shards;
+    size_t ii;
+
+    if (instance->threads.count > 0 || nthreads == 0) {
+        ret = LIBCOUCHBASE_ERROR;
+    } else if (nthreads > 1 &&
+               (instance->near_cache != NULL ||
+                instance->shared_cache != NULL ||
+                instance->coalesce.enabled || instance->hedge.usec != 0 ||
+                instance->batch.enabled)) {
+        /* They use state shared by all of the servers */
+        ret = LIBCOUCHBASE_NOT_SUPPORTED;
+    }
+
+    if (ret == LIBCOUCHBASE_SUCCESS &&
+        (shards = calloc(nthreads, sizeof(*shards))) == NULL) {
+        ret = LIBCOUCHBASE_ENOMEM;
+    }
+
+    if (ret != LIBCOUCHBASE_SUCCESS) {
+        for (ii = 1; ii < nthreads; ++ii) {
+            io[ii - 1]->destroy(io[ii - 1]);
+        }
+        return ret;
+    }
+
+    shards[0] = &instance->shard;
+    for (ii = 1; ii < nthreads; ++ii) {
+        if ((shards[ii] = create_shard(instance, io[ii - 1])) == NULL) {
+            ret = LIBCOUCHBASE_ENOMEM;
+        }
+    }
+
+    /* The tasks may spool commands, and that would try to run the event
+     * loop recursively if we didn't have the configuration */
+    if (ret == LIBCOUCHBASE_SUCCESS) {
+        libcouchbase_ensure_vbucket_config(instance);
+    }
+
+    instance->shard.sock[0] = instance->shard.sock[1] = INVALID_SOCKET;
+    for (ii = 0; ii < nthreads && ret == LIBCOUCHBASE_SUCCESS; ++ii) {
+        ret = start_wakeup(shards[ii]);
+    }
+
+    if (ret != LIBCOUCHBASE_SUCCESS) {
+        for (ii = 0; ii < nthreads; ++ii) {
+            if (shards[ii] != NULL) {
+                release_wakeup(shards[ii]);
+                if (ii > 0) {
+                    destroy_shard(instance, shards[ii]);
+                }
+            }
+        }
+        free(shards);
+        return ret;
+    }
+
+    pthread_mutex_init(&instance->threads.mutex, NULL);
+    pthread_cond_init(&instance->threads.cond, NULL);
+    pthread_rwlock_init(&instance->threads.config_lock, NULL);
+    instance->threads.shards = shards;
+    instance->threads.count = nthreads;
+    instance->threads.nparked = 0;
+    instance->threads.paused = false;
+
+    /* Hand out the servers we've got */
+    for (ii = 0; ii < instance->nservers; ++ii) {
+        move_server(instance->servers + ii, shards[ii % nthreads]);
+    }
+
+    /* The first thread may park the others as soon as it runs, so it
+     * is started last */
+    for (ii = nthreads; ii > 0; --ii) {
+        if (pthread_create(&shards[ii - 1]->thread, NULL, io_thread_main,
+                           shards[ii - 1]) != 0) {
+            libcouchbase_stop_io_thread(instance);
+            return LIBCOUCHBASE_ERROR;
+        }
+        shards[ii - 1]->running = true;
+    }
+
+    return LIBCOUCHBASE_SUCCESS;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_start_io_thread(libcouchbase_t instance)
+{
+    return libcouchbase_start_io_threads(instance, 1, NULL);
+}
+
+LIBCOUCHBASE_API
+void libcouchbase_stop_io_thread(libcouchbase_t instance)
+{
+    shard_t **shards = instance->threads.shards;
+    size_t count = instance->threads.count;
+    size_t ii;
+
+    if (count == 0) {
+        return;
+    }
+
+    /* Stop the first thread first, so that it can't try to pause the
+     * others once they're gone */
+    for (ii = 0; ii < count; ++ii) {
+        if (!shards[ii]->running) {
+            continue;
+        }
+        shards[ii]->tasks.stop.task = stop_task;
+        shards[ii]->tasks.stop.arg = shards[ii];
+        shard_submit_task(shards[ii], &shards[ii]->tasks.stop);
+        pthread_join(shards[ii]->thread, NULL);
+        shards[ii]->running = false;
+    }
+
+    /* The event loop of the instance owns all of the servers again */
+    for (ii = 1; ii < count; ++ii) {
+        if (shards[ii]->seqno > instance->shard.seqno) {
+            instance->shard.seqno = shards[ii]->seqno;
+        }
+    }
+    for (ii = 0; ii < instance->nservers; ++ii) {
+        move_server(instance->servers + ii, &instance->shard);
+    }
+
+    for (ii = 0; ii < count; ++ii) {
+        release_wakeup(shards[ii]);
+        if (ii > 0) {
+            destroy_shard(instance, shards[ii]);
+        }
+    }
+    free(shards);
+
+    pthread_rwlock_destroy(&instance->threads.config_lock);
+    pthread_cond_destroy(&instance->threads.cond);
+    pthread_mutex_destroy(&instance->threads.mutex);
+    instance->threads.shards = NULL;
+    instance->threads.count = 0;
+}
+
+bool libcouchbase_threads_shared(libcouchbase_t instance)
+{
+    return instance->threads.count > 1;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_submit(libcouchbase_t instance,
+                                         libcouchbase_task_t task,
+                                         void *arg)
+{
+    if (instance->threads.count == 0) {
+        return LIBCOUCHBASE_ERROR;
+    }
+
+    return shard_submit(instance->threads.shards[0], task, arg);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_submit_by_key(libcouchbase_t instance,
+                                                const void *hashkey,
+                                                size_t nhashkey,
+                                                libcouchbase_task_t task,
+                                                void *arg)
+{
+    shard_t *shard;
+
+    if (instance->threads.count == 0) {
+        return LIBCOUCHBASE_ERROR;
+    }
+
+    shard = instance->threads.shards[0];
+    pthread_rwlock_rdlock(&instance->threads.config_lock);
+    if (instance->vbucket_config != NULL && instance->nvbuckets > 0) {
+        int vb = vbucket_get_vbucket_by_key(instance->vbucket_config,
+                                            hashkey, nhashkey);
+        uint16_t idx = instance->vb_server_map[vb];
+        if (idx < instance->nservers) {
+            shard = instance->servers[idx].shard;
+        }
+    }
+    pthread_rwlock_unlock(&instance->threads.config_lock);
+
+    return shard_submit(shard, task, arg);
+}
+
+#else
+
+shard_t *libcouchbase_current_shard(libcouchbase_t instance)
+{
+    return &instance->shard;
+}
+
+shard_t *libcouchbase_shard_for_new_server(libcouchbase_t instance)
+{
+    return &instance->shard;
+}
+
+bool libcouchbase_server_is_local(libcouchbase_server_t *server)
+{
+    (void)server;
+    return true;
+}
+
+uint32_t libcouchbase_server_next_seqno(libcouchbase_server_t *server)
+{
+    return ++server->shard->seqno;
+}
+
+libcouchbase_error_t libcouchbase_forward_packet(libcouchbase_server_t *server,
+                                                 const void *command_cookie)
+{
+    (void)server;
+    (void)command_cookie;
+    return LIBCOUCHBASE_NOT_SUPPORTED;
+}
+
+void libcouchbase_forward_fence(libcouchbase_t instance)
+{
+    (void)instance;
+}
+
+void libcouchbase_forward_retries(libcouchbase_t instance, uint8_t retries)
+{
+    (void)instance;
+    (void)retries;
+}
+
+void libcouchbase_forward_flush(libcouchbase_t instance)
+{
+    (void)instance;
+}
+
+void libcouchbase_threads_pause(libcouchbase_t instance)
+{
+    (void)instance;
+}
+
+void libcouchbase_threads_resume(libcouchbase_t instance)
+{
+    (void)instance;
+}
+
+bool libcouchbase_threads_shared(libcouchbase_t instance)
+{
+    (void)instance;
+    return false;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_start_io_threads(libcouchbase_t instance,
+                                                   size_t nthreads,
+                                                   libcouchbase_io_opt_t * const *io)
+{
+    size_t ii;
+    (void)instance;
+    for (ii = 1; ii < nthreads; ++ii) {
+        io[ii - 1]->destroy(io[ii - 1]);
+    }
+    return LIBCOUCHBASE_NOT_SUPPORTED;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_start_io_thread(libcouchbase_t instance)
+{
+    (void)instance;
+    return LIBCOUCHBASE_NOT_SUPPORTED;
+}
+
+LIBCOUCHBASE_API
+void libcouchbase_stop_io_thread(libcouchbase_t instance)
+{
+    (void)instance;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_submit(libcouchbase_t instance,
+                                         libcouchbase_task_t task,
+                                         void *arg)
+{
+    (void)instance;
+    (void)task;
+    (void)arg;
+    return LIBCOUCHBASE_NOT_SUPPORTED;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_submit_by_key(libcouchbase_t instance,
+                                                const void *hashkey,
+                                                size_t nhashkey,
+                                                libcouchbase_task_t task,
+                                                void *arg)
+{
+    (void)instance;
+    (void)hashkey;
+    (void)nhashkey;
+    (void)task;
+    (void)arg;
+    return LIBCOUCHBASE_NOT_SUPPORTED;
+}
+
+#endif
@@ -0,0 +1,524 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the timeouts for the commands. Each command gets a
+ * timer in a hierarchical timer wheel with four levels of 64 slots, and
+ * a resolution of one millisecond. The first level holds the timers
+ * expiring within 64ms, the second within 4 seconds, the third within
+ * 4 minutes and the last one within 4.6 hours (longer timeouts are
+ * truncated). When the wheel passes the end of a level, the next slot
+ * of the level above is moved down. Adding, cancelling and expiring a
+ * timer are all O(1).
+ *
+ * The wheel is driven by a single timer from the I/O backend that fires
+ * when the next slot with timers is due (or when we need to move the
+ * timers down a level). Each event loop (see shard_t) has its own wheel
+ * for the commands sent to its servers.
+ */
+#include "internal.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+/** The longest timeout we may represent in the wheel */
+#define WHEEL_MAX (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+static bool list_empty(op_timer_t *head)
+{
+    return head->next == head;
+}
+
+static void list_init(op_timer_t *head)
+{
+    head->next = head->prev = head;
+}
+
+static void list_add(op_timer_t *head, op_timer_t *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_del(op_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+/**
+ * Move all of the timers in a list to another (empty) list
+ */
+static void list_move(op_timer_t *dest, op_timer_t *src)
+{
+    if (list_empty(src)) {
+        list_init(dest);
+    } else {
+        dest->next = src->next;
+        dest->prev = src->prev;
+        dest->next->prev = dest;
+        dest->prev->next = dest;
+        list_init(src);
+    }
+}
+
+static void wheel_insert(shard_t *shard, op_timer_t *timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    int level;
+
+    if (expires < shard->timeout.current) {
+        expires = shard->timeout.current;
+    }
+    delta = expires - shard->timeout.current;
+    if (delta > WHEEL_MAX) {
+        expires = shard->timeout.current + WHEEL_MAX;
+        delta = WHEEL_MAX;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; ++level) {
+        if (delta < ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    list_add(&shard->timeout.slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK],
+             timer);
+}
+
+/**
+ * Move the timers in the current slot of a level to the levels below
+ * @return true if the slot was the first slot of the level
+ */
+static bool cascade(shard_t *shard, int level)
+{
+    size_t idx = (shard->timeout.current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    op_timer_t list;
+
+    list_move(&list, &shard->timeout.slots[level][idx]);
+    while (!list_empty(&list)) {
+        op_timer_t *timer = list.next;
+        list_del(timer);
+        wheel_insert(shard, timer);
+    }
+
+    return idx == 0;
+}
+
+/**
+ * Release the timer (and make it available for a new command)
+ */
+static void release_timer(op_timer_t *timer)
+{
+    cmd_log_t *log = &timer->server->cmd_log;
+    timer->next = log->timers;
+    log->timers = timer;
+}
+
+/**
+ * Report that a command timed out to the user
+ */
+static void report_timeout(libcouchbase_server_t *server,
+                           cmd_log_entry_t *entry)
+{
+    libcouchbase_t instance = server->instance;
+    const void *cookie = entry->cookie;
+    protocol_binary_request_header *req;
+    const char *key;
+    size_t nkey;
+
+    req = libcouchbase_cmd_log_packet(&server->cmd_log, entry);
+    key = (const char *)(req + 1) + req->request.extlen;
+    nkey = ntohs(req->request.keylen);
+
+    switch (entry->opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GAT:
+    case PROTOCOL_BINARY_CMD_GATQ:
+    case PROTOCOL_BINARY_CMD_GET_REPLICA:
+        libcouchbase_get_callback(instance, entry, LIBCOUCHBASE_ETIMEDOUT,
+                                  key, nkey, NULL, 0, 0, 0);
+        break;
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        instance->callbacks.storage(instance, cookie, LIBCOUCHBASE_ETIMEDOUT,
+                                    key, nkey, 0);
+        break;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        instance->callbacks.arithmetic(instance, cookie,
+                                       LIBCOUCHBASE_ETIMEDOUT,
+                                       key, nkey, 0, 0);
+        break;
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        instance->callbacks.remove(instance, cookie, LIBCOUCHBASE_ETIMEDOUT,
+                                   key, nkey);
+        break;
+    case PROTOCOL_BINARY_CMD_TOUCH:
+        instance->callbacks.touch(instance, cookie, LIBCOUCHBASE_ETIMEDOUT,
+                                  key, nkey);
+        break;
+    default:
+        /* Nothing to report */
+        break;
+    }
+}
+
+static void expire(op_timer_t *timer)
+{
+    libcouchbase_server_t *server = timer->server;
+    cmd_log_entry_t *entry;
+    bool report;
+
+    entry = libcouchbase_cmd_log_at(&server->cmd_log, timer->position);
+    assert(entry != NULL && entry->timer == timer);
+    entry->timer = NULL;
+    --server->shard->timeout.count;
+    release_timer(timer);
+
+    report = libcouchbase_hedge_resolve(server, entry, false);
+    if (entry == libcouchbase_cmd_log_head(&server->cmd_log)) {
+        if (server->stream.remaining > 0) {
+            /* Ignore the rest of the value */
+            server->stream.deliver = false;
+        }
+        /* The server didn't respond to the oldest command in time (or
+         * we didn't manage to connect to it) */
+        server->hung = true;
+    }
+    libcouchbase_cmd_log_complete(&server->cmd_log, entry);
+
+    if (report) {
+        report_timeout(server, entry);
+    }
+}
+
+static void timer_handler(libcouchbase_socket_t sock, short which, void *arg);
+
+/**
+ * Start the I/O timer so that it fires when the next slot is due
+ * @return false if the I/O backend failed to update the timer
+ */
+static bool arm_timer(shard_t *shard, uint64_t now)
+{
+    libcouchbase_io_opt_t *io = shard->io;
+    uint64_t current = shard->timeout.current;
+    uint64_t ii;
+    uint64_t usec;
+
+    /* Look for the next slot with timers (or the next cascade) */
+    for (ii = 1; ii < WHEEL_SIZE; ++ii) {
+        size_t idx = (current + ii) & WHEEL_MASK;
+        if (idx == 0 || !list_empty(&shard->timeout.slots[0][idx])) {
+            break;
+        }
+    }
+
+    shard->timeout.deadline = current + ii;
+    if (shard->timeout.deadline > now) {
+        usec = (shard->timeout.deadline - now) * 1000;
+    } else {
+        usec = 0;
+    }
+
+    if (io->update_timer(io, shard->timeout.timer, (uint32_t)usec,
+                         shard, timer_handler) == -1) {
+        return false;
+    }
+    shard->timeout.armed = true;
+    return true;
+}
+
+/**
+ * Close the connections to the servers that stopped responding, and
+ * drop the commands that timed out while we tried to connect to a
+ * server (the timers for their commands are cancelled)
+ */
+static void release_hung(shard_t *shard)
+{
+    libcouchbase_t instance = shard->instance;
+    size_t ii;
+
+    for (ii = 0; ii < instance->nservers; ++ii) {
+        libcouchbase_server_t *server = instance->servers + ii;
+        if (server->shard == shard && server->hung) {
+            server->hung = false;
+            if (server->connected) {
+                libcouchbase_server_shutdown(server,
+                                             PROTOCOL_BINARY_RESPONSE_ETMPFAIL);
+            } else {
+                libcouchbase_server_drop_expired(server);
+            }
+        }
+    }
+}
+
+/**
+ * We can't tell when the timers in the wheel are due without the I/O
+ * timer, so fail all of the commands with a timer right away
+ */
+static void expire_all(shard_t *shard)
+{
+    op_timer_t list;
+    int ii;
+    int jj;
+
+    /* The callbacks may add new timers to the wheel */
+    list_init(&list);
+    for (ii = 0; ii < WHEEL_LEVELS; ++ii) {
+        for (jj = 0; jj < WHEEL_SIZE; ++jj) {
+            op_timer_t *slot = &shard->timeout.slots[ii][jj];
+            while (!list_empty(slot)) {
+                op_timer_t *timer = slot->next;
+                list_del(timer);
+                list_add(&list, timer);
+            }
+        }
+    }
+
+    while (!list_empty(&list)) {
+        op_timer_t *timer = list.next;
+        list_del(timer);
+        expire(timer);
+    }
+}
+
+static void timer_handler(libcouchbase_socket_t sock, short which, void *arg)
+{
+    shard_t *shard = arg;
+    uint64_t now = libcouchbase_get_msec();
+    (void)sock;
+    (void)which;
+
+    shard->timeout.armed = false;
+    while (shard->timeout.current < now && shard->timeout.count > 0) {
+        op_timer_t list;
+
+        ++shard->timeout.current;
+        if ((shard->timeout.current & WHEEL_MASK) == 0) {
+            int level = 1;
+            while (level < WHEEL_LEVELS && cascade(shard, level)) {
+                ++level;
+            }
+        }
+
+        /* The callbacks may add new timers to the slot */
+        list_move(&list,
+                  &shard->timeout.slots[0][shard->timeout.current & WHEEL_MASK]);
+        while (!list_empty(&list)) {
+            op_timer_t *timer = list.next;
+            list_del(timer);
+            expire(timer);
+        }
+    }
+
+    if (shard->timeout.count > 0 && !arm_timer(shard, now)) {
+        expire_all(shard);
+    }
+    release_hung(shard);
+    if (shard->timeout.count == 0) {
+        shard->timeout.current = now;
+    }
+
+    libcouchbase_maybe_breakout(shard->instance);
+}
+
+/**
+ * Add a timer to the wheel of an event loop (and make sure the I/O
+ * timer fires in time for it)
+ */
+static void add_timer(shard_t *shard, op_timer_t *timer)
+{
+    uint64_t now = libcouchbase_get_msec();
+
+    if (shard->timeout.count == 0) {
+        /* Nothing in the wheel, so we may move it forward */
+        shard->timeout.current = now;
+    }
+
+    wheel_insert(shard, timer);
+    ++shard->timeout.count;
+
+    if (shard->timeout.timer == NULL &&
+        (shard->timeout.timer = shard->io->create_timer(shard->io)) == NULL) {
+        /* The timer is handled the next time we manage to arm it */
+        return;
+    }
+
+    if ((!shard->timeout.armed ||
+         timer->expires < shard->timeout.deadline) &&
+        !arm_timer(shard, now)) {
+        expire_all(shard);
+    }
+}
+
+void libcouchbase_timeout_init(shard_t *shard)
+{
+    int ii;
+    int jj;
+
+    for (ii = 0; ii < WHEEL_LEVELS; ++ii) {
+        for (jj = 0; jj < WHEEL_SIZE; ++jj) {
+            list_init(&shard->timeout.slots[ii][jj]);
+        }
+    }
+    shard->timeout.current = libcouchbase_get_msec();
+}
+
+void libcouchbase_timeout_destroy(shard_t *shard)
+{
+    libcouchbase_io_opt_t *io = shard->io;
+    if (shard->timeout.timer != NULL) {
+        io->delete_timer(io, shard->timeout.timer);
+        io->destroy_timer(io, shard->timeout.timer);
+        shard->timeout.timer = NULL;
+    }
+}
+
+void libcouchbase_timeout_start(libcouchbase_server_t *server)
+{
+    libcouchbase_t instance = server->instance;
+    shard_t *shard = server->shard;
+    cmd_log_t *log = &server->cmd_log;
+    cmd_log_entry_t *entry = libcouchbase_cmd_log_tail(log);
+    uint32_t usec = libcouchbase_current_shard(instance)->op_timeout;
+    op_timer_t *timer;
+
+    switch (entry->opcode) {
+    case PROTOCOL_BINARY_CMD_NOOP:
+    case PROTOCOL_BINARY_CMD_TAP_CONNECT:
+        /* There's nothing to report to the user for these */
+        libcouchbase_cmd_log_complete(log, entry);
+        return;
+    default:
+        break;
+    }
+
+    if (usec == 0 && (usec = instance->timeout.usec) == 0) {
+        return;
+    }
+
+    if ((timer = log->timers) != NULL) {
+        log->timers = timer->next;
+    } else if ((timer = malloc(sizeof(*timer))) == NULL) {
+        return;
+    }
+
+    timer->expires = libcouchbase_get_msec() + (usec + 999) / 1000;
+    timer->server = server;
+    timer->position = log->first + log->count - 1;
+    entry->timer = timer;
+    add_timer(shard, timer);
+}
+
+void libcouchbase_timeout_cancel(op_timer_t *timer)
+{
+    list_del(timer);
+    --timer->server->shard->timeout.count;
+    release_timer(timer);
+}
+
+void libcouchbase_timeout_move(cmd_log_entry_t *from,
+                               libcouchbase_server_t *server,
+                               cmd_log_entry_t *to)
+{
+    if (to->timer != NULL) {
+        libcouchbase_timeout_cancel(to->timer);
+        to->timer = NULL;
+    }
+
+    if (from->timer != NULL) {
+        op_timer_t *timer = from->timer;
+        shard_t *shard = timer->server->shard;
+
+        to->timer = timer;
+        from->timer = NULL;
+        if (shard != server->shard) {
+            /* The timer belongs in the wheel of the other event loop */
+            list_del(timer);
+            --shard->timeout.count;
+        }
+        timer->server = server;
+        timer->position = server->cmd_log.first + server->cmd_log.count - 1;
+        if (shard != server->shard) {
+            add_timer(server->shard, timer);
+        }
+    }
+}
+
+void libcouchbase_timeout_server_moved(libcouchbase_server_t *server)
+{
+    size_t ii;
+
+    for (ii = 0; ii < server->cmd_log.count; ++ii) {
+        cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(&server->cmd_log, ii);
+        if (entry->timer != NULL) {
+            entry->timer->server = server;
+        }
+    }
+}
+
+void libcouchbase_timeout_shard_moved(libcouchbase_server_t *server,
+                                      shard_t *from)
+{
+    size_t ii;
+
+    for (ii = 0; ii < server->cmd_log.count; ++ii) {
+        cmd_log_entry_t *entry = libcouchbase_cmd_log_entry(&server->cmd_log, ii);
+        if (entry->timer != NULL) {
+            list_del(entry->timer);
+            --from->timeout.count;
+            add_timer(server->shard, entry->timer);
+        }
+    }
+}
+
+LIBCOUCHBASE_API
+void libcouchbase_set_timeout(libcouchbase_t instance, uint32_t usec)
+{
+    instance->timeout.usec = usec;
+}
+
+LIBCOUCHBASE_API
+uint32_t libcouchbase_get_timeout(libcouchbase_t instance)
+{
+    return instance->timeout.usec;
+}
+
+LIBCOUCHBASE_API
+void libcouchbase_set_operation_timeout(libcouchbase_t instance, uint32_t usec)
+{
+    libcouchbase_current_shard(instance)->next_op_timeout = usec;
+}
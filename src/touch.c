@@ -27,17 +27,19 @@
  */
 LIBCOUCHBASE_API
 libcouchbase_error_t libcouchbase_mtouch(libcouchbase_t instance,
+                                         const void * const *command_cookies,
                                          size_t num_keys,
                                          const void * const *keys,
                                          const size_t *nkey,
                                          const time_t *exp)
 {
-    return libcouchbase_mtouch_by_key(instance, NULL, 0, num_keys,
-                                      keys, nkey, exp);
+    return libcouchbase_mtouch_by_key(instance, command_cookies, NULL, 0,
+                                      num_keys, keys, nkey, exp);
 }
 
 LIBCOUCHBASE_API
 libcouchbase_error_t libcouchbase_mtouch_by_key(libcouchbase_t instance,
+                                                const void * const *command_cookies,
                                                 const void *hashkey,
                                                 size_t nhashkey,
                                                 size_t num_keys,
@@ -47,11 +49,13 @@ libcouchbase_error_t libcouchbase_mtouch_by_key(libcouchbase_t instance,
 {
     uint16_t vb = 0;
     libcouchbase_server_t *server = NULL;
+    libcouchbase_error_t ret = LIBCOUCHBASE_SUCCESS;
     size_t ii;
 
     // we need a vbucket config before we can start getting data..
     libcouchbase_ensure_vbucket_config(instance);
     assert(instance->vbucket_config);
+    libcouchbase_operation_begin(instance);
 
     if (nhashkey != 0) {
         vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
@@ -59,7 +63,7 @@ libcouchbase_error_t libcouchbase_mtouch_by_key(libcouchbase_t instance,
         server = instance->servers + instance->vb_server_map[vb];
     }
 
-    for (ii = 0; ii < num_keys; ++ii) {
+    for (ii = 0; ii < num_keys && ret == LIBCOUCHBASE_SUCCESS; ++ii) {
         protocol_binary_request_touch req;
         if (nhashkey == 0) {
             vb = (uint16_t)vbucket_get_vbucket_by_key(instance->vbucket_config,
@@ -75,15 +79,17 @@ libcouchbase_error_t libcouchbase_mtouch_by_key(libcouchbase_t instance,
         req.message.header.request.datatype = PROTOCOL_BINARY_RAW_BYTES;
         req.message.header.request.vbucket = ntohs(vb);
         req.message.header.request.bodylen = ntohl((uint32_t)(nkey[ii]) + 4);
-        req.message.header.request.opaque = ++instance->seqno;
+        req.message.header.request.opaque = libcouchbase_server_next_seqno(server);
         // @todo fix the relative time!
         req.message.body.expiration = htonl((uint32_t)exp[ii]);
-        libcouchbase_server_start_packet(server, req.bytes, sizeof(req.bytes));
+        libcouchbase_server_start_packet(server,
+                                         command_cookies ? command_cookies[ii] : NULL,
+                                         req.bytes, sizeof(req.bytes));
         libcouchbase_server_write_packet(server, keys[ii], nkey[ii]);
-        libcouchbase_server_end_packet(server);
+        ret = libcouchbase_server_end_packet(server);
     }
 
     libcouchbase_server_send_packets(server);
 
-    return LIBCOUCHBASE_SUCCESS;
+    return ret;
 }
@@ -37,3 +37,39 @@ extern uint64_t libcouchbase_byteswap64(uint64_t val)
 }
 #endif
 
+
+uint64_t libcouchbase_get_msec(void)
+{
+#ifdef WIN32
+    return (uint64_t)GetTickCount64();
+#elif defined(HAVE_CLOCK_GETTIME)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + (uint64_t)tv.tv_usec / 1000;
+#endif
+}
+
+/**
+ * Put a socket in non-blocking mode
+ * @param sock the socket to update
+ * @return 0 on success, -1 otherwise
+ */
+int libcouchbase_make_socket_nonblocking(libcouchbase_socket_t sock)
+{
+#ifdef WIN32
+    u_long nonblocking = 1;
+    if (ioctlsocket(sock, FIONBIO, &nonblocking) == SOCKET_ERROR) {
+        return -1;
+    }
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+#endif
+    return 0;
+}
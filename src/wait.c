@@ -0,0 +1,272 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2011 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/**
+ * This file contains the functions to wait for a subset of the spooled
+ * commands. Each call to a spool function starts a new operation, and
+ * the command log entries for the commands remember the operation they
+ * belong to (even if they're sent to another server). Each event loop
+ * keeps the number of commands not completed yet for each operation in
+ * a small hash table, so while we wait we only look up the operations
+ * we wait for.
+ */
+#include "internal.h"
+
+/** Don't create a table with less than 64 slots */
+static const size_t min_op_counts = 64;
+
+/**
+ * Get the slot an operation should be stored in
+ * @param shard the event loop with the table
+ * @param operation the operation to look up
+ * @return the index of the first slot to probe
+ */
+static size_t op_count_home(const shard_t *shard,
+                            libcouchbase_operation_t operation)
+{
+    /* The operations are allocated in sequence, so spread them out */
+    return (size_t)(operation * 2654435761U) & (shard->op_counts.size - 1);
+}
+
+/**
+ * Find the slot for an operation
+ * @param shard the event loop with the table
+ * @param operation the operation to look up
+ * @return the slot containing the operation or the empty slot it
+ *         should be stored in (NULL if the table isn't allocated)
+ */
+static op_count_t *find_op_count(const shard_t *shard,
+                                 libcouchbase_operation_t operation)
+{
+    size_t mask = shard->op_counts.size - 1;
+    size_t idx;
+
+    if (shard->op_counts.size == 0) {
+        return NULL;
+    }
+
+    idx = op_count_home(shard, operation);
+    while (shard->op_counts.slots[idx].operation != 0 &&
+           shard->op_counts.slots[idx].operation != operation) {
+        idx = (idx + 1) & mask;
+    }
+    return shard->op_counts.slots + idx;
+}
+
+/**
+ * Double the size of the table (keep it at most half full)
+ * @param shard the event loop with the table
+ * @return true if success, false otherwise
+ */
+static bool grow_op_counts(shard_t *shard)
+{
+    op_count_t *old = shard->op_counts.slots;
+    size_t size = shard->op_counts.size;
+    size_t next = size ? size << 1 : min_op_counts;
+    size_t ii;
+
+    shard->op_counts.slots = calloc(next, sizeof(*old));
+    if (shard->op_counts.slots == NULL) {
+        shard->op_counts.slots = old;
+        return false;
+    }
+    shard->op_counts.size = next;
+
+    for (ii = 0; ii < size; ++ii) {
+        if (old[ii].operation != 0) {
+            *find_op_count(shard, old[ii].operation) = old[ii];
+        }
+    }
+    free(old);
+    return true;
+}
+
+bool libcouchbase_operation_track(shard_t *shard,
+                                  libcouchbase_operation_t operation)
+{
+    op_count_t *slot;
+
+    /* 0 is never used as a handle, so nobody waits for it */
+    if (operation == 0) {
+        return true;
+    }
+
+    slot = find_op_count(shard, operation);
+    if (slot == NULL || slot->operation == 0) {
+        if (2 * (shard->op_counts.count + 1) > shard->op_counts.size &&
+            !grow_op_counts(shard) &&
+            shard->op_counts.count + 1 >= shard->op_counts.size) {
+            return false;
+        }
+        slot = find_op_count(shard, operation);
+        slot->operation = operation;
+        slot->count = 0;
+        ++shard->op_counts.count;
+    }
+    ++slot->count;
+    return true;
+}
+
+void libcouchbase_operation_untrack(shard_t *shard,
+                                    libcouchbase_operation_t operation)
+{
+    size_t mask = shard->op_counts.size - 1;
+    op_count_t *slot;
+    size_t idx;
+    size_t next;
+
+    if (operation == 0) {
+        return;
+    }
+
+    slot = find_op_count(shard, operation);
+    assert(slot != NULL && slot->operation == operation);
+    if (--slot->count > 0) {
+        return;
+    }
+
+    /* Move the entries following it in the probe sequence down, so
+     * that the lookups don't need tombstones */
+    idx = (size_t)(slot - shard->op_counts.slots);
+    next = idx;
+    for (;;) {
+        size_t home;
+        next = (next + 1) & mask;
+        if (shard->op_counts.slots[next].operation == 0) {
+            break;
+        }
+        home = op_count_home(shard, shard->op_counts.slots[next].operation);
+        if (((next - home) & mask) >= ((next - idx) & mask)) {
+            shard->op_counts.slots[idx] = shard->op_counts.slots[next];
+            idx = next;
+        }
+    }
+    shard->op_counts.slots[idx].operation = 0;
+    shard->op_counts.slots[idx].count = 0;
+    --shard->op_counts.count;
+}
+
+void libcouchbase_operation_counts_destroy(shard_t *shard)
+{
+    free(shard->op_counts.slots);
+    shard->op_counts.slots = NULL;
+    shard->op_counts.size = 0;
+    shard->op_counts.count = 0;
+}
+
+void libcouchbase_operation_begin(libcouchbase_t instance)
+{
+    shard_t *shard = libcouchbase_current_shard(instance);
+    /* 0 is never used as a handle */
+    if (++shard->operation == 0) {
+        ++shard->operation;
+    }
+    shard->op_timeout = shard->next_op_timeout;
+    shard->next_op_timeout = 0;
+}
+
+size_t libcouchbase_wait_remaining(libcouchbase_t instance)
+{
+    size_t ret = 0;
+    size_t ii;
+
+    for (ii = 0; ii < instance->wait.noperations; ++ii) {
+        op_count_t *slot = find_op_count(&instance->shard,
+                                         instance->wait.operations[ii]);
+        if (slot != NULL && slot->operation != 0) {
+            ret += slot->count;
+        }
+    }
+    return ret;
+}
+
+static void wait_timer_handler(libcouchbase_socket_t sock, short which,
+                               void *arg)
+{
+    libcouchbase_t instance = arg;
+    (void)sock;
+    (void)which;
+
+    instance->wait.timedout = true;
+    instance->io->stop_event_loop(instance->io);
+}
+
+void libcouchbase_wait_destroy(libcouchbase_t instance)
+{
+    if (instance->wait.timer != NULL) {
+        instance->io->delete_timer(instance->io, instance->wait.timer);
+        instance->io->destroy_timer(instance->io, instance->wait.timer);
+        instance->wait.timer = NULL;
+    }
+    libcouchbase_operation_counts_destroy(&instance->shard);
+}
+
+LIBCOUCHBASE_API
+libcouchbase_operation_t libcouchbase_get_last_operation(libcouchbase_t instance)
+{
+    return libcouchbase_current_shard(instance)->operation;
+}
+
+LIBCOUCHBASE_API
+libcouchbase_error_t libcouchbase_wait(libcouchbase_t instance,
+                                       const libcouchbase_operation_t *operations,
+                                       size_t num_operations,
+                                       uint32_t usec)
+{
+    libcouchbase_io_opt_t *io = instance->io;
+    bool armed = false;
+
+    instance->wait.operations = operations;
+    instance->wait.noperations = num_operations;
+    instance->wait.timedout = false;
+
+    if (libcouchbase_wait_remaining(instance) > 0) {
+        if (usec > 0) {
+            if (instance->wait.timer == NULL &&
+                (instance->wait.timer = io->create_timer(io)) == NULL) {
+                instance->wait.noperations = 0;
+                return LIBCOUCHBASE_ENOMEM;
+            }
+            if (io->update_timer(io, instance->wait.timer, usec, instance,
+                                 wait_timer_handler) == -1) {
+                instance->wait.noperations = 0;
+                return LIBCOUCHBASE_ERROR;
+            }
+            armed = true;
+        }
+
+        libcouchbase_flush(instance);
+
+        /* The event loop may be stopped by others (for instance when
+         * we receive a new configuration), so keep running it until
+         * we're done */
+        while (libcouchbase_wait_remaining(instance) > 0 &&
+               !instance->wait.timedout) {
+            io->run_event_loop(io);
+        }
+
+        if (armed) {
+            io->delete_timer(io, instance->wait.timer);
+        }
+    }
+
+    instance->wait.operations = NULL;
+    instance->wait.noperations = 0;
+
+    return instance->wait.timedout ? LIBCOUCHBASE_ETIMEDOUT :
+        LIBCOUCHBASE_SUCCESS;
+}